@@ -0,0 +1,134 @@
+//! Microbenchmarks of the parts of the emulator used on every step
+//!
+//! Run with cargo bench --bench micro (see the benchmarks section of
+//! NOTES.md for comparing against a saved baseline).
+
+use std::hint::black_box;
+
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+
+use riscvemu::decode::Decoder;
+use riscvemu::platform::arch::{
+    make_rv32i, make_rv32m, make_rv32priv, make_rv32zicsr,
+};
+use riscvemu::platform::csr::{
+    MachineInterface, CSR_MCYCLE, CSR_MIE, CSR_MSCRATCH, CSR_MSTATUS,
+};
+use riscvemu::platform::machine::{MIP_MTIP, MSTATUS_MIE};
+use riscvemu::platform::memory::{Memory, Wordsize};
+use riscvemu::platform::{Instr, Platform};
+use riscvemu::utils::mask;
+
+/// A mix of common instructions (loads, stores, ALU operations,
+/// branches, jumps, multiplies and CSR accesses)
+const INSTRS: [u32; 8] = [
+    0x00108093, // addi x1, x1, 1
+    0x00112023, // sw x1, 0(x2)
+    0x00012183, // lw x3, 0(x2)
+    0x00114133, // xor x2, x2, x1
+    0x021101b3, // mul x3, x2, x1
+    0xfe209ee3, // bne x1, x2, -4
+    0xff5ff06f, // jal x0, -12
+    0x340090f3, // csrrw x1, mscratch, x1
+];
+
+fn decoder() -> Decoder<Instr<Platform>> {
+    let mut decoder = Decoder::new(mask(7));
+    make_rv32i(&mut decoder).expect("adding instructions should work");
+    make_rv32m(&mut decoder).expect("adding instructions should work");
+    make_rv32zicsr(&mut decoder).expect("adding instructions should work");
+    make_rv32priv(&mut decoder).expect("adding instructions should work");
+    decoder
+}
+
+fn decode(c: &mut Criterion) {
+    let decoder = decoder();
+    let mut group = c.benchmark_group("decode");
+    group.throughput(Throughput::Elements(INSTRS.len() as u64));
+    group.bench_function("get_exec", |b| {
+        b.iter(|| {
+            for instr in INSTRS {
+                black_box(decoder.get_exec(black_box(instr)).is_ok());
+            }
+        })
+    });
+    group.finish();
+}
+
+fn memory(c: &mut Criterion) {
+    const WORDS: u64 = 1024;
+    let mut memory = Memory::default();
+    for n in 0..WORDS {
+        memory
+            .write(0x2000_0000 + 4 * n, n, Wordsize::Word)
+            .unwrap();
+    }
+
+    let mut group = c.benchmark_group("memory");
+    group.throughput(Throughput::Elements(WORDS));
+    group.bench_function("read_word", |b| {
+        b.iter(|| {
+            for n in 0..WORDS {
+                let addr = black_box(0x2000_0000 + 4 * n);
+                black_box(memory.read(addr, Wordsize::Word).unwrap());
+            }
+        })
+    });
+    group.bench_function("read_byte", |b| {
+        b.iter(|| {
+            for n in 0..WORDS {
+                let addr = black_box(0x2000_0000 + n);
+                black_box(memory.read(addr, Wordsize::Byte).unwrap());
+            }
+        })
+    });
+    group.bench_function("write_word", |b| {
+        b.iter(|| {
+            for n in 0..WORDS {
+                let addr = black_box(0x2000_0000 + 4 * n);
+                memory.write(addr, n, Wordsize::Word).unwrap();
+            }
+        })
+    });
+    group.finish();
+}
+
+fn csr(c: &mut Criterion) {
+    let mut interface = MachineInterface::default();
+    let mut group = c.benchmark_group("csr");
+    group.bench_function("read_csr", |b| {
+        b.iter(|| {
+            black_box(interface.read_csr(black_box(CSR_MSTATUS)).unwrap());
+            black_box(interface.read_csr(black_box(CSR_MCYCLE)).unwrap());
+        })
+    });
+    group.bench_function("write_csr", |b| {
+        b.iter(|| {
+            let value = black_box(0x1234_5678);
+            interface.write_csr(black_box(CSR_MSCRATCH), value).unwrap();
+        })
+    });
+
+    // Called before every instruction, usually with no interrupt to take
+    group.bench_function("trap_interrupt_none", |b| {
+        let trap_ctrl = &mut interface.machine.trap_ctrl;
+        b.iter(|| black_box(trap_ctrl.trap_interrupt(black_box(0x100))))
+    });
+
+    // The timer interrupt is pending at reset (mtimecmp is 0), so
+    // enabling it makes trap_interrupt take it; mret re-enables it
+    interface.write_csr(CSR_MIE, 1 << MIP_MTIP).unwrap();
+    interface.write_csr(CSR_MSTATUS, 1 << MSTATUS_MIE).unwrap();
+    group.bench_function("trap_interrupt_taken", |b| {
+        let trap_ctrl = &mut interface.machine.trap_ctrl;
+        b.iter(|| {
+            let handler = trap_ctrl.trap_interrupt(black_box(0x100));
+            assert!(handler.is_some(), "interrupt should be taken");
+            trap_ctrl.mret()
+        })
+    });
+    group.finish();
+}
+
+criterion_group!(benches, decode, memory, csr);
+criterion_main!(benches);
@@ -0,0 +1,110 @@
+//! Benchmarks of Platform::step running whole programs
+//!
+//! Each benchmark runs STEPS instructions from reset, on the hello
+//! world program from test_traces/hello.trace and on small synthetic
+//! loops that stress the ALU, memory and CSRs. Run with cargo bench
+//! --bench programs (see the benchmarks section of NOTES.md for
+//! comparing against a saved baseline).
+
+use std::hint::black_box;
+
+use criterion::{
+    criterion_group, criterion_main, BatchSize, Criterion, Throughput,
+};
+
+use riscvemu::elf_utils::ElfLoadable;
+use riscvemu::platform::Platform;
+use riscvemu::trace_file::{Section, TraceLoadable, TraceReader};
+
+/// Number of instructions executed in each benchmark iteration
+const STEPS: u64 = 10_000;
+
+/// Increments a counter and mixes it into other registers
+const ALU_LOOP: [u32; 5] = [
+    0x00000093, // addi x1, x0, 0
+    0x00108093, // loop: addi x1, x1, 1
+    0x00114133, // xor x2, x2, x1
+    0x021101b3, // mul x3, x2, x1
+    0xff5ff06f, // jal x0, loop
+];
+
+/// Stores and loads words around a 1 KiB buffer at the start of RAM
+const MEMORY_LOOP: [u32; 8] = [
+    0x20000137, // lui x2, 0x20000
+    0x00108093, // loop: addi x1, x1, 1
+    0x00112023, // sw x1, 0(x2)
+    0x00012183, // lw x3, 0(x2)
+    0x3fc0f213, // andi x4, x1, 0x3fc
+    0x004102b3, // add x5, x2, x4
+    0x0032a023, // sw x3, 0(x5)
+    0xfe9ff06f, // jal x0, loop
+];
+
+/// Reads and writes machine-mode CSRs
+const CSR_LOOP: [u32; 4] = [
+    0xb00020f3, // loop: csrrs x1, mcycle, x0
+    0x34009073, // csrrw x0, mscratch, x1
+    0x34002173, // csrrs x2, mscratch, x0
+    0xff5ff06f, // jal x0, loop
+];
+
+/// Read the .eeprom section of a trace file
+fn eeprom_section(path: &str) -> Section {
+    let mut reader = TraceReader::open(path).expect("trace should open");
+    while let Some(section) = reader.next_section().expect("should parse") {
+        if let Section::Eeprom { .. } = section {
+            return section;
+        }
+    }
+    panic!("{path} has no .eeprom section")
+}
+
+/// Write a program (as instruction words) into the EEPROM
+fn load_program(program: &[u32]) -> Platform {
+    let mut platform = Platform::new();
+    for (addr, instr) in (0..).step_by(4).zip(program) {
+        for (offset, byte) in (0..).zip(instr.to_le_bytes()) {
+            platform
+                .write_byte(addr + offset, byte)
+                .expect("program should fit in the EEPROM");
+        }
+    }
+    platform
+}
+
+/// Benchmark STEPS calls to step on the platforms made by setup
+fn bench_steps(c: &mut Criterion, name: &str, setup: impl Fn() -> Platform) {
+    let mut group = c.benchmark_group("step");
+    group.throughput(Throughput::Elements(STEPS));
+    group.bench_function(name, |b| {
+        b.iter_batched_ref(
+            &setup,
+            |platform| {
+                for _ in 0..STEPS {
+                    platform.step().expect("program should not fail");
+                }
+                black_box(platform.mcycle())
+            },
+            BatchSize::LargeInput,
+        )
+    });
+    group.finish();
+}
+
+fn programs(c: &mut Criterion) {
+    let hello = eeprom_section(concat!(
+        env!("CARGO_MANIFEST_DIR"),
+        "/test_traces/hello.trace"
+    ));
+    bench_steps(c, "hello", || {
+        let mut platform = Platform::new();
+        platform.push(&hello);
+        platform
+    });
+    bench_steps(c, "alu_loop", || load_program(&ALU_LOOP));
+    bench_steps(c, "memory_loop", || load_program(&MEMORY_LOOP));
+    bench_steps(c, "csr_loop", || load_program(&CSR_LOOP));
+}
+
+criterion_group!(benches, programs);
+criterion_main!(benches);
@@ -0,0 +1,129 @@
+/**
+ * \file riscvemu.h
+ * \brief C interface to the RISC-V emulator
+ *
+ * Link with the library built by the capi crate (libriscvemu_capi.so
+ * or libriscvemu_capi.a). See capi/src/lib.rs for the conventions of
+ * the interface:
+ *
+ * - Objects are opaque pointers, created by a *_new function (or
+ *   riscvemu_snapshot) and destroyed by the matching *_free function.
+ * - Functions that can fail return 0 on success and -1 on failure;
+ *   riscvemu_last_error describes the failure.
+ * - An emulator must only be used by one thread at a time, but
+ *   interrupt handles can be used from any thread.
+ */
+
+#ifndef RISCVEMU_H
+#define RISCVEMU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reasons returned by riscvemu_run, with the value it stores */
+#define RISCVEMU_STOP_STEPS 0      /* all steps executed (0) */
+#define RISCVEMU_STOP_BREAKPOINT 1 /* pc breakpoint (the pc) */
+#define RISCVEMU_STOP_CYCLE 2      /* cycle breakpoint (the cycle) */
+#define RISCVEMU_STOP_WATCHPOINT 3 /* watchpoint (the address) */
+#define RISCVEMU_STOP_EXIT 4       /* semihosting exit (the status) */
+#define RISCVEMU_STOP_EXCEPTION 5  /* exception, if exceptions are
+                                      errors (the mcause) */
+
+typedef struct RiscvEmuConfig RiscvEmuConfig;
+typedef struct RiscvEmu RiscvEmu;
+typedef struct RiscvEmuSnapshot RiscvEmuSnapshot;
+typedef struct RiscvEmuInterrupts RiscvEmuInterrupts;
+
+/* Configuration */
+
+RiscvEmuConfig *riscvemu_config_new(void);
+void riscvemu_config_free(RiscvEmuConfig *config);
+void riscvemu_config_memory_map(RiscvEmuConfig *config, uint32_t eeprom_size,
+                                uint32_t io_base, uint32_t ram_base,
+                                uint32_t ram_size);
+void riscvemu_config_trace(RiscvEmuConfig *config, bool trace);
+void riscvemu_config_exceptions_are_errors(RiscvEmuConfig *config,
+                                           bool exceptions_are_errors);
+void riscvemu_config_semihosting(RiscvEmuConfig *config, const char *root);
+void riscvemu_config_uart_rx_depth(RiscvEmuConfig *config, size_t depth);
+/* interval 0 (the default) delivers input as soon as there is room */
+void riscvemu_config_uart_rx_interval(RiscvEmuConfig *config,
+                                      uint64_t interval);
+/* frequency 0 (the default) makes mtime count clock cycles */
+void riscvemu_config_mtime_frequency(RiscvEmuConfig *config,
+                                     uint64_t frequency);
+void riscvemu_config_block_device(RiscvEmuConfig *config, const char *path);
+void riscvemu_config_elf(RiscvEmuConfig *config, const char *path);
+void riscvemu_config_image(RiscvEmuConfig *config, const uint8_t *image,
+                           size_t len);
+
+/* Emulator */
+
+/* config may be NULL for the defaults. On failure, returns NULL and
+   copies the message to error (if not NULL). */
+RiscvEmu *riscvemu_new(const RiscvEmuConfig *config, char *error,
+                       size_t error_len);
+void riscvemu_free(RiscvEmu *emu);
+const char *riscvemu_last_error(const RiscvEmu *emu);
+int riscvemu_load_elf(RiscvEmu *emu, const char *path);
+int riscvemu_load_image(RiscvEmu *emu, const uint8_t *image, size_t len);
+
+/* Returns a RISCVEMU_STOP_* reason; value may be NULL */
+int riscvemu_run(RiscvEmu *emu, uint64_t max_steps, uint64_t *value);
+uint64_t riscvemu_mcycle(const RiscvEmu *emu);
+
+/* Registers and memory (memory access bypasses the PMA checker and
+   memory-mapped registers) */
+
+uint32_t riscvemu_pc(const RiscvEmu *emu);
+void riscvemu_set_pc(RiscvEmu *emu, uint32_t pc);
+uint32_t riscvemu_x(const RiscvEmu *emu, uint32_t n);
+void riscvemu_set_x(RiscvEmu *emu, uint32_t n, uint32_t value);
+void riscvemu_read_memory(const RiscvEmu *emu, uint32_t addr, uint8_t *buf,
+                          uint32_t len);
+void riscvemu_write_memory(RiscvEmu *emu, uint32_t addr, const uint8_t *buf,
+                           uint32_t len);
+
+/* UART */
+
+/* Returns the number of bytes of output copied to buf */
+size_t riscvemu_uart_read(RiscvEmu *emu, uint8_t *buf, size_t len);
+void riscvemu_uart_send(RiscvEmu *emu, const uint8_t *bytes, size_t len);
+
+/* Breakpoints */
+
+void riscvemu_add_breakpoint(RiscvEmu *emu, uint32_t pc);
+bool riscvemu_remove_breakpoint(RiscvEmu *emu, uint32_t pc);
+
+/* Interrupt injection (from any thread) */
+
+RiscvEmuInterrupts *riscvemu_interrupts_new(const RiscvEmu *emu);
+void riscvemu_interrupts_free(RiscvEmuInterrupts *interrupts);
+void riscvemu_raise_external(const RiscvEmuInterrupts *interrupts);
+void riscvemu_clear_external(const RiscvEmuInterrupts *interrupts);
+void riscvemu_raise_software(const RiscvEmuInterrupts *interrupts);
+void riscvemu_clear_software(const RiscvEmuInterrupts *interrupts);
+
+/* Snapshots */
+
+/* A snapshot saves the pc, registers, CSRs, RAM, pending UART output,
+   UART input, and the DMA, block device and interrupt line state. It
+   does not save the program (so it can only be restored into an
+   emulator with the same program loaded), open semihosting files, the
+   block device image contents (writes to the disk are not undone),
+   interrupt requests not yet applied, or settings such as
+   breakpoints. */
+RiscvEmuSnapshot *riscvemu_snapshot(RiscvEmu *emu);
+void riscvemu_restore(RiscvEmu *emu, const RiscvEmuSnapshot *snapshot);
+void riscvemu_snapshot_free(RiscvEmuSnapshot *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RISCVEMU_H */
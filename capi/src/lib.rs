@@ -0,0 +1,727 @@
+//! C interface to the emulator
+//!
+//! This crate builds the emulator as a shared or static library with
+//! a C interface (declared in include/riscvemu.h), so that C and C++
+//! test harnesses can create platforms, run programs and inspect the
+//! results in process, instead of starting the emulate binary for each
+//! test and parsing its output. It is a thin layer over
+//! PlatformBuilder and Platform.
+//!
+//! The conventions of the interface are:
+//!
+//! * Objects (configurations, emulators, snapshots and interrupt
+//!   handles) are opaque pointers, created by a *_new function (or
+//!   riscvemu_snapshot) and destroyed by the matching *_free function.
+//!   Passing NULL to a *_free function does nothing.
+//! * Functions that can fail return 0 on success and -1 on failure.
+//!   The message for the last failure on an emulator can be read with
+//!   riscvemu_last_error.
+//! * An emulator must only be used by one thread at a time, but
+//!   interrupt handles can be used from any thread.
+//!
+//! The main riscvemu crate forbids unsafe code; this crate holds all
+//! of the unsafe code needed to cross the C boundary.
+
+use std::ffi::{c_char, c_int, CStr, CString};
+use std::path::PathBuf;
+use std::slice;
+
+use riscvemu::elf_utils::load_elf;
+use riscvemu::platform::breakpoints::StopReason;
+use riscvemu::platform::builder::PlatformBuilder;
+use riscvemu::platform::checkpoint::Checkpoint;
+use riscvemu::platform::eei::Eei;
+use riscvemu::platform::interrupts::InterruptHandle;
+use riscvemu::platform::machine::Trap;
+use riscvemu::platform::memory_map::MemoryMap;
+use riscvemu::platform::Platform;
+
+/// riscvemu_run: all the requested steps were executed
+pub const RISCVEMU_STOP_STEPS: c_int = 0;
+/// riscvemu_run: stopped at a pc breakpoint (value is the pc)
+pub const RISCVEMU_STOP_BREAKPOINT: c_int = 1;
+/// riscvemu_run: stopped at a cycle breakpoint (value is the cycle)
+pub const RISCVEMU_STOP_CYCLE: c_int = 2;
+/// riscvemu_run: stopped at a watchpoint (value is the address)
+pub const RISCVEMU_STOP_WATCHPOINT: c_int = 3;
+/// riscvemu_run: the program exited using semihosting (value is the
+/// exit status)
+pub const RISCVEMU_STOP_EXIT: c_int = 4;
+/// riscvemu_run: the program raised an exception while exceptions are
+/// errors (value is the mcause of the exception)
+pub const RISCVEMU_STOP_EXCEPTION: c_int = 5;
+
+/// Options for creating an emulator
+pub struct RiscvEmuConfig {
+    builder: PlatformBuilder,
+}
+
+impl RiscvEmuConfig {
+    fn update(&mut self, set: impl FnOnce(PlatformBuilder) -> PlatformBuilder) {
+        self.builder = set(std::mem::take(&mut self.builder));
+    }
+}
+
+/// An emulated platform, along with the message for the last error
+pub struct RiscvEmu {
+    platform: Platform,
+    last_error: CString,
+}
+
+/// A saved copy of the state of an emulator
+pub struct RiscvEmuSnapshot {
+    checkpoint: Checkpoint,
+}
+
+/// A handle for raising and clearing interrupts from any thread
+pub struct RiscvEmuInterrupts {
+    handle: InterruptHandle,
+}
+
+impl RiscvEmu {
+    fn fail(&mut self, message: impl ToString) -> c_int {
+        let message = message.to_string().replace('\0', " ");
+        self.last_error = CString::new(message).expect("NULs were removed");
+        -1
+    }
+}
+
+/// Convert a C string argument to a path
+///
+/// # Safety
+///
+/// path must be a valid NUL-terminated string
+unsafe fn to_path(path: *const c_char) -> PathBuf {
+    PathBuf::from(CStr::from_ptr(path).to_string_lossy().into_owned())
+}
+
+/// Make a slice from a C pointer and length, which may be NULL if the
+/// length is 0
+///
+/// # Safety
+///
+/// If len is not 0, data must point to len readable bytes
+unsafe fn to_slice<'a>(data: *const u8, len: usize) -> &'a [u8] {
+    if len == 0 {
+        &[]
+    } else {
+        slice::from_raw_parts(data, len)
+    }
+}
+
+/// Copy message into the buffer of length len (if it is not NULL),
+/// truncating and NUL-terminating it
+///
+/// # Safety
+///
+/// If buf is not NULL, it must point to len writable bytes
+unsafe fn copy_message(message: &str, buf: *mut c_char, len: usize) {
+    if buf.is_null() || len == 0 {
+        return;
+    }
+    let count = message.len().min(len - 1);
+    let buf = slice::from_raw_parts_mut(buf.cast::<u8>(), len);
+    buf[..count].copy_from_slice(&message.as_bytes()[..count]);
+    buf[count] = 0;
+}
+
+/// Create a configuration with the default options
+#[no_mangle]
+pub extern "C" fn riscvemu_config_new() -> *mut RiscvEmuConfig {
+    Box::into_raw(Box::new(RiscvEmuConfig {
+        builder: PlatformBuilder::default(),
+    }))
+}
+
+/// # Safety
+///
+/// config must be NULL or a configuration from riscvemu_config_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_free(config: *mut RiscvEmuConfig) {
+    if !config.is_null() {
+        drop(Box::from_raw(config));
+    }
+}
+
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_memory_map(
+    config: *mut RiscvEmuConfig,
+    eeprom_size: u32,
+    io_base: u32,
+    ram_base: u32,
+    ram_size: u32,
+) {
+    let memory_map = MemoryMap {
+        eeprom_size,
+        io_base,
+        ram_base,
+        ram_size,
+    };
+    (*config).update(|builder| builder.memory_map(memory_map));
+}
+
+/// Print each instruction as it is executed (to standard output)
+///
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_trace(
+    config: *mut RiscvEmuConfig,
+    trace: bool,
+) {
+    (*config).update(|builder| builder.trace(trace));
+}
+
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_exceptions_are_errors(
+    config: *mut RiscvEmuConfig,
+    exceptions_are_errors: bool,
+) {
+    let value = exceptions_are_errors;
+    (*config).update(|builder| builder.exceptions_are_errors(value));
+}
+
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new, and root a
+/// NUL-terminated string
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_semihosting(
+    config: *mut RiscvEmuConfig,
+    root: *const c_char,
+) {
+    (*config).update(|builder| builder.semihosting(to_path(root)));
+}
+
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_uart_rx_depth(
+    config: *mut RiscvEmuConfig,
+    depth: usize,
+) {
+    (*config).update(|builder| builder.uart_rx_depth(depth));
+}
+
+/// Deliver UART input at one byte every interval cycles (or as soon
+/// as there is room in the FIFO, the default, if interval is 0)
+///
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_uart_rx_interval(
+    config: *mut RiscvEmuConfig,
+    interval: u64,
+) {
+    let interval = (interval != 0).then_some(interval);
+    (*config).update(|builder| builder.uart_rx_interval(interval));
+}
+
+/// Make mtime follow the host clock at frequency ticks per second (or
+/// count clock cycles, the default, if frequency is 0)
+///
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_mtime_frequency(
+    config: *mut RiscvEmuConfig,
+    frequency: u64,
+) {
+    let frequency = (frequency != 0).then_some(frequency);
+    (*config).update(|builder| builder.mtime_frequency(frequency));
+}
+
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new, and path a
+/// NUL-terminated string
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_block_device(
+    config: *mut RiscvEmuConfig,
+    path: *const c_char,
+) {
+    (*config).update(|builder| builder.block_device(to_path(path)));
+}
+
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new, and path a
+/// NUL-terminated string
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_elf(
+    config: *mut RiscvEmuConfig,
+    path: *const c_char,
+) {
+    (*config).update(|builder| builder.elf(to_path(path)));
+}
+
+/// # Safety
+///
+/// config must be a configuration from riscvemu_config_new, and image
+/// must point to len bytes (the image is copied)
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_config_image(
+    config: *mut RiscvEmuConfig,
+    image: *const u8,
+    len: usize,
+) {
+    let image = to_slice(image, len);
+    (*config).update(|builder| builder.image(image));
+}
+
+/// Create an emulator from a configuration (or with the default
+/// options, if config is NULL), loading the configured program.
+/// Returns NULL on failure, with the error message copied to
+/// error (if it is not NULL), which holds error_len bytes.
+///
+/// # Safety
+///
+/// config must be NULL or a configuration from riscvemu_config_new,
+/// and error must be NULL or point to error_len writable bytes
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_new(
+    config: *const RiscvEmuConfig,
+    error: *mut c_char,
+    error_len: usize,
+) -> *mut RiscvEmu {
+    let builder = match config.as_ref() {
+        Some(config) => config.builder.clone(),
+        None => PlatformBuilder::default(),
+    };
+    match builder.build() {
+        Ok(platform) => Box::into_raw(Box::new(RiscvEmu {
+            platform,
+            last_error: CString::default(),
+        })),
+        Err(e) => {
+            copy_message(&e.to_string(), error, error_len);
+            std::ptr::null_mut()
+        }
+    }
+}
+
+/// # Safety
+///
+/// emu must be NULL or an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_free(emu: *mut RiscvEmu) {
+    if !emu.is_null() {
+        drop(Box::from_raw(emu));
+    }
+}
+
+/// The message for the last failure on this emulator (an empty string
+/// if there has not been one). The string is valid until the next call
+/// on the emulator.
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_last_error(
+    emu: *const RiscvEmu,
+) -> *const c_char {
+    (*emu).last_error.as_ptr()
+}
+
+/// Load an ELF file into the EEPROM
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new, and path a
+/// NUL-terminated string
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_load_elf(
+    emu: *mut RiscvEmu,
+    path: *const c_char,
+) -> c_int {
+    let emu = &mut *emu;
+    let path = to_path(path).to_string_lossy().into_owned();
+    match load_elf(&mut emu.platform, &path) {
+        Ok(()) => 0,
+        Err(e) => emu.fail(e),
+    }
+}
+
+/// Load a raw image into the EEPROM, starting at address 0
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new, and image must point to
+/// len bytes
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_load_image(
+    emu: *mut RiscvEmu,
+    image: *const u8,
+    len: usize,
+) -> c_int {
+    let emu = &mut *emu;
+    match emu.platform.load_image(to_slice(image, len)) {
+        Ok(()) => 0,
+        Err(e) => emu.fail(e),
+    }
+}
+
+/// Execute up to max_steps steps (see Platform::run). Returns one of
+/// the RISCVEMU_STOP_* reasons, and stores the value that goes with
+/// it in value (if it is not NULL).
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new, and value must be NULL
+/// or writable
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_run(
+    emu: *mut RiscvEmu,
+    max_steps: u64,
+    value: *mut u64,
+) -> c_int {
+    let emu = &mut *emu;
+    let (reason, stop_value) = match emu.platform.run(max_steps) {
+        Ok(StopReason::StepsCompleted) => (RISCVEMU_STOP_STEPS, 0),
+        Ok(StopReason::Breakpoint(pc)) => (RISCVEMU_STOP_BREAKPOINT, pc.into()),
+        Ok(StopReason::Cycle(cycle)) => (RISCVEMU_STOP_CYCLE, cycle),
+        Ok(StopReason::Watchpoint(hit)) => {
+            (RISCVEMU_STOP_WATCHPOINT, hit.addr.into())
+        }
+        Ok(StopReason::Exit(status)) => (RISCVEMU_STOP_EXIT, status.into()),
+        Err(e) => {
+            let mcause = Trap::Exception(e).mcause();
+            (RISCVEMU_STOP_EXCEPTION, mcause.into())
+        }
+    };
+    if let Some(value) = value.as_mut() {
+        *value = stop_value;
+    }
+    reason
+}
+
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_mcycle(emu: *const RiscvEmu) -> u64 {
+    (*emu).platform.mcycle()
+}
+
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_pc(emu: *const RiscvEmu) -> u32 {
+    (*emu).platform.pc()
+}
+
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_set_pc(emu: *mut RiscvEmu, pc: u32) {
+    (*emu).platform.set_pc(pc)
+}
+
+/// Read register x0-x31 (returns 0 for other register numbers)
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_x(emu: *const RiscvEmu, n: u32) -> u32 {
+    match u8::try_from(n) {
+        Ok(n) if n < 32 => (*emu).platform.x(n),
+        _ => 0,
+    }
+}
+
+/// Write register x1-x31 (writes to other register numbers are
+/// ignored)
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_set_x(
+    emu: *mut RiscvEmu,
+    n: u32,
+    value: u32,
+) {
+    match u8::try_from(n) {
+        Ok(n) if n < 32 => (*emu).platform.set_x(n, value),
+        _ => {}
+    }
+}
+
+/// Read len bytes of memory starting at addr into buf. This bypasses
+/// the PMA checker and the memory-mapped registers.
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new, and buf must point to len
+/// writable bytes
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_read_memory(
+    emu: *const RiscvEmu,
+    addr: u32,
+    buf: *mut u8,
+    len: u32,
+) {
+    if len == 0 {
+        return;
+    }
+    let bytes = (*emu).platform.debug_load_bytes(addr, len);
+    slice::from_raw_parts_mut(buf, bytes.len()).copy_from_slice(&bytes);
+}
+
+/// Write len bytes from buf to memory starting at addr. This bypasses
+/// the PMA checker and the memory-mapped registers, so it can modify
+/// the EEPROM.
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new, and buf must point to len
+/// bytes
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_write_memory(
+    emu: *mut RiscvEmu,
+    addr: u32,
+    buf: *const u8,
+    len: u32,
+) {
+    let len = usize::try_from(len).unwrap();
+    (*emu).platform.debug_store_bytes(addr, to_slice(buf, len));
+}
+
+/// Read up to len bytes of the program's UART output into buf,
+/// returning the number of bytes read. Output that does not fit is
+/// returned by the next call.
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new, and buf must point to len
+/// writable bytes
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_uart_read(
+    emu: *mut RiscvEmu,
+    buf: *mut u8,
+    len: usize,
+) -> usize {
+    if len == 0 {
+        return 0;
+    }
+    (*emu)
+        .platform
+        .read_uartout(slice::from_raw_parts_mut(buf, len))
+}
+
+/// Send bytes to the program over the UART receiver
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new, and bytes must point to
+/// len bytes
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_uart_send(
+    emu: *mut RiscvEmu,
+    bytes: *const u8,
+    len: usize,
+) {
+    (*emu).platform.send_uart_input(to_slice(bytes, len));
+}
+
+/// Stop riscvemu_run when the pc reaches addr
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_add_breakpoint(emu: *mut RiscvEmu, pc: u32) {
+    (*emu).platform.breakpoints_mut().insert_pc(pc);
+}
+
+/// Returns true if there was a breakpoint at pc
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_remove_breakpoint(
+    emu: *mut RiscvEmu,
+    pc: u32,
+) -> bool {
+    (*emu).platform.breakpoints_mut().remove_pc(pc)
+}
+
+/// Create a handle for raising and clearing the emulator's external and
+/// software interrupts, which can be used from any thread (and outlive
+/// the emulator)
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_interrupts_new(
+    emu: *const RiscvEmu,
+) -> *mut RiscvEmuInterrupts {
+    let handle = (*emu).platform.interrupt_handle();
+    Box::into_raw(Box::new(RiscvEmuInterrupts { handle }))
+}
+
+/// # Safety
+///
+/// interrupts must be NULL or a handle from riscvemu_interrupts_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_interrupts_free(
+    interrupts: *mut RiscvEmuInterrupts,
+) {
+    if !interrupts.is_null() {
+        drop(Box::from_raw(interrupts));
+    }
+}
+
+/// # Safety
+///
+/// interrupts must be a handle from riscvemu_interrupts_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_raise_external(
+    interrupts: *const RiscvEmuInterrupts,
+) {
+    (*interrupts).handle.raise_external();
+}
+
+/// # Safety
+///
+/// interrupts must be a handle from riscvemu_interrupts_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_clear_external(
+    interrupts: *const RiscvEmuInterrupts,
+) {
+    (*interrupts).handle.clear_external();
+}
+
+/// # Safety
+///
+/// interrupts must be a handle from riscvemu_interrupts_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_raise_software(
+    interrupts: *const RiscvEmuInterrupts,
+) {
+    (*interrupts).handle.raise_software();
+}
+
+/// # Safety
+///
+/// interrupts must be a handle from riscvemu_interrupts_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_clear_software(
+    interrupts: *const RiscvEmuInterrupts,
+) {
+    (*interrupts).handle.clear_software();
+}
+
+/// Save the state of the emulator (see Platform::checkpoint). Open
+/// semihosting files, the block device image contents and interrupt
+/// requests not yet applied are not saved.
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_snapshot(
+    emu: *mut RiscvEmu,
+) -> *mut RiscvEmuSnapshot {
+    let checkpoint = (*emu).platform.checkpoint();
+    Box::into_raw(Box::new(RiscvEmuSnapshot { checkpoint }))
+}
+
+/// Restore the state saved in a snapshot (which can be restored any
+/// number of times, into the emulator it was taken from or another
+/// with the same program)
+///
+/// # Safety
+///
+/// emu must be an emulator from riscvemu_new, and snapshot a snapshot
+/// from riscvemu_snapshot
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_restore(
+    emu: *mut RiscvEmu,
+    snapshot: *const RiscvEmuSnapshot,
+) {
+    (*emu).platform.restore(&(*snapshot).checkpoint);
+}
+
+/// # Safety
+///
+/// snapshot must be NULL or a snapshot from riscvemu_snapshot
+#[no_mangle]
+pub unsafe extern "C" fn riscvemu_snapshot_free(
+    snapshot: *mut RiscvEmuSnapshot,
+) {
+    if !snapshot.is_null() {
+        drop(Box::from_raw(snapshot));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+
+    /// Write 'A' to uarttx, then loop
+    const PROGRAM: [u8; 16] = [
+        0x37, 0x01, 0x00, 0x10, // lui x2, 0x10000
+        0x93, 0x00, 0x10, 0x04, // addi x1, x0, 0x41
+        0x23, 0x2c, 0x11, 0x00, // sw x1, 0x18(x2)
+        0x6f, 0x00, 0x00, 0x00, // jal x0, 0
+    ];
+
+    #[test]
+    fn check_run_program() {
+        unsafe {
+            let config = riscvemu_config_new();
+            riscvemu_config_image(config, PROGRAM.as_ptr(), PROGRAM.len());
+            let emu = riscvemu_new(config, std::ptr::null_mut(), 0);
+            riscvemu_config_free(config);
+            assert!(!emu.is_null());
+
+            let snapshot = riscvemu_snapshot(emu);
+            riscvemu_add_breakpoint(emu, 12);
+            let mut value = 0;
+            let reason = riscvemu_run(emu, 100, &mut value);
+            assert_eq!((reason, value), (RISCVEMU_STOP_BREAKPOINT, 12));
+            assert_eq!(riscvemu_x(emu, 1), 0x41);
+
+            let mut buf = [0; 4];
+            assert_eq!(riscvemu_uart_read(emu, buf.as_mut_ptr(), 4), 1);
+            assert_eq!(buf[0], b'A');
+
+            riscvemu_restore(emu, snapshot);
+            assert_eq!((riscvemu_pc(emu), riscvemu_x(emu, 1)), (0, 0));
+            riscvemu_snapshot_free(snapshot);
+            riscvemu_free(emu);
+        }
+    }
+
+    #[test]
+    fn check_new_error() {
+        let mut error = [0 as c_char; 64];
+        unsafe {
+            let config = riscvemu_config_new();
+            riscvemu_config_memory_map(config, 0x1000, 0, 0x2000, 0x1000);
+            let emu = riscvemu_new(config, error.as_mut_ptr(), error.len());
+            riscvemu_config_free(config);
+            assert!(emu.is_null());
+            let error = CStr::from_ptr(error.as_ptr()).to_str().unwrap();
+            assert!(error.starts_with("Invalid memory map"));
+        }
+    }
+}
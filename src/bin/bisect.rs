@@ -0,0 +1,142 @@
+use clap::Parser;
+use clap_num::maybe_hex;
+use riscvemu::bisect::{find_divergence, run_lockstep, Engine, Run};
+use riscvemu::elf_utils::load_elf;
+use riscvemu::platform::Platform;
+use riscvemu::trace_file::load_trace;
+use std::error::Error;
+
+/// Find the first cycle where two runs of a program diverge
+///
+/// The two runs can use two different programs (for example, before
+/// and after a change), or the same program with two different
+/// execution engines (block, which uses the decoded block cache, or
+/// step, which executes one instruction at a time).
+///
+/// Both runs are compared using a hash of the state every INTERVAL
+/// cycles, and then a binary search finds the last cycle where the
+/// states match. The instruction executed by each run at that cycle
+/// is printed, along with the differences in the registers, CSR state,
+/// RAM and UART output after it executes.
+///
+/// With --lockstep, the first program is instead run using the block
+/// engine and single stepping in lockstep, comparing the registers,
+/// CSR state, the RAM written and the UART output produced after
+/// every block, and the first block where they differ is printed.
+///
+#[derive(Parser, Debug)]
+#[command(author, version, about, long_about)]
+struct Args {
+    /// Path to the program for the first run
+    first: String,
+
+    /// Path to the program for the second run (default: the same as
+    /// the first)
+    second: Option<String>,
+
+    /// The programs are trace files (text or binary) rather than ELF
+    /// files. Only the .eeprom section is used
+    #[arg(short, long)]
+    trace: bool,
+
+    /// Engine for the first run (block or step)
+    #[arg(long, default_value = "block")]
+    first_engine: Engine,
+
+    /// Engine for the second run (block or step)
+    #[arg(long, default_value = "block")]
+    second_engine: Engine,
+
+    /// Number of cycles between state comparisons
+    #[arg(short, long, default_value = "0x10000", value_parser=maybe_hex::<u64>)]
+    interval: u64,
+
+    /// Compare the block engine against single stepping after every
+    /// block (the second program and the engines are ignored)
+    #[arg(short, long)]
+    lockstep: bool,
+
+    /// Stop searching at this cycle
+    #[arg(short, long, value_parser=maybe_hex::<u64>)]
+    cycles: u64,
+}
+
+fn load_run(
+    path: &str,
+    trace: bool,
+    engine: Engine,
+) -> Result<Run, Box<dyn Error>> {
+    let mut platform = Platform::new();
+    if trace {
+        load_trace(&mut platform, path.to_string())?;
+    } else {
+        load_elf(&mut platform, &path.to_string())?;
+    }
+    Ok(Run::new(platform, engine))
+}
+
+fn main() {
+    let args = Args::parse();
+    let second = match &args.second {
+        Some(second) if !args.lockstep => second,
+        _ => &args.first,
+    };
+    let runs = load_run(&args.first, args.trace, args.first_engine).and_then(
+        |first| Ok([first, load_run(second, args.trace, args.second_engine)?]),
+    );
+    let mut runs = match runs {
+        Ok(runs) => runs,
+        Err(e) => {
+            println!("Error loading program: {e}");
+            return;
+        }
+    };
+
+    if args.lockstep {
+        let [fast, reference] = &mut runs;
+        match run_lockstep(
+            &mut fast.platform,
+            &mut reference.platform,
+            args.cycles,
+        ) {
+            None => println!("No mismatch in the first {} cycles", args.cycles),
+            Some(mismatch) => {
+                println!(
+                    "Mismatch in the block starting at cycle {}:",
+                    mismatch.cycle
+                );
+                for (pc, instr) in mismatch.instrs {
+                    println!("  pc=0x{pc:x}: {instr}");
+                }
+                println!("Differences (block engine != single step):");
+                for difference in mismatch.differences {
+                    println!("  {difference}");
+                }
+            }
+        }
+        return;
+    }
+
+    match find_divergence(&mut runs, args.interval, args.cycles) {
+        None => println!("No divergence in the first {} cycles", args.cycles),
+        Some(divergence) => {
+            match divergence.last_matching_cycle {
+                Some(cycle) => println!(
+                    "States match up to cycle {cycle} and differ after it"
+                ),
+                None => println!("States differ at reset"),
+            }
+            if let Some(instrs) = divergence.instrs {
+                for (name, (pc, instr)) in
+                    ["first", "second"].iter().zip(instrs)
+                {
+                    println!("The {name} run executed pc=0x{pc:x}: {instr}");
+                }
+            }
+            println!("Differences (first != second):");
+            for difference in divergence.differences {
+                println!("  {difference}");
+            }
+        }
+    }
+}
@@ -0,0 +1,70 @@
+use clap::Parser;
+use clap_num::maybe_hex;
+use riscvemu::platform::Platform;
+use riscvemu::trace_file::{
+    check_trace_file, check_trace_file_parallel, ParallelCheckOptions,
+};
+use std::path::PathBuf;
+
+/// Check a program against the trace points in a trace file
+///
+/// The trace file (text or binary, see elf2trace) contains the program
+/// and the trace points. The program is run, and the state of the
+/// platform is checked at each trace point. The first failing trace
+/// point is reported.
+///
+/// By default, the trace is checked in parallel: the program is first
+/// run once to take checkpoints of the platform state, and then the
+/// trace points between each pair of checkpoints are checked on
+/// separate threads. With --checkpoints, the checkpoints are read from
+/// a file saved by an earlier run using --save-checkpoints, and the
+/// first run is skipped. The checkpoints must have been taken for the
+/// same program and trace file.
+///
+/// With --threads 1, the trace is checked serially, reading trace
+/// points as they are needed.
+///
+#[derive(Parser, Debug)]
+#[command(author, version, about, long_about)]
+struct Args {
+    /// Path to the trace file
+    input: String,
+
+    /// Number of threads to use (default: the number of cores)
+    #[arg(short = 'j', long)]
+    threads: Option<usize>,
+
+    /// Minimum number of cycles between checkpoints
+    #[arg(short, long, value_parser=maybe_hex::<u64>)]
+    interval: Option<u64>,
+
+    /// Read checkpoints from this file instead of taking them
+    #[arg(short, long, value_name = "FILE")]
+    checkpoints: Option<PathBuf>,
+
+    /// Save the checkpoints used to this file
+    #[arg(short, long, value_name = "FILE")]
+    save_checkpoints: Option<PathBuf>,
+}
+
+fn main() {
+    let args = Args::parse();
+    let result = if args.threads == Some(1)
+        && args.checkpoints.is_none()
+        && args.save_checkpoints.is_none()
+    {
+        check_trace_file(&mut Platform::new(), &args.input)
+    } else {
+        let options = ParallelCheckOptions {
+            threads: args.threads.unwrap_or(0),
+            interval: args.interval,
+            checkpoints_in: args.checkpoints,
+            checkpoints_out: args.save_checkpoints,
+        };
+        check_trace_file_parallel(args.input.clone(), &options)
+    };
+    match result {
+        Err(e) => println!("{e}"),
+        Ok(_) => println!("Trace check passed"),
+    }
+}
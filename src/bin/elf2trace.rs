@@ -1,5 +1,12 @@
 use clap::Parser;
-use riscvemu::trace_file::elf_to_trace_file;
+use clap_num::maybe_hex;
+use riscvemu::platform::breakpoints::BreakpointSpec;
+use riscvemu::trace_file::{
+    convert_trace_file, elf_to_trace_file, record_trace_file, RecordOptions,
+    TraceFileError, TraceFormat,
+};
+use std::fs;
+use std::path::Path;
 
 /// Program to convert an ELF executable file to a trace image file
 ///
@@ -50,26 +57,144 @@ use riscvemu::trace_file::elf_to_trace_file;
 /// of supported escape sequences is as follows:
 ///
 /// * \n: newline character
+/// * \t: tab character
+/// * \r: carriage return character
+/// * \": quote character
+/// * \\: backslash character
 ///
 /// Trace points do not need to be listed in cycle order, but they
 /// will be checked in cycle order during emulation.
 ///
+/// With --binary, the output is written in a compact binary format
+/// instead, which contains an index from cycle to trace point. With
+/// --convert, the input is an existing trace file (in either format)
+/// rather than an ELF file, so that trace files can be converted
+/// between the text and binary formats.
+///
+/// With --record, the program is also run for the given number of
+/// cycles, and trace points recording the pc, registers and UART
+/// output are written at the events selected by the other recording
+/// options. This produces a golden trace for the program. A final
+/// trace point is always written at the last cycle.
+///
+/// If the input is a directory, every file in it is converted (using
+/// the same options), and the output is the directory to write the
+/// trace files to, each named after its input file with the extension
+/// .trace. A file that cannot be converted is reported, and the rest
+/// are still converted.
+///
 #[derive(Parser, Debug)]
 #[command(author, version, about, long_about)]
 struct Args {
-    /// Path to input ELF file
+    /// Path to input ELF file (or a directory of them)
     #[arg(short, long)]
     input: String,
 
-    /// Path to output file
+    /// Path to output file (or directory, if the input is a directory)
     #[arg(short, long)]
     output: String,
+
+    /// Write the output in the binary trace format
+    #[arg(short, long)]
+    binary: bool,
+
+    /// Treat the input as a trace file (text or binary) to convert,
+    /// instead of an ELF file
+    #[arg(short, long)]
+    convert: bool,
+
+    /// Run the program for this many cycles and record trace points
+    #[arg(short, long, value_name = "CYCLES", value_parser=maybe_hex::<u64>)]
+    record: Option<u64>,
+
+    /// While recording, write a trace point every INTERVAL cycles
+    #[arg(long, value_parser=maybe_hex::<u64>)]
+    interval: Option<u64>,
+
+    /// While recording, write a trace point after every UART write
+    #[arg(long)]
+    on_uart: bool,
+
+    /// While recording, write a trace point on entry to a trap
+    #[arg(long)]
+    on_trap: bool,
+
+    /// While recording, write a trace point when a breakpoint is
+    /// reached (can be given more than once). BREAKPOINT has the same
+    /// format as the emulate --break option, e.g. a symbol name
+    #[arg(long, value_name = "BREAKPOINT")]
+    at: Vec<BreakpointSpec>,
+}
+
+/// Convert one input file according to the arguments
+fn convert(
+    args: &Args,
+    input: String,
+    output: String,
+) -> Result<(), TraceFileError> {
+    let format = if args.binary {
+        TraceFormat::Binary
+    } else {
+        TraceFormat::Text
+    };
+    if args.convert {
+        convert_trace_file(input, output, format)
+    } else if let Some(cycles) = args.record {
+        let options = RecordOptions {
+            cycles,
+            interval: args.interval,
+            on_uart: args.on_uart,
+            on_trap: args.on_trap,
+            breakpoints: args.at.clone(),
+        };
+        record_trace_file(input, output, format, &options)
+    } else {
+        elf_to_trace_file(input, output, format)
+    }
+}
+
+/// Convert every file in the input directory, writing the trace files
+/// to the output directory
+fn convert_dir(args: &Args) -> Result<(), std::io::Error> {
+    let output_dir = Path::new(&args.output);
+    fs::create_dir_all(output_dir)?;
+    let mut inputs = Vec::new();
+    for entry in fs::read_dir(&args.input)? {
+        let path = entry?.path();
+        if path.is_file() {
+            inputs.push(path);
+        }
+    }
+    inputs.sort();
+
+    for input in inputs {
+        let Some(stem) = input.file_stem() else {
+            continue;
+        };
+        let name = format!("{}.trace", stem.to_string_lossy());
+        let output = output_dir.join(name);
+        let result = convert(
+            args,
+            input.to_string_lossy().into_owned(),
+            output.to_string_lossy().into_owned(),
+        );
+        match result {
+            Err(e) => println!("{}: {e}", input.display()),
+            Ok(_) => println!("{} -> {}", input.display(), output.display()),
+        }
+    }
+    Ok(())
 }
 
 fn main() {
     let args = Args::parse();
-    match elf_to_trace_file(args.input.clone(), args.output) {
-        Err(e) => println!("{e}"),
-        Ok(_) => (),
+    if Path::new(&args.input).is_dir() {
+        if let Err(e) = convert_dir(&args) {
+            println!("{e}");
+        }
+        return;
+    }
+    if let Err(e) = convert(&args, args.input.clone(), args.output.clone()) {
+        println!("{e}");
     }
 }
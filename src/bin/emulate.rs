@@ -1,11 +1,41 @@
 use clap::Parser;
 use clap_num::maybe_hex;
+use riscvemu::elf_utils::{
+    read_line_table, read_symbols, FullSymbol, SymbolIndex,
+};
+use riscvemu::gdb::GdbStub;
+use riscvemu::platform::breakpoints::{BreakpointSpec, Location, StopReason};
+use riscvemu::platform::builder::BuildError;
 use riscvemu::platform::eei::Eei;
+use riscvemu::platform::machine::Exception;
 use riscvemu::platform::memory::Wordsize;
-use riscvemu::{elf_utils::load_elf, platform::Platform};
+use riscvemu::platform::memory_map::{parse_size, MemoryMap};
+use riscvemu::platform::uart::DEFAULT_RX_DEPTH;
+use riscvemu::platform::Platform;
+use std::error::Error;
 use std::io::{Read, Write};
-use std::sync::mpsc;
-use std::{io, thread};
+use std::net::TcpListener;
+use std::path::{Path, PathBuf};
+#[cfg(unix)]
+use std::os::unix::net::UnixListener;
+use std::{fs, io};
+
+/// Number of instructions executed between each print of the uart
+/// output
+const RUN_STEPS: u64 = 0x10000;
+
+/// Size of the buffer used to copy uart output to stdout
+const UART_BUF_LEN: usize = 4096;
+
+/// Arguments that debug the program, which --coverage and
+/// --max-cycles do not support
+const DEBUG_ARGS: [&str; 5] = [
+    "debug",
+    "gdb",
+    "pc_breakpoint",
+    "cycle_breakpoint",
+    "breakpoints",
+];
 
 /// Emulate a 32-bit RISC-V processor
 ///
@@ -36,10 +66,132 @@ struct Args {
     #[arg(short, long, value_parser=maybe_hex::<u64>)]
     cycle_breakpoint: Option<u64>,
 
+    /// Break when a breakpoint is reached and begin debug stepping
+    /// (can be given more than once). BREAKPOINT is an address (use
+    /// 0x prefix for hexadecimal) or symbol name, optionally followed
+    /// by a condition such as :x10=5, or @CYCLE to break when mcycle
+    /// reaches CYCLE. Execution between breakpoints runs at full speed
+    #[arg(short, long = "break", value_name = "BREAKPOINT")]
+    breakpoints: Vec<BreakpointSpec>,
+
     /// Print the 8-word memory region starting from this address
     /// along with debugging
     #[arg(short, long, value_parser=maybe_hex::<u32>)]
     memory: Option<u32>,
+
+    /// Wait for a gdb connection before starting execution. The
+    /// argument is either a TCP port number (listening on localhost)
+    /// or the path of a unix socket to create
+    #[arg(short, long, value_name = "PORT|PATH")]
+    gdb: Option<String>,
+
+    /// Enable semihosting, allowing the program to open files in DIR
+    /// (and its subdirectories). When the program exits using
+    /// semihosting, the emulator exits with the program's exit status
+    #[arg(long, value_name = "DIR")]
+    semihosting: Option<PathBuf>,
+
+    /// Send the contents of this file (or standard input, if PATH is
+    /// -) to the program over the UART receiver
+    #[arg(long, value_name = "PATH")]
+    uart_input: Option<PathBuf>,
+
+    /// Number of bytes the UART receive FIFO holds
+    #[arg(long, value_name = "BYTES", default_value_t = DEFAULT_RX_DEPTH)]
+    uart_rx_depth: usize,
+
+    /// Deliver UART input at one byte every CYCLES cycles, dropping
+    /// bytes when the receive FIFO is full (by default, input arrives
+    /// as soon as there is room in the FIFO)
+    #[arg(long, value_name = "CYCLES", value_parser=maybe_hex::<u64>)]
+    uart_rx_interval: Option<u64>,
+
+    /// Use this image file as the disk of the block device (the size
+    /// of the file is the size of the disk)
+    #[arg(long, value_name = "IMAGE")]
+    block_device: Option<PathBuf>,
+
+    /// Make mtime follow the host's clock, counting HZ ticks per
+    /// second (by default, mtime advances once per clock cycle)
+    #[arg(long, value_name = "HZ")]
+    mtime_frequency: Option<u64>,
+
+    /// Read the memory map (the sizes and base addresses of the EEPROM,
+    /// I/O region and RAM) from this file
+    #[arg(long, value_name = "PATH")]
+    memory_map: Option<PathBuf>,
+
+    /// Size of RAM in bytes, overriding the memory map (a K, M or G
+    /// suffix multiplies by 1024, 1024^2 or 1024^3)
+    #[arg(long, value_name = "BYTES", value_parser=parse_size)]
+    ram_size: Option<u32>,
+
+    /// Record which instructions are executed, and when the program
+    /// exits (or stops on an exception, or reaches --max-cycles),
+    /// write the coverage to this file in lcov format. Lines are taken
+    /// from the program's DWARF information if it was built with -g
+    #[arg(long, value_name = "PATH", conflicts_with_all = DEBUG_ARGS)]
+    coverage: Option<PathBuf>,
+
+    /// Stop the program when mcycle reaches CYCLES (use 0x prefix for
+    /// hexadecimal). Use this to write coverage for a program that
+    /// does not exit
+    #[arg(
+        long,
+        value_name = "CYCLES",
+        value_parser=maybe_hex::<u64>,
+        conflicts_with_all = DEBUG_ARGS
+    )]
+    max_cycles: Option<u64>,
+}
+
+/// Create the platform, configured according to the arguments, send
+/// it the UART input and load the program
+fn make_platform(
+    args: &Args,
+    memory_map: MemoryMap,
+    uart_input: &[u8],
+) -> Result<Platform, BuildError> {
+    let mut builder = Platform::builder()
+        .memory_map(memory_map)
+        .exceptions_are_errors(args.exceptions_are_errors)
+        .uart_rx_depth(args.uart_rx_depth)
+        .uart_rx_interval(args.uart_rx_interval)
+        .uart_input(uart_input)
+        .mtime_frequency(args.mtime_frequency)
+        .elf(&args.input);
+    if let Some(root) = &args.semihosting {
+        builder = builder.semihosting(root);
+    }
+    if let Some(image) = &args.block_device {
+        builder = builder.block_device(image);
+    }
+    builder.build()
+}
+
+/// Read the memory map file (if any) and apply the --ram-size option,
+/// checking that the result is valid
+fn read_memory_map(args: &Args) -> Result<MemoryMap, Box<dyn Error>> {
+    let mut memory_map = match &args.memory_map {
+        Some(path) => fs::read_to_string(path)?.parse()?,
+        None => MemoryMap::default(),
+    };
+    if let Some(ram_size) = args.ram_size {
+        memory_map.ram_size = ram_size;
+    }
+    memory_map.validate()?;
+    Ok(memory_map)
+}
+
+/// Read all of the UART input file (or standard input if path is -)
+fn read_uart_input(path: &Path) -> Result<Vec<u8>, io::Error> {
+    if path == Path::new("-") {
+        let mut input = Vec::new();
+        io::stdin().read_to_end(&mut input)?;
+        Ok(input)
+    } else {
+        fs::read(path)
+    }
 }
 
 fn press_enter_to_continue() {
@@ -53,6 +205,18 @@ fn press_enter_to_continue() {
     let _ = stdin.read(&mut [0u8]).unwrap();
 }
 
+/// Wait for the user to press enter. Returns true if the user typed
+/// c before pressing enter (continue to the next breakpoint).
+fn step_or_continue() -> bool {
+    let mut stdout = io::stdout();
+    write!(stdout, "Press enter to step (c to continue)...").unwrap();
+    stdout.flush().unwrap();
+
+    let mut line = String::new();
+    io::stdin().read_line(&mut line).unwrap();
+    line.trim() == "c"
+}
+
 fn print_memory(platform: &Platform, base: u32) {
     for n in 0..8 {
         let addr = base + 4 * n;
@@ -61,31 +225,198 @@ fn print_memory(platform: &Platform, base: u32) {
     }
 }
 
+/// Add all the breakpoints given on the command line to the
+/// platform's breakpoint set
+fn insert_breakpoints(
+    platform: &mut Platform,
+    args: &Args,
+) -> Result<(), Box<dyn Error>> {
+    let mut specs = args.breakpoints.clone();
+    specs.extend(args.pc_breakpoint.map(|pc| BreakpointSpec::Pc {
+        location: Location::Addr(pc),
+        condition: None,
+    }));
+    specs.extend(args.cycle_breakpoint.map(BreakpointSpec::Cycle));
+
+    // Only require a symbol table if it is needed
+    let needs_symbols = specs.iter().any(|spec| {
+        matches!(
+            spec,
+            BreakpointSpec::Pc {
+                location: Location::Symbol(_),
+                ..
+            }
+        )
+    });
+    let symbols = if needs_symbols {
+        read_symbols(&args.input)?
+    } else {
+        Vec::new()
+    };
+
+    for spec in specs.iter() {
+        platform.breakpoints_mut().insert_spec(spec, &symbols)?;
+    }
+    Ok(())
+}
+
+/// Print an exception along with the pc (and the function containing
+/// it, if the program has symbols) and mcycle
+fn print_exception(platform: &Platform, ex: Exception) {
+    println!(
+        "Got exception {ex:?} at pc={}, mcycle={}",
+        platform.describe_addr(platform.pc()),
+        platform.mcycle()
+    );
+}
+
+/// Write the coverage recorded by the platform to path in lcov format
+fn write_coverage(
+    platform: &Platform,
+    elf_name: &String,
+    path: &Path,
+) -> Result<(), Box<dyn Error>> {
+    let coverage = platform.coverage().expect("coverage should be enabled");
+
+    // A program without a symbol table has no function coverage, but
+    // still has line (or instruction) coverage
+    let functions: Vec<FullSymbol> = read_symbols(elf_name)
+        .unwrap_or_default()
+        .into_iter()
+        .filter(|symbol| symbol.is_func())
+        .collect();
+    let functions = SymbolIndex::new(&functions);
+    let lines = read_line_table(elf_name)?;
+
+    let mut out = io::BufWriter::new(fs::File::create(path)?);
+    let functions = functions.ranges();
+    coverage.write_lcov(&mut out, elf_name, functions, lines.as_ref())?;
+    out.flush()?;
+    println!(
+        "\nWrote coverage ({} instructions executed) to {}",
+        coverage.executed_count(),
+        path.display()
+    );
+    Ok(())
+}
+
+/// Exit the emulator with the exit status of the program
+fn exit_program(status: u32) -> ! {
+    println!("\nProgram exited with status {status}");
+    std::process::exit(i32::try_from(status).unwrap_or(1))
+}
+
+/// Write the uart output to stdout, using buf to move it out of the
+/// platform (so that printing the output does not allocate)
+fn print_uartout(platform: &mut Platform, buf: &mut [u8]) {
+    let mut stdout = io::stdout().lock();
+    loop {
+        let count = platform.read_uartout(buf);
+        if count == 0 {
+            break;
+        }
+        stdout.write_all(&buf[..count]).unwrap();
+    }
+    stdout.flush().unwrap();
+}
+
+/// Run until a breakpoint is reached, printing uart output along
+/// the way
+fn run_to_breakpoint(platform: &mut Platform) -> Result<StopReason, Exception> {
+    let mut uart_buf = [0; UART_BUF_LEN];
+    loop {
+        let stop_reason = platform.run(RUN_STEPS);
+        print_uartout(platform, &mut uart_buf);
+        let stop_reason = stop_reason?;
+        if stop_reason != StopReason::StepsCompleted {
+            return Ok(stop_reason);
+        }
+    }
+}
+
+/// Accept a single gdb connection and serve it until gdb detaches
+fn run_gdb_server(
+    platform: &mut Platform,
+    address: &str,
+) -> Result<(), Box<dyn Error>> {
+    let uart = io::stdout();
+    if let Ok(port) = address.parse::<u16>() {
+        let listener = TcpListener::bind(("127.0.0.1", port))?;
+        println!("Waiting for gdb connection on port {port}");
+        let (stream, _) = listener.accept()?;
+        stream.set_nodelay(true)?;
+        GdbStub::new(stream, uart).serve(platform)?;
+    } else {
+        #[cfg(unix)]
+        {
+            let listener = UnixListener::bind(address)?;
+            println!("Waiting for gdb connection on {address}");
+            let (stream, _) = listener.accept()?;
+            GdbStub::new(stream, uart).serve(platform)?;
+        }
+        #[cfg(not(unix))]
+        return Err("gdb address must be a port number".into());
+    }
+    Ok(())
+}
+
 fn main() {
     let args = Args::parse();
 
-    if args.debug
+    let uart_input = match &args.uart_input {
+        Some(path) => match read_uart_input(path) {
+            Ok(input) => input,
+            Err(e) => {
+                println!("Error reading UART input: {e}");
+                return;
+            }
+        },
+        None => Vec::new(),
+    };
+
+    let memory_map = match read_memory_map(&args) {
+        Ok(memory_map) => memory_map,
+        Err(e) => {
+            println!("Error reading memory map: {e}");
+            return;
+        }
+    };
+
+    if let Some(address) = &args.gdb {
+        let mut platform = match make_platform(&args, memory_map, &uart_input) {
+            Ok(platform) => platform,
+            Err(e) => {
+                println!("{e}");
+                return;
+            }
+        };
+
+        if let Err(e) = run_gdb_server(&mut platform, address) {
+            println!("gdb server error: {e}");
+        }
+    } else if args.debug
         || args.pc_breakpoint.is_some()
         || args.cycle_breakpoint.is_some()
+        || !args.breakpoints.is_empty()
     {
-        let mut platform = Platform::new();
-        platform.set_exceptions_are_errors(args.exceptions_are_errors);
-
-        // Open an executable file
-        let elf_name = args.input.to_string();
-        load_elf(&mut platform, &elf_name).unwrap();
+        let mut platform = match make_platform(&args, memory_map, &uart_input) {
+            Ok(platform) => platform,
+            Err(e) => {
+                println!("{e}");
+                return;
+            }
+        };
 
         if args.debug {
             platform.set_trace(true);
             loop {
                 if let Err(ex) = platform.step() {
-                    println!(
-                        "Got exception {ex:?} at pc=0x{:x}, mcycle={}",
-                        platform.pc(),
-                        platform.mcycle()
-                    );
+                    print_exception(&platform, ex);
                     return;
                 }
+                if let Some(status) = platform.take_exit_status() {
+                    exit_program(status);
+                }
 
                 if let Some(base) = args.memory {
                     println!("Memory:");
@@ -95,83 +426,89 @@ fn main() {
                 press_enter_to_continue();
             }
         } else {
-            let mut step = false;
+            if let Err(e) = insert_breakpoints(&mut platform, &args) {
+                println!("Error setting breakpoints: {e}");
+                return;
+            }
+
             loop {
-                if let Some(pc_breakpoint) = args.pc_breakpoint {
-                    if platform.pc() == pc_breakpoint {
-                        platform.set_trace(true);
-                        step = true;
+                match run_to_breakpoint(&mut platform) {
+                    Ok(StopReason::Exit(status)) => exit_program(status),
+                    Ok(stop_reason) => println!("\nStopped: {stop_reason:?}"),
+                    Err(ex) => {
+                        print_exception(&platform, ex);
+                        return;
                     }
                 }
 
-                if let Some(cycle_breakpoint) = args.cycle_breakpoint {
-                    if platform.mcycle() == cycle_breakpoint {
-                        platform.set_trace(true);
-                        step = true;
+                // Debug step until the user asks to continue
+                platform.set_trace(true);
+                loop {
+                    if let Err(ex) = platform.step() {
+                        print_exception(&platform, ex);
+                        return;
+                    }
+                    if let Some(status) = platform.take_exit_status() {
+                        exit_program(status);
                     }
-                }
-
-                if let Err(ex) = platform.step() {
-                    println!(
-                        "Got exception {ex:?} at pc=0x{:x}, mcycle={}",
-                        platform.pc(),
-                        platform.mcycle()
-                    );
-                    return;
-                }
 
-                if step {
                     if let Some(base) = args.memory {
                         println!("Memory:");
                         print_memory(&platform, base)
                     }
 
-                    press_enter_to_continue();
+                    if step_or_continue() {
+                        break;
+                    }
                 }
+                platform.set_trace(false);
             }
         }
     } else {
-        let (uart_tx, uart_rx) = mpsc::channel();
-
-        // Thread running the emulation
-        let emulator_handle = thread::spawn(move || {
-            let mut platform = Platform::new();
-            platform.set_exceptions_are_errors(args.exceptions_are_errors);
-
-            // Open an executable file
-            let elf_name = args.input.to_string();
-
-            if let Err(e) = load_elf(&mut platform, &elf_name) {
-                println!("Error loading elf: {e}");
+        let mut platform = match make_platform(&args, memory_map, &uart_input) {
+            Ok(platform) => platform,
+            Err(e) => {
+                println!("{e}");
                 return;
             }
+        };
 
-            println!("Beginning execution\n");
-            loop {
-                if let Err(ex) = platform.step() {
-                    println!(
-                        "Got exception {ex:?} at pc=0x{:x}, mcycle={}",
-                        platform.pc(),
-                        platform.mcycle()
-                    );
-                    return;
-                }
+        if args.coverage.is_some() {
+            platform.enable_coverage();
+        }
 
-                uart_tx.send(platform.flush_uartout()).unwrap();
+        println!("Beginning execution\n");
+        let mut uart_buf = [0; UART_BUF_LEN];
+        let exit_status = loop {
+            let steps = match args.max_cycles {
+                Some(max) => {
+                    RUN_STEPS.min(max.saturating_sub(platform.mcycle()))
+                }
+                None => RUN_STEPS,
+            };
+            if steps == 0 {
+                println!("\nStopped at mcycle={}", platform.mcycle());
+                break None;
             }
-        });
-
-        // Thread for printing received UART stdout
-        let uart_host_handle = thread::spawn(move || loop {
-            if let Ok(uart_rx) = uart_rx.recv() {
-                print!("{uart_rx}");
-            } else {
-                println!("UART channel closed");
-                break;
+            let stop_reason = platform.run(steps);
+            print_uartout(&mut platform, &mut uart_buf);
+            match stop_reason {
+                Ok(StopReason::Exit(status)) => break Some(status),
+                Ok(_) => {}
+                Err(ex) => {
+                    print_exception(&platform, ex);
+                    break None;
+                }
             }
-        });
+        };
 
-        uart_host_handle.join().unwrap();
-        emulator_handle.join().unwrap();
+        if let Some(path) = &args.coverage {
+            if let Err(e) = write_coverage(&platform, &args.input, path) {
+                println!("Error writing coverage: {e}");
+            }
+        }
+        if let Some(status) = exit_status {
+            exit_program(status);
+        }
     }
 }
@@ -0,0 +1,110 @@
+use clap::Parser;
+use clap_num::maybe_hex;
+use riscvemu::torture::{generate, InstrMix, TortureOptions};
+use riscvemu::trace_file::{
+    write_program_trace_file, RecordOptions, TraceFormat,
+};
+
+/// Generate a random RV32IM torture program as a trace file
+///
+/// The program is a random sequence of valid instructions, executed
+/// in a loop, which never raises an exception. It is written as the
+/// .eeprom section of a trace file (see elf2trace), which can be run
+/// using emulate, compared between execution engines using bisect
+/// --lockstep, or used as a benchmark.
+///
+/// The mix of instructions is set by relative weights for each kind
+/// of instruction. Operands are biased towards corner cases, such as
+/// division by zero, signed division overflow and misaligned loads
+/// and stores. The same options always generate the same program.
+///
+/// With --record, the program is also run for the given number of
+/// cycles, and trace points recording the pc and registers are
+/// written, producing a golden trace for the program.
+///
+#[derive(Parser, Debug)]
+#[command(author, version, about, long_about)]
+struct Args {
+    /// Path to output file
+    #[arg(short, long)]
+    output: String,
+
+    /// Seed for the random number generator
+    #[arg(short, long, default_value_t = 1)]
+    seed: u64,
+
+    /// Number of groups of instructions in the loop body
+    #[arg(short, long, default_value_t = 1000)]
+    length: usize,
+
+    /// Number of times the loop body is executed
+    #[arg(short = 'n', long, default_value_t = 10)]
+    iterations: u32,
+
+    /// Weight of ALU instructions
+    #[arg(long, default_value_t = 50)]
+    alu: u32,
+
+    /// Weight of multiply and divide instructions
+    #[arg(long, default_value_t = 15)]
+    mul_div: u32,
+
+    /// Weight of loads and stores
+    #[arg(long, default_value_t = 20)]
+    load_store: u32,
+
+    /// Weight of branches
+    #[arg(long, default_value_t = 15)]
+    branch: u32,
+
+    /// Number of bytes of RAM used by loads and stores
+    #[arg(short, long, default_value = "0x1000", value_parser=maybe_hex::<u32>)]
+    footprint: u32,
+
+    /// Write the output in the binary trace format
+    #[arg(short, long)]
+    binary: bool,
+
+    /// Run the program for this many cycles and record trace points
+    #[arg(short, long, value_name = "CYCLES", value_parser=maybe_hex::<u64>)]
+    record: Option<u64>,
+
+    /// While recording, write a trace point every INTERVAL cycles
+    #[arg(long, value_parser=maybe_hex::<u64>)]
+    interval: Option<u64>,
+}
+
+fn main() {
+    let args = Args::parse();
+    let options = TortureOptions {
+        seed: args.seed,
+        length: args.length,
+        iterations: args.iterations,
+        mix: InstrMix {
+            alu: args.alu,
+            mul_div: args.mul_div,
+            load_store: args.load_store,
+            branch: args.branch,
+        },
+        footprint: args.footprint,
+    };
+    let format = if args.binary {
+        TraceFormat::Binary
+    } else {
+        TraceFormat::Text
+    };
+    let record_options = args.record.map(|cycles| RecordOptions {
+        cycles,
+        interval: args.interval,
+        ..RecordOptions::default()
+    });
+    let result = write_program_trace_file(
+        generate(&options),
+        args.output,
+        format,
+        record_options.as_ref(),
+    );
+    if let Err(e) = result {
+        println!("{e}");
+    }
+}
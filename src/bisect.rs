@@ -0,0 +1,427 @@
+//! First-divergence search between two runs
+//!
+//! When a change to the program or to the emulator breaks a trace,
+//! the interesting question is where the two runs first differ. This
+//! module runs two platforms side by side (for example, two versions
+//! of a program, or the same program using two execution engines) and
+//! finds the first cycle at which their states differ:
+//!
+//! * both runs advance interval cycles at a time, comparing a hash of
+//!   the state (see Checkpoint::state_hash) after each interval, and
+//!   keeping a checkpoint of the last state that matched
+//! * once the hashes differ, a binary search between the last
+//!   matching and the first mismatching cycle, restarting both runs
+//!   from the matching checkpoints each time, finds the last cycle
+//!   where the states are the same
+//! * the instruction executed by each run at that cycle is reported,
+//!   along with every difference in the state one cycle later
+//!
+//! The binary search assumes that once the states differ, they keep
+//! differing. If they differ only briefly (for example, a register
+//! that differs and is then overwritten) within one interval, that
+//! difference can be missed, and a later one reported instead; use a
+//! smaller interval to find it.
+//!
+//! A run whose program exits using semihosting stops there, and its
+//! state is compared as it was at the exit.
+//!
+//! For checking the block engine itself, run_lockstep runs it
+//! alongside single stepping, comparing the state after every block,
+//! so that the first block executed differently is found directly.
+//! To keep that cheap, only the pages of RAM written during the block
+//! and the UART output produced during it are compared, along with
+//! the rest of the checkpoint state.
+//!
+//! Otherwise, only the state in a checkpoint is compared (the pc,
+//! registers, CSR state, RAM and pending UART output), so two
+//! different programs can be compared. UART output is never flushed,
+//! so it is compared in full.
+
+use std::str::FromStr;
+
+use thiserror::Error;
+
+use crate::platform::breakpoints::StopReason;
+use crate::platform::checkpoint::{Checkpoint, StateDifference};
+use crate::platform::eei::Eei;
+use crate::platform::Platform;
+
+#[derive(Debug, Error)]
+pub enum EngineError {
+    #[error("unknown engine '{0}' (expected block or step)")]
+    UnknownEngine(String),
+}
+
+/// The way a run executes instructions
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum Engine {
+    /// Platform::run, using the decoded block cache
+    Block,
+    /// Platform::step, one instruction at a time
+    Step,
+}
+
+impl FromStr for Engine {
+    type Err = EngineError;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "block" => Ok(Self::Block),
+            "step" => Ok(Self::Step),
+            _ => Err(EngineError::UnknownEngine(s.to_string())),
+        }
+    }
+}
+
+/// A platform with a program loaded, and the engine used to run it
+#[derive(Debug)]
+pub struct Run {
+    pub platform: Platform,
+    pub engine: Engine,
+    /// Set when the program exits using semihosting, after which the
+    /// run does not advance (until it is restored from a checkpoint)
+    exited: bool,
+}
+
+impl Run {
+    pub fn new(mut platform: Platform, engine: Engine) -> Self {
+        platform.set_exceptions_are_errors(false);
+        Self {
+            platform,
+            engine,
+            exited: false,
+        }
+    }
+
+    /// Run until mcycle reaches cycle, or the program exits
+    fn run_to_cycle(&mut self, cycle: u64) {
+        match self.engine {
+            Engine::Block => {
+                if !self.exited {
+                    let stop_reason = self
+                        .platform
+                        .run_to_cycle(cycle)
+                        .expect("exceptions are not errors while bisecting");
+                    self.exited = matches!(stop_reason, StopReason::Exit(_));
+                }
+            }
+            Engine::Step => {
+                while !self.exited && self.platform.mcycle() < cycle {
+                    self.platform
+                        .step()
+                        .expect("exceptions are not errors while bisecting");
+                    self.exited = self.platform.take_exit_status().is_some();
+                }
+            }
+        }
+    }
+
+    fn restore(&mut self, checkpoint: &Checkpoint) {
+        self.platform.restore(checkpoint);
+        self.exited = false;
+    }
+}
+
+/// Where two runs first differ
+#[derive(Debug)]
+pub struct Divergence {
+    /// The last cycle at which the states of the two runs match (or
+    /// None if they differ at reset)
+    pub last_matching_cycle: Option<u64>,
+    /// The pc and disassembly of the instruction executed by each run
+    /// at the last matching cycle
+    pub instrs: Option<[(u32, String); 2]>,
+    /// The differences between the states at the first mismatching
+    /// cycle
+    pub differences: Vec<StateDifference>,
+}
+
+fn instr(platform: &Platform) -> (u32, String) {
+    let pc = platform.pc();
+    (pc, platform.disassemble(pc))
+}
+
+/// Find the first cycle (up to max_cycle) where the states of two
+/// runs differ, checking the state hashes every interval cycles. Both
+/// runs must be at reset. Returns None if the states match up to
+/// max_cycle.
+pub fn find_divergence(
+    runs: &mut [Run; 2],
+    interval: u64,
+    max_cycle: u64,
+) -> Option<Divergence> {
+    let interval = interval.max(1);
+    let mut matching =
+        [runs[0].platform.checkpoint(), runs[1].platform.checkpoint()];
+    if matching[0].state_hash() != matching[1].state_hash() {
+        return Some(Divergence {
+            last_matching_cycle: None,
+            instrs: None,
+            differences: matching[0].differences(&matching[1]),
+        });
+    }
+
+    // Find an interval containing the divergence
+    let mut last_match = 0;
+    let mut first_mismatch = loop {
+        if last_match >= max_cycle {
+            return None;
+        }
+        let cycle = last_match.saturating_add(interval).min(max_cycle);
+        let checkpoints = run_both_to(runs, cycle);
+        if checkpoints[0].state_hash() == checkpoints[1].state_hash() {
+            last_match = cycle;
+            matching = checkpoints;
+        } else {
+            break cycle;
+        }
+    };
+
+    // Narrow it down to a single cycle
+    while first_mismatch - last_match > 1 {
+        let cycle = last_match + (first_mismatch - last_match) / 2;
+        restore_both(runs, &matching);
+        let checkpoints = run_both_to(runs, cycle);
+        if checkpoints[0].state_hash() == checkpoints[1].state_hash() {
+            last_match = cycle;
+            matching = checkpoints;
+        } else {
+            first_mismatch = cycle;
+        }
+    }
+
+    restore_both(runs, &matching);
+    let instrs = [instr(&runs[0].platform), instr(&runs[1].platform)];
+    let checkpoints = run_both_to(runs, first_mismatch);
+    Some(Divergence {
+        last_matching_cycle: Some(last_match),
+        instrs: Some(instrs),
+        differences: checkpoints[0].differences(&checkpoints[1]),
+    })
+}
+
+fn run_both_to(runs: &mut [Run; 2], cycle: u64) -> [Checkpoint; 2] {
+    runs.each_mut().map(|run| {
+        run.run_to_cycle(cycle);
+        run.platform.checkpoint()
+    })
+}
+
+fn restore_both(runs: &mut [Run; 2], checkpoints: &[Checkpoint; 2]) {
+    for (run, checkpoint) in runs.iter_mut().zip(checkpoints.iter()) {
+        run.restore(checkpoint);
+    }
+}
+
+/// The first block where the block engine and single stepping
+/// disagree (see run_lockstep)
+#[derive(Debug)]
+pub struct LockstepMismatch {
+    /// The value of mcycle at the start of the block
+    pub cycle: u64,
+    /// The pc and disassembly of each instruction executed by the
+    /// reference (single stepping) run in the block
+    pub instrs: Vec<(u32, String)>,
+    /// The differences between the states after the block (the
+    /// first value is from the block engine)
+    pub differences: Vec<StateDifference>,
+}
+
+/// Run the same program on two platforms in lockstep, one using the
+/// block engine (Platform::run_one_block) and the other single
+/// stepping (Platform::step) as the reference. After every block, the
+/// reference takes the same number of steps, and the pc, registers,
+/// CSR and peripheral state, the pages of RAM written by either
+/// platform during the block, and the UART output produced during
+/// the block are compared. Stops at the first block that ends at or
+/// after max_cycle, or at the first mismatch.
+///
+/// The UART output of both platforms is consumed as it is compared.
+/// Both platforms should start in the same state: a difference in a
+/// page of RAM that is not written after the call is not found.
+///
+/// This is slower than either engine alone, since the reference is
+/// single stepped, but it checks that every block is executed
+/// exactly as single stepping would execute it.
+pub fn run_lockstep(
+    fast: &mut Platform,
+    reference: &mut Platform,
+    max_cycle: u64,
+) -> Option<LockstepMismatch> {
+    fast.set_exceptions_are_errors(false);
+    reference.set_exceptions_are_errors(false);
+    fast.track_dirty_pages();
+    reference.track_dirty_pages();
+    let mut pages = Vec::new();
+    let mut uart_out = [Vec::new(), Vec::new()];
+    while fast.mcycle() < max_cycle {
+        let cycle = fast.mcycle();
+        let steps = fast
+            .run_one_block()
+            .expect("exceptions are not errors in lockstep");
+        let mut instrs = Vec::new();
+        for _ in 0..steps {
+            instrs.push(instr(reference));
+            reference
+                .step()
+                .expect("exceptions are not errors in lockstep");
+        }
+
+        pages.clear();
+        fast.take_dirty_pages(&mut pages);
+        reference.take_dirty_pages(&mut pages);
+        pages.sort_unstable();
+        pages.dedup();
+        let mut differences = fast
+            .partial_checkpoint(&pages)
+            .differences(&reference.partial_checkpoint(&pages));
+
+        for (platform, buf) in [&mut *fast, &mut *reference]
+            .into_iter()
+            .zip(uart_out.iter_mut())
+        {
+            buf.resize(platform.uart_output_unread(), 0);
+            platform.read_uartout(buf);
+        }
+        if uart_out[0] != uart_out[1] {
+            let [a, b] = uart_out.clone();
+            differences.push(StateDifference::Uart(a, b));
+        }
+
+        if !differences.is_empty() {
+            return Some(LockstepMismatch {
+                cycle,
+                instrs,
+                differences,
+            });
+        }
+    }
+    None
+}
+
+#[cfg(test)]
+mod tests {
+
+    use std::path::PathBuf;
+
+    use super::*;
+    use crate::encode::*;
+    use crate::trace_file::load_trace;
+
+    fn hello_run(engine: Engine) -> Run {
+        let mut d = PathBuf::from(env!("CARGO_MANIFEST_DIR"));
+        d.push("test_traces/hello.trace");
+        let path = d.into_os_string().into_string().unwrap();
+        let mut platform = Platform::new();
+        load_trace(&mut platform, path).unwrap();
+        Run::new(platform, engine)
+    }
+
+    #[test]
+    fn check_engines_agree() {
+        let mut runs = [hello_run(Engine::Block), hello_run(Engine::Step)];
+        assert!(find_divergence(&mut runs, 1000, 3000).is_none());
+    }
+
+    #[test]
+    fn check_lockstep_agrees() {
+        let mut fast = hello_run(Engine::Block).platform;
+        let mut reference = hello_run(Engine::Step).platform;
+        assert!(run_lockstep(&mut fast, &mut reference, 3000).is_none());
+        assert!(fast.mcycle() >= 3000);
+    }
+
+    /// A block engine bug (simulated by patching the program that
+    /// only the block engine runs) is reported at the block where it
+    /// happens
+    #[test]
+    fn check_lockstep_reports_mismatch() -> Result<(), &'static str> {
+        let mut run = hello_run(Engine::Block);
+        run.platform.run_to_cycle(1000).unwrap();
+        let pc = run.platform.pc();
+
+        let mut fast = hello_run(Engine::Block).platform;
+        for (n, byte) in (pc..).zip(addi!(x31, x31, 1).to_le_bytes().iter()) {
+            fast.debug_store_byte(n, *byte);
+        }
+        let mut reference = hello_run(Engine::Step).platform;
+        let mismatch = run_lockstep(&mut fast, &mut reference, 3000).unwrap();
+        assert!(mismatch.cycle <= 1000);
+        assert!(mismatch.instrs.iter().any(|(instr_pc, _)| *instr_pc == pc));
+        assert!(!mismatch.differences.is_empty());
+        Ok(())
+    }
+
+    /// A difference in a store is found in the page it writes, and
+    /// pages that are not written are not compared
+    #[test]
+    fn check_lockstep_compares_stores() -> Result<(), &'static str> {
+        let mut fast = Platform::new();
+        let mut reference = Platform::new();
+        for (platform, value) in [(&mut fast, 1), (&mut reference, 2)] {
+            platform.debug_store_bytes(0x2000_0000, &[value as u8]);
+            for (n, instr) in
+                [addi!(x1, x0, value), lui!(x2, 0x20001), sb!(x1, x2, 0x10)]
+                    .iter()
+                    .enumerate()
+            {
+                let bytes = instr.to_le_bytes();
+                platform.debug_store_bytes(4 * n as u32, &bytes);
+            }
+        }
+        let mismatch = run_lockstep(&mut fast, &mut reference, 3).unwrap();
+        assert!(mismatch.differences.contains(&StateDifference::Memory {
+            addr: 0x2000_1010,
+            values: (1, 2)
+        }));
+        assert!(!mismatch.differences.iter().any(|difference| matches!(
+            difference,
+            StateDifference::Memory {
+                addr: 0x2000_0000,
+                ..
+            }
+        )));
+        Ok(())
+    }
+
+    /// Patch one instruction of the program in the second run, and
+    /// check the divergence is found where it is executed
+    #[test]
+    fn check_patched_program_diverges() -> Result<(), &'static str> {
+        let mut run = hello_run(Engine::Block);
+        run.platform.run_to_cycle(1000).unwrap();
+        let pc = run.platform.pc();
+        let patch = addi!(x31, x31, 1).to_le_bytes();
+        let patched_run = || {
+            let mut run = hello_run(Engine::Step);
+            for (n, byte) in (pc..).zip(patch.iter()) {
+                run.platform.debug_store_byte(n, *byte);
+            }
+            run
+        };
+
+        // Comparing every cycle finds the first divergence
+        let mut runs = [hello_run(Engine::Block), patched_run()];
+        let first = find_divergence(&mut runs, 1, 3000).unwrap();
+        let first_cycle = first.last_matching_cycle.unwrap();
+        assert!(first_cycle <= 1000);
+
+        // The patched instruction changes x31, which the program later
+        // overwrites, so with a longer interval a later execution of
+        // it may be found instead
+        for interval in [1, 256] {
+            let mut runs = [hello_run(Engine::Block), patched_run()];
+            let divergence =
+                find_divergence(&mut runs, interval, 3000).unwrap();
+            assert!(divergence.last_matching_cycle.unwrap() >= first_cycle);
+            let instrs = divergence.instrs.unwrap();
+            assert_eq!(instrs[0].0, pc);
+            assert_eq!(instrs[1], (pc, "addi x31, x31, 0x1".to_string()));
+            assert!(divergence.differences.iter().any(|difference| matches!(
+                difference,
+                StateDifference::Reg { index: 31, .. }
+            )));
+        }
+        Ok(())
+    }
+}
@@ -14,6 +14,12 @@ use elf::{ElfBytes, ParseError};
 
 use thiserror::Error;
 
+pub use self::line_table::{LineRange, LineTable, LineTableError};
+pub use self::symbol_index::{SymbolIndex, SymbolRange};
+
+pub mod line_table;
+pub mod symbol_index;
+
 #[derive(Debug, Error)]
 pub enum ElfError {
     #[error("Attempted to write byte to non-writable memory address 0x{0:x}")]
@@ -36,9 +42,11 @@ pub enum ElfError {
     InvalidSymbolInfoType(u8),
     #[error("missing program segment table")]
     MissingSegmentTable,
+    #[error("Failed to parse line table: {0}")]
+    LineTable(#[from] LineTableError),
 }
 
-#[derive(Debug, PartialEq, Eq)]
+#[derive(Debug, Clone, PartialEq, Eq)]
 pub enum SymbolBind {
     Local,
     Global,
@@ -60,7 +68,7 @@ impl SymbolBind {
     }
 }
 
-#[derive(Debug, PartialEq, Eq)]
+#[derive(Debug, Clone, PartialEq, Eq)]
 pub enum SymbolType {
     Notype,
     Object,
@@ -86,7 +94,7 @@ impl SymbolType {
     }
 }
 
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub struct SymbolInfo {
     st_type: SymbolType,
     st_bind: SymbolBind,
@@ -100,7 +108,7 @@ impl SymbolInfo {
     }
 }
 
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub enum SymbolSection {
     Undef,
     Loreserve,
@@ -152,12 +160,13 @@ impl SymbolSection {
     }
 }
 
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub struct FullSymbol {
     pub name: Option<String>,
     section: SymbolSection,
     info: SymbolInfo,
     pub value: u32,
+    pub size: u32,
 }
 
 impl FullSymbol {
@@ -196,11 +205,13 @@ impl FullSymbol {
         let section = SymbolSection::from_symbol(symbol, elf_file)?;
         let info = SymbolInfo::from_symbol(&symbol)?;
         let value = symbol.st_value.try_into().unwrap();
+        let size = symbol.st_size.try_into().unwrap();
         Ok(Self {
             name,
             section,
             info,
             value,
+            size,
         })
     }
 }
@@ -296,6 +307,19 @@ impl ElfFile {
         Ok(data_pair.0)
     }
 
+    /// Get the data in the section called name, or None if there is
+    /// no such section
+    fn section_data_by_name(
+        &self,
+        name: &str,
+    ) -> Result<Option<&[u8]>, ElfError> {
+        let elf_bytes = self.elf_bytes()?;
+        match elf_bytes.section_header_by_name(name)? {
+            Some(header) => Ok(Some(self.section_data(&header)?)),
+            None => Ok(None),
+        }
+    }
+
     /// Returns the list of global or function symbols (other symbols
     /// are ignored).
     fn symbols(&self) -> Result<Vec<FullSymbol>, ElfError> {
@@ -355,3 +379,31 @@ pub fn load_elf<L: ElfLoadable>(
     loadable.load_symbols(elf_file.symbols()?);
     Ok(())
 }
+
+/// Read the symbol table of an ELF file from disk, without loading
+/// anything
+pub fn read_symbols(
+    elf_file_path: &String,
+) -> Result<Vec<FullSymbol>, ElfError> {
+    ElfFile::from_file(elf_file_path)?.symbols()
+}
+
+/// Read the DWARF line number information of an ELF file from disk.
+/// Returns None if the file has no .debug_line section (for example,
+/// if it was not compiled with -g).
+pub fn read_line_table(
+    elf_file_path: &String,
+) -> Result<Option<LineTable>, ElfError> {
+    let elf_file = ElfFile::from_file(elf_file_path)?;
+    let Some(debug_line) = elf_file.section_data_by_name(".debug_line")? else {
+        return Ok(None);
+    };
+    let debug_line_str = elf_file
+        .section_data_by_name(".debug_line_str")?
+        .unwrap_or_default();
+    let debug_str = elf_file
+        .section_data_by_name(".debug_str")?
+        .unwrap_or_default();
+    let line_table = LineTable::parse(debug_line, debug_line_str, debug_str)?;
+    Ok(Some(line_table))
+}
@@ -0,0 +1,718 @@
+//! Address to source line lookup, from DWARF line number information
+//!
+//! A program compiled with -g has a .debug_line section, which holds a
+//! line number program for each compilation unit: a compact bytecode
+//! that, when run, produces a table of rows mapping instruction
+//! addresses to source files and lines (see section 6.2 of the DWARF 5
+//! standard). This module runs those programs (versions 2 to 5 of the
+//! format) and keeps the result as sorted address ranges, so that
+//! coverage (and anything else that needs a source line) can look up
+//! the line for an address.
+//!
+//! Only the file, line and address columns are kept. Files are named
+//! by their path joined to their include directory, as recorded by the
+//! compiler (which may be relative to the compilation directory).
+
+use thiserror::Error;
+
+#[derive(Debug, Error, PartialEq, Eq)]
+pub enum LineTableError {
+    #[error("line table is truncated")]
+    Truncated,
+    #[error("unsupported line table version {0}")]
+    UnsupportedVersion(u16),
+    #[error("unsupported attribute form 0x{0:x} in line table header")]
+    UnsupportedForm(u64),
+    #[error("invalid file index {0} in line table")]
+    InvalidFile(u64),
+    #[error("invalid string offset 0x{0:x} in line table")]
+    InvalidString(u64),
+    #[error("address 0x{0:x} does not fit in 32 bits")]
+    AddressTooLarge(u64),
+    #[error("line table has a line_range of 0")]
+    ZeroLineRange,
+}
+
+// Standard opcodes
+const DW_LNS_COPY: u8 = 1;
+const DW_LNS_ADVANCE_PC: u8 = 2;
+const DW_LNS_ADVANCE_LINE: u8 = 3;
+const DW_LNS_SET_FILE: u8 = 4;
+const DW_LNS_CONST_ADD_PC: u8 = 8;
+const DW_LNS_FIXED_ADVANCE_PC: u8 = 9;
+
+// Extended opcodes
+const DW_LNE_END_SEQUENCE: u8 = 1;
+const DW_LNE_SET_ADDRESS: u8 = 2;
+const DW_LNE_DEFINE_FILE: u8 = 3;
+
+// Entry formats in version 5 headers
+const DW_LNCT_PATH: u64 = 1;
+const DW_LNCT_DIRECTORY_INDEX: u64 = 2;
+
+const DW_FORM_BLOCK: u64 = 0x09;
+const DW_FORM_BLOCK1: u64 = 0x0a;
+const DW_FORM_BLOCK2: u64 = 0x03;
+const DW_FORM_BLOCK4: u64 = 0x04;
+const DW_FORM_DATA1: u64 = 0x0b;
+const DW_FORM_DATA2: u64 = 0x05;
+const DW_FORM_DATA4: u64 = 0x06;
+const DW_FORM_DATA8: u64 = 0x07;
+const DW_FORM_DATA16: u64 = 0x1e;
+const DW_FORM_LINE_STRP: u64 = 0x1f;
+const DW_FORM_SDATA: u64 = 0x0d;
+const DW_FORM_STRING: u64 = 0x08;
+const DW_FORM_STRP: u64 = 0x0e;
+const DW_FORM_UDATA: u64 = 0x0f;
+
+/// The source line of the addresses [start, end)
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct LineRange {
+    pub start: u32,
+    /// One past the last address in the range
+    pub end: u32,
+    /// Index into LineTable::files
+    pub file: usize,
+    pub line: u32,
+}
+
+/// Source lines of address ranges, sorted by address
+#[derive(Debug, Clone, Default)]
+pub struct LineTable {
+    files: Vec<String>,
+    ranges: Vec<LineRange>,
+}
+
+impl LineTable {
+    /// Create a line table from ranges (in any order) whose file fields
+    /// index files
+    pub fn new(files: Vec<String>, mut ranges: Vec<LineRange>) -> Self {
+        ranges.sort_by_key(|range| range.start);
+        Self { files, ranges }
+    }
+
+    /// Run the line number programs in a .debug_line section. Version 5
+    /// programs name files by offsets into the .debug_line_str and
+    /// .debug_str sections (either may be empty if not present).
+    pub fn parse(
+        debug_line: &[u8],
+        debug_line_str: &[u8],
+        debug_str: &[u8],
+    ) -> Result<Self, LineTableError> {
+        let strings = Strings {
+            debug_line_str,
+            debug_str,
+        };
+        let mut table = Self::default();
+        let mut reader = Reader::new(debug_line);
+        while !reader.is_empty() {
+            table.parse_unit(&mut reader, &strings)?;
+        }
+        table.ranges.sort_by_key(|range| range.start);
+        Ok(table)
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.ranges.is_empty()
+    }
+
+    /// The address ranges, sorted by start address
+    pub fn ranges(&self) -> &[LineRange] {
+        &self.ranges
+    }
+
+    /// The path of a file, given its index from a LineRange
+    pub fn file(&self, file: usize) -> &str {
+        &self.files[file]
+    }
+
+    /// The range containing addr
+    pub fn lookup(&self, addr: u32) -> Option<&LineRange> {
+        let n = self.ranges.partition_point(|range| range.start <= addr);
+        let range = self.ranges.get(n.checked_sub(1)?)?;
+        (addr < range.end).then_some(range)
+    }
+
+    /// Parse one compilation unit's header and run its program, adding
+    /// its files and ranges to the table
+    fn parse_unit(
+        &mut self,
+        reader: &mut Reader,
+        strings: &Strings,
+    ) -> Result<(), LineTableError> {
+        let (unit_length, offset_size) = reader.initial_length()?;
+        let mut unit = Reader::new(reader.bytes(unit_length)?);
+        let version = unit.u16()?;
+        if !(2..=5).contains(&version) {
+            return Err(LineTableError::UnsupportedVersion(version));
+        }
+        if version >= 5 {
+            let _address_size = unit.u8()?;
+            let _segment_selector_size = unit.u8()?;
+        }
+        let header_length = unit.offset(offset_size)?;
+        let mut program = unit.clone();
+        program.skip(header_length)?;
+
+        let min_inst_length = u64::from(unit.u8()?);
+        if version >= 4 {
+            let _max_ops_per_inst = unit.u8()?;
+        }
+        let _default_is_stmt = unit.u8()?;
+        let line_base = i64::from(unit.u8()? as i8);
+        let line_range = u64::from(unit.u8()?);
+        if line_range == 0 {
+            return Err(LineTableError::ZeroLineRange);
+        }
+        let opcode_base = unit.u8()?;
+        let mut opcode_lengths = Vec::new();
+        for _ in 1..opcode_base {
+            opcode_lengths.push(unit.u8()?);
+        }
+
+        // Files are indexed from 1 before version 5, and from 0 after.
+        // The table's own file list is shared by all units.
+        let first_file = self.files.len();
+        let file_base = if version >= 5 { 0 } else { 1 };
+        if version >= 5 {
+            let directories = parse_entries(&mut unit, strings, offset_size)?;
+            let directories: Vec<String> =
+                directories.into_iter().map(|entry| entry.path).collect();
+            for file in parse_entries(&mut unit, strings, offset_size)? {
+                let dir = directories.get(file.directory as usize);
+                self.files.push(join_path(dir, &file.path));
+            }
+        } else {
+            // Directory 0 is the compilation directory, which is not
+            // listed
+            let mut directories = Vec::new();
+            loop {
+                let dir = unit.string()?;
+                if dir.is_empty() {
+                    break;
+                }
+                directories.push(dir);
+            }
+            loop {
+                let path = unit.string()?;
+                if path.is_empty() {
+                    break;
+                }
+                let directory = unit.uleb128()?;
+                let _mtime = unit.uleb128()?;
+                let _length = unit.uleb128()?;
+                let dir = (directory as usize)
+                    .checked_sub(1)
+                    .and_then(|n| directories.get(n));
+                self.files.push(join_path(dir, &path));
+            }
+        }
+        let file_index = |files: &[String], file: u64| {
+            let index = (file as usize)
+                .checked_sub(file_base)
+                .map(|n| first_file + n)
+                .filter(|n| *n < files.len());
+            index.ok_or(LineTableError::InvalidFile(file))
+        };
+
+        // Run the program, turning each row into a range ending at the
+        // next row's address
+        let mut address: u64 = 0;
+        let mut file: u64 = 1;
+        let mut line: i64 = 1;
+        let mut previous: Option<(u64, u64, i64)> = None;
+        while !program.is_empty() {
+            let opcode = program.u8()?;
+            let mut emit_row = false;
+            let mut end_sequence = false;
+            if opcode >= opcode_base {
+                let adjusted = u64::from(opcode - opcode_base);
+                let advance =
+                    (adjusted / line_range).checked_mul(min_inst_length);
+                address = advance_address(address, advance)?;
+                let advance = line_base + (adjusted % line_range) as i64;
+                line = line.wrapping_add(advance);
+                emit_row = true;
+            } else if opcode == 0 {
+                let length = program.uleb128()?;
+                let mut extended = Reader::new(program.bytes(length)?);
+                match extended.u8()? {
+                    DW_LNE_END_SEQUENCE => {
+                        emit_row = true;
+                        end_sequence = true;
+                    }
+                    DW_LNE_SET_ADDRESS => {
+                        address = extended.address(length - 1)?;
+                    }
+                    DW_LNE_DEFINE_FILE => {
+                        let path = extended.string()?;
+                        self.files.push(path);
+                    }
+                    _ => {}
+                }
+            } else {
+                match opcode {
+                    DW_LNS_COPY => emit_row = true,
+                    DW_LNS_ADVANCE_PC => {
+                        let advance =
+                            program.uleb128()?.checked_mul(min_inst_length);
+                        address = advance_address(address, advance)?;
+                    }
+                    DW_LNS_ADVANCE_LINE => {
+                        line = line.wrapping_add(program.sleb128()?)
+                    }
+                    DW_LNS_SET_FILE => file = program.uleb128()?,
+                    DW_LNS_CONST_ADD_PC => {
+                        let adjusted = u64::from(255 - opcode_base);
+                        let advance = (adjusted / line_range)
+                            .checked_mul(min_inst_length);
+                        address = advance_address(address, advance)?;
+                    }
+                    DW_LNS_FIXED_ADVANCE_PC => {
+                        let advance = u64::from(program.u16()?);
+                        address = advance_address(address, Some(advance))?;
+                    }
+                    _ => {
+                        // Skip the operands of other standard opcodes
+                        let operands = opcode_lengths[usize::from(opcode) - 1];
+                        for _ in 0..operands {
+                            program.uleb128()?;
+                        }
+                    }
+                }
+            }
+
+            if emit_row {
+                if let Some((start, file, line)) = previous {
+                    if start < address {
+                        self.ranges.push(LineRange {
+                            start: to_u32(start)?,
+                            end: to_u32(address)?,
+                            file: file_index(&self.files, file)?,
+                            line: u32::try_from(line).unwrap_or(0),
+                        });
+                    }
+                }
+                previous = (!end_sequence).then_some((address, file, line));
+            }
+            if end_sequence {
+                address = 0;
+                file = 1;
+                line = 1;
+            }
+        }
+        Ok(())
+    }
+}
+
+fn to_u32(address: u64) -> Result<u32, LineTableError> {
+    u32::try_from(address).map_err(|_| LineTableError::AddressTooLarge(address))
+}
+
+/// Add advance to address. advance is None if computing it overflowed.
+fn advance_address(
+    address: u64,
+    advance: Option<u64>,
+) -> Result<u64, LineTableError> {
+    advance
+        .and_then(|advance| address.checked_add(advance))
+        .ok_or(LineTableError::AddressTooLarge(address))
+}
+
+fn join_path(dir: Option<&String>, path: &str) -> String {
+    match dir {
+        Some(dir) if !path.starts_with('/') && !dir.is_empty() => {
+            format!("{dir}/{path}")
+        }
+        _ => path.to_string(),
+    }
+}
+
+/// The string sections referred to by version 5 headers
+struct Strings<'a> {
+    debug_line_str: &'a [u8],
+    debug_str: &'a [u8],
+}
+
+/// A directory or file entry in a version 5 header
+#[derive(Default)]
+struct Entry {
+    path: String,
+    directory: u64,
+}
+
+/// Parse a version 5 directory or file table
+fn parse_entries(
+    unit: &mut Reader,
+    strings: &Strings,
+    offset_size: u8,
+) -> Result<Vec<Entry>, LineTableError> {
+    let format_count = unit.u8()?;
+    let mut format = Vec::new();
+    for _ in 0..format_count {
+        format.push((unit.uleb128()?, unit.uleb128()?));
+    }
+    let count = unit.uleb128()?;
+    let mut entries = Vec::new();
+    for _ in 0..count {
+        let mut entry = Entry::default();
+        for (content_type, form) in format.iter() {
+            let value = unit.form(*form, strings, offset_size)?;
+            match (*content_type, value) {
+                (DW_LNCT_PATH, FormValue::String(path)) => entry.path = path,
+                (DW_LNCT_DIRECTORY_INDEX, FormValue::Number(n)) => {
+                    entry.directory = n
+                }
+                _ => {}
+            }
+        }
+        entries.push(entry);
+    }
+    Ok(entries)
+}
+
+enum FormValue {
+    String(String),
+    Number(u64),
+    Other,
+}
+
+/// Reads little-endian values from a byte slice
+#[derive(Clone)]
+struct Reader<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn new(data: &'a [u8]) -> Self {
+        Self { data }
+    }
+
+    fn is_empty(&self) -> bool {
+        self.data.is_empty()
+    }
+
+    fn bytes(&mut self, len: u64) -> Result<&'a [u8], LineTableError> {
+        let len =
+            usize::try_from(len).map_err(|_| LineTableError::Truncated)?;
+        if len > self.data.len() {
+            return Err(LineTableError::Truncated);
+        }
+        let (bytes, rest) = self.data.split_at(len);
+        self.data = rest;
+        Ok(bytes)
+    }
+
+    fn skip(&mut self, len: u64) -> Result<(), LineTableError> {
+        self.bytes(len).map(|_| ())
+    }
+
+    /// Read a len-byte unsigned value (len at most 8)
+    fn address(&mut self, len: u64) -> Result<u64, LineTableError> {
+        let bytes = self.bytes(len)?;
+        Ok(bytes
+            .iter()
+            .rev()
+            .fold(0, |value, byte| value << 8 | u64::from(*byte)))
+    }
+
+    fn u8(&mut self) -> Result<u8, LineTableError> {
+        Ok(self.bytes(1)?[0])
+    }
+
+    fn u16(&mut self) -> Result<u16, LineTableError> {
+        Ok(self.address(2)? as u16)
+    }
+
+    /// Read a 4- or 8-byte section offset
+    fn offset(&mut self, offset_size: u8) -> Result<u64, LineTableError> {
+        self.address(offset_size.into())
+    }
+
+    /// Read a unit length, returning the length and the size of
+    /// offsets in the unit (4 for 32-bit DWARF, 8 for 64-bit DWARF)
+    fn initial_length(&mut self) -> Result<(u64, u8), LineTableError> {
+        let length = self.address(4)?;
+        if length == 0xffff_ffff {
+            Ok((self.address(8)?, 8))
+        } else {
+            Ok((length, 4))
+        }
+    }
+
+    fn uleb128(&mut self) -> Result<u64, LineTableError> {
+        let mut value = 0;
+        let mut shift = 0;
+        loop {
+            let byte = self.u8()?;
+            if shift < 64 {
+                value |= u64::from(byte & 0x7f) << shift;
+            }
+            shift += 7;
+            if byte & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+    }
+
+    fn sleb128(&mut self) -> Result<i64, LineTableError> {
+        let mut value: i64 = 0;
+        let mut shift = 0;
+        loop {
+            let byte = self.u8()?;
+            if shift < 64 {
+                value |= i64::from(byte & 0x7f) << shift;
+            }
+            shift += 7;
+            if byte & 0x80 == 0 {
+                if shift < 64 && byte & 0x40 != 0 {
+                    value |= -1 << shift;
+                }
+                return Ok(value);
+            }
+        }
+    }
+
+    /// Read a null-terminated string
+    fn string(&mut self) -> Result<String, LineTableError> {
+        let len = self
+            .data
+            .iter()
+            .position(|byte| *byte == 0)
+            .ok_or(LineTableError::Truncated)?;
+        let string = String::from_utf8_lossy(&self.data[..len]).into_owned();
+        self.data = &self.data[len + 1..];
+        Ok(string)
+    }
+
+    /// Read an attribute value in a version 5 entry
+    fn form(
+        &mut self,
+        form: u64,
+        strings: &Strings,
+        offset_size: u8,
+    ) -> Result<FormValue, LineTableError> {
+        let value = match form {
+            DW_FORM_STRING => FormValue::String(self.string()?),
+            DW_FORM_LINE_STRP | DW_FORM_STRP => {
+                let offset = self.offset(offset_size)?;
+                let section = if form == DW_FORM_LINE_STRP {
+                    strings.debug_line_str
+                } else {
+                    strings.debug_str
+                };
+                let string = usize::try_from(offset)
+                    .ok()
+                    .and_then(|offset| section.get(offset..))
+                    .and_then(|string| Reader::new(string).string().ok())
+                    .ok_or(LineTableError::InvalidString(offset))?;
+                FormValue::String(string)
+            }
+            DW_FORM_DATA1 => FormValue::Number(self.address(1)?),
+            DW_FORM_DATA2 => FormValue::Number(self.address(2)?),
+            DW_FORM_DATA4 => FormValue::Number(self.address(4)?),
+            DW_FORM_DATA8 => FormValue::Number(self.address(8)?),
+            DW_FORM_UDATA => FormValue::Number(self.uleb128()?),
+            DW_FORM_SDATA => {
+                self.sleb128()?;
+                FormValue::Other
+            }
+            DW_FORM_DATA16 => {
+                self.skip(16)?;
+                FormValue::Other
+            }
+            DW_FORM_BLOCK | DW_FORM_BLOCK1 | DW_FORM_BLOCK2
+            | DW_FORM_BLOCK4 => {
+                let len = match form {
+                    DW_FORM_BLOCK1 => self.address(1)?,
+                    DW_FORM_BLOCK2 => self.address(2)?,
+                    DW_FORM_BLOCK4 => self.address(4)?,
+                    _ => self.uleb128()?,
+                };
+                self.skip(len)?;
+                FormValue::Other
+            }
+            _ => return Err(LineTableError::UnsupportedForm(form)),
+        };
+        Ok(value)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+
+    const OPCODE_LENGTHS: [u8; 12] = [0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1];
+    const END_SEQUENCE: [u8; 3] = [0x00, 1, DW_LNE_END_SEQUENCE];
+
+    fn set_address(addr: u32) -> Vec<u8> {
+        let mut bytes = vec![0x00, 5, DW_LNE_SET_ADDRESS];
+        bytes.extend(addr.to_le_bytes());
+        bytes
+    }
+
+    /// Wrap a header (after the header_length field) and a program into
+    /// a 32-bit DWARF unit
+    fn unit(version: u16, header: &[u8], program: &[u8]) -> Vec<u8> {
+        let mut body = version.to_le_bytes().to_vec();
+        if version >= 5 {
+            body.extend([4, 0]); // address and segment selector sizes
+        }
+        body.extend((header.len() as u32).to_le_bytes());
+        body.extend(header);
+        body.extend(program);
+        let mut unit = (body.len() as u32).to_le_bytes().to_vec();
+        unit.extend(body);
+        unit
+    }
+
+    fn version_4_unit() -> Vec<u8> {
+        let mut header = vec![1, 1, 1, 0xfb, 14, 13];
+        header.extend(OPCODE_LENGTHS);
+        header.extend(b"src\0\0");
+        header.extend(b"main.c\0\x01\0\0util.h\0\0\0\0\0");
+        let program = [
+            &set_address(0x100)[..],
+            &[DW_LNS_ADVANCE_LINE, 9],
+            &[DW_LNS_COPY],
+            &[131], // address += 8, line += 1
+            &[DW_LNS_SET_FILE, 2],
+            &[DW_LNS_ADVANCE_PC, 4],
+            &[DW_LNS_COPY],
+            &[DW_LNS_ADVANCE_PC, 4],
+            &END_SEQUENCE,
+        ]
+        .concat();
+        unit(4, &header, &program)
+    }
+
+    fn version_5_unit() -> Vec<u8> {
+        let mut header = vec![2, 1, 1, 0xfb, 14, 13];
+        header.extend(OPCODE_LENGTHS);
+        // Directories: paths in .debug_line_str
+        header.extend([1, 1, 0x1f, 2, 0, 0, 0, 0, 7, 0, 0, 0]);
+        // Files: inline paths and directory indices
+        header.extend([2, 1, 0x08, 2, 0x0b, 2]);
+        header.extend(b"a.c\0\0b.c\0\x01");
+        let program = [
+            &set_address(0x200)[..],
+            &[DW_LNS_COPY],
+            &[DW_LNS_SET_FILE, 0],
+            &[48], // address += 2 * 2, line += 2
+            &[DW_LNS_ADVANCE_PC, 1],
+            &END_SEQUENCE,
+        ]
+        .concat();
+        unit(5, &header, &program)
+    }
+
+    fn describe(table: &LineTable, addr: u32) -> Option<(&str, u32)> {
+        let range = table.lookup(addr)?;
+        Some((table.file(range.file), range.line))
+    }
+
+    #[test]
+    fn check_version_4_line_table() {
+        let table = LineTable::parse(&version_4_unit(), &[], &[]).unwrap();
+        assert_eq!(table.ranges().len(), 3);
+        assert_eq!(describe(&table, 0xff), None);
+        assert_eq!(describe(&table, 0x100), Some(("src/main.c", 10)));
+        assert_eq!(describe(&table, 0x107), Some(("src/main.c", 10)));
+        assert_eq!(describe(&table, 0x108), Some(("src/main.c", 11)));
+        assert_eq!(describe(&table, 0x10c), Some(("util.h", 11)));
+        assert_eq!(describe(&table, 0x110), None);
+    }
+
+    #[test]
+    fn check_version_5_line_table() {
+        let debug_line_str = b"/build\0lib\0";
+        let table =
+            LineTable::parse(&version_5_unit(), debug_line_str, &[]).unwrap();
+        assert_eq!(describe(&table, 0x200), Some(("lib/b.c", 1)));
+        assert_eq!(describe(&table, 0x204), Some(("/build/a.c", 3)));
+        assert_eq!(describe(&table, 0x206), None);
+    }
+
+    #[test]
+    fn check_units_are_combined() {
+        let mut debug_line = version_5_unit();
+        debug_line.extend(version_4_unit());
+        let table =
+            LineTable::parse(&debug_line, b"/build\0lib\0", &[]).unwrap();
+        assert_eq!(describe(&table, 0x10c), Some(("util.h", 11)));
+        assert_eq!(describe(&table, 0x204), Some(("/build/a.c", 3)));
+        let starts: Vec<u32> =
+            table.ranges().iter().map(|range| range.start).collect();
+        assert_eq!(starts, [0x100, 0x108, 0x10c, 0x200, 0x204]);
+    }
+
+    #[test]
+    fn check_line_table_errors() {
+        let debug_line = version_4_unit();
+        let truncated = &debug_line[..debug_line.len() - 1];
+        let result = LineTable::parse(truncated, &[], &[]);
+        assert_eq!(result.unwrap_err(), LineTableError::Truncated);
+
+        let bad_version = unit(6, &[], &[]);
+        let result = LineTable::parse(&bad_version, &[], &[]);
+        assert_eq!(result.unwrap_err(), LineTableError::UnsupportedVersion(6));
+
+        // The directory strings are missing
+        let result = LineTable::parse(&version_5_unit(), &[], &[]);
+        assert_eq!(result.unwrap_err(), LineTableError::InvalidString(0));
+
+        let mut header = vec![1, 1, 1, 0xfb, 0, 13];
+        header.extend(OPCODE_LENGTHS);
+        header.extend(b"\0\0");
+        let zero_line_range = unit(4, &header, &[]);
+        let result = LineTable::parse(&zero_line_range, &[], &[]);
+        assert_eq!(result.unwrap_err(), LineTableError::ZeroLineRange);
+    }
+
+    /// Address advances that overflow are errors, and line advances
+    /// that overflow do not panic
+    #[test]
+    fn check_line_table_overflow() {
+        let mut header = vec![1, 1, 1, 0xfb, 14, 13];
+        header.extend(OPCODE_LENGTHS);
+        header.extend(b"\0a.c\0\0\0\0\0");
+        let huge = [0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 1];
+        let program = [
+            &[DW_LNS_ADVANCE_PC][..],
+            &huge,
+            &[DW_LNS_COPY, DW_LNS_ADVANCE_PC, 1],
+        ]
+        .concat();
+        let overflow = unit(4, &header, &program);
+        let result = LineTable::parse(&overflow, &[], &[]);
+        assert_eq!(
+            result.unwrap_err(),
+            LineTableError::AddressTooLarge(u64::MAX)
+        );
+
+        let program = [
+            &set_address(0x100)[..],
+            &[DW_LNS_ADVANCE_LINE],
+            &huge[..9],
+            &[0],
+            &[DW_LNS_ADVANCE_LINE, 1],
+            &[DW_LNS_COPY],
+            &[DW_LNS_ADVANCE_PC, 4],
+            &END_SEQUENCE,
+        ]
+        .concat();
+        let table =
+            LineTable::parse(&unit(4, &header, &program), &[], &[]).unwrap();
+        assert_eq!(describe(&table, 0x100), Some(("a.c", 0)));
+    }
+
+    #[test]
+    fn check_leb128() {
+        let mut reader = Reader::new(&[0xe5, 0x8e, 0x26, 0x7f, 0x80, 0x7f]);
+        assert_eq!(reader.uleb128(), Ok(624485));
+        assert_eq!(reader.sleb128(), Ok(-1));
+        assert_eq!(reader.sleb128(), Ok(-128));
+        assert!(reader.is_empty());
+    }
+}
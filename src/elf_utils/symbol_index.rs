@@ -0,0 +1,145 @@
+//! Address to symbol lookup
+//!
+//! Tracing, profiling, breakpoints and exception reports all need to
+//! name the function containing an address. The symbol index holds
+//! the address range [value, value + size) of each symbol defined in
+//! a section, in a sorted array of non-overlapping ranges, so a
+//! lookup is a binary search.
+//!
+//! Symbols without a name, or that are not defined in a section (such
+//! as undefined or absolute symbols), are not indexed. A function with
+//! a size of zero (common for assembly labels like _start) is taken to
+//! extend to the start of the next symbol. Where ranges overlap, the
+//! one that starts first (or, at the same address, the larger one) is
+//! kept, and ranges that start inside it are dropped.
+
+use super::{FullSymbol, SymbolSection};
+
+/// The address range covered by one symbol
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct SymbolRange {
+    pub name: String,
+    pub start: u32,
+    /// One past the last address in the range
+    pub end: u32,
+}
+
+/// Symbol address ranges, sorted by address
+#[derive(Debug, Clone, Default)]
+pub struct SymbolIndex {
+    ranges: Vec<SymbolRange>,
+}
+
+impl SymbolIndex {
+    pub fn new(symbols: &[FullSymbol]) -> Self {
+        let mut candidates: Vec<(&FullSymbol, &str)> = symbols
+            .iter()
+            .filter(|symbol| matches!(symbol.section, SymbolSection::Named(_)))
+            .filter_map(|symbol| Some((symbol, symbol.name.as_deref()?)))
+            .filter(|(symbol, _)| symbol.size != 0 || symbol.is_func())
+            .collect();
+        candidates.sort_by_key(|(symbol, _)| {
+            (symbol.value, std::cmp::Reverse(symbol.size))
+        });
+
+        let mut ranges: Vec<SymbolRange> = Vec::new();
+        for (symbol, name) in candidates.iter() {
+            let start = symbol.value;
+            let end = if symbol.size != 0 {
+                start.saturating_add(symbol.size)
+            } else {
+                let next = candidates
+                    .partition_point(|(other, _)| other.value <= start);
+                candidates
+                    .get(next)
+                    .map_or(start.saturating_add(4), |(next, _)| next.value)
+            };
+            if ranges.last().is_some_and(|last| start < last.end) {
+                continue;
+            }
+            ranges.push(SymbolRange {
+                name: name.to_string(),
+                start,
+                end,
+            });
+        }
+        Self { ranges }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.ranges.is_empty()
+    }
+
+    /// The symbol ranges, sorted by start address
+    pub fn ranges(&self) -> &[SymbolRange] {
+        &self.ranges
+    }
+
+    /// The symbol whose range contains addr
+    pub fn lookup(&self, addr: u32) -> Option<&SymbolRange> {
+        let n = self.ranges.partition_point(|range| range.start <= addr);
+        let range = self.ranges.get(n.checked_sub(1)?)?;
+        (addr < range.end).then_some(range)
+    }
+
+    /// Describe addr as an offset into its symbol (for example,
+    /// main+0x14), or None if no symbol contains it
+    pub fn describe(&self, addr: u32) -> Option<String> {
+        let range = self.lookup(addr)?;
+        let offset = addr - range.start;
+        if offset == 0 {
+            Some(range.name.clone())
+        } else {
+            Some(format!("{}+0x{offset:x}", range.name))
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::super::{SymbolBind, SymbolInfo, SymbolType};
+    use super::*;
+
+    fn symbol(name: &str, value: u32, size: u32, func: bool) -> FullSymbol {
+        FullSymbol {
+            name: Some(name.to_string()),
+            section: SymbolSection::Named(".text".to_string()),
+            info: SymbolInfo {
+                st_type: if func {
+                    SymbolType::Func
+                } else {
+                    SymbolType::Object
+                },
+                st_bind: SymbolBind::Global,
+            },
+            value,
+            size,
+        }
+    }
+
+    #[test]
+    fn check_symbol_lookup() {
+        let mut undefined = symbol("undefined", 0, 0, true);
+        undefined.section = SymbolSection::Undef;
+        let index = SymbolIndex::new(&[
+            symbol("main", 0x200, 0x40, true),
+            symbol("_start", 0x88, 0, true),
+            undefined,
+            symbol("inner", 0x210, 0x8, true),
+            symbol("table", 0x2000_0000, 0x10, false),
+            symbol("label", 0x100, 0, false),
+            symbol("last", 0x300, 0, true),
+        ]);
+
+        assert_eq!(index.lookup(0x0), None);
+        assert_eq!(index.describe(0x88).unwrap(), "_start");
+        assert_eq!(index.describe(0x1fc).unwrap(), "_start+0x174");
+        assert_eq!(index.describe(0x214).unwrap(), "main+0x14");
+        assert_eq!(index.lookup(0x240), None);
+        assert_eq!(index.describe(0x300).unwrap(), "last");
+        assert_eq!(index.describe(0x304).unwrap(), "last+0x4");
+        assert_eq!(index.describe(0x2000_000f).unwrap(), "table+0xf");
+        assert_eq!(index.lookup(0x2000_0010), None);
+    }
+}
@@ -0,0 +1,630 @@
+//! GDB Remote Serial Protocol Stub
+//!
+//! This file implements a minimal gdb server (a "stub") which allows
+//! gdb to debug a program running on the platform. Connect from gdb
+//! using target remote (for example, target remote :1234, or target
+//! remote /path/to/socket for a unix socket).
+//!
+//! The following functionality is supported:
+//!
+//! * reading and writing the registers (x0-x31, pc, and CSRs using
+//!   gdb register numbers 65 + csr address)
+//! * reading and writing memory (this bypasses the PMA checker and
+//!   memory-mapped registers, so that the EEPROM can be written). A
+//!   read returns at most MAX_READ_LENGTH bytes, so that the reply
+//!   fits in the advertised packet size
+//! * software and hardware breakpoints (which are equivalent here;
+//!   memory is never patched with ebreak instructions)
+//! * write, read and access watchpoints
+//! * single step and continue. Continue uses the batched
+//!   Platform::run loop, not the single-step trace path, and checks
+//!   for an interrupt request from gdb (ctrl-c) between batches.
+//!
+//! The protocol is described in the gdb manual, appendix E (gdb
+//! remote serial protocol). Only the all-stop mode with a single
+//! thread is implemented.
+
+use std::fmt::Write as _;
+use std::io::{self, Read, Write};
+use std::net::TcpStream;
+#[cfg(unix)]
+use std::os::unix::net::UnixStream;
+
+use thiserror::Error;
+
+use crate::platform::{
+    breakpoints::{StopReason, WatchKind, Watchpoint},
+    eei::Eei,
+    machine::Exception,
+    Platform,
+};
+
+/// Number of steps executed by Platform::run between checks for an
+/// interrupt request from gdb
+const CONTINUE_BATCH_STEPS: u64 = 0x10000;
+
+/// The packet size advertised to gdb in the qSupported reply
+const PACKET_SIZE: usize = 0x1000;
+
+/// The most bytes of memory returned by an m packet: each byte is
+/// sent as two hex digits, and the packet is framed by $ and #xx
+const MAX_READ_LENGTH: u32 = ((PACKET_SIZE - 4) / 2) as u32;
+
+/// The register number of the program counter (the registers x0-x31
+/// come first)
+const PC_REGNUM: usize = 32;
+
+/// CSRs are numbered from here in the gdb riscv register set
+const FIRST_CSR_REGNUM: usize = 65;
+
+/// Target description, needed so that gdb treats the target as 32-bit
+const TARGET_XML: &str = "<?xml version=\"1.0\"?>\
+<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\
+<target version=\"1.0\"><architecture>riscv:rv32</architecture></target>";
+
+// Signal numbers used in stop replies
+const SIGINT: u8 = 2;
+const SIGILL: u8 = 4;
+const SIGTRAP: u8 = 5;
+const SIGBUS: u8 = 7;
+const SIGSEGV: u8 = 11;
+
+#[derive(Debug, Error)]
+pub enum GdbError {
+    #[error("gdb connection I/O error: {0}")]
+    IoError(String),
+}
+
+impl From<io::Error> for GdbError {
+    fn from(e: io::Error) -> Self {
+        Self::IoError(e.to_string())
+    }
+}
+
+/// A connection to gdb
+pub trait Connection: Read + Write {
+    /// Return true if gdb has sent an interrupt request (the byte
+    /// 0x03) or closed the connection. Must not block.
+    fn poll_interrupt(&mut self) -> io::Result<bool>;
+}
+
+/// Interpret the result of a non-blocking single-byte read
+fn interrupt_requested(
+    result: io::Result<usize>,
+    byte: u8,
+) -> io::Result<bool> {
+    match result {
+        Ok(0) => Ok(true), // connection closed
+        Ok(_) => Ok(byte == 0x03),
+        Err(e) if e.kind() == io::ErrorKind::WouldBlock => Ok(false),
+        Err(e) => Err(e),
+    }
+}
+
+impl Connection for TcpStream {
+    fn poll_interrupt(&mut self) -> io::Result<bool> {
+        let mut byte = [0u8];
+        self.set_nonblocking(true)?;
+        let result = self.read(&mut byte);
+        self.set_nonblocking(false)?;
+        interrupt_requested(result, byte[0])
+    }
+}
+
+#[cfg(unix)]
+impl Connection for UnixStream {
+    fn poll_interrupt(&mut self) -> io::Result<bool> {
+        let mut byte = [0u8];
+        self.set_nonblocking(true)?;
+        let result = self.read(&mut byte);
+        self.set_nonblocking(false)?;
+        interrupt_requested(result, byte[0])
+    }
+}
+
+/// Result of reading from the connection when a packet is expected
+enum Incoming {
+    Packet(String),
+    Interrupt,
+    Closed,
+}
+
+/// What the server should do after handling a packet
+enum Action {
+    Reply(String),
+    Resume { step: bool },
+    Detach,
+    Kill,
+}
+
+fn checksum(data: &str) -> u8 {
+    data.bytes().fold(0u8, |sum, byte| sum.wrapping_add(byte))
+}
+
+fn parse_hex(value: &str) -> Option<u32> {
+    u32::from_str_radix(value, 16).ok()
+}
+
+/// Encode a 32-bit value as little-endian hex (the target byte order)
+fn encode_u32(value: u32) -> String {
+    value
+        .to_le_bytes()
+        .iter()
+        .map(|byte| format!("{byte:02x}"))
+        .collect()
+}
+
+fn decode_u32(hex: &str) -> Option<u32> {
+    let bytes = decode_bytes(hex)?;
+    let bytes: [u8; 4] = bytes.try_into().ok()?;
+    Some(u32::from_le_bytes(bytes))
+}
+
+fn decode_bytes(hex: &str) -> Option<Vec<u8>> {
+    if hex.len() % 2 != 0 {
+        return None;
+    }
+    (0..hex.len())
+        .step_by(2)
+        .map(|n| u8::from_str_radix(hex.get(n..n + 2)?, 16).ok())
+        .collect()
+}
+
+/// Parse "addr,length" (both hexadecimal)
+fn parse_addr_length(args: &str) -> Option<(u32, u32)> {
+    let (addr, length) = args.split_once(',')?;
+    Some((parse_hex(addr)?, parse_hex(length)?))
+}
+
+fn exception_signal(ex: Exception) -> u8 {
+    match ex {
+        Exception::IllegalInstruction => SIGILL,
+        Exception::Breakpoint | Exception::MmodeEcall => SIGTRAP,
+        Exception::InstructionAddressMisaligned
+        | Exception::LoadAddressMisaligned
+        | Exception::StoreAddressMisaligned => SIGBUS,
+        Exception::InstructionAccessFault
+        | Exception::LoadAccessFault
+        | Exception::StoreAccessFault => SIGSEGV,
+    }
+}
+
+/// The gdb server state for one connection
+pub struct GdbStub<C: Connection, U: Write> {
+    conn: C,
+    /// Where UART output from the platform is echoed
+    uart: U,
+}
+
+impl<C: Connection, U: Write> GdbStub<C, U> {
+    pub fn new(conn: C, uart: U) -> Self {
+        Self { conn, uart }
+    }
+
+    /// Serve gdb requests until gdb detaches, kills the target, or
+    /// closes the connection.
+    pub fn serve(&mut self, platform: &mut Platform) -> Result<(), GdbError> {
+        loop {
+            let packet = match self.read_packet()? {
+                Incoming::Packet(packet) => packet,
+                Incoming::Interrupt => {
+                    // Already stopped; report the stop again
+                    self.write_packet(&format!("S{SIGINT:02x}"))?;
+                    continue;
+                }
+                Incoming::Closed => return Ok(()),
+            };
+            match self.handle_packet(platform, &packet) {
+                Action::Reply(reply) => self.write_packet(&reply)?,
+                Action::Resume { step } => {
+                    let reply = self.resume(platform, step)?;
+                    self.write_packet(&reply)?
+                }
+                Action::Detach => {
+                    self.write_packet("OK")?;
+                    return Ok(());
+                }
+                Action::Kill => return Ok(()),
+            }
+        }
+    }
+
+    fn read_byte(&mut self) -> Result<Option<u8>, GdbError> {
+        let mut byte = [0u8];
+        match self.conn.read(&mut byte)? {
+            0 => Ok(None),
+            _ => Ok(Some(byte[0])),
+        }
+    }
+
+    /// Read the next packet, acknowledging it. Packets with bad
+    /// checksums are rejected (gdb will retransmit them).
+    fn read_packet(&mut self) -> Result<Incoming, GdbError> {
+        loop {
+            // Skip to the start of the packet (this drops acks)
+            match self.read_byte()? {
+                None => return Ok(Incoming::Closed),
+                Some(0x03) => return Ok(Incoming::Interrupt),
+                Some(b'$') => (),
+                Some(_) => continue,
+            }
+
+            let mut data = Vec::new();
+            loop {
+                match self.read_byte()? {
+                    None => return Ok(Incoming::Closed),
+                    Some(b'#') => break,
+                    Some(byte) => data.push(byte),
+                }
+            }
+
+            let mut sum = [0u8; 2];
+            self.conn.read_exact(&mut sum)?;
+            let data = String::from_utf8_lossy(&data).to_string();
+            let expected = std::str::from_utf8(&sum)
+                .ok()
+                .and_then(|sum| u8::from_str_radix(sum, 16).ok());
+            if expected == Some(checksum(&data)) {
+                self.conn.write_all(b"+")?;
+                return Ok(Incoming::Packet(data));
+            } else {
+                self.conn.write_all(b"-")?;
+            }
+        }
+    }
+
+    fn write_packet(&mut self, data: &str) -> Result<(), GdbError> {
+        let packet = format!("${data}#{:02x}", checksum(data));
+        self.conn.write_all(packet.as_bytes())?;
+        self.conn.flush()?;
+        Ok(())
+    }
+
+    fn drain_uart(&mut self, platform: &mut Platform) -> Result<(), GdbError> {
+        let uart_out = platform.flush_uartout();
+        if !uart_out.is_empty() {
+            self.uart.write_all(uart_out.as_bytes())?;
+            self.uart.flush()?;
+        }
+        Ok(())
+    }
+
+    /// Step once, or continue until a breakpoint, watchpoint,
+    /// exception (if exceptions are errors) or interrupt request, and
+    /// return the stop reply.
+    fn resume(
+        &mut self,
+        platform: &mut Platform,
+        step: bool,
+    ) -> Result<String, GdbError> {
+        let batch_steps = if step { 1 } else { CONTINUE_BATCH_STEPS };
+        loop {
+            let result = platform.run(batch_steps);
+            self.drain_uart(platform)?;
+            let reply = match result {
+                Err(ex) => format!("S{:02x}", exception_signal(ex)),
+                Ok(StopReason::Breakpoint(_) | StopReason::Cycle(_)) => {
+                    format!("S{SIGTRAP:02x}")
+                }
+                Ok(StopReason::Watchpoint(hit)) => {
+                    let kind = match hit.watchpoint.kind {
+                        WatchKind::Write => "watch",
+                        WatchKind::Read => "rwatch",
+                        WatchKind::Access => "awatch",
+                    };
+                    format!("T{SIGTRAP:02x}{kind}:{:x};", hit.addr)
+                }
+                Ok(StopReason::Exit(status)) => {
+                    format!("W{:02x}", status & 0xff)
+                }
+                Ok(StopReason::StepsCompleted) => {
+                    if step {
+                        format!("S{SIGTRAP:02x}")
+                    } else if self.conn.poll_interrupt()? {
+                        format!("S{SIGINT:02x}")
+                    } else {
+                        continue;
+                    }
+                }
+            };
+            return Ok(reply);
+        }
+    }
+
+    fn handle_packet(
+        &mut self,
+        platform: &mut Platform,
+        packet: &str,
+    ) -> Action {
+        let reply = |reply: Option<String>| {
+            Action::Reply(reply.unwrap_or_else(|| "E01".to_string()))
+        };
+        let (command, args) = packet.split_at(packet.len().min(1));
+        match command {
+            "?" => Action::Reply(format!("S{SIGTRAP:02x}")),
+            "g" => Action::Reply(read_registers(platform)),
+            "G" => reply(write_registers(platform, args)),
+            "p" => reply(read_register(platform, args)),
+            "P" => reply(write_register(platform, args)),
+            "m" => reply(read_memory(platform, args)),
+            "M" => reply(write_memory(platform, args)),
+            "Z" => reply(set_breakpoint(platform, args, true)),
+            "z" => reply(set_breakpoint(platform, args, false)),
+            "c" | "s" => {
+                if let Some(addr) = parse_hex(args) {
+                    platform.set_pc(addr);
+                }
+                Action::Resume {
+                    step: command == "s",
+                }
+            }
+            "H" => Action::Reply("OK".to_string()),
+            "D" => Action::Detach,
+            "k" => Action::Kill,
+            "q" => Action::Reply(query(args)),
+            // Empty reply means the packet is not supported
+            _ => Action::Reply(String::new()),
+        }
+    }
+}
+
+fn query(args: &str) -> String {
+    if args.starts_with("Supported") {
+        format!("PacketSize={PACKET_SIZE:x};qXfer:features:read+")
+    } else if args == "Attached" {
+        "1".to_string()
+    } else if let Some(range) =
+        args.strip_prefix("Xfer:features:read:target.xml:")
+    {
+        // Send the requested chunk of the target description
+        if let Some((offset, length)) = parse_addr_length(range) {
+            let start = TARGET_XML.len().min(offset as usize);
+            let end = TARGET_XML.len().min(start + length as usize);
+            let prefix = if end == TARGET_XML.len() { "l" } else { "m" };
+            format!("{prefix}{}", &TARGET_XML[start..end])
+        } else {
+            "E01".to_string()
+        }
+    } else {
+        String::new()
+    }
+}
+
+fn read_registers(platform: &Platform) -> String {
+    let mut registers: String =
+        (0..32).map(|n| encode_u32(platform.x(n))).collect();
+    registers.push_str(&encode_u32(platform.pc()));
+    registers
+}
+
+fn write_registers(platform: &mut Platform, args: &str) -> Option<String> {
+    for n in 0..=PC_REGNUM {
+        let value = decode_u32(args.get(8 * n..8 * (n + 1))?)?;
+        if n == PC_REGNUM {
+            platform.set_pc(value);
+        } else {
+            platform.set_x(n as u8, value);
+        }
+    }
+    Some("OK".to_string())
+}
+
+fn read_register(platform: &Platform, args: &str) -> Option<String> {
+    let regnum = parse_hex(args)? as usize;
+    let value = if regnum < PC_REGNUM {
+        platform.x(regnum as u8)
+    } else if regnum == PC_REGNUM {
+        platform.pc()
+    } else {
+        let csr = regnum.checked_sub(FIRST_CSR_REGNUM)?;
+        platform.read_csr(csr.try_into().ok()?).ok()?
+    };
+    Some(encode_u32(value))
+}
+
+fn write_register(platform: &mut Platform, args: &str) -> Option<String> {
+    let (regnum, value) = args.split_once('=')?;
+    let regnum = parse_hex(regnum)? as usize;
+    let value = decode_u32(value)?;
+    if regnum < PC_REGNUM {
+        platform.set_x(regnum as u8, value);
+    } else if regnum == PC_REGNUM {
+        platform.set_pc(value);
+    } else {
+        let csr = regnum.checked_sub(FIRST_CSR_REGNUM)?;
+        platform.write_csr(csr.try_into().ok()?, value).ok()?;
+    }
+    Some("OK".to_string())
+}
+
+/// Read memory for an m packet. gdb accepts a shorter reply than it
+/// asked for, so a longer read is cut to MAX_READ_LENGTH bytes.
+fn read_memory(platform: &Platform, args: &str) -> Option<String> {
+    let (addr, length) = parse_addr_length(args)?;
+    let length = length.min(MAX_READ_LENGTH);
+    let mut data = String::with_capacity(2 * length as usize);
+    for n in 0..length {
+        let byte = platform.debug_load_byte(addr.wrapping_add(n));
+        write!(data, "{byte:02x}").unwrap();
+    }
+    Some(data)
+}
+
+fn write_memory(platform: &mut Platform, args: &str) -> Option<String> {
+    let (addr_length, data) = args.split_once(':')?;
+    let (addr, length) = parse_addr_length(addr_length)?;
+    let data = decode_bytes(data)?;
+    if data.len() != length as usize {
+        return None;
+    }
+    for (n, byte) in data.into_iter().enumerate() {
+        platform.debug_store_byte(addr.wrapping_add(n as u32), byte);
+    }
+    Some("OK".to_string())
+}
+
+/// Handle Z (insert) and z (remove) packets of the form type,addr,kind
+fn set_breakpoint(
+    platform: &mut Platform,
+    args: &str,
+    insert: bool,
+) -> Option<String> {
+    let (kind, addr_length) = args.split_once(',')?;
+    let (addr, length) = parse_addr_length(addr_length)?;
+    let breakpoints = platform.breakpoints_mut();
+    let watch_kind = match kind {
+        // Software and hardware breakpoints are the same thing here
+        "0" | "1" => {
+            if insert {
+                breakpoints.insert_pc(addr);
+            } else {
+                breakpoints.remove_pc(addr);
+            }
+            return Some("OK".to_string());
+        }
+        "2" => WatchKind::Write,
+        "3" => WatchKind::Read,
+        "4" => WatchKind::Access,
+        _ => return Some(String::new()),
+    };
+    let watchpoint = Watchpoint {
+        addr,
+        len: length,
+        kind: watch_kind,
+    };
+    if insert {
+        breakpoints.insert_watchpoint(watchpoint);
+    } else {
+        breakpoints.remove_watchpoint(watchpoint);
+    }
+    Some("OK".to_string())
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::elf_utils::ElfLoadable;
+    use crate::encode::*;
+    use std::io::Cursor;
+
+    /// In-memory connection containing the packets sent by gdb
+    struct MockConnection {
+        input: Cursor<Vec<u8>>,
+        output: Vec<u8>,
+    }
+
+    impl Read for MockConnection {
+        fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+            self.input.read(buf)
+        }
+    }
+
+    impl Write for MockConnection {
+        fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+            self.output.write(buf)
+        }
+
+        fn flush(&mut self) -> io::Result<()> {
+            Ok(())
+        }
+    }
+
+    impl Connection for MockConnection {
+        fn poll_interrupt(&mut self) -> io::Result<bool> {
+            Ok(false)
+        }
+    }
+
+    fn packet(data: &str) -> String {
+        format!("${data}#{:02x}", checksum(data))
+    }
+
+    /// Send the packets to the stub, and return the replies (without
+    /// acks and checksums)
+    fn serve(platform: &mut Platform, packets: &[&str]) -> Vec<String> {
+        let input: String = packets.iter().map(|p| packet(p)).collect();
+        let conn = MockConnection {
+            input: Cursor::new(input.into_bytes()),
+            output: Vec::new(),
+        };
+        let mut stub = GdbStub::new(conn, Vec::new());
+        stub.serve(platform).expect("serve should work");
+        let output = String::from_utf8(stub.conn.output).unwrap();
+        output
+            .split('$')
+            .skip(1)
+            .map(|p| p.split('#').next().unwrap().to_string())
+            .collect()
+    }
+
+    fn write_instr(platform: &mut Platform, addr: u32, instr: u32) {
+        for (n, byte) in instr.to_le_bytes().iter().enumerate() {
+            platform.write_byte(addr + n as u32, *byte).unwrap();
+        }
+    }
+
+    #[test]
+    fn check_register_and_memory_access() -> Result<(), &'static str> {
+        let mut platform = Platform::new();
+        write_instr(&mut platform, 0, addi!(x1, x0, 5));
+        platform.set_x(2, 0x1234_5678);
+        let replies = serve(
+            &mut platform,
+            &[
+                "p2",
+                "P3=efbeadde",
+                "m0,4",
+                "M20000000,2:aa55",
+                "s",
+                "p1",
+                "k",
+            ],
+        );
+        assert_eq!(
+            replies,
+            ["78563412", "OK", "93005000", "OK", "S05", "05000000"]
+        );
+        assert_eq!(platform.x(3), 0xdead_beef);
+        assert_eq!(platform.debug_load_byte(0x2000_0001), 0x55);
+        assert_eq!(platform.pc(), 4);
+        Ok(())
+    }
+
+    /// A memory read longer than fits in a packet is cut short
+    #[test]
+    fn check_long_memory_read() -> Result<(), &'static str> {
+        let mut platform = Platform::new();
+        write_instr(&mut platform, 0, addi!(x1, x0, 5));
+        let replies = serve(&mut platform, &["m0,ffffffff", "k"]);
+        assert_eq!(replies[0].len(), 2 * MAX_READ_LENGTH as usize);
+        assert!(replies[0].starts_with("93005000"));
+        assert!(replies[0].len() + 4 <= PACKET_SIZE);
+        Ok(())
+    }
+
+    #[test]
+    fn check_continue_to_breakpoint() -> Result<(), &'static str> {
+        let mut platform = Platform::new();
+        for n in 0..4 {
+            write_instr(&mut platform, 4 * n, addi!(x1, x1, 1));
+        }
+        let replies = serve(&mut platform, &["Z0,8,4", "c", "z0,8,4", "k"]);
+        assert_eq!(replies, ["OK", "S05", "OK"]);
+        assert_eq!(platform.pc(), 8);
+        assert_eq!(platform.x(1), 2);
+        Ok(())
+    }
+
+    #[test]
+    fn check_continue_to_watchpoint() -> Result<(), &'static str> {
+        let mut platform = Platform::new();
+        write_instr(&mut platform, 0, lui!(x2, 0x20000));
+        write_instr(&mut platform, 4, addi!(x1, x0, 7));
+        write_instr(&mut platform, 8, sw!(x1, x2, 16));
+        let replies = serve(&mut platform, &["Z2,20000010,4", "c", "k"]);
+        assert_eq!(replies, ["OK", "T05watch:20000010;"]);
+        assert_eq!(platform.pc(), 12);
+        Ok(())
+    }
+}
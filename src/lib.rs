@@ -1,11 +1,14 @@
 #![forbid(unsafe_code)]
 
+pub mod bisect;
 pub mod decode;
 pub mod elf_utils;
 pub mod encode;
+pub mod gdb;
 pub mod instr_type;
 pub mod opcodes;
 pub mod platform;
+pub mod torture;
 pub mod trace_file;
 
 pub mod utils;
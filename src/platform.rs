@@ -26,11 +26,13 @@
 //! for this platform must write values to the trap vector table (part
 //! of the EEPROM memory map.
 
-use queues::{IsQueue, Queue};
+use std::cell::{Cell, Ref, RefCell};
+use std::collections::VecDeque;
+use std::sync::Arc;
 
 use crate::{
     decode::Decoder,
-    elf_utils::{ElfError, ElfLoadable, FullSymbol},
+    elf_utils::{ElfError, ElfLoadable, FullSymbol, SymbolIndex},
     trace_file::{
         Property, Section, TraceCheck, TraceCheckFailed, TraceLoadable,
         TracePoint,
@@ -40,28 +42,54 @@ use crate::{
 
 use self::{
     arch::{make_rv32i, make_rv32m, make_rv32priv, make_rv32zicsr},
+    block_cache::{
+        ends_block, Block, BlockCache, DecodedInstr, MAX_BLOCK_LENGTH,
+    },
+    block_device::BlockDevice,
+    breakpoints::{Breakpoints, StopReason, WatchpointHit},
+    coverage::Coverage,
     csr::MachineInterface,
     csr::{CSR_MIE, CSR_MIP, CSR_MSTATUS},
+    dma::Dma,
     eei::Eei,
+    hooks::{Hooks, NoHooks},
+    interrupts::InterruptMailbox,
     machine::Exception,
     memory::{Memory, Wordsize},
+    memory_map::{MemoryMap, MemoryMapError},
     pma::{
-        PmaChecker, EXTINTCTRL_ADDR, MTIMECMPH_ADDR, MTIMECMP_ADDR,
-        MTIMEH_ADDR, MTIME_ADDR, SOFTINTCTRL_ADDR, UARTTX_ADDR,
+        PmaChecker, BLKBUF_ADDR, BLKCMD_ADDR, BLKCOUNT_ADDR, BLKSECTOR_ADDR,
+        BLKSIZE_ADDR, BLKSTAT_ADDR, DMACTRL_ADDR, DMADST_ADDR, DMALEN_ADDR,
+        DMASRC_ADDR, DMASTAT_ADDR, EXTINTCTRL_ADDR, MTIMECMPH_ADDR,
+        MTIMECMP_ADDR, MTIMEH_ADDR, MTIME_ADDR, SOFTINTCTRL_ADDR, UARTRX_ADDR,
+        UARTSTAT_ADDR, UARTTX_ADDR,
     },
     pma::{
         EXCEPTION_VECTOR, MACHINE_EXTERNAL_INT_VECTOR,
         MACHINE_SOFTWARE_INT_VECTOR, MACHINE_TIMER_INT_VECTOR, NMI_VECTOR,
         RESET_VECTOR,
     },
+    print_macros::{Disassembly, PrintContext, Printer},
     registers::Registers,
+    semihosting::Semihosting,
+    uart::UartRx,
 };
 
 pub mod arch;
+pub mod block_cache;
+pub mod builder;
+pub mod block_device;
+pub mod breakpoints;
+pub mod checkpoint;
+pub mod coverage;
 pub mod csr;
+pub mod dma;
 pub mod eei;
+pub mod hooks;
+pub mod interrupts;
 pub mod machine;
 pub mod memory;
+pub mod memory_map;
 pub mod pma;
 pub mod print_macros;
 pub mod registers;
@@ -69,28 +97,55 @@ pub mod rv32i;
 pub mod rv32m;
 pub mod rv32priv;
 pub mod rv32zicsr;
+pub mod semihosting;
+pub mod uart;
 
 /// Stores a function for executing/printing an instruction
 #[derive(Debug)]
 pub struct Instr<E: Eei> {
     pub executer: fn(eei: &mut E, instr: u32) -> Result<(), Exception>,
-    pub printer: fn(u32) -> String,
+    pub printer: Printer,
 }
 
-#[derive(Debug, Default)]
-pub struct Platform {
+/// The emulated platform. H is the type of the instrumentation hooks
+/// (see the hooks module), which defaults to NoHooks.
+#[derive(Debug)]
+pub struct Platform<H: Hooks = NoHooks> {
     registers: Registers,
     pma_checker: PmaChecker,
     memory: Memory,
     machine_interface: MachineInterface,
-    decoder: Decoder<Instr<Platform>>,
+    decoder: Decoder<Instr<Platform<H>>>,
     pc: u32,
     trace: bool,
     exceptions_are_errors: bool,
-    uart_out: Queue<char>,
+    /// Bytes written to the UART transmitter, not yet read by the host
+    uart_out: VecDeque<u8>,
+    /// In a RefCell because reading the data register (a load, which
+    /// takes &self) removes a byte from the FIFO
+    uart_rx: RefCell<UartRx>,
+    dma: Dma,
+    block_device: BlockDevice,
+    /// The external interrupt line (see the interrupts module)
+    external_line: bool,
+    interrupt_mailbox: Arc<InterruptMailbox>,
+    breakpoints: Breakpoints,
+    /// Set by a load or store that triggers a watchpoint
+    watchpoint_hit: Cell<Option<WatchpointHit>>,
+    block_cache: BlockCache<Platform<H>>,
+    symbols: SymbolIndex,
+    /// Present if semihosting is enabled
+    semihosting: Option<Semihosting>,
+    /// Set when the program exits using semihosting
+    exit_status: Option<u32>,
+    /// Present if coverage is enabled
+    coverage: Option<Coverage>,
+    /// In a RefCell because loads and CSR reads (which take &self)
+    /// call the hooks
+    hooks: RefCell<H>,
 }
 
-impl TraceCheck for Platform {
+impl<H: Hooks> TraceCheck for Platform<H> {
     fn check_trace_point(
         &mut self,
         trace_point: TracePoint,
@@ -101,9 +156,22 @@ impl TraceCheck for Platform {
             Err(TraceCheckFailed::CannotAdvanceToCycle { current, required })
         } else {
             // Advance to required trace point
-            while current < required {
-                self.step().unwrap();
-                current = self.machine_interface.machine.mcycle();
+            let stop_reason =
+                self.run_to_cycle(required).map_err(|exception| {
+                    TraceCheckFailed::Exception {
+                        cycle: self.mcycle(),
+                        exception,
+                    }
+                })?;
+            current = self.mcycle();
+            if let StopReason::Exit(status) = stop_reason {
+                if current < required {
+                    return Err(TraceCheckFailed::ProgramExited {
+                        cycle: current,
+                        status,
+                        required,
+                    });
+                }
             }
 
             // Check the properties
@@ -147,13 +215,14 @@ impl TraceCheck for Platform {
     }
 }
 
-impl ElfLoadable for Platform {
+impl<H: Hooks> ElfLoadable for Platform<H> {
     /// Write a byte to the EEPROM region of the platform. Returns an
     /// error on an attempt to write anything other than the eeprom region
     fn write_byte(&mut self, addr: u32, data: u8) -> Result<(), ElfError> {
         if !self.pma_checker.in_eeprom(addr, 1) {
             Err(ElfError::NonWritable(addr))
         } else {
+            self.block_cache.clear();
             self.memory
                 .write(addr.into(), data.into(), Wordsize::Byte)
                 .expect("should work, address is 32-bit");
@@ -161,15 +230,24 @@ impl ElfLoadable for Platform {
         }
     }
 
-    /// Ignore symbols
-    fn load_symbols(&mut self, _symbols: Vec<FullSymbol>) {}
+    /// Keep the symbols in an index, for naming addresses
+    fn load_symbols(&mut self, symbols: Vec<FullSymbol>) {
+        self.symbols = SymbolIndex::new(&symbols);
+    }
 }
 
-impl TraceLoadable for Platform {
+impl<H: Hooks> TraceLoadable for Platform<H> {
     /// Load the .eeprom section into memory
     fn push(&mut self, section: &Section) {
         match section {
-            Section::Eeprom { section_data, .. } => {
+            Section::Eeprom {
+                section_data,
+                symbols,
+            } => {
+                self.block_cache.clear();
+                if !symbols.is_empty() {
+                    self.symbols = SymbolIndex::new(symbols);
+                }
                 for (addr, instr) in section_data.iter() {
                     self.memory
                         .write((*addr).into(), (*instr).into(), Wordsize::Word)
@@ -183,9 +261,26 @@ impl TraceLoadable for Platform {
 }
 
 impl Platform {
-    /// Create the platform. Do not use Self::default(), which does
-    /// not set up the decoder.
+    /// Create the platform, without instrumentation hooks
     pub fn new() -> Self {
+        Self::with_hooks(NoHooks)
+    }
+
+    /// Create the platform with a memory map other than the default.
+    /// Returns an error if the memory map is invalid.
+    pub fn with_memory_map(
+        memory_map: MemoryMap,
+    ) -> Result<Self, MemoryMapError> {
+        Ok(Self {
+            pma_checker: PmaChecker::with_memory_map(memory_map)?,
+            ..Self::new()
+        })
+    }
+}
+
+impl<H: Hooks> Platform<H> {
+    /// Create the platform, calling hooks as the program runs
+    pub fn with_hooks(hooks: H) -> Self {
         let mut decoder = Decoder::new(mask(7));
         make_rv32i(&mut decoder).expect("adding instructions should work");
         make_rv32m(&mut decoder).expect("adding instructions should work");
@@ -193,11 +288,52 @@ impl Platform {
         make_rv32priv(&mut decoder).expect("adding instructions should work");
 
         Self {
+            registers: Registers::default(),
+            pma_checker: PmaChecker::default(),
+            memory: Memory::default(),
+            machine_interface: MachineInterface::default(),
             decoder,
-            ..Self::default()
+            pc: 0,
+            trace: false,
+            exceptions_are_errors: false,
+            uart_out: VecDeque::new(),
+            uart_rx: RefCell::default(),
+            dma: Dma::default(),
+            block_device: BlockDevice::default(),
+            external_line: false,
+            interrupt_mailbox: Arc::default(),
+            breakpoints: Breakpoints::default(),
+            watchpoint_hit: Cell::default(),
+            block_cache: BlockCache::default(),
+            symbols: SymbolIndex::default(),
+            semihosting: None,
+            exit_status: None,
+            coverage: None,
+            hooks: RefCell::new(hooks),
+        }
+    }
+
+    pub fn hooks(&self) -> Ref<'_, H> {
+        self.hooks.borrow()
+    }
+
+    pub fn hooks_mut(&mut self) -> &mut H {
+        self.hooks.get_mut()
+    }
+
+    /// Call a hook, unless hooks are disabled (in which case this
+    /// compiles to nothing)
+    #[inline(always)]
+    fn hook(&self, call: impl FnOnce(&mut H)) {
+        if H::ENABLED {
+            call(&mut self.hooks.borrow_mut())
         }
     }
 
+    pub fn memory_map(&self) -> &MemoryMap {
+        self.pma_checker.memory_map()
+    }
+
     pub fn set_trace(&mut self, trace: bool) {
         self.trace = trace;
     }
@@ -210,10 +346,94 @@ impl Platform {
         self.machine_interface.machine.mcycle()
     }
 
+    pub fn breakpoints(&self) -> &Breakpoints {
+        &self.breakpoints
+    }
+
+    pub fn breakpoints_mut(&mut self) -> &mut Breakpoints {
+        &mut self.breakpoints
+    }
+
+    /// The symbols loaded with the program (empty if there were none)
+    pub fn symbols(&self) -> &SymbolIndex {
+        &self.symbols
+    }
+
+    /// Start recording which instructions are executed (see the
+    /// coverage module). Does nothing if coverage is already enabled.
+    pub fn enable_coverage(&mut self) {
+        let eeprom_size = self.memory_map().eeprom_size;
+        self.coverage.get_or_insert_with(|| Coverage::new(eeprom_size));
+    }
+
+    /// The instructions executed since coverage was enabled (None if it
+    /// is not enabled)
+    pub fn coverage(&self) -> Option<&Coverage> {
+        self.coverage.as_ref()
+    }
+
+    pub fn coverage_mut(&mut self) -> Option<&mut Coverage> {
+        self.coverage.as_mut()
+    }
+
+    /// Describe an address using the symbols loaded with the program
+    /// (for example, 0x214 <main+0x14>)
+    pub fn describe_addr(&self, addr: u32) -> String {
+        match self.symbols.describe(addr) {
+            Some(symbol) => format!("0x{addr:x} <{symbol}>"),
+            None => format!("0x{addr:x}"),
+        }
+    }
+
+    /// Read a byte of memory for debugging purposes. This bypasses
+    /// the PMA checker and memory-mapped registers.
+    pub fn debug_load_byte(&self, addr: u32) -> u8 {
+        self.memory
+            .read(addr.into(), Wordsize::Byte)
+            .expect("should work, address is 32-bit")
+            .try_into()
+            .expect("value should fit into 8 bits")
+    }
+
+    /// Write a byte of memory for debugging purposes. This bypasses
+    /// the PMA checker and memory-mapped registers, so it can be used
+    /// to modify the EEPROM.
+    pub fn debug_store_byte(&mut self, addr: u32, data: u8) {
+        self.block_cache.clear();
+        self.memory
+            .write(addr.into(), data.into(), Wordsize::Byte)
+            .expect("should work, address is 32-bit")
+    }
+
+    /// Read len bytes of memory starting at addr, like
+    /// debug_load_byte
+    pub fn debug_load_bytes(&self, addr: u32, len: u32) -> Vec<u8> {
+        self.memory.read_bytes(addr.into(), len.into())
+    }
+
+    /// Write bytes to memory starting at addr, like debug_store_byte
+    pub fn debug_store_bytes(&mut self, addr: u32, bytes: &[u8]) {
+        self.block_cache.clear();
+        self.memory.write_bytes(addr.into(), bytes);
+    }
+
+    /// Start recording which pages of memory are written, by the
+    /// program or by a peripheral (see take_dirty_pages)
+    pub fn track_dirty_pages(&mut self) {
+        self.memory.track_dirty_pages();
+    }
+
+    /// Move the numbers of the pages (address / PAGE_SIZE) written
+    /// since the last call into pages. Pages can be listed more than
+    /// once, and in any order.
+    pub fn take_dirty_pages(&mut self, pages: &mut Vec<u64>) {
+        self.memory.take_dirty_pages(pages);
+    }
+
     /// Print the program counter along with the memory region and any
     /// other information (like trap type)
     pub fn pretty_print_pc(&self) {
-        print!("pc=0x{:x}", self.pc);
+        print!("pc={}", self.describe_addr(self.pc));
         match self.pc {
             RESET_VECTOR => println!(" (reset vector)"),
             NMI_VECTOR => println!(" (NMI vector)"),
@@ -233,14 +453,90 @@ impl Platform {
         }
     }
 
+    /// Disassemble the instruction at pc, or describe why it cannot
+    /// be fetched or decoded
+    pub fn disassemble(&self, pc: u32) -> String {
+        match self.fetch_instruction(pc) {
+            Ok(instr) => match self.decoder.get_exec(instr) {
+                Ok(decoded_instr) => Disassembly {
+                    printer: decoded_instr.printer,
+                    instr,
+                    context: PrintContext {
+                        pc,
+                        symbols: Some(&self.symbols),
+                    },
+                }
+                .to_string(),
+                Err(_) => format!("illegal instruction 0x{instr:08x}"),
+            },
+            Err(ex) => format!("{ex:?}"),
+        }
+    }
+
     /// Return the current contents of the uart output buffer and also
     /// delete the contents of the buffer
     pub fn flush_uartout(&mut self) -> String {
-        let mut uart_out = String::new();
-        while let Ok(ch) = self.uart_out.remove() {
-            uart_out.push(ch);
+        self.uart_out.drain(..).map(char::from).collect()
+    }
+
+    /// Move up to buf.len() bytes of uart output into buf, returning
+    /// the number of bytes moved. Unlike flush_uartout, this does not
+    /// allocate, so it can be called after every step.
+    pub fn read_uartout(&mut self, buf: &mut [u8]) -> usize {
+        let count = buf.len().min(self.uart_out.len());
+        for (dst, byte) in buf.iter_mut().zip(self.uart_out.drain(..count)) {
+            *dst = byte;
         }
-        uart_out
+        count
+    }
+
+    /// Add bytes to the uart output, as if the program had written them
+    /// to the transmitter
+    pub(super) fn push_uartout(&mut self, bytes: &[u8]) {
+        self.uart_out.extend(bytes);
+    }
+
+    /// The number of bytes of uart output not read yet
+    pub fn uart_output_unread(&self) -> usize {
+        self.uart_out.len()
+    }
+
+    /// Send bytes to the program over the UART. They are buffered,
+    /// and arrive in the UART receive FIFO as described in the uart
+    /// module.
+    pub fn send_uart_input(&mut self, bytes: &[u8]) {
+        let mcycle = self.mcycle();
+        self.uart_rx.get_mut().send(bytes, mcycle);
+    }
+
+    /// The number of bytes sent using send_uart_input that the
+    /// program has not read yet
+    pub fn uart_input_unread(&self) -> usize {
+        self.uart_rx.borrow().unread()
+    }
+
+    /// Set the number of bytes the UART receive FIFO can hold
+    pub fn set_uart_rx_depth(&mut self, depth: usize) {
+        self.uart_rx.get_mut().set_depth(depth);
+    }
+
+    /// Deliver UART input at one byte every interval cycles, dropping
+    /// bytes if the receive FIFO is full, or (if interval is None, the
+    /// default) as soon as there is room in the FIFO
+    pub fn set_uart_rx_interval(&mut self, interval: Option<u64>) {
+        let mcycle = self.mcycle();
+        self.uart_rx.get_mut().set_interval(interval, mcycle);
+    }
+
+    /// Make mtime follow the host clock at frequency ticks per second,
+    /// so the program's timers track real time however fast the
+    /// emulator runs, or (if frequency is None, the default) advance
+    /// mtime once per clock cycle
+    pub fn set_mtime_frequency(&mut self, frequency: Option<u64>) {
+        self.machine_interface
+            .machine
+            .trap_ctrl
+            .set_mtime_frequency(frequency);
     }
 
     /// Reset the state of the platform. Reset is described in
@@ -259,11 +555,241 @@ impl Platform {
         // execute(). This ensures that the first execution occurs when
         // mcycle=0 and mtime=0 (otherwise, the first instruction would
         // execute when mcycle=1 and mtime=1).
+        self.poll_interrupt_mailbox();
         let maybe_exception = self.execute();
         self.increment_clock();
         maybe_exception
     }
 
+    /// Run (ignoring breakpoints) until mcycle reaches cycle. Does
+    /// nothing if mcycle is already at or past cycle.
+    ///
+    /// Returns StopReason::Exit (possibly before reaching cycle) if
+    /// the program exits using semihosting, and otherwise
+    /// StopReason::StepsCompleted. If exceptions are errors, the
+    /// first exception is returned as an Err variant.
+    pub fn run_to_cycle(
+        &mut self,
+        cycle: u64,
+    ) -> Result<StopReason, Exception> {
+        while self.mcycle() < cycle {
+            let stop_reason = self.run(cycle - self.mcycle())?;
+            if let StopReason::Exit(_) = stop_reason {
+                return Ok(stop_reason);
+            }
+        }
+        Ok(StopReason::StepsCompleted)
+    }
+
+    /// Execute up to max_steps steps, returning early if a
+    /// breakpoint or watchpoint is hit, or if the program exits using
+    /// semihosting.
+    ///
+    /// This is the loop to use for long runs: unlike the debug
+    /// stepping in the emulate binary, it does not print anything
+    /// (unless trace is enabled), and it executes instructions from
+    /// the decoded block cache (see the block_cache module), which
+    /// gives the same result as calling step() repeatedly. The
+    /// breakpoint set is only consulted on entry to a block: blocks
+    /// containing no pc breakpoint, and not spanning a cycle
+    /// breakpoint, run without any per-step checks.
+    ///
+    /// A breakpoint at the current pc (or current cycle) is ignored on
+    /// the first step, so that calling run() again after stopping at a
+    /// breakpoint makes progress.
+    ///
+    /// If exceptions are errors, the first exception is returned as
+    /// an Err variant.
+    pub fn run(&mut self, max_steps: u64) -> Result<StopReason, Exception> {
+        if self.breakpoints.take_pcs_changed() {
+            self.block_cache.update_breakpoint_flags(&self.breakpoints);
+        }
+
+        let mut steps = 0;
+        while steps < max_steps {
+            self.poll_interrupt_mailbox();
+            let block = if self.trace {
+                None
+            } else {
+                self.block_at(self.pc)
+            };
+            let stop_reason = match block {
+                Some(block)
+                    if !block.has_breakpoint
+                        && !self.breakpoints.has_cycle_in_range(
+                            self.mcycle(),
+                            self.mcycle() + u64::from(block.len()),
+                        ) =>
+                {
+                    self.run_block(&block, max_steps, &mut steps)?;
+                    None
+                }
+                Some(block) => {
+                    self.run_block_checked(&block, max_steps, &mut steps)?
+                }
+                None => self.step_checked(&mut steps)?,
+            };
+            if let Some(stop_reason) = stop_reason {
+                return Ok(stop_reason);
+            }
+            if let Some(hit) = self.watchpoint_hit.take() {
+                return Ok(StopReason::Watchpoint(hit));
+            }
+            if let Some(status) = self.exit_status.take() {
+                return Ok(StopReason::Exit(status));
+            }
+        }
+        Ok(StopReason::StepsCompleted)
+    }
+
+    /// Execute the block starting at the current pc from the block
+    /// cache (ignoring breakpoints), or a single step if there is no
+    /// block (or trace is enabled). Control may leave the block early,
+    /// for example on an interrupt. Returns the number of steps taken.
+    pub fn run_one_block(&mut self) -> Result<u64, Exception> {
+        let mut steps = 0;
+        let block = if self.trace {
+            None
+        } else {
+            self.block_at(self.pc)
+        };
+        match block {
+            Some(block) => self.run_block(&block, u64::MAX, &mut steps)?,
+            None => {
+                steps = 1;
+                self.step()?
+            }
+        }
+        Ok(steps)
+    }
+
+    /// Perform one step, first checking for a breakpoint at the
+    /// current pc and cycle (unless this is the first step of a run)
+    fn step_checked(
+        &mut self,
+        steps: &mut u64,
+    ) -> Result<Option<StopReason>, Exception> {
+        if *steps != 0 {
+            if self.breakpoints.pc_triggered(self.pc, self) {
+                return Ok(Some(StopReason::Breakpoint(self.pc)));
+            }
+            if self.breakpoints.contains_cycle(self.mcycle()) {
+                return Ok(Some(StopReason::Cycle(self.mcycle())));
+            }
+        }
+        *steps += 1;
+        self.step()?;
+        Ok(None)
+    }
+
+    /// Execute instructions from a block whose first instruction is
+    /// at the current pc, stopping at the end of the block, when
+    /// control leaves the block, when a watchpoint is hit, or when
+    /// steps reaches max_steps. Each step taken increments steps.
+    ///
+    /// Each step is the same as step(), except that the instruction
+    /// has already been fetched and decoded.
+    fn run_block(
+        &mut self,
+        block: &Block<Self>,
+        max_steps: u64,
+        steps: &mut u64,
+    ) -> Result<(), Exception> {
+        let check_watchpoints = self.breakpoints.has_watchpoints();
+        let mut addr = block.start;
+        for decoded in block.instrs.iter() {
+            if self.pc != addr || *steps == max_steps {
+                break;
+            }
+            *steps += 1;
+            let maybe_exception = if self.take_interrupt() {
+                Ok(())
+            } else {
+                self.execute_decoded(decoded.instr, decoded.executer)
+            };
+            self.increment_clock();
+            maybe_exception?;
+            if check_watchpoints && self.watchpoint_hit.get().is_some() {
+                break;
+            }
+            addr += 4;
+        }
+        Ok(())
+    }
+
+    /// Same as run_block, but check for breakpoints before every
+    /// step. Used for blocks flagged as containing a breakpoint.
+    fn run_block_checked(
+        &mut self,
+        block: &Block<Self>,
+        max_steps: u64,
+        steps: &mut u64,
+    ) -> Result<Option<StopReason>, Exception> {
+        while (block.start..block.end()).contains(&self.pc)
+            && *steps < max_steps
+            && self.watchpoint_hit.get().is_none()
+        {
+            let pc = self.pc;
+            if let Some(stop_reason) = self.step_checked(steps)? {
+                return Ok(Some(stop_reason));
+            }
+            if self.pc != pc + 4 {
+                break;
+            }
+        }
+        Ok(None)
+    }
+
+    /// Get the block starting at pc from the cache, decoding it if
+    /// necessary. Returns None if the instruction at pc cannot be
+    /// fetched or decoded.
+    fn block_at(&mut self, pc: u32) -> Option<Arc<Block<Self>>> {
+        if let Some(block) = self.block_cache.get(pc) {
+            return Some(block);
+        }
+
+        let mut instrs = Vec::new();
+        let mut addr = pc;
+        while instrs.len() < MAX_BLOCK_LENGTH {
+            let Ok(instr) = self.fetch_instruction(addr) else {
+                break;
+            };
+            let Ok(decoded_instr) = self.decoder.get_exec(instr) else {
+                break;
+            };
+            instrs.push(DecodedInstr {
+                instr,
+                executer: decoded_instr.executer,
+            });
+            if ends_block(instr) {
+                break;
+            }
+            addr += 4;
+        }
+
+        if instrs.is_empty() {
+            None
+        } else {
+            let block = Block {
+                start: pc,
+                instrs,
+                has_breakpoint: false,
+            };
+            Some(self.block_cache.insert(block, &self.breakpoints))
+        }
+    }
+
+    /// Record a watchpoint hit if a load or store touches a watched
+    /// region. Only the first hit in a step is kept.
+    fn check_watchpoints(&self, addr: u32, width: u32, is_write: bool) {
+        if self.breakpoints.has_watchpoints() {
+            let hit = self.breakpoints.check_access(addr, width, is_write);
+            if hit.is_some() && self.watchpoint_hit.get().is_none() {
+                self.watchpoint_hit.set(hit);
+            }
+        }
+    }
+
     /// Increment clock and time
     ///
     /// This is deliberately separated from the execute step so that
@@ -276,6 +802,27 @@ impl Platform {
         // Increment machine counters
         self.machine_interface.machine.increment_mcycle();
         self.machine_interface.machine.trap_ctrl.increment_mtime();
+
+        let mcycle = self.mcycle();
+        if self.uart_rx.get_mut().tick(mcycle) {
+            self.update_external_interrupt();
+        }
+    }
+
+    /// Set mip.MEIP from the external interrupt line and the
+    /// interrupt outputs of the peripherals (the UART receiver, the
+    /// DMA controller and the block device)
+    fn update_external_interrupt(&mut self) {
+        let level = self.external_line
+            || self.uart_rx.get_mut().interrupt_level()
+            || self.dma.interrupt_level()
+            || self.block_device.interrupt_level();
+        let trap_ctrl = &mut self.machine_interface.machine.trap_ctrl;
+        if level {
+            trap_ctrl.raise_external_interrupt();
+        } else {
+            trap_ctrl.clear_external_interrupt();
+        }
     }
 
     /// Single clock cycle step
@@ -316,21 +863,12 @@ impl Platform {
 
         // Check for pending interrupts. If an interrupt is pending,
         // set the pc to the interrupt handler vector and return.
-        if let Some(interrupt_pc) = self
-            .machine_interface
-            .machine
-            .trap_ctrl
-            .trap_interrupt(self.pc)
-        {
-            if self.trace {
-                println!("Got interrupt: setting pc=0x{interrupt_pc:x}",)
-            }
-            self.pc = interrupt_pc;
+        if self.take_interrupt() {
             return Ok(());
         }
 
         // Fetch the instruction at the current pc.
-        let instr = match self.fetch_instruction() {
+        let instr = match self.fetch_instruction(self.pc) {
             Ok(instr) => instr,
             Err(ex) => {
                 if self.trace {
@@ -364,11 +902,56 @@ impl Platform {
         };
 
         if self.trace {
-            println!("Decoded instruction: {}", (decoded_instr.printer)(instr))
+            let disassembly = Disassembly {
+                printer: decoded_instr.printer,
+                instr,
+                context: PrintContext {
+                    pc: self.pc,
+                    symbols: Some(&self.symbols),
+                },
+            };
+            println!("Decoded instruction: {disassembly}")
+        }
+
+        self.execute_decoded(instr, decoded_instr.executer)
+    }
+
+    /// If an interrupt is pending, set the pc to the interrupt
+    /// handler vector and return true.
+    fn take_interrupt(&mut self) -> bool {
+        if let Some(interrupt_pc) = self
+            .machine_interface
+            .machine
+            .trap_ctrl
+            .trap_interrupt(self.pc)
+        {
+            if self.trace {
+                println!("Got interrupt: setting pc=0x{interrupt_pc:x}",)
+            }
+            let (pc, mcause) = (self.pc, self.trap_mcause());
+            self.hook(|hooks| hooks.on_trap(pc, mcause));
+            self.pc = interrupt_pc;
+            true
+        } else {
+            false
+        }
+    }
+
+    /// Execute an instruction that has already been fetched from the
+    /// current pc and decoded, and increment minstret if it completes
+    fn execute_decoded(
+        &mut self,
+        instr: u32,
+        executer: fn(&mut Self, u32) -> Result<(), Exception>,
+    ) -> Result<(), Exception> {
+        let pc = self.pc;
+        self.hook(|hooks| hooks.on_fetch(pc, instr));
+        if let Some(coverage) = &mut self.coverage {
+            coverage.mark(pc);
         }
 
         // Execute the instruction
-        if let Err(ex) = (decoded_instr.executer)(self, instr) {
+        if let Err(ex) = executer(self, instr) {
             if self.trace {
                 println!("Got exception {ex:?} while executing instruction");
             }
@@ -382,6 +965,7 @@ impl Platform {
 	// exceptions are not considered to be retired (see 3.3.1
 	// privileged spec).
         self.machine_interface.machine.increment_minstret();
+        self.hook(|hooks| hooks.on_retire(pc, instr));
 
         Ok(())
     }
@@ -396,20 +980,27 @@ impl Platform {
         if self.exceptions_are_errors {
             Err(ex)
         } else {
+            let pc = self.pc;
             self.pc = self
                 .machine_interface
                 .machine
                 .trap_ctrl
-                .raise_exception(self.pc, ex);
+                .raise_exception(pc, ex);
+            let mcause = self.trap_mcause();
+            self.hook(|hooks| hooks.on_trap(pc, mcause));
             Ok(())
         }
     }
 
-    fn fetch_instruction(&self) -> Result<u32, Exception> {
-        self.pma_checker.check_instruction_fetch(self.pc)?;
+    fn trap_mcause(&self) -> u32 {
+        self.machine_interface.machine.trap_ctrl.csr_mcause()
+    }
+
+    fn fetch_instruction(&self, pc: u32) -> Result<u32, Exception> {
+        self.pma_checker.check_instruction_fetch(pc)?;
         let instr = self
             .memory
-            .read(self.pc.into(), Wordsize::Word)
+            .read(pc.into(), Wordsize::Word)
             .expect("read should succeed ")
             .try_into()
             .expect("result should fit in 32 bits");
@@ -418,7 +1009,7 @@ impl Platform {
 }
 
 /// Implementation of the unprivileged execution environment interface
-impl Eei for Platform {
+impl<H: Hooks> Eei for Platform<H> {
     fn set_pc(&mut self, pc: u32) {
         self.pc = pc;
     }
@@ -446,22 +1037,40 @@ impl Eei for Platform {
     }
 
     fn load(&self, addr: u32, width: Wordsize) -> Result<u32, Exception> {
+        let load_width = width.width().into();
         self.pma_checker.check_load(addr, width.width().into())?;
+        self.check_watchpoints(addr, width.width().into(), false);
         // Match memory mapped registers first, then perform general load
-        let result = match addr {
-            MTIME_ADDR => self.machine_interface.machine.trap_ctrl.mmap_mtime(),
-            MTIMEH_ADDR => {
+        let result = match self.pma_checker.io_register(addr) {
+            Some(MTIME_ADDR) => {
+                self.machine_interface.machine.trap_ctrl.mmap_mtime()
+            }
+            Some(MTIMEH_ADDR) => {
                 self.machine_interface.machine.trap_ctrl.mmap_mtimeh()
             }
-            MTIMECMP_ADDR => {
+            Some(MTIMECMP_ADDR) => {
                 self.machine_interface.machine.trap_ctrl.mmap_mtimecmp()
             }
-            MTIMECMPH_ADDR => {
+            Some(MTIMECMPH_ADDR) => {
                 self.machine_interface.machine.trap_ctrl.mmap_mtimecmph()
             }
-            SOFTINTCTRL_ADDR => todo!("implement load softintctrl"),
-            EXTINTCTRL_ADDR => todo!("implement load extintctrl"),
-            UARTTX_ADDR => todo!("implement load uarttx"),
+            Some(SOFTINTCTRL_ADDR) => self.softintctrl(),
+            Some(EXTINTCTRL_ADDR) => self.extintctrl(),
+            // The transmitter is write-only, and reads as zero
+            Some(UARTTX_ADDR) => 0,
+            Some(UARTRX_ADDR) => self.uart_rx.borrow_mut().read_data(),
+            Some(UARTSTAT_ADDR) => self.uart_rx.borrow_mut().read_status(),
+            Some(DMASRC_ADDR) => self.dma.src,
+            Some(DMADST_ADDR) => self.dma.dst,
+            Some(DMALEN_ADDR) => self.dma.len,
+            Some(DMACTRL_ADDR) => self.dma.ctrl,
+            Some(DMASTAT_ADDR) => self.dma.status,
+            Some(BLKSECTOR_ADDR) => self.block_device.sector,
+            Some(BLKCOUNT_ADDR) => self.block_device.count,
+            Some(BLKBUF_ADDR) => self.block_device.buf,
+            Some(BLKCMD_ADDR) => self.block_device.cmd,
+            Some(BLKSTAT_ADDR) => self.block_device.status,
+            Some(BLKSIZE_ADDR) => self.block_device.size(),
             _ => self
                 .memory
                 .read(addr.into(), width)
@@ -469,6 +1078,7 @@ impl Eei for Platform {
                 .try_into()
                 .expect("value should fit into 32 bits"),
         };
+        self.hook(|hooks| hooks.on_load(addr, load_width, result));
         Ok(result)
     }
 
@@ -478,46 +1088,61 @@ impl Eei for Platform {
         data: u32,
         width: Wordsize,
     ) -> Result<(), Exception> {
+        let store_width = width.width().into();
         self.pma_checker.check_store(addr, width.width().into())?;
+        self.check_watchpoints(addr, width.width().into(), true);
         // Match memory mapped registers first, then perform general load
-        match addr {
-            MTIME_ADDR => self
+        match self.pma_checker.io_register(addr) {
+            Some(MTIME_ADDR) => self
                 .machine_interface
                 .machine
                 .trap_ctrl
                 .mmap_write_mtime(data),
-            MTIMEH_ADDR => self
+            Some(MTIMEH_ADDR) => self
                 .machine_interface
                 .machine
                 .trap_ctrl
                 .mmap_write_mtimeh(data),
-            MTIMECMP_ADDR => self
+            Some(MTIMECMP_ADDR) => self
                 .machine_interface
                 .machine
                 .trap_ctrl
                 .mmap_write_mtimecmp(data),
-            MTIMECMPH_ADDR => self
+            Some(MTIMECMPH_ADDR) => self
                 .machine_interface
                 .machine
                 .trap_ctrl
                 .mmap_write_mtimecmph(data),
-            SOFTINTCTRL_ADDR => todo!("implement store softintctrl"),
-            EXTINTCTRL_ADDR => todo!("implement store extintctrl"),
-            UARTTX_ADDR => {
-                self.uart_out
-                    .add(u8::try_from(0xff & data).unwrap() as char)
-                    .expect("insert into queue should work");
+            Some(SOFTINTCTRL_ADDR) => self.write_softintctrl(data),
+            Some(EXTINTCTRL_ADDR) => self.write_extintctrl(data),
+            Some(UARTTX_ADDR) => {
+                self.uart_out.push_back(u8::try_from(0xff & data).unwrap())
             }
+            Some(UARTRX_ADDR) => {}
+            Some(UARTSTAT_ADDR) => self.uart_rx.get_mut().write_status(data),
+            Some(DMASRC_ADDR) => self.dma.src = data,
+            Some(DMADST_ADDR) => self.dma.dst = data,
+            Some(DMALEN_ADDR) => self.dma.len = data,
+            Some(DMACTRL_ADDR) => self.write_dma_ctrl(data),
+            Some(DMASTAT_ADDR) => self.write_dma_status(data),
+            Some(BLKSECTOR_ADDR) => self.block_device.sector = data,
+            Some(BLKCOUNT_ADDR) => self.block_device.count = data,
+            Some(BLKBUF_ADDR) => self.block_device.buf = data,
+            Some(BLKCMD_ADDR) => self.write_block_cmd(data),
+            Some(BLKSTAT_ADDR) => self.write_block_status(data),
+            Some(BLKSIZE_ADDR) => {}
             _ => self
                 .memory
                 .write(addr.into(), data.into(), width)
                 .expect("memory write should work"),
         };
+        self.hook(|hooks| hooks.on_store(addr, store_width, data));
         Ok(())
     }
 
     fn read_csr(&self, addr: u16) -> Result<u32, Exception> {
         if let Ok(result) = self.machine_interface.read_csr(addr) {
+            self.hook(|hooks| hooks.on_csr(addr, result, false));
             Ok(result)
         } else {
             // csr not present or read-only
@@ -527,7 +1152,10 @@ impl Eei for Platform {
 
     fn write_csr(&mut self, addr: u16, value: u32) -> Result<(), Exception> {
         match self.machine_interface.write_csr(addr, value) {
-            Ok(_) => Ok(()),
+            Ok(_) => {
+                self.hook(|hooks| hooks.on_csr(addr, value, true));
+                Ok(())
+            }
             Err(_) => Err(Exception::IllegalInstruction),
         }
     }
@@ -535,6 +1163,10 @@ impl Eei for Platform {
     fn mret(&mut self) {
         self.pc = self.machine_interface.machine.trap_ctrl.mret();
     }
+
+    fn ebreak(&mut self) -> Result<(), Exception> {
+        self.semihosting_ebreak()
+    }
 }
 
 #[cfg(test)]
@@ -546,8 +1178,10 @@ mod tests {
 
     use super::*;
     use crate::encode::*;
+    use crate::platform::breakpoints::Condition;
     use crate::platform::csr::{CSR_MARCHID, CSR_MSCRATCH, CSR_MSTATUS};
-    use crate::platform::machine::{Trap, MSTATUS_MIE};
+    use crate::platform::machine::{Trap, MIP_MEIP, MSTATUS_MIE};
+    use crate::platform::uart::UARTSTAT_RX_INTERRUPT_ENABLE;
     use crate::trace_file::load_trace;
     use crate::utils::interpret_i32_as_unsigned;
 
@@ -906,6 +1540,34 @@ mod tests {
         Ok(())
     }
 
+    /// Branch offsets are 13-bit signed values, so a forward branch
+    /// of 2 KiB or more is not a backward branch
+    #[test]
+    fn check_beq_taken_far() -> Result<(), &'static str> {
+        let mut platform = Platform::new();
+        write_instr(&mut platform, 0x100, beq!(x0, x0, 0xffc));
+        write_instr(&mut platform, 0x10fc, beq!(x0, x0, -0x1000));
+        platform.set_pc(0x100);
+        platform.step().unwrap();
+        assert_eq!(platform.pc(), 0x10fc);
+        platform.step().unwrap();
+        assert_eq!(platform.pc(), 0xfc);
+        Ok(())
+    }
+
+    /// Branch and jump targets are disassembled as absolute addresses
+    #[test]
+    fn check_disassemble_targets() -> Result<(), &'static str> {
+        let mut platform = Platform::new();
+        write_instr(&mut platform, 0x100, beq!(x1, x2, -0x10));
+        write_instr(&mut platform, 0x104, jal!(x1, 0x800));
+        write_instr(&mut platform, 0x108, addi!(x1, x2, -1));
+        assert_eq!(platform.disassemble(0x100), "beq x1, x2, 0xf0");
+        assert_eq!(platform.disassemble(0x104), "jal x1, 0x904");
+        assert_eq!(platform.disassemble(0x108), "addi x1, x2, 0xfff");
+        Ok(())
+    }
+
     #[test]
     fn check_bne_not_taken() -> Result<(), &'static str> {
         let mut platform = Platform::new();
@@ -1670,6 +2332,118 @@ mod tests {
         Ok(())
     }
 
+    /// Division by zero and signed overflow do not trap, and give the
+    /// results in the specification
+    #[test]
+    fn check_div_rem_corner_cases() -> Result<(), &'static str> {
+        let min = 0x8000_0000;
+        let minus_one = 0xffff_ffff;
+        let cases = [
+            (div!(x1, x2, x3), 7, 0, minus_one),
+            (divu!(x1, x2, x3), 7, 0, 0xffff_ffff),
+            (rem!(x1, x2, x3), 7, 0, 7),
+            (remu!(x1, x2, x3), 7, 0, 7),
+            (div!(x1, x2, x3), min, minus_one, min),
+            (rem!(x1, x2, x3), min, minus_one, 0),
+        ];
+        for (instr, src1, src2, result) in cases {
+            let mut platform = Platform::new();
+            write_instr(&mut platform, 0, instr);
+            platform.set_x(2, src1);
+            platform.set_x(3, src2);
+            platform.step().unwrap();
+            assert_eq!(platform.x(1), result);
+            assert_eq!(platform.pc, 4);
+        }
+        Ok(())
+    }
+
+    fn trace_path(trace_file: &str) -> String {
+        let mut d = PathBuf::from(env!("CARGO_MANIFEST_DIR"));
+        d.push(format!("test_traces/{trace_file}"));
+        d.into_os_string().into_string().unwrap()
+    }
+
+    /// Running from the block cache should give the same state as
+    /// single stepping
+    #[test]
+    fn check_run_matches_step() {
+        let mut stepped = Platform::new();
+        let mut run = Platform::new();
+        load_trace(&mut stepped, trace_path("hello.trace")).unwrap();
+        load_trace(&mut run, trace_path("hello.trace")).unwrap();
+
+        for _ in 0..3000 {
+            stepped.step().unwrap();
+        }
+        // Run in uneven batches to stop part way through blocks
+        while run.mcycle() < 3000 {
+            let batch = 7.min(3000 - run.mcycle());
+            assert_eq!(run.run(batch).unwrap(), StopReason::StepsCompleted);
+        }
+
+        assert_eq!(run.pc(), stepped.pc());
+        assert_eq!(
+            run.machine_interface.machine.csr_minstret(),
+            stepped.machine_interface.machine.csr_minstret()
+        );
+        for n in 0..32 {
+            assert_eq!(run.x(n), stepped.x(n));
+        }
+        assert_eq!(run.flush_uartout(), stepped.flush_uartout());
+    }
+
+    #[test]
+    fn check_run_breakpoints() -> Result<(), &'static str> {
+        let mut platform = Platform::new();
+        write_instr(&mut platform, 0, addi!(x1, x1, 1));
+        write_instr(&mut platform, 4, addi!(x2, x2, 2));
+        write_instr(&mut platform, 8, jal!(x0, -8));
+
+        let breakpoints = platform.breakpoints_mut();
+        breakpoints.insert_conditional_pc(
+            4,
+            Some(Condition::RegEquals { index: 1, value: 3 }),
+        );
+        breakpoints.insert_cycle(20);
+
+        // The first two visits to pc=4 do not meet the condition
+        assert_eq!(platform.run(100).unwrap(), StopReason::Breakpoint(4));
+        assert_eq!(platform.x(1), 3);
+        assert_eq!(platform.mcycle(), 7);
+
+        // Removing the pc breakpoint unflags the block
+        platform.breakpoints_mut().remove_pc(4);
+        assert_eq!(platform.run(100).unwrap(), StopReason::Cycle(20));
+        assert_eq!(platform.run(100).unwrap(), StopReason::StepsCompleted);
+        assert_eq!(platform.mcycle(), 120);
+        Ok(())
+    }
+
+    /// UART input raises the external interrupt (when enabled) until
+    /// the program has read it all
+    #[test]
+    fn check_uart_rx_interrupt() -> Result<(), &'static str> {
+        let mut platform = Platform::new();
+        write_instr(&mut platform, 0, addi!(x0, x0, 0));
+        write_instr(&mut platform, 4, addi!(x0, x0, 0));
+        let enable = UARTSTAT_RX_INTERRUPT_ENABLE;
+        platform.store(UARTSTAT_ADDR, enable, Wordsize::Word).unwrap();
+        platform.send_uart_input(b"hi");
+        platform.step().unwrap();
+        let meip = 1 << MIP_MEIP;
+        assert_ne!(platform.read_csr(CSR_MIP).unwrap() & meip, 0);
+
+        let data = platform.load(UARTRX_ADDR, Wordsize::Word).unwrap();
+        assert_eq!(data, b'h'.into());
+        let data = platform.load(UARTRX_ADDR, Wordsize::Word).unwrap();
+        assert_eq!(data, b'i'.into());
+        assert_eq!(platform.uart_input_unread(), 0);
+        platform.step().unwrap();
+        assert_eq!(platform.read_csr(CSR_MIP).unwrap() & meip, 0);
+        Ok(())
+    }
+
     macro_rules! make_trace_test {
         ($test_name:ident, $trace_file:expr) => {
             #[test]
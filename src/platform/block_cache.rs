@@ -0,0 +1,124 @@
+//! Decoded basic block cache
+//!
+//! Fetching and decoding an instruction (walking the decoder tree)
+//! is a large part of the cost of a step. Since instructions can only
+//! be fetched from the EEPROM, which the program cannot write, the
+//! result of decoding a straight-line sequence of instructions can be
+//! kept and reused every time execution reaches the start of the
+//! sequence again.
+//!
+//! A block is a sequence of consecutive instructions starting at some
+//! pc and ending at the first instruction that can change control
+//! flow (a branch, jump or system instruction), or at the first
+//! instruction that cannot be fetched or decoded (that instruction is
+//! not part of the block). Executing from the cache is exactly
+//! equivalent to single stepping: interrupts, counters and exceptions
+//! are handled per instruction, and control may leave a block part way
+//! through (for example, on an interrupt or an exception).
+//!
+//! Each block also carries a flag recording whether any pc breakpoint
+//! lies inside it, so that the breakpoint set only needs to be
+//! consulted on entry to a block, rather than before every step.
+
+use std::collections::HashMap;
+use std::sync::Arc;
+
+use crate::opcodes::{OP_BRANCH, OP_JAL, OP_JALR, OP_SYSTEM};
+use crate::utils::mask;
+
+use super::breakpoints::Breakpoints;
+use super::machine::Exception;
+
+/// The maximum number of instructions in a block
+pub const MAX_BLOCK_LENGTH: usize = 64;
+
+/// Returns true if instr may change control flow, in which case it
+/// is the last instruction of its block
+pub fn ends_block(instr: u32) -> bool {
+    matches!(instr & mask(7), OP_BRANCH | OP_JAL | OP_JALR | OP_SYSTEM)
+}
+
+/// An instruction that has already been fetched and decoded
+#[derive(Debug)]
+pub struct DecodedInstr<E> {
+    pub instr: u32,
+    pub executer: fn(eei: &mut E, instr: u32) -> Result<(), Exception>,
+}
+
+/// A straight-line sequence of decoded instructions
+#[derive(Debug)]
+pub struct Block<E> {
+    /// Address of the first instruction in the block
+    pub start: u32,
+    pub instrs: Vec<DecodedInstr<E>>,
+    /// True if a pc breakpoint lies in [start, end)
+    pub has_breakpoint: bool,
+}
+
+impl<E> Block<E> {
+    /// The address one past the last instruction in the block
+    pub fn end(&self) -> u32 {
+        self.start + 4 * self.len()
+    }
+
+    pub fn len(&self) -> u32 {
+        self.instrs
+            .len()
+            .try_into()
+            .expect("block length should fit in 32 bits")
+    }
+}
+
+/// Cache of decoded blocks, indexed by start address
+#[derive(Debug)]
+pub struct BlockCache<E> {
+    blocks: HashMap<u32, Arc<Block<E>>>,
+}
+
+impl<E> Default for BlockCache<E> {
+    fn default() -> Self {
+        Self {
+            blocks: HashMap::new(),
+        }
+    }
+}
+
+impl<E> BlockCache<E> {
+    pub fn get(&self, pc: u32) -> Option<Arc<Block<E>>> {
+        self.blocks.get(&pc).cloned()
+    }
+
+    /// Store a new block, setting its breakpoint flag from the
+    /// current breakpoint set
+    pub fn insert(
+        &mut self,
+        mut block: Block<E>,
+        breakpoints: &Breakpoints,
+    ) -> Arc<Block<E>> {
+        block.has_breakpoint =
+            breakpoints.has_pc_in_range(block.start, block.end());
+        let block = Arc::new(block);
+        self.blocks.insert(block.start, block.clone());
+        block
+    }
+
+    /// Recompute the breakpoint flag of every block. Call this
+    /// whenever the set of pc breakpoints changes.
+    pub fn update_breakpoint_flags(&mut self, breakpoints: &Breakpoints) {
+        for block in self.blocks.values_mut() {
+            let has_breakpoint =
+                breakpoints.has_pc_in_range(block.start, block.end());
+            if block.has_breakpoint != has_breakpoint {
+                Arc::get_mut(block)
+                    .expect("blocks should not be shared outside a run")
+                    .has_breakpoint = has_breakpoint;
+            }
+        }
+    }
+
+    /// Remove all blocks. Call this whenever the contents of the
+    /// EEPROM change.
+    pub fn clear(&mut self) {
+        self.blocks.clear()
+    }
+}
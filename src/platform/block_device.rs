@@ -0,0 +1,321 @@
+//! Block storage device
+//!
+//! The block device is a disk of 512-byte sectors, stored in an image
+//! file on the host, that the program reads and writes a run of
+//! sectors at a time. It is programmed through memory-mapped
+//! registers in the I/O region:
+//!
+//! | Address | Description |
+//! |---------|-------------|
+//! | 0x1000_0038 | blksector (first sector of the transfer) |
+//! | 0x1000_003c | blkcount (number of sectors to transfer) |
+//! | 0x1000_0040 | blkbuf (RAM address of the transfer buffer) |
+//! | 0x1000_0044 | blkcmd (command, see below) |
+//! | 0x1000_0048 | blkstat (status, see below) |
+//! | 0x1000_004c | blksize (number of sectors in the image, read-only) |
+//!
+//! The fields of blkcmd are:
+//!
+//! | Bits | Description |
+//! |------|-------------|
+//! | 0-1 | Command: writing 1 reads sectors into the buffer, and 2 writes the buffer to sectors (reads as 0) |
+//! | 2 | Completion interrupt enable |
+//!
+//! The fields of blkstat are (write 1 to a bit to clear it):
+//!
+//! | Bits | Description |
+//! |------|-------------|
+//! | 0 | Done: the last command has finished |
+//! | 1 | Error: the last command was invalid (no image attached, sectors past the end of the image, or a buffer not in RAM), or the host file access failed |
+//!
+//! Like the DMA controller, a command completes when it is written
+//! to blkcmd, and the completion interrupt (mip.MEIP, while done is
+//! set and the interrupt is enabled) is raised straight away.
+//!
+//! Sectors are moved between the image file and RAM without going
+//! through the program's loads and stores. RAM is stored in pages
+//! (see the memory module), and each page's part of the transfer is
+//! read from the file straight into the page, or written to the file
+//! straight from the page, with one positional read or write. There
+//! is no intermediate buffer. (The image file is not mapped into
+//! memory, which would need unsafe code.) If a host file access
+//! fails, the pages before it have already been transferred.
+//!
+//! The image file is not resized: its size (rounded down to a whole
+//! number of sectors) is the size of the disk. The device registers
+//! are saved in a checkpoint, but the image contents are not, so
+//! restoring a checkpoint does not undo writes to the disk.
+
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::path::Path;
+
+use super::hooks::Hooks;
+use super::Platform;
+
+/// Bytes per sector
+pub const SECTOR_SIZE: u32 = 512;
+
+/// blkcmd: command field mask
+pub const BLKCMD_COMMAND_MASK: u32 = 0b11;
+/// blkcmd: read sectors into RAM
+pub const BLKCMD_READ: u32 = 1;
+/// blkcmd: write RAM to sectors
+pub const BLKCMD_WRITE: u32 = 2;
+/// blkcmd: completion interrupt enable
+pub const BLKCMD_INTERRUPT_ENABLE: u32 = 1 << 2;
+
+/// blkstat: command done
+pub const BLKSTAT_DONE: u32 = 1 << 0;
+/// blkstat: command error
+pub const BLKSTAT_ERROR: u32 = 1 << 1;
+
+/// The block device registers, and the image file (if attached)
+#[derive(Debug, Default)]
+pub struct BlockDevice {
+    pub sector: u32,
+    pub count: u32,
+    pub buf: u32,
+    /// The blkcmd register, without the command field
+    pub cmd: u32,
+    pub status: u32,
+    image: Option<File>,
+    /// Number of sectors in the image
+    sectors: u32,
+}
+
+impl BlockDevice {
+    /// Use the image file at path as the disk
+    pub fn attach(&mut self, path: &Path) -> Result<(), io::Error> {
+        let image = OpenOptions::new().read(true).write(true).open(path)?;
+        let sectors = image.metadata()?.len() / u64::from(SECTOR_SIZE);
+        self.sectors = u32::try_from(sectors).unwrap_or(u32::MAX);
+        self.image = Some(image);
+        Ok(())
+    }
+
+    /// The blksize register
+    pub fn size(&self) -> u32 {
+        self.sectors
+    }
+
+    /// True if the device is raising the external interrupt
+    pub fn interrupt_level(&self) -> bool {
+        self.cmd & BLKCMD_INTERRUPT_ENABLE != 0
+            && self.status & BLKSTAT_DONE != 0
+    }
+
+    /// The byte offset and length in the image of the sectors in the
+    /// transfer, if they are all in the image
+    fn extent(&self) -> Option<(u64, u32)> {
+        let end = self.sector.checked_add(self.count)?;
+        if end > self.sectors {
+            return None;
+        }
+        let offset = u64::from(self.sector) * u64::from(SECTOR_SIZE);
+        Some((offset, self.count.checked_mul(SECTOR_SIZE)?))
+    }
+}
+
+impl<H: Hooks> Platform<H> {
+    /// Use the image file at path as the block device's disk
+    pub fn attach_block_device(
+        &mut self,
+        path: &Path,
+    ) -> Result<(), io::Error> {
+        self.block_device.attach(path)
+    }
+
+    /// Write the blkcmd register, performing the command (if any)
+    pub(super) fn write_block_cmd(&mut self, value: u32) {
+        self.block_device.cmd = value & !BLKCMD_COMMAND_MASK;
+        let command = value & BLKCMD_COMMAND_MASK;
+        if command != 0 {
+            let ok = match command {
+                BLKCMD_READ => self.block_read(),
+                BLKCMD_WRITE => self.block_write(),
+                _ => false,
+            };
+            self.block_device.status = if ok {
+                BLKSTAT_DONE
+            } else {
+                BLKSTAT_DONE | BLKSTAT_ERROR
+            };
+        }
+        self.update_external_interrupt();
+    }
+
+    /// Write the blkstat register (clearing the bits set in value)
+    pub(super) fn write_block_status(&mut self, value: u32) {
+        self.block_device.status &= !value;
+        self.update_external_interrupt();
+    }
+
+    /// The buffer address and length of the transfer, if the sectors
+    /// are in the image and the buffer is in RAM
+    fn block_transfer(&self) -> Option<(u64, u32, u32)> {
+        let (offset, len) = self.block_device.extent()?;
+        let buf = self.block_device.buf;
+        let valid = len == 0 || self.pma_checker.in_main_memory(buf, len);
+        valid.then_some((offset, buf, len))
+    }
+
+    fn block_read(&mut self) -> bool {
+        let Some((offset, buf, len)) = self.block_transfer() else {
+            return false;
+        };
+        let Some(image) = &self.block_device.image else {
+            return false;
+        };
+        let len_bytes = usize::try_from(len).unwrap();
+        let read = self.memory.for_each_chunk_mut(
+            buf.into(),
+            len_bytes,
+            |chunk_offset, chunk| {
+                read_exact_at(image, chunk, offset + chunk_offset as u64)
+            },
+        );
+        self.check_watchpoints(buf, len, true);
+        read.is_ok()
+    }
+
+    fn block_write(&mut self) -> bool {
+        let Some((offset, buf, len)) = self.block_transfer() else {
+            return false;
+        };
+        let Some(image) = &self.block_device.image else {
+            return false;
+        };
+        self.check_watchpoints(buf, len, false);
+        let len_bytes = usize::try_from(len).unwrap();
+        let written = self.memory.for_each_chunk(
+            buf.into(),
+            len_bytes,
+            |chunk_offset, chunk| {
+                write_all_at(image, chunk, offset + chunk_offset as u64)
+            },
+        );
+        written.is_ok()
+    }
+}
+
+#[cfg(unix)]
+fn read_exact_at(file: &File, buf: &mut [u8], offset: u64) -> io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    file.read_exact_at(buf, offset)
+}
+
+#[cfg(unix)]
+fn write_all_at(file: &File, buf: &[u8], offset: u64) -> io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    file.write_all_at(buf, offset)
+}
+
+#[cfg(not(unix))]
+fn read_exact_at(
+    mut file: &File,
+    buf: &mut [u8],
+    offset: u64,
+) -> io::Result<()> {
+    use std::io::{Read, Seek, SeekFrom};
+    file.seek(SeekFrom::Start(offset))?;
+    file.read_exact(buf)
+}
+
+#[cfg(not(unix))]
+fn write_all_at(mut file: &File, buf: &[u8], offset: u64) -> io::Result<()> {
+    use std::io::{Seek, SeekFrom, Write};
+    file.seek(SeekFrom::Start(offset))?;
+    file.write_all(buf)
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::platform::eei::Eei;
+    use crate::platform::memory::Wordsize;
+    use crate::platform::pma::{
+        BLKBUF_ADDR, BLKCMD_ADDR, BLKCOUNT_ADDR, BLKSECTOR_ADDR, BLKSIZE_ADDR,
+        BLKSTAT_ADDR,
+    };
+
+    const RAM: u32 = 0x2000_0000;
+
+    fn command(platform: &mut Platform, cmd: u32, sector: u32, buf: u32) {
+        let registers = [
+            (BLKSECTOR_ADDR, sector),
+            (BLKCOUNT_ADDR, 1),
+            (BLKBUF_ADDR, buf),
+            (BLKCMD_ADDR, cmd),
+        ];
+        for (addr, value) in registers {
+            platform.store(addr, value, Wordsize::Word).unwrap();
+        }
+    }
+
+    fn status(platform: &mut Platform) -> u32 {
+        let status = platform.load(BLKSTAT_ADDR, Wordsize::Word).unwrap();
+        platform
+            .store(BLKSTAT_ADDR, status, Wordsize::Word)
+            .unwrap();
+        status
+    }
+
+    #[test]
+    fn check_sector_round_trip() {
+        let mut path = std::env::temp_dir();
+        path.push(format!("riscvemu-block-{}.img", std::process::id()));
+        std::fs::write(&path, vec![0; 4 * 512 + 100]).unwrap();
+
+        let mut platform = Platform::new();
+        platform.attach_block_device(&path).unwrap();
+        let size = platform.load(BLKSIZE_ADDR, Wordsize::Word).unwrap();
+        assert_eq!(size, 4);
+
+        let sector: Vec<u8> = (0..512).map(|n| (n % 251) as u8).collect();
+        platform.memory.write_bytes(RAM.into(), &sector);
+        command(&mut platform, BLKCMD_WRITE, 2, RAM);
+        assert_eq!(status(&mut platform), BLKSTAT_DONE);
+        let image = std::fs::read(&path).unwrap();
+        assert_eq!(&image[2 * 512..3 * 512], sector);
+
+        command(&mut platform, BLKCMD_READ, 2, RAM + 0x1000);
+        assert_eq!(status(&mut platform), BLKSTAT_DONE);
+        let read = platform.memory.read_bytes((RAM + 0x1000).into(), 512);
+        assert_eq!(read, sector);
+
+        // A transfer that spans several pages of RAM, at a buffer that
+        // is not page aligned
+        let disk: Vec<u8> = (0..4 * 512).map(|n| (n % 253) as u8).collect();
+        std::fs::write(&path, &disk).unwrap();
+        let registers = [
+            (BLKSECTOR_ADDR, 0),
+            (BLKCOUNT_ADDR, 4),
+            (BLKBUF_ADDR, RAM + 0xf00),
+            (BLKCMD_ADDR, BLKCMD_READ),
+        ];
+        for (addr, value) in registers {
+            platform.store(addr, value, Wordsize::Word).unwrap();
+        }
+        assert_eq!(status(&mut platform), BLKSTAT_DONE);
+        let read = platform.memory.read_bytes((RAM + 0xf00).into(), 4 * 512);
+        assert_eq!(read, disk);
+        platform
+            .memory
+            .write_bytes((RAM + 0xf00).into(), &[0; 4 * 512]);
+        platform
+            .store(BLKCMD_ADDR, BLKCMD_WRITE, Wordsize::Word)
+            .unwrap();
+        assert_eq!(status(&mut platform), BLKSTAT_DONE);
+        assert_eq!(std::fs::read(&path).unwrap(), vec![0; 4 * 512]);
+
+        // Past the end of the image, and a buffer in the EEPROM
+        command(&mut platform, BLKCMD_READ, 4, RAM);
+        assert_eq!(status(&mut platform), BLKSTAT_DONE | BLKSTAT_ERROR);
+        command(&mut platform, BLKCMD_READ, 0, 0x100);
+        assert_eq!(status(&mut platform), BLKSTAT_DONE | BLKSTAT_ERROR);
+
+        std::fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,407 @@
+//! Breakpoints and watchpoints
+//!
+//! This file contains the state used to stop a batched run of the
+//! platform (see Platform::run) before it has completed the requested
+//! number of steps. Breakpoints are program counter values (optionally
+//! with a condition on a register), checked before the instruction at
+//! that address is executed, or mcycle values, checked before the
+//! step that begins at that cycle. Watchpoints are memory regions,
+//! checked when a load or store instruction accesses them; execution
+//! stops after the accessing instruction has completed (this is the
+//! behaviour expected by gdb).
+//!
+//! Breakpoints can be written on the command line as follows:
+//!
+//! * `0x1234` or `4660`: stop when the pc reaches this address
+//! * `main`: stop when the pc reaches the address of a symbol
+//! * `main:x10=0x5`: as above, but only if register x10 is 5
+//! * `@3000`: stop when mcycle reaches 3000
+//!
+
+use std::collections::{BTreeMap, BTreeSet};
+use std::str::FromStr;
+
+use thiserror::Error;
+
+use crate::elf_utils::FullSymbol;
+
+use super::eei::Eei;
+
+#[derive(Debug, Error)]
+pub enum BreakpointError {
+    #[error("could not parse breakpoint '{0}'")]
+    ParseFailed(String),
+    #[error("symbol '{0}' not found in the symbol table")]
+    UnknownSymbol(String),
+}
+
+/// Parse a decimal value, or a hexadecimal value with 0x prefix
+fn parse_maybe_hex<T: TryFrom<u64>>(value: &str) -> Option<T> {
+    let value = match value.strip_prefix("0x") {
+        Some(hex) => u64::from_str_radix(hex, 16).ok()?,
+        None => value.parse::<u64>().ok()?,
+    };
+    value.try_into().ok()
+}
+
+/// A condition that must hold for a pc breakpoint to stop execution
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum Condition {
+    /// Register x{index} holds value
+    RegEquals { index: u8, value: u32 },
+}
+
+impl Condition {
+    pub fn holds<E: Eei>(&self, eei: &E) -> bool {
+        match self {
+            Self::RegEquals { index, value } => eei.x(*index) == *value,
+        }
+    }
+}
+
+impl FromStr for Condition {
+    type Err = BreakpointError;
+
+    /// Parse a condition of the form xN=VALUE
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        let parse_failed = || BreakpointError::ParseFailed(s.to_string());
+        let (reg, value) = s.split_once('=').ok_or_else(parse_failed)?;
+        let index = reg
+            .strip_prefix('x')
+            .and_then(|index| index.parse::<u8>().ok())
+            .filter(|index| *index < 32)
+            .ok_or_else(parse_failed)?;
+        let value = parse_maybe_hex(value).ok_or_else(parse_failed)?;
+        Ok(Self::RegEquals { index, value })
+    }
+}
+
+/// Where a pc breakpoint is placed
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Location {
+    Addr(u32),
+    /// A symbol, resolved using the ELF symbol table
+    Symbol(String),
+}
+
+/// A breakpoint, as written on the command line (see the module
+/// documentation for the syntax)
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum BreakpointSpec {
+    Pc {
+        location: Location,
+        condition: Option<Condition>,
+    },
+    Cycle(u64),
+}
+
+impl FromStr for BreakpointSpec {
+    type Err = BreakpointError;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        let parse_failed = || BreakpointError::ParseFailed(s.to_string());
+        if let Some(cycle) = s.strip_prefix('@') {
+            let cycle = parse_maybe_hex(cycle).ok_or_else(parse_failed)?;
+            return Ok(Self::Cycle(cycle));
+        }
+
+        let (location, condition) = match s.split_once(':') {
+            Some((location, condition)) => (location, Some(condition.parse()?)),
+            None => (s, None),
+        };
+        let location = if location.starts_with(|c: char| c.is_ascii_digit()) {
+            Location::Addr(parse_maybe_hex(location).ok_or_else(parse_failed)?)
+        } else if !location.is_empty() {
+            Location::Symbol(location.to_string())
+        } else {
+            return Err(parse_failed());
+        };
+        Ok(Self::Pc {
+            location,
+            condition,
+        })
+    }
+}
+
+/// The kind of memory access that triggers a watchpoint
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum WatchKind {
+    /// Trigger on stores
+    Write,
+    /// Trigger on loads
+    Read,
+    /// Trigger on loads or stores
+    Access,
+}
+
+impl WatchKind {
+    fn matches(&self, is_write: bool) -> bool {
+        match self {
+            Self::Write => is_write,
+            Self::Read => !is_write,
+            Self::Access => true,
+        }
+    }
+}
+
+/// A watched memory region [addr, addr + len)
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct Watchpoint {
+    pub addr: u32,
+    pub len: u32,
+    pub kind: WatchKind,
+}
+
+impl Watchpoint {
+    /// True if an access of width bytes at addr overlaps the
+    /// watched region and is of the right kind
+    fn triggered_by(&self, addr: u32, width: u32, is_write: bool) -> bool {
+        let start = u64::from(self.addr);
+        let end = start + u64::from(self.len);
+        let access_start = u64::from(addr);
+        let access_end = access_start + u64::from(width);
+        self.kind.matches(is_write) && access_start < end && start < access_end
+    }
+}
+
+/// Record of the watchpoint that triggered, and the address of the
+/// access that triggered it
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct WatchpointHit {
+    pub watchpoint: Watchpoint,
+    pub addr: u32,
+}
+
+/// The reason a batched run returned
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum StopReason {
+    /// All the requested steps were executed
+    StepsCompleted,
+    /// The program counter reached a breakpoint. The instruction
+    /// at the breakpoint has not been executed.
+    Breakpoint(u32),
+    /// mcycle reached a cycle breakpoint
+    Cycle(u64),
+    /// A load or store accessed a watched memory region
+    Watchpoint(WatchpointHit),
+    /// The program exited using semihosting, with this exit status
+    Exit(u32),
+}
+
+/// The set of breakpoints and watchpoints for a platform
+#[derive(Debug, Default)]
+pub struct Breakpoints {
+    /// Breakpoint addresses, along with an optional condition
+    pcs: BTreeMap<u32, Option<Condition>>,
+    cycles: BTreeSet<u64>,
+    watchpoints: Vec<Watchpoint>,
+    /// Set whenever pcs changes, so that the platform knows to
+    /// recompute the breakpoint flags in its block cache
+    pcs_changed: bool,
+}
+
+impl Breakpoints {
+    /// Returns true if there is nothing that could stop a run
+    pub fn is_empty(&self) -> bool {
+        self.pcs.is_empty()
+            && self.cycles.is_empty()
+            && self.watchpoints.is_empty()
+    }
+
+    /// Insert an unconditional breakpoint at pc (replacing any
+    /// condition already present at pc)
+    pub fn insert_pc(&mut self, pc: u32) {
+        self.insert_conditional_pc(pc, None)
+    }
+
+    pub fn insert_conditional_pc(
+        &mut self,
+        pc: u32,
+        condition: Option<Condition>,
+    ) {
+        self.pcs.insert(pc, condition);
+        self.pcs_changed = true;
+    }
+
+    /// Returns true if the breakpoint was present
+    pub fn remove_pc(&mut self, pc: u32) -> bool {
+        self.pcs_changed = true;
+        self.pcs.remove(&pc).is_some()
+    }
+
+    pub fn contains_pc(&self, pc: u32) -> bool {
+        self.pcs.contains_key(&pc)
+    }
+
+    /// Returns true if there is a pc breakpoint in [start, end)
+    pub fn has_pc_in_range(&self, start: u32, end: u32) -> bool {
+        self.pcs.range(start..end).next().is_some()
+    }
+
+    /// Returns true if there is a breakpoint at pc whose condition (if
+    /// any) holds
+    pub fn pc_triggered<E: Eei>(&self, pc: u32, eei: &E) -> bool {
+        match self.pcs.get(&pc) {
+            Some(Some(condition)) => condition.holds(eei),
+            Some(None) => true,
+            None => false,
+        }
+    }
+
+    /// Return true (once) if the pc breakpoints have changed since the
+    /// last call
+    pub fn take_pcs_changed(&mut self) -> bool {
+        std::mem::take(&mut self.pcs_changed)
+    }
+
+    pub fn insert_cycle(&mut self, cycle: u64) {
+        self.cycles.insert(cycle);
+    }
+
+    /// Returns true if the breakpoint was present
+    pub fn remove_cycle(&mut self, cycle: u64) -> bool {
+        self.cycles.remove(&cycle)
+    }
+
+    pub fn contains_cycle(&self, cycle: u64) -> bool {
+        self.cycles.contains(&cycle)
+    }
+
+    /// Returns true if there is a cycle breakpoint in [start, end)
+    pub fn has_cycle_in_range(&self, start: u64, end: u64) -> bool {
+        self.cycles.range(start..end).next().is_some()
+    }
+
+    /// Insert a breakpoint from its command line form, resolving
+    /// symbol names using symbols
+    pub fn insert_spec(
+        &mut self,
+        spec: &BreakpointSpec,
+        symbols: &[FullSymbol],
+    ) -> Result<(), BreakpointError> {
+        match spec {
+            BreakpointSpec::Pc {
+                location,
+                condition,
+            } => {
+                let pc = match location {
+                    Location::Addr(addr) => *addr,
+                    Location::Symbol(name) => {
+                        symbols
+                            .iter()
+                            .find(|s| s.name.as_ref() == Some(name))
+                            .ok_or_else(|| {
+                                BreakpointError::UnknownSymbol(name.clone())
+                            })?
+                            .value
+                    }
+                };
+                self.insert_conditional_pc(pc, *condition);
+            }
+            BreakpointSpec::Cycle(cycle) => self.insert_cycle(*cycle),
+        }
+        Ok(())
+    }
+
+    pub fn insert_watchpoint(&mut self, watchpoint: Watchpoint) {
+        if !self.watchpoints.contains(&watchpoint) {
+            self.watchpoints.push(watchpoint)
+        }
+    }
+
+    /// Returns true if the watchpoint was present
+    pub fn remove_watchpoint(&mut self, watchpoint: Watchpoint) -> bool {
+        let length_before = self.watchpoints.len();
+        self.watchpoints.retain(|w| *w != watchpoint);
+        self.watchpoints.len() != length_before
+    }
+
+    pub fn has_watchpoints(&self) -> bool {
+        !self.watchpoints.is_empty()
+    }
+
+    /// Return the first watchpoint triggered by an access of width
+    /// bytes at addr, if any
+    pub fn check_access(
+        &self,
+        addr: u32,
+        width: u32,
+        is_write: bool,
+    ) -> Option<WatchpointHit> {
+        self.watchpoints
+            .iter()
+            .find(|w| w.triggered_by(addr, width, is_write))
+            .map(|watchpoint| WatchpointHit {
+                watchpoint: *watchpoint,
+                addr,
+            })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+
+    #[test]
+    fn check_watchpoint_overlap() {
+        let mut breakpoints = Breakpoints::default();
+        let watchpoint = Watchpoint {
+            addr: 0x2000_0010,
+            len: 4,
+            kind: WatchKind::Write,
+        };
+        breakpoints.insert_watchpoint(watchpoint);
+
+        // Halfword store overlapping the last byte of the region
+        assert!(breakpoints.check_access(0x2000_0013, 2, true).is_some());
+        // Loads do not trigger a write watchpoint
+        assert!(breakpoints.check_access(0x2000_0010, 4, false).is_none());
+        // Store just past the end of the region
+        assert!(breakpoints.check_access(0x2000_0014, 4, true).is_none());
+        // Store just before the start of the region
+        assert!(breakpoints.check_access(0x2000_000c, 4, true).is_none());
+
+        assert!(breakpoints.remove_watchpoint(watchpoint));
+        assert!(breakpoints.is_empty());
+    }
+
+    #[test]
+    fn check_parse_breakpoint_spec() {
+        assert_eq!(
+            "0x1234".parse::<BreakpointSpec>().unwrap(),
+            BreakpointSpec::Pc {
+                location: Location::Addr(0x1234),
+                condition: None
+            }
+        );
+        assert_eq!(
+            "main:x10=0x5".parse::<BreakpointSpec>().unwrap(),
+            BreakpointSpec::Pc {
+                location: Location::Symbol("main".to_string()),
+                condition: Some(Condition::RegEquals {
+                    index: 10,
+                    value: 5
+                })
+            }
+        );
+        assert_eq!(
+            "@3000".parse::<BreakpointSpec>().unwrap(),
+            BreakpointSpec::Cycle(3000)
+        );
+        assert!("main:x32=1".parse::<BreakpointSpec>().is_err());
+        assert!("0x12g4".parse::<BreakpointSpec>().is_err());
+        assert!("@".parse::<BreakpointSpec>().is_err());
+    }
+
+    #[test]
+    fn check_pc_ranges() {
+        let mut breakpoints = Breakpoints::default();
+        breakpoints.insert_pc(0x100);
+        assert!(breakpoints.take_pcs_changed());
+        assert!(!breakpoints.take_pcs_changed());
+        assert!(breakpoints.has_pc_in_range(0xf0, 0x104));
+        assert!(!breakpoints.has_pc_in_range(0x104, 0x200));
+        assert!(!breakpoints.has_pc_in_range(0xf0, 0x100));
+    }
+}
@@ -0,0 +1,236 @@
+//! Building a configured platform
+//!
+//! PlatformBuilder collects the options that the emulate binary sets
+//! from its command line (the memory map, semihosting, UART receiver,
+//! mtime mode, block device and program), so that a test harness can
+//! create a ready-to-run platform in one expression and keep it in
+//! process, instead of starting the emulate binary for each test:
+//!
+//! ```no_run
+//! use riscvemu::platform::Platform;
+//!
+//! let mut platform = Platform::builder()
+//!     .elf("main.out")
+//!     .uart_input(b"hello")
+//!     .build()
+//!     .expect("platform should build");
+//! platform.run(1_000_000).expect("program should not raise an error");
+//! print!("{}", platform.flush_uartout());
+//! ```
+//!
+//! The C interface (the capi crate in this repository) is built on
+//! this API.
+
+use std::io;
+use std::path::PathBuf;
+
+use thiserror::Error;
+
+use crate::elf_utils::{load_elf, ElfError, ElfLoadable};
+
+use super::hooks::{Hooks, NoHooks};
+use super::memory_map::{MemoryMap, MemoryMapError};
+use super::pma::PmaChecker;
+use super::uart::DEFAULT_RX_DEPTH;
+use super::Platform;
+
+#[derive(Debug, Error)]
+pub enum BuildError {
+    #[error("Invalid memory map: {0}")]
+    MemoryMap(#[from] MemoryMapError),
+    #[error("Error opening block device image: {0}")]
+    BlockDevice(io::Error),
+    #[error("Error loading program: {0}")]
+    Program(#[from] ElfError),
+}
+
+/// The program to load into the EEPROM
+#[derive(Debug, Clone)]
+enum Program {
+    Elf(PathBuf),
+    Image(Vec<u8>),
+}
+
+/// Options for creating a platform (see the module documentation)
+#[derive(Debug, Clone)]
+pub struct PlatformBuilder {
+    memory_map: MemoryMap,
+    trace: bool,
+    exceptions_are_errors: bool,
+    semihosting: Option<PathBuf>,
+    uart_rx_depth: usize,
+    uart_rx_interval: Option<u64>,
+    uart_input: Vec<u8>,
+    mtime_frequency: Option<u64>,
+    block_device: Option<PathBuf>,
+    program: Option<Program>,
+}
+
+impl Default for PlatformBuilder {
+    fn default() -> Self {
+        Self {
+            memory_map: MemoryMap::default(),
+            trace: false,
+            exceptions_are_errors: false,
+            semihosting: None,
+            uart_rx_depth: DEFAULT_RX_DEPTH,
+            uart_rx_interval: None,
+            uart_input: Vec::new(),
+            mtime_frequency: None,
+            block_device: None,
+            program: None,
+        }
+    }
+}
+
+impl PlatformBuilder {
+    pub fn memory_map(mut self, memory_map: MemoryMap) -> Self {
+        self.memory_map = memory_map;
+        self
+    }
+
+    pub fn trace(mut self, trace: bool) -> Self {
+        self.trace = trace;
+        self
+    }
+
+    pub fn exceptions_are_errors(
+        mut self,
+        exceptions_are_errors: bool,
+    ) -> Self {
+        self.exceptions_are_errors = exceptions_are_errors;
+        self
+    }
+
+    /// Enable semihosting, with host files in root
+    pub fn semihosting(mut self, root: impl Into<PathBuf>) -> Self {
+        self.semihosting = Some(root.into());
+        self
+    }
+
+    pub fn uart_rx_depth(mut self, depth: usize) -> Self {
+        self.uart_rx_depth = depth;
+        self
+    }
+
+    /// See Platform::set_uart_rx_interval
+    pub fn uart_rx_interval(mut self, interval: Option<u64>) -> Self {
+        self.uart_rx_interval = interval;
+        self
+    }
+
+    /// Bytes to send to the program over the UART receiver (added to
+    /// any given before)
+    pub fn uart_input(mut self, bytes: &[u8]) -> Self {
+        self.uart_input.extend_from_slice(bytes);
+        self
+    }
+
+    /// See Platform::set_mtime_frequency
+    pub fn mtime_frequency(mut self, frequency: Option<u64>) -> Self {
+        self.mtime_frequency = frequency;
+        self
+    }
+
+    /// Use the image file at path as the block device's disk
+    pub fn block_device(mut self, path: impl Into<PathBuf>) -> Self {
+        self.block_device = Some(path.into());
+        self
+    }
+
+    /// Load the program from an ELF file
+    pub fn elf(mut self, path: impl Into<PathBuf>) -> Self {
+        self.program = Some(Program::Elf(path.into()));
+        self
+    }
+
+    /// Load the program from a raw EEPROM image (see
+    /// Platform::load_image)
+    pub fn image(mut self, image: &[u8]) -> Self {
+        self.program = Some(Program::Image(image.to_vec()));
+        self
+    }
+
+    /// Create the platform and load the program (if any)
+    pub fn build(self) -> Result<Platform, BuildError> {
+        self.build_with_hooks(NoHooks)
+    }
+
+    /// Create the platform with instrumentation hooks (see the hooks
+    /// module) and load the program (if any)
+    pub fn build_with_hooks<H: Hooks>(
+        self,
+        hooks: H,
+    ) -> Result<Platform<H>, BuildError> {
+        let mut platform = Platform::with_hooks(hooks);
+        platform.pma_checker = PmaChecker::with_memory_map(self.memory_map)?;
+        platform.set_trace(self.trace);
+        platform.set_exceptions_are_errors(self.exceptions_are_errors);
+        platform.set_semihosting(self.semihosting);
+        platform.set_uart_rx_depth(self.uart_rx_depth);
+        platform.set_uart_rx_interval(self.uart_rx_interval);
+        platform.send_uart_input(&self.uart_input);
+        platform.set_mtime_frequency(self.mtime_frequency);
+        if let Some(path) = &self.block_device {
+            platform
+                .attach_block_device(path)
+                .map_err(BuildError::BlockDevice)?;
+        }
+        match &self.program {
+            Some(Program::Elf(path)) => {
+                let path = path.to_string_lossy().into_owned();
+                load_elf(&mut platform, &path)?
+            }
+            Some(Program::Image(image)) => platform.load_image(image)?,
+            None => {}
+        }
+        Ok(platform)
+    }
+}
+
+impl Platform {
+    /// Start building a platform with non-default options
+    pub fn builder() -> PlatformBuilder {
+        PlatformBuilder::default()
+    }
+}
+
+impl<H: Hooks> Platform<H> {
+    /// Load a raw image (for example, made with objcopy -O binary)
+    /// into the EEPROM, starting at address 0. Returns an error if the
+    /// image is larger than the EEPROM.
+    pub fn load_image(&mut self, image: &[u8]) -> Result<(), ElfError> {
+        for (addr, byte) in (0..).zip(image) {
+            self.write_byte(addr, *byte)?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::platform::breakpoints::StopReason;
+    use crate::platform::eei::Eei;
+
+    #[test]
+    fn check_build_from_image() {
+        // addi x1, x0, 5; then loop (jal x0, 0)
+        let image = [0x93, 0x00, 0x50, 0x00, 0x6f, 0x00, 0x00, 0x00];
+        let mut platform = Platform::builder()
+            .image(&image)
+            .uart_input(b"ab")
+            .build()
+            .unwrap();
+        assert_eq!(platform.uart_input_unread(), 2);
+        let stop_reason = platform.run(10).unwrap();
+        assert!(matches!(stop_reason, StopReason::StepsCompleted));
+        assert_eq!(platform.x(1), 5);
+        assert_eq!(platform.pc(), 4);
+
+        let too_big = vec![0; 8 * 1024 * 1024];
+        let result = Platform::builder().image(&too_big).build();
+        assert!(matches!(result, Err(BuildError::Program(_))));
+    }
+}
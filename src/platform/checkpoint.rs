@@ -0,0 +1,640 @@
+//! Platform checkpoints
+//!
+//! A checkpoint is a copy of the state of the platform that affects
+//! execution: the pc, the registers, the machine (CSR, counter and
+//! interrupt) state, the contents of RAM, any UART output that has
+//! not yet been flushed, the UART receiver (see UartRxState), the DMA
+//! controller and block device registers, and the external interrupt
+//! line. Restoring a checkpoint recomputes mip.MEIP from the restored
+//! peripherals.
+//!
+//! Restoring a checkpoint and continuing gives the same result as
+//! continuing from the point where the checkpoint was taken, provided
+//! the program does not depend on state outside the platform, which
+//! is not saved:
+//!
+//! * the EEPROM, so a checkpoint can only be restored into a platform
+//!   that already has the same program loaded
+//! * the contents of the block device image file (which belongs to
+//!   the host, and is not rolled back)
+//! * semihosting open files, and a pending exit status
+//! * interrupt requests posted by an InterruptHandle but not yet
+//!   applied by the platform
+//! * settings: breakpoints, trace, the UART receiver depth and pacing
+//!   interval, and the mtime mode
+//!
+//! Checkpoints can be written to a file, so that they can be reused by
+//! a later run. All integers are little-endian. The file contains the
+//! bytes of MAGIC, a u32 version and a u32 number of checkpoints,
+//! followed by the checkpoints. Each checkpoint is: the pc (u32), x0
+//! to x31 (u32 each), the machine state (MACHINE_STATE_LEN u64
+//! values), the pending UART output (u32 length followed by the bytes),
+//! the non-zero bytes of RAM (a u32 count followed by (addr: u32,
+//! byte: u8) pairs in address order), the peripheral registers
+//! (DEVICE_STATE_LEN u32 values), and the UART receiver: the next
+//! arrival cycle (u64), the overrun and interrupt enable bits (bits 0
+//! and 1 of a u8), then the FIFO and the pending input (each a u32
+//! length followed by the bytes). Lengths are checked against the
+//! data remaining in the file as it is read, so a corrupt length is
+//! an error rather than a huge allocation.
+
+use std::collections::hash_map::DefaultHasher;
+use std::collections::BTreeMap;
+use std::fmt;
+use std::fs::File;
+use std::hash::{Hash, Hasher};
+use std::io::{self, BufReader, BufWriter, Read, Write};
+use std::path::Path;
+
+use thiserror::Error;
+
+use super::eei::Eei;
+use super::hooks::Hooks;
+use super::machine::{Machine, MACHINE_STATE_LEN, MACHINE_STATE_NAMES};
+use super::memory::{Wordsize, PAGE_SIZE};
+use super::uart::UartRxState;
+use super::Platform;
+
+pub const MAGIC: &[u8; 8] = b"RVCKPT\0\0";
+pub const VERSION: u32 = 3;
+
+/// Number of peripheral registers saved in a checkpoint
+pub const DEVICE_STATE_LEN: usize = 11;
+
+/// The names of the peripheral registers in Checkpoint::devices (the
+/// DMA controller registers, the block device registers and the
+/// external interrupt line)
+pub const DEVICE_STATE_NAMES: [&str; DEVICE_STATE_LEN] = [
+    "dmasrc",
+    "dmadst",
+    "dmalen",
+    "dmactrl",
+    "dmastat",
+    "blksector",
+    "blkcount",
+    "blkbuf",
+    "blkcmd",
+    "blkstat",
+    "extintctrl",
+];
+
+#[derive(Debug, Error)]
+pub enum CheckpointError {
+    #[error("Checkpoint file I/O error: {0}")]
+    IoError(String),
+    #[error("invalid checkpoint file: {0}")]
+    InvalidCheckpoint(String),
+}
+
+impl From<io::Error> for CheckpointError {
+    fn from(e: io::Error) -> Self {
+        if e.kind() == io::ErrorKind::UnexpectedEof {
+            invalid("unexpected end of file")
+        } else {
+            Self::IoError(e.to_string())
+        }
+    }
+}
+
+fn invalid(reason: &str) -> CheckpointError {
+    CheckpointError::InvalidCheckpoint(reason.to_string())
+}
+
+/// One way in which the states in two checkpoints differ. In each
+/// variant, the first value is from the first checkpoint.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum StateDifference {
+    Pc(u32, u32),
+    Reg {
+        index: u8,
+        values: (u32, u32),
+    },
+    /// A word of the machine state (see Machine::state)
+    Machine {
+        name: &'static str,
+        values: (u64, u64),
+    },
+    Memory {
+        addr: u32,
+        values: (u8, u8),
+    },
+    Uart(Vec<u8>, Vec<u8>),
+    /// A peripheral register (see DEVICE_STATE_NAMES)
+    Device {
+        name: &'static str,
+        values: (u32, u32),
+    },
+    UartRx(UartRxState, UartRxState),
+}
+
+impl fmt::Display for StateDifference {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Self::Pc(a, b) => write!(f, "pc: 0x{a:x} != 0x{b:x}"),
+            Self::Reg { index, values } => {
+                write!(f, "x{index}: 0x{:x} != 0x{:x}", values.0, values.1)
+            }
+            Self::Machine { name, values } => {
+                write!(f, "{name}: 0x{:x} != 0x{:x}", values.0, values.1)
+            }
+            Self::Memory { addr, values } => write!(
+                f,
+                "memory at 0x{addr:x}: 0x{:02x} != 0x{:02x}",
+                values.0, values.1
+            ),
+            Self::Uart(a, b) => write!(
+                f,
+                "uart: {:?} != {:?}",
+                String::from_utf8_lossy(a),
+                String::from_utf8_lossy(b)
+            ),
+            Self::Device { name, values } => {
+                write!(f, "{name}: 0x{:x} != 0x{:x}", values.0, values.1)
+            }
+            Self::UartRx(a, b) => write!(f, "uart rx: {a:?} != {b:?}"),
+        }
+    }
+}
+
+/// The state of a platform at a particular cycle
+#[derive(Debug, Clone)]
+pub struct Checkpoint {
+    pc: u32,
+    registers: [u32; 32],
+    machine: Machine,
+    /// Non-zero bytes of RAM, in address order
+    ram: Vec<(u32, u8)>,
+    uart_out: Vec<u8>,
+    /// The peripheral registers named in DEVICE_STATE_NAMES
+    devices: [u32; DEVICE_STATE_LEN],
+    uart_rx: UartRxState,
+}
+
+impl Checkpoint {
+    /// The value of mcycle when the checkpoint was taken
+    pub fn cycle(&self) -> u64 {
+        self.machine.mcycle()
+    }
+
+    pub fn pc(&self) -> u32 {
+        self.pc
+    }
+
+    /// A hash of the whole state, for quickly comparing states
+    pub fn state_hash(&self) -> u64 {
+        let mut hasher = DefaultHasher::new();
+        self.pc.hash(&mut hasher);
+        self.registers.hash(&mut hasher);
+        self.machine.state().hash(&mut hasher);
+        self.ram.hash(&mut hasher);
+        self.uart_out.hash(&mut hasher);
+        self.devices.hash(&mut hasher);
+        self.uart_rx.hash(&mut hasher);
+        hasher.finish()
+    }
+
+    /// List every difference between this state and another one
+    pub fn differences(&self, other: &Checkpoint) -> Vec<StateDifference> {
+        let mut differences = Vec::new();
+        if self.pc != other.pc {
+            differences.push(StateDifference::Pc(self.pc, other.pc));
+        }
+        for (index, values) in self
+            .registers
+            .iter()
+            .zip(other.registers.iter())
+            .enumerate()
+        {
+            if values.0 != values.1 {
+                differences.push(StateDifference::Reg {
+                    index: index.try_into().unwrap(),
+                    values: (*values.0, *values.1),
+                });
+            }
+        }
+        let states = (self.machine.state(), other.machine.state());
+        for (n, name) in MACHINE_STATE_NAMES.iter().enumerate() {
+            if states.0[n] != states.1[n] {
+                differences.push(StateDifference::Machine {
+                    name,
+                    values: (states.0[n], states.1[n]),
+                });
+            }
+        }
+
+        // Missing bytes are zero
+        let mut memory: BTreeMap<u32, (u8, u8)> = BTreeMap::new();
+        for (addr, byte) in self.ram.iter() {
+            memory.entry(*addr).or_default().0 = *byte;
+        }
+        for (addr, byte) in other.ram.iter() {
+            memory.entry(*addr).or_default().1 = *byte;
+        }
+        for (addr, values) in memory {
+            if values.0 != values.1 {
+                differences.push(StateDifference::Memory { addr, values });
+            }
+        }
+
+        if self.uart_out != other.uart_out {
+            differences.push(StateDifference::Uart(
+                self.uart_out.clone(),
+                other.uart_out.clone(),
+            ));
+        }
+        for (n, name) in DEVICE_STATE_NAMES.iter().enumerate() {
+            if self.devices[n] != other.devices[n] {
+                differences.push(StateDifference::Device {
+                    name,
+                    values: (self.devices[n], other.devices[n]),
+                });
+            }
+        }
+        if self.uart_rx != other.uart_rx {
+            differences.push(StateDifference::UartRx(
+                self.uart_rx.clone(),
+                other.uart_rx.clone(),
+            ));
+        }
+        differences
+    }
+
+    fn write<W: Write>(&self, writer: &mut W) -> Result<(), CheckpointError> {
+        writer.write_all(&self.pc.to_le_bytes())?;
+        for value in self.registers {
+            writer.write_all(&value.to_le_bytes())?;
+        }
+        for word in self.machine.state() {
+            writer.write_all(&word.to_le_bytes())?;
+        }
+        let uart_len = u32::try_from(self.uart_out.len())
+            .map_err(|_| invalid("UART output too long"))?;
+        writer.write_all(&uart_len.to_le_bytes())?;
+        writer.write_all(&self.uart_out)?;
+        let ram_len = u32::try_from(self.ram.len()).unwrap();
+        writer.write_all(&ram_len.to_le_bytes())?;
+        for (addr, byte) in self.ram.iter() {
+            writer.write_all(&addr.to_le_bytes())?;
+            writer.write_all(&[*byte])?;
+        }
+        for value in self.devices {
+            writer.write_all(&value.to_le_bytes())?;
+        }
+        let uart_rx = &self.uart_rx;
+        writer.write_all(&uart_rx.next_arrival.to_le_bytes())?;
+        let flags =
+            u8::from(uart_rx.overrun) | u8::from(uart_rx.interrupt_enable) << 1;
+        writer.write_all(&[flags])?;
+        for bytes in [&uart_rx.fifo, &uart_rx.pending] {
+            let len = u32::try_from(bytes.len())
+                .map_err(|_| invalid("UART input too long"))?;
+            writer.write_all(&len.to_le_bytes())?;
+            writer.write_all(bytes)?;
+        }
+        Ok(())
+    }
+
+    fn read<R: Read>(reader: &mut R) -> Result<Self, CheckpointError> {
+        let pc = read_u32(reader)?;
+        let mut registers = [0; 32];
+        for value in registers.iter_mut() {
+            *value = read_u32(reader)?;
+        }
+        let mut state = [0; MACHINE_STATE_LEN];
+        for word in state.iter_mut() {
+            *word = read_u64(reader)?;
+        }
+        let machine = Machine::from_state(&state)
+            .ok_or_else(|| invalid("invalid machine state"))?;
+        let uart_out = read_bytes(reader)?;
+        let ram_len = read_u32(reader)?;
+        let mut ram = Vec::new();
+        for _ in 0..ram_len {
+            let addr = read_u32(reader)?;
+            let mut byte = [0; 1];
+            reader.read_exact(&mut byte)?;
+            ram.push((addr, byte[0]));
+        }
+        let mut devices = [0; DEVICE_STATE_LEN];
+        for value in devices.iter_mut() {
+            *value = read_u32(reader)?;
+        }
+        let next_arrival = read_u64(reader)?;
+        let mut flags = [0; 1];
+        reader.read_exact(&mut flags)?;
+        let uart_rx = UartRxState {
+            fifo: read_bytes(reader)?,
+            pending: read_bytes(reader)?,
+            next_arrival,
+            overrun: flags[0] & 1 != 0,
+            interrupt_enable: flags[0] & 2 != 0,
+        };
+        Ok(Self {
+            pc,
+            registers,
+            machine,
+            ram,
+            uart_out,
+            devices,
+            uart_rx,
+        })
+    }
+}
+
+fn read_u32<R: Read>(reader: &mut R) -> Result<u32, CheckpointError> {
+    let mut buf = [0; 4];
+    reader.read_exact(&mut buf)?;
+    Ok(u32::from_le_bytes(buf))
+}
+
+/// Read a u32 length followed by that many bytes. The buffer only
+/// grows as the bytes are read, so a corrupt length cannot cause a
+/// large allocation.
+fn read_bytes<R: Read>(reader: &mut R) -> Result<Vec<u8>, CheckpointError> {
+    let len = read_u32(reader)?;
+    let mut bytes = Vec::new();
+    reader.take(len.into()).read_to_end(&mut bytes)?;
+    if bytes.len() != usize::try_from(len).unwrap() {
+        return Err(invalid("unexpected end of file"));
+    }
+    Ok(bytes)
+}
+
+fn read_u64<R: Read>(reader: &mut R) -> Result<u64, CheckpointError> {
+    let mut buf = [0; 8];
+    reader.read_exact(&mut buf)?;
+    Ok(u64::from_le_bytes(buf))
+}
+
+/// Write a list of checkpoints to a file
+pub fn write_checkpoint_file<P: AsRef<Path>>(
+    path: P,
+    checkpoints: &[Checkpoint],
+) -> Result<(), CheckpointError> {
+    let mut writer = BufWriter::new(File::create(path)?);
+    writer.write_all(MAGIC)?;
+    writer.write_all(&VERSION.to_le_bytes())?;
+    let count = u32::try_from(checkpoints.len()).unwrap();
+    writer.write_all(&count.to_le_bytes())?;
+    for checkpoint in checkpoints {
+        checkpoint.write(&mut writer)?;
+    }
+    writer.flush()?;
+    Ok(())
+}
+
+/// Read a list of checkpoints written by write_checkpoint_file
+pub fn read_checkpoint_file<P: AsRef<Path>>(
+    path: P,
+) -> Result<Vec<Checkpoint>, CheckpointError> {
+    let mut reader = BufReader::new(File::open(path)?);
+    let mut magic = [0; MAGIC.len()];
+    reader.read_exact(&mut magic)?;
+    if &magic != MAGIC {
+        return Err(invalid("missing magic bytes"));
+    }
+    if read_u32(&mut reader)? != VERSION {
+        return Err(invalid("unsupported version"));
+    }
+    let count = read_u32(&mut reader)?;
+    (0..count).map(|_| Checkpoint::read(&mut reader)).collect()
+}
+
+impl<H: Hooks> Platform<H> {
+    /// Take a checkpoint of the current state
+    pub fn checkpoint(&self) -> Checkpoint {
+        let uart_out = self.uart_out.iter().copied().collect();
+
+        let mut ram: Vec<(u32, u8)> = self
+            .memory
+            .nonzero_bytes()
+            .map(|(addr, byte)| {
+                (addr.try_into().expect("address should be 32-bit"), byte)
+            })
+            .filter(|(addr, _)| !self.pma_checker.in_eeprom(*addr, 1))
+            .collect();
+        ram.sort_unstable();
+        self.checkpoint_with(ram, uart_out)
+    }
+
+    /// A checkpoint holding only part of the state: RAM is limited to
+    /// the given pages (see Platform::take_dirty_pages), which must be
+    /// sorted, and the UART output is left out. Only useful for
+    /// comparing with another partial checkpoint of the same pages.
+    pub fn partial_checkpoint(&self, pages: &[u64]) -> Checkpoint {
+        let mut ram = Vec::new();
+        for page in pages {
+            let base = page * PAGE_SIZE as u64;
+            let bytes = self.memory.page(*page);
+            for (addr, byte) in (base..).zip(bytes.iter().copied()) {
+                let addr = addr.try_into().expect("address should be 32-bit");
+                if byte != 0 && !self.pma_checker.in_eeprom(addr, 1) {
+                    ram.push((addr, byte));
+                }
+            }
+        }
+        self.checkpoint_with(ram, Vec::new())
+    }
+
+    fn checkpoint_with(
+        &self,
+        ram: Vec<(u32, u8)>,
+        uart_out: Vec<u8>,
+    ) -> Checkpoint {
+        // In wall-clock mode, save mtime as it is now
+        let mut machine = self.machine_interface.machine.clone();
+        machine.trap_ctrl.set_mtime_frequency(None);
+        Checkpoint {
+            pc: self.pc(),
+            registers: std::array::from_fn(|n| self.x(n.try_into().unwrap())),
+            machine,
+            ram,
+            uart_out,
+            devices: self.device_state(),
+            uart_rx: self.uart_rx.borrow().state(),
+        }
+    }
+
+    /// Restore the state saved in a checkpoint. The EEPROM (and so the
+    /// block cache) is left unchanged.
+    pub fn restore(&mut self, checkpoint: &Checkpoint) {
+        self.set_pc(checkpoint.pc);
+        for (n, value) in checkpoint.registers.iter().enumerate() {
+            self.set_x(n.try_into().unwrap(), *value);
+        }
+        // Keep the current mtime mode, continuing from the saved mtime
+        let frequency =
+            self.machine_interface.machine.trap_ctrl.mtime_frequency();
+        self.machine_interface.machine = checkpoint.machine.clone();
+        self.machine_interface
+            .machine
+            .trap_ctrl
+            .set_mtime_frequency(frequency);
+
+        let pma_checker = &self.pma_checker;
+        self.memory
+            .retain(|addr| pma_checker.in_eeprom(addr.try_into().unwrap(), 1));
+        for (addr, byte) in checkpoint.ram.iter() {
+            self.memory
+                .write((*addr).into(), (*byte).into(), Wordsize::Byte)
+                .expect("should work, address is 32-bit");
+        }
+
+        self.uart_out.clear();
+        self.uart_out.extend(&checkpoint.uart_out);
+
+        self.restore_device_state(&checkpoint.devices);
+        let mcycle = self.mcycle();
+        self.uart_rx.get_mut().restore(&checkpoint.uart_rx, mcycle);
+        // The saved mip.MEIP reflects the peripherals when the
+        // checkpoint was taken; make it agree with the restored ones
+        self.update_external_interrupt();
+        self.watchpoint_hit.set(None);
+    }
+
+    /// The peripheral registers, in the order of DEVICE_STATE_NAMES
+    fn device_state(&self) -> [u32; DEVICE_STATE_LEN] {
+        let dma = &self.dma;
+        let block_device = &self.block_device;
+        [
+            dma.src,
+            dma.dst,
+            dma.len,
+            dma.ctrl,
+            dma.status,
+            block_device.sector,
+            block_device.count,
+            block_device.buf,
+            block_device.cmd,
+            block_device.status,
+            self.external_line.into(),
+        ]
+    }
+
+    /// Restore the peripheral registers saved using device_state()
+    fn restore_device_state(&mut self, devices: &[u32; DEVICE_STATE_LEN]) {
+        let dma = &mut self.dma;
+        dma.src = devices[0];
+        dma.dst = devices[1];
+        dma.len = devices[2];
+        dma.ctrl = devices[3];
+        dma.status = devices[4];
+        let block_device = &mut self.block_device;
+        block_device.sector = devices[5];
+        block_device.count = devices[6];
+        block_device.buf = devices[7];
+        block_device.cmd = devices[8];
+        block_device.status = devices[9];
+        self.external_line = devices[10] != 0;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use std::path::PathBuf;
+
+    use super::*;
+    use crate::platform::csr::CSR_MIP;
+    use crate::platform::machine::MIP_MEIP;
+    use crate::platform::pma::{DMALEN_ADDR, UARTRX_ADDR, UARTSTAT_ADDR};
+    use crate::platform::uart::UARTSTAT_RX_INTERRUPT_ENABLE;
+    use crate::trace_file::load_trace;
+
+    /// Restoring a checkpoint (including one read back from a file)
+    /// and running gives the same state as running straight through
+    #[test]
+    fn check_restore_matches_run() {
+        let mut d = PathBuf::from(env!("CARGO_MANIFEST_DIR"));
+        d.push("test_traces/hello.trace");
+        let path = d.into_os_string().into_string().unwrap();
+
+        let mut platform = Platform::new();
+        load_trace(&mut platform, path.clone()).unwrap();
+        platform.run(500).unwrap();
+        let checkpoint = platform.checkpoint();
+        platform.run(1500).unwrap();
+        let expected = platform.checkpoint();
+
+        let mut file = std::env::temp_dir();
+        file.push(format!("riscvemu-checkpoint-{}", std::process::id()));
+        write_checkpoint_file(&file, &[checkpoint]).unwrap();
+        let checkpoints = read_checkpoint_file(&file).unwrap();
+        std::fs::remove_file(&file).unwrap();
+
+        let mut platform = Platform::new();
+        load_trace(&mut platform, path).unwrap();
+        platform.run(100).unwrap();
+        platform.restore(&checkpoints[0]);
+        assert_eq!(platform.mcycle(), 500);
+        platform.run(1500).unwrap();
+        let found = platform.checkpoint();
+
+        assert_eq!(found.pc, expected.pc);
+        assert_eq!(found.registers, expected.registers);
+        assert_eq!(found.machine.state(), expected.machine.state());
+        assert_eq!(found.ram, expected.ram);
+        assert_eq!(found.uart_out, expected.uart_out);
+        assert_eq!(found.devices, expected.devices);
+        assert_eq!(found.uart_rx, expected.uart_rx);
+    }
+
+    /// The peripheral registers and UART input are restored, and
+    /// mip.MEIP follows the restored peripherals
+    #[test]
+    fn check_restore_peripherals() {
+        let meip = |platform: &Platform| {
+            platform.read_csr(CSR_MIP).unwrap() & (1 << MIP_MEIP) != 0
+        };
+        let mut platform = Platform::new();
+        let enable = UARTSTAT_RX_INTERRUPT_ENABLE;
+        platform
+            .store(UARTSTAT_ADDR, enable, Wordsize::Word)
+            .unwrap();
+        platform.send_uart_input(b"ab");
+        platform.store(DMALEN_ADDR, 12, Wordsize::Word).unwrap();
+
+        let mut file = std::env::temp_dir();
+        file.push(format!("riscvemu-devices-{}", std::process::id()));
+        write_checkpoint_file(&file, &[platform.checkpoint()]).unwrap();
+        let checkpoints = read_checkpoint_file(&file).unwrap();
+        std::fs::remove_file(&file).unwrap();
+
+        let mut restored = Platform::new();
+        let reset = restored.checkpoint();
+        restored.restore(&checkpoints[0]);
+        assert!(meip(&restored));
+        assert_eq!(restored.load(DMALEN_ADDR, Wordsize::Word).unwrap(), 12);
+        let read = restored.load(UARTRX_ADDR, Wordsize::Word).unwrap();
+        assert_eq!(read, u32::from(b'a'));
+        assert_eq!(restored.uart_input_unread(), 1);
+
+        restored.restore(&reset);
+        assert!(!meip(&restored));
+        assert_eq!(restored.uart_input_unread(), 0);
+    }
+
+    /// A length in a checkpoint file that is longer than the rest of
+    /// the file is an error
+    #[test]
+    fn check_corrupt_length() {
+        let mut platform = Platform::new();
+        platform.push_uartout(b"\xffhi");
+        let mut file = std::env::temp_dir();
+        file.push(format!("riscvemu-corrupt-{}", std::process::id()));
+        write_checkpoint_file(&file, &[platform.checkpoint()]).unwrap();
+        let checkpoints = read_checkpoint_file(&file).unwrap();
+        assert_eq!(checkpoints[0].uart_out, b"\xffhi");
+
+        // The UART output length follows the header, pc, registers and
+        // machine state
+        let mut bytes = std::fs::read(&file).unwrap();
+        let offset = MAGIC.len() + 8 + 4 * 33 + 8 * MACHINE_STATE_LEN;
+        assert_eq!(bytes[offset..offset + 4], 3u32.to_le_bytes());
+        bytes[offset..offset + 4].copy_from_slice(&u32::MAX.to_le_bytes());
+        std::fs::write(&file, &bytes).unwrap();
+        let result = read_checkpoint_file(&file);
+        std::fs::remove_file(&file).unwrap();
+        assert!(matches!(result, Err(CheckpointError::InvalidCheckpoint(_))));
+    }
+}
@@ -0,0 +1,254 @@
+//! Guest code coverage
+//!
+//! When coverage is enabled, the platform sets a bit in a bitmap over
+//! the EEPROM (one bit per word) for each instruction it executes,
+//! whether by single steps or from the block cache. Setting the bit is
+//! a bounds check and an or, so unlike single-step tracing, coverage is
+//! cheap enough to leave on for whole test runs. The bitmap records
+//! whether an instruction was executed, not how many times.
+//!
+//! The bitmap is exported in the lcov tracefile format (read by genhtml
+//! and most coverage tools). Where the program has DWARF line number
+//! information, each instruction counts towards its source line, and a
+//! line is hit if any of its instructions was executed. Instructions
+//! without line information (for example, assembly, or a program built
+//! without -g) are reported one per line in a file named after the
+//! program, with line n standing for the instruction at address
+//! 4 * (n - 1). A function is hit if its first instruction was
+//! executed. Every count in the output is 0 or 1.
+
+use std::collections::BTreeMap;
+use std::io::{self, Write};
+
+use crate::elf_utils::{LineTable, SymbolRange};
+
+/// Bitmap of the EEPROM words from which instructions were executed
+#[derive(Debug, Clone)]
+pub struct Coverage {
+    /// Bit n % 64 of bits[n / 64] is set if the word at address 4n was
+    /// executed
+    bits: Vec<u64>,
+    eeprom_size: u32,
+}
+
+/// The functions and lines of one source file in the lcov output
+#[derive(Default)]
+struct FileCoverage<'a> {
+    /// Line, name and whether the function was called
+    functions: Vec<(u32, &'a str, bool)>,
+    /// Whether each line was executed
+    lines: BTreeMap<u32, bool>,
+}
+
+impl Coverage {
+    /// Create an empty bitmap over an EEPROM of eeprom_size bytes
+    pub fn new(eeprom_size: u32) -> Self {
+        let words = usize::try_from(eeprom_size / 4).unwrap();
+        Self {
+            bits: vec![0; words.div_ceil(64)],
+            eeprom_size,
+        }
+    }
+
+    /// Record that the instruction at pc was executed (pcs outside the
+    /// EEPROM are ignored)
+    #[inline(always)]
+    pub fn mark(&mut self, pc: u32) {
+        let word = (pc / 4) as usize;
+        if let Some(bits) = self.bits.get_mut(word / 64) {
+            *bits |= 1 << (word % 64);
+        }
+    }
+
+    /// True if the instruction at addr was executed
+    pub fn is_executed(&self, addr: u32) -> bool {
+        let word = (addr / 4) as usize;
+        self.bits
+            .get(word / 64)
+            .is_some_and(|bits| bits & (1 << (word % 64)) != 0)
+    }
+
+    /// The number of distinct instructions executed
+    pub fn executed_count(&self) -> u32 {
+        self.bits.iter().map(|bits| bits.count_ones()).sum()
+    }
+
+    /// Forget all executed instructions
+    pub fn clear(&mut self) {
+        self.bits.fill(0);
+    }
+
+    /// The addresses of the executed instructions, in order
+    fn executed(&self) -> impl Iterator<Item = u32> + '_ {
+        self.bits.iter().enumerate().flat_map(|(n, bits)| {
+            (0..64)
+                .filter(move |bit| bits & (1 << bit) != 0)
+                .map(move |bit| u32::try_from(4 * (64 * n + bit)).unwrap())
+        })
+    }
+
+    /// The addresses of the instructions in [start, end) that are in
+    /// the EEPROM
+    fn instructions(&self, start: u32, end: u32) -> impl Iterator<Item = u32> {
+        let end = end.min(self.eeprom_size);
+        (start.next_multiple_of(4)..end).step_by(4)
+    }
+
+    /// Write the coverage in lcov format. program names the file that
+    /// instructions without line information are reported in. functions
+    /// are the address ranges of the program's functions (other symbols
+    /// should not be included), and lines is the program's DWARF line
+    /// information, if it has any.
+    pub fn write_lcov(
+        &self,
+        out: &mut impl Write,
+        program: &str,
+        functions: &[SymbolRange],
+        lines: Option<&LineTable>,
+    ) -> io::Result<()> {
+        let locate = |addr: u32| {
+            lines
+                .and_then(|lines| {
+                    let range = lines.lookup(addr)?;
+                    Some((lines.file(range.file), range.line))
+                })
+                .unwrap_or((program, addr / 4 + 1))
+        };
+
+        // Every instruction in a function or with line information is
+        // reported, executed or not, as is every executed instruction
+        let mut files: BTreeMap<&str, FileCoverage> = BTreeMap::new();
+        let line_ranges = lines.map_or(&[][..], |lines| lines.ranges());
+        let instructions = functions
+            .iter()
+            .map(|function| (function.start, function.end))
+            .chain(line_ranges.iter().map(|range| (range.start, range.end)))
+            .flat_map(|(start, end)| self.instructions(start, end))
+            .chain(self.executed());
+        for addr in instructions {
+            let (file, line) = locate(addr);
+            let file = files.entry(file).or_default();
+            *file.lines.entry(line).or_default() |= self.is_executed(addr);
+        }
+        for function in functions {
+            if function.start >= self.eeprom_size {
+                continue;
+            }
+            let (file, line) = locate(function.start);
+            let called = self.is_executed(function.start);
+            files.entry(file).or_default().functions.push((
+                line,
+                &function.name,
+                called,
+            ));
+        }
+
+        for (name, file) in files.iter() {
+            writeln!(out, "TN:")?;
+            writeln!(out, "SF:{name}")?;
+            for (line, function, _) in file.functions.iter() {
+                writeln!(out, "FN:{line},{function}")?;
+            }
+            for (_, function, called) in file.functions.iter() {
+                writeln!(out, "FNDA:{},{function}", u32::from(*called))?;
+            }
+            let called = file.functions.iter().filter(|f| f.2).count();
+            writeln!(out, "FNF:{}", file.functions.len())?;
+            writeln!(out, "FNH:{called}")?;
+            for (line, executed) in file.lines.iter() {
+                writeln!(out, "DA:{line},{}", u32::from(*executed))?;
+            }
+            let executed = file.lines.values().filter(|hit| **hit).count();
+            writeln!(out, "LF:{}", file.lines.len())?;
+            writeln!(out, "LH:{executed}")?;
+            writeln!(out, "end_of_record")?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::elf_utils::LineRange;
+    use crate::platform::builder::PlatformBuilder;
+    use crate::platform::eei::Eei;
+
+    #[test]
+    fn check_coverage_bitmap() {
+        let mut coverage = Coverage::new(0x100);
+        coverage.mark(0x0);
+        coverage.mark(0x8);
+        coverage.mark(0xfc);
+        coverage.mark(0x100);
+        assert!(coverage.is_executed(0x8));
+        assert!(!coverage.is_executed(0x4));
+        assert!(!coverage.is_executed(0x100));
+        assert_eq!(coverage.executed_count(), 3);
+        assert_eq!(coverage.executed().collect::<Vec<_>>(), [0, 8, 0xfc]);
+        coverage.clear();
+        assert_eq!(coverage.executed_count(), 0);
+    }
+
+    #[test]
+    fn check_platform_records_coverage() {
+        let image = [
+            0x93, 0x00, 0x10, 0x00, // addi x1, x0, 1
+            0x63, 0x94, 0x00, 0x00, // bne x1, x0, 8
+            0x13, 0x01, 0x20, 0x00, // addi x2, x0, 2
+            0x6f, 0x00, 0x00, 0x00, // jal x0, 0
+        ];
+        let mut platform =
+            PlatformBuilder::default().image(&image).build().unwrap();
+        platform.run(10).unwrap();
+        assert!(platform.coverage().is_none());
+
+        platform.set_pc(0);
+        platform.enable_coverage();
+        platform.run(10).unwrap();
+        let coverage = platform.coverage().unwrap();
+        assert_eq!(coverage.executed().collect::<Vec<_>>(), [0, 4, 0xc]);
+    }
+
+    #[test]
+    fn check_lcov_output() {
+        let mut coverage = Coverage::new(0x100);
+        for pc in [0x0, 0x4, 0xc] {
+            coverage.mark(pc);
+        }
+        let functions = [
+            SymbolRange {
+                name: "main".to_string(),
+                start: 0x0,
+                end: 0x10,
+            },
+            SymbolRange {
+                name: "unused".to_string(),
+                start: 0x10,
+                end: 0x18,
+            },
+        ];
+        let line = |start, end, line| LineRange {
+            start,
+            end,
+            file: 0,
+            line,
+        };
+        let lines = LineTable::new(
+            vec!["main.c".to_string()],
+            vec![line(0x8, 0xc, 4), line(0x0, 0x8, 3)],
+        );
+
+        let mut out = Vec::new();
+        coverage
+            .write_lcov(&mut out, "prog.elf", &functions, Some(&lines))
+            .unwrap();
+        let expected = "\
+            TN:\nSF:main.c\nFN:3,main\nFNDA:1,main\nFNF:1\nFNH:1\n\
+            DA:3,1\nDA:4,0\nLF:2\nLH:1\nend_of_record\n\
+            TN:\nSF:prog.elf\nFN:5,unused\nFNDA:0,unused\nFNF:1\nFNH:0\n\
+            DA:4,1\nDA:5,0\nDA:6,0\nLF:3\nLH:1\nend_of_record\n";
+        assert_eq!(String::from_utf8(out).unwrap(), expected);
+    }
+}
@@ -0,0 +1,279 @@
+//! DMA controller
+//!
+//! The DMA controller copies a block of bytes without the program
+//! having to execute a load and store for each one. It is programmed
+//! through memory-mapped registers in the I/O region:
+//!
+//! | Address | Description |
+//! |---------|-------------|
+//! | 0x1000_0024 | dmasrc (source address) |
+//! | 0x1000_0028 | dmadst (destination address) |
+//! | 0x1000_002c | dmalen (number of bytes to copy) |
+//! | 0x1000_0030 | dmactrl (control, see below) |
+//! | 0x1000_0034 | dmastat (status, see below) |
+//!
+//! The fields of dmactrl are:
+//!
+//! | Bits | Description |
+//! |------|-------------|
+//! | 0 | Start: writing 1 performs the transfer (reads as 0) |
+//! | 1 | Fixed source: read every byte from the I/O register at dmasrc |
+//! | 2 | Fixed destination: write every byte to the I/O register at dmadst |
+//! | 3 | Completion interrupt enable |
+//!
+//! The fields of dmastat are (write 1 to a bit to clear it):
+//!
+//! | Bits | Description |
+//! |------|-------------|
+//! | 0 | Done: the last transfer has finished |
+//! | 1 | Error: the last transfer accessed an invalid address, and stopped there |
+//!
+//! A transfer is performed entirely when the start bit is written, so
+//! the controller is never seen busy: done is already set when the
+//! store to dmactrl completes. While done is set and the completion
+//! interrupt is enabled, the controller raises the machine external
+//! interrupt (mip.MEIP).
+//!
+//! A memory-to-memory copy (neither address fixed) is done directly
+//! between the pages of the memory store (see the memory module), a
+//! page slice at a time. Overlapping ranges give the same result as
+//! copying through a temporary buffer (like memmove). The source
+//! range must lie in EEPROM or RAM, and the destination range in RAM;
+//! otherwise nothing is copied and the error bit is set. With a fixed source or
+//! destination (for example, to read the UART receiver, or write to
+//! the UART transmitter), each byte is transferred with a word access
+//! to the I/O register (using its low byte) and a byte access to
+//! memory. A fixed address cannot be one of the DMA registers.
+//!
+//! DMA accesses trigger watchpoints like the program's own loads and
+//! stores. The controller registers are saved in a checkpoint.
+
+use super::eei::Eei;
+use super::hooks::Hooks;
+use super::memory::Wordsize;
+use super::pma::{DMASRC_ADDR, DMASTAT_ADDR};
+use super::Platform;
+
+/// dmactrl: start the transfer
+pub const DMACTRL_START: u32 = 1 << 0;
+/// dmactrl: fixed source address
+pub const DMACTRL_SRC_FIXED: u32 = 1 << 1;
+/// dmactrl: fixed destination address
+pub const DMACTRL_DST_FIXED: u32 = 1 << 2;
+/// dmactrl: completion interrupt enable
+pub const DMACTRL_INTERRUPT_ENABLE: u32 = 1 << 3;
+
+/// dmastat: transfer done
+pub const DMASTAT_DONE: u32 = 1 << 0;
+/// dmastat: transfer error
+pub const DMASTAT_ERROR: u32 = 1 << 1;
+
+/// The DMA controller registers
+#[derive(Debug, Default, Clone)]
+pub struct Dma {
+    pub src: u32,
+    pub dst: u32,
+    pub len: u32,
+    /// The dmactrl register, without the start bit
+    pub ctrl: u32,
+    pub status: u32,
+}
+
+impl Dma {
+    /// True if the controller is raising the external interrupt
+    pub fn interrupt_level(&self) -> bool {
+        self.ctrl & DMACTRL_INTERRUPT_ENABLE != 0
+            && self.status & DMASTAT_DONE != 0
+    }
+}
+
+impl<H: Hooks> Platform<H> {
+    /// Write the dmactrl register, performing the transfer if the
+    /// start bit is set
+    pub(super) fn write_dma_ctrl(&mut self, value: u32) {
+        self.dma.ctrl = value & !DMACTRL_START;
+        if value & DMACTRL_START != 0 {
+            let ok = self.dma_transfer();
+            self.dma.status = if ok {
+                DMASTAT_DONE
+            } else {
+                DMASTAT_DONE | DMASTAT_ERROR
+            };
+        }
+        self.update_external_interrupt();
+    }
+
+    /// Write the dmastat register (clearing the bits set in value)
+    pub(super) fn write_dma_status(&mut self, value: u32) {
+        self.dma.status &= !value;
+        self.update_external_interrupt();
+    }
+
+    /// Perform the transfer described by the DMA registers. Returns
+    /// false if it stopped at an invalid access.
+    fn dma_transfer(&mut self) -> bool {
+        let Dma {
+            src,
+            dst,
+            len,
+            ctrl,
+            ..
+        } = self.dma;
+        let src_fixed = ctrl & DMACTRL_SRC_FIXED != 0;
+        let dst_fixed = ctrl & DMACTRL_DST_FIXED != 0;
+        if !src_fixed && !dst_fixed {
+            return self.dma_copy(src, dst, len);
+        }
+        let is_dma_register = |addr| {
+            self.pma_checker
+                .io_register(addr)
+                .is_some_and(|reg| (DMASRC_ADDR..=DMASTAT_ADDR).contains(&reg))
+        };
+        if (src_fixed && is_dma_register(src))
+            || (dst_fixed && is_dma_register(dst))
+        {
+            return false;
+        }
+
+        for n in 0..len {
+            let byte = if src_fixed {
+                self.load(src, Wordsize::Word).map(|word| word & 0xff)
+            } else {
+                self.load(src.wrapping_add(n), Wordsize::Byte)
+            };
+            let Ok(byte) = byte else {
+                return false;
+            };
+            let stored = if dst_fixed {
+                self.store(dst, byte, Wordsize::Word)
+            } else {
+                self.store(dst.wrapping_add(n), byte, Wordsize::Byte)
+            };
+            if stored.is_err() {
+                return false;
+            }
+        }
+        true
+    }
+
+    /// Copy len bytes from src to dst in memory, a page at a time.
+    /// Returns false (without copying anything) if either range is
+    /// invalid.
+    fn dma_copy(&mut self, src: u32, dst: u32, len: u32) -> bool {
+        if len == 0 {
+            return true;
+        }
+        let pma = &self.pma_checker;
+        let src_valid = pma.in_eeprom(src, len) || pma.in_main_memory(src, len);
+        if !src_valid || !pma.in_main_memory(dst, len) {
+            return false;
+        }
+
+        self.check_watchpoints(src, len, false);
+        self.check_watchpoints(dst, len, true);
+        self.memory.copy(src.into(), dst.into(), len.into());
+        true
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::platform::csr::CSR_MIP;
+    use crate::platform::machine::MIP_MEIP;
+    use crate::platform::pma::{
+        DMACTRL_ADDR, DMADST_ADDR, DMALEN_ADDR, UARTTX_ADDR,
+    };
+
+    const RAM: u32 = 0x2000_0000;
+
+    fn write_ram(platform: &mut Platform, addr: u32, bytes: &[u8]) {
+        for (n, byte) in (0..).zip(bytes) {
+            platform
+                .store(addr + n, (*byte).into(), Wordsize::Byte)
+                .unwrap();
+        }
+    }
+
+    fn read_ram(platform: &Platform, addr: u32, len: u32) -> Vec<u8> {
+        (0..len)
+            .map(|n| platform.load(addr + n, Wordsize::Byte).unwrap())
+            .map(|byte| u8::try_from(byte).unwrap())
+            .collect()
+    }
+
+    fn start(platform: &mut Platform, src: u32, dst: u32, len: u32, ctrl: u32) {
+        let registers = [
+            (DMASRC_ADDR, src),
+            (DMADST_ADDR, dst),
+            (DMALEN_ADDR, len),
+            (DMACTRL_ADDR, ctrl | DMACTRL_START),
+        ];
+        for (addr, value) in registers {
+            platform.store(addr, value, Wordsize::Word).unwrap();
+        }
+    }
+
+    fn status(platform: &Platform) -> u32 {
+        platform.load(DMASTAT_ADDR, Wordsize::Word).unwrap()
+    }
+
+    #[test]
+    fn check_memory_copy() {
+        let mut platform = Platform::new();
+        write_ram(&mut platform, RAM, b"abcdef");
+        start(&mut platform, RAM, RAM + 0x100, 6, 0);
+        assert_eq!(status(&platform), DMASTAT_DONE);
+        assert_eq!(read_ram(&platform, RAM + 0x100, 6), b"abcdef");
+
+        // Overlapping ranges are copied like memmove
+        start(&mut platform, RAM, RAM + 2, 6, 0);
+        assert_eq!(read_ram(&platform, RAM, 8), b"ababcdef");
+
+        // The destination cannot be the EEPROM
+        start(&mut platform, RAM, 0x100, 6, 0);
+        assert_eq!(status(&platform), DMASTAT_DONE | DMASTAT_ERROR);
+        assert_eq!(read_ram(&platform, 0x100, 6), [0; 6]);
+        platform.store(DMASTAT_ADDR, 0xff, Wordsize::Word).unwrap();
+        assert_eq!(status(&platform), 0);
+    }
+
+    #[test]
+    fn check_fixed_destination() {
+        let mut platform = Platform::new();
+        write_ram(&mut platform, RAM, b"hello");
+        start(&mut platform, RAM, UARTTX_ADDR, 5, DMACTRL_DST_FIXED);
+        assert_eq!(status(&platform), DMASTAT_DONE);
+        assert_eq!(platform.flush_uartout(), "hello");
+
+        start(&mut platform, RAM, DMACTRL_ADDR, 5, DMACTRL_DST_FIXED);
+        assert_eq!(status(&platform), DMASTAT_DONE | DMASTAT_ERROR);
+    }
+
+    /// A fixed source that is write-only (the UART transmitter)
+    /// reads as zero
+    #[test]
+    fn check_fixed_source() {
+        let mut platform = Platform::new();
+        write_ram(&mut platform, RAM, b"abcd");
+        start(&mut platform, UARTTX_ADDR, RAM, 4, DMACTRL_SRC_FIXED);
+        assert_eq!(status(&platform), DMASTAT_DONE);
+        assert_eq!(read_ram(&platform, RAM, 4), [0; 4]);
+
+        start(&mut platform, DMALEN_ADDR, RAM, 4, DMACTRL_SRC_FIXED);
+        assert_eq!(status(&platform), DMASTAT_DONE | DMASTAT_ERROR);
+    }
+
+    #[test]
+    fn check_completion_interrupt() {
+        let mut platform = Platform::new();
+        let meip = 1 << MIP_MEIP;
+        start(&mut platform, RAM, RAM + 4, 4, DMACTRL_INTERRUPT_ENABLE);
+        assert_ne!(platform.read_csr(CSR_MIP).unwrap() & meip, 0);
+        platform
+            .store(DMASTAT_ADDR, DMASTAT_DONE, Wordsize::Word)
+            .unwrap();
+        assert_eq!(platform.read_csr(CSR_MIP).unwrap() & meip, 0);
+    }
+}
@@ -85,4 +85,10 @@ pub trait Eei {
 
     /// Return from trap
     fn mret(&mut self);
+
+    /// Execute an ebreak instruction at the current pc. This raises
+    /// the breakpoint exception, unless the environment handles the
+    /// ebreak itself (for example, as a semihosting call), in which
+    /// case it is also responsible for incrementing the pc.
+    fn ebreak(&mut self) -> Result<(), Exception>;
 }
@@ -0,0 +1,132 @@
+//! Instrumentation hooks
+//!
+//! A platform can be given a Hooks implementation, whose callbacks are
+//! called as the program runs: for each instruction fetched and
+//! retired, each load and store, each trap, and each CSR access. This
+//! lets tools such as profilers, coverage collectors or cache models
+//! observe execution without changes to the execution loop:
+//!
+//! ```
+//! use riscvemu::platform::hooks::Hooks;
+//! use riscvemu::platform::Platform;
+//!
+//! #[derive(Default)]
+//! struct CountLoads {
+//!     loads: u64,
+//! }
+//!
+//! impl Hooks for CountLoads {
+//!     fn on_load(&mut self, _addr: u32, _width: u32, _value: u32) {
+//!         self.loads += 1;
+//!     }
+//! }
+//!
+//! let mut platform = Platform::with_hooks(CountLoads::default());
+//! platform.run(1000).unwrap();
+//! println!("{} loads", platform.hooks().loads);
+//! ```
+//!
+//! The hooks are a type parameter of the platform, so calls to them
+//! are static (and can be inlined). The default, NoHooks, sets ENABLED
+//! to false, which removes every hook call (and the work of preparing
+//! its arguments) at compile time, so a platform without hooks runs
+//! exactly as fast as before.
+//!
+//! Hooks cannot access the platform from inside a callback. They are
+//! called for instructions run from the block cache in the same way as
+//! for single steps.
+
+/// Callbacks for observing execution. All of the callbacks do nothing
+/// by default, so implementations only need to define the ones they
+/// use.
+pub trait Hooks {
+    /// If false, the platform never calls the hooks
+    const ENABLED: bool = true;
+
+    /// Called before the instruction instr at pc is executed
+    fn on_fetch(&mut self, _pc: u32, _instr: u32) {}
+
+    /// Called after the instruction instr at pc has completed without
+    /// an exception
+    fn on_retire(&mut self, _pc: u32, _instr: u32) {}
+
+    /// Called after a successful load of width bytes from addr
+    /// (including memory-mapped registers)
+    fn on_load(&mut self, _addr: u32, _width: u32, _value: u32) {}
+
+    /// Called after a successful store of width bytes to addr
+    /// (including memory-mapped registers)
+    fn on_store(&mut self, _addr: u32, _width: u32, _value: u32) {}
+
+    /// Called when a trap is taken at pc (the address stored in mepc),
+    /// with the value written to mcause
+    fn on_trap(&mut self, _pc: u32, _mcause: u32) {}
+
+    /// Called after a successful read (or write, if is_write) of value
+    /// from (or to) the CSR at addr
+    fn on_csr(&mut self, _addr: u16, _value: u32, _is_write: bool) {}
+}
+
+/// The hooks of a platform without instrumentation
+#[derive(Debug, Default, Clone, Copy)]
+pub struct NoHooks;
+
+impl Hooks for NoHooks {
+    const ENABLED: bool = false;
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::platform::builder::PlatformBuilder;
+
+    #[derive(Debug, Default)]
+    struct Recorder {
+        retired: Vec<u32>,
+        stores: Vec<(u32, u32)>,
+        traps: Vec<(u32, u32)>,
+        csr_writes: Vec<(u16, u32)>,
+    }
+
+    impl Hooks for Recorder {
+        fn on_retire(&mut self, pc: u32, _instr: u32) {
+            self.retired.push(pc);
+        }
+
+        fn on_store(&mut self, addr: u32, _width: u32, value: u32) {
+            self.stores.push((addr, value));
+        }
+
+        fn on_trap(&mut self, pc: u32, mcause: u32) {
+            self.traps.push((pc, mcause));
+        }
+
+        fn on_csr(&mut self, addr: u16, value: u32, is_write: bool) {
+            if is_write {
+                self.csr_writes.push((addr, value));
+            }
+        }
+    }
+
+    #[test]
+    fn check_hooks_are_called() {
+        let image = [
+            0x37, 0x01, 0x00, 0x20, // lui x2, 0x20000
+            0x93, 0x00, 0x70, 0x00, // addi x1, x0, 7
+            0x23, 0x20, 0x11, 0x00, // sw x1, 0(x2)
+            0x73, 0x90, 0x00, 0x34, // csrw mscratch, x1
+            0x73, 0x00, 0x00, 0x00, // ecall
+        ];
+        let mut platform = PlatformBuilder::default()
+            .image(&image)
+            .build_with_hooks(Recorder::default())
+            .unwrap();
+        platform.run(5).unwrap();
+        let hooks = platform.hooks();
+        assert_eq!(hooks.retired, [0, 4, 8, 12]);
+        assert_eq!(hooks.stores, [(0x2000_0000, 7)]);
+        assert_eq!(hooks.csr_writes, [(0x340, 7)]);
+        assert_eq!(hooks.traps, [(16, 11)]);
+    }
+}
@@ -0,0 +1,211 @@
+//! Software and external interrupt control
+//!
+//! The platform has two memory-mapped interrupt control registers
+//! (see the pma module):
+//!
+//! * softintctrl: bit 0 is the machine software interrupt pending bit
+//!   (mip.MSIP). Writing 1 raises the software interrupt, and writing
+//!   0 clears it; reading returns the current value.
+//! * extintctrl: bit 0 is the external interrupt line, which is
+//!   raised by devices outside the platform (see InterruptHandle
+//!   below). Writing 0 acknowledges (clears) it, and writing 1 raises
+//!   it; reading returns the current value.
+//!
+//! mip.MEIP is pending while the external interrupt line is raised or
+//! any of the platform's own peripherals (the UART receiver, DMA
+//! controller and block device) is raising its interrupt.
+//!
+//! Host threads that model devices outside the platform raise and
+//! clear interrupts through an InterruptHandle, which can be cloned
+//! and sent to other threads. Requests are posted to a lock-free
+//! mailbox (a single atomic word), and the thread running the
+//! platform applies them before each step, or before each block when
+//! running from the block cache. Checking for requests is a single
+//! atomic load, so the execution loop never takes a lock.
+//!
+//! The external interrupt line is saved in a checkpoint, but requests
+//! posted to the mailbox and not yet applied are not.
+
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::Arc;
+
+use super::hooks::Hooks;
+use super::machine::MIP_MSIP;
+use super::Platform;
+
+const RAISE_EXTERNAL: u32 = 1 << 0;
+const CLEAR_EXTERNAL: u32 = 1 << 1;
+const RAISE_SOFTWARE: u32 = 1 << 2;
+const CLEAR_SOFTWARE: u32 = 1 << 3;
+
+/// Interrupt requests posted by host threads, not yet applied to the
+/// platform
+#[derive(Debug, Default)]
+pub struct InterruptMailbox {
+    requests: AtomicU32,
+}
+
+impl InterruptMailbox {
+    /// Post a request, replacing any earlier request it cancels (so
+    /// the last of a raise and a clear wins)
+    fn post(&self, request: u32, cancels: u32) {
+        let _ = self.requests.fetch_update(
+            Ordering::Release,
+            Ordering::Relaxed,
+            |requests| Some((requests & !cancels) | request),
+        );
+    }
+
+    /// Take all the posted requests
+    #[inline]
+    fn take(&self) -> u32 {
+        if self.requests.load(Ordering::Relaxed) == 0 {
+            0
+        } else {
+            self.requests.swap(0, Ordering::Acquire)
+        }
+    }
+}
+
+/// A handle for raising and clearing the platform's software and
+/// external interrupts from any thread
+#[derive(Debug, Clone)]
+pub struct InterruptHandle {
+    mailbox: Arc<InterruptMailbox>,
+}
+
+impl InterruptHandle {
+    /// Raise the external interrupt line
+    pub fn raise_external(&self) {
+        self.mailbox.post(RAISE_EXTERNAL, CLEAR_EXTERNAL);
+    }
+
+    /// Clear the external interrupt line
+    pub fn clear_external(&self) {
+        self.mailbox.post(CLEAR_EXTERNAL, RAISE_EXTERNAL);
+    }
+
+    /// Raise the machine software interrupt
+    pub fn raise_software(&self) {
+        self.mailbox.post(RAISE_SOFTWARE, CLEAR_SOFTWARE);
+    }
+
+    /// Clear the machine software interrupt
+    pub fn clear_software(&self) {
+        self.mailbox.post(CLEAR_SOFTWARE, RAISE_SOFTWARE);
+    }
+}
+
+impl<H: Hooks> Platform<H> {
+    /// Get a handle for raising and clearing interrupts from other
+    /// threads
+    pub fn interrupt_handle(&self) -> InterruptHandle {
+        InterruptHandle {
+            mailbox: self.interrupt_mailbox.clone(),
+        }
+    }
+
+    /// Apply the interrupt requests posted to the mailbox
+    #[inline]
+    pub(super) fn poll_interrupt_mailbox(&mut self) {
+        let requests = self.interrupt_mailbox.take();
+        if requests != 0 {
+            self.apply_interrupt_requests(requests);
+        }
+    }
+
+    fn apply_interrupt_requests(&mut self, requests: u32) {
+        if requests & RAISE_EXTERNAL != 0 {
+            self.write_extintctrl(1);
+        } else if requests & CLEAR_EXTERNAL != 0 {
+            self.write_extintctrl(0);
+        }
+        if requests & RAISE_SOFTWARE != 0 {
+            self.write_softintctrl(1);
+        } else if requests & CLEAR_SOFTWARE != 0 {
+            self.write_softintctrl(0);
+        }
+    }
+
+    /// Read the softintctrl register
+    pub(super) fn softintctrl(&self) -> u32 {
+        self.machine_interface.machine.trap_ctrl.csr_mip() >> MIP_MSIP & 1
+    }
+
+    /// Write the softintctrl register
+    pub(super) fn write_softintctrl(&mut self, value: u32) {
+        let trap_ctrl = &mut self.machine_interface.machine.trap_ctrl;
+        if value & 1 != 0 {
+            trap_ctrl.raise_software_interrupt();
+        } else {
+            trap_ctrl.clear_software_interrupt();
+        }
+    }
+
+    /// Read the extintctrl register
+    pub(super) fn extintctrl(&self) -> u32 {
+        self.external_line.into()
+    }
+
+    /// Write the extintctrl register
+    pub(super) fn write_extintctrl(&mut self, value: u32) {
+        self.external_line = value & 1 != 0;
+        self.update_external_interrupt();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::platform::csr::CSR_MIP;
+    use crate::platform::eei::Eei;
+    use crate::platform::machine::MIP_MEIP;
+    use crate::platform::memory::Wordsize;
+    use crate::platform::pma::{EXTINTCTRL_ADDR, SOFTINTCTRL_ADDR};
+
+    /// The software and external interrupt bits of mip (the timer
+    /// interrupt is pending from reset)
+    fn mip(platform: &Platform) -> u32 {
+        let mask = 1 << MIP_MSIP | 1 << MIP_MEIP;
+        platform.read_csr(CSR_MIP).unwrap() & mask
+    }
+
+    #[test]
+    fn check_interrupt_control_registers() {
+        let mut platform = Platform::new();
+        platform.store(SOFTINTCTRL_ADDR, 1, Wordsize::Word).unwrap();
+        assert_eq!(platform.load(SOFTINTCTRL_ADDR, Wordsize::Word).unwrap(), 1);
+        assert_eq!(mip(&platform), 1 << MIP_MSIP);
+        platform.store(SOFTINTCTRL_ADDR, 0, Wordsize::Word).unwrap();
+        assert_eq!(mip(&platform), 0);
+
+        platform.store(EXTINTCTRL_ADDR, 1, Wordsize::Word).unwrap();
+        assert_eq!(platform.load(EXTINTCTRL_ADDR, Wordsize::Word).unwrap(), 1);
+        assert_eq!(mip(&platform), 1 << MIP_MEIP);
+        platform.store(EXTINTCTRL_ADDR, 0, Wordsize::Word).unwrap();
+        assert_eq!(mip(&platform), 0);
+    }
+
+    #[test]
+    fn check_interrupt_handle() {
+        let mut platform = Platform::new();
+        let handle = platform.interrupt_handle();
+        std::thread::spawn(move || {
+            handle.raise_software();
+            handle.raise_external();
+            handle.clear_external();
+        })
+        .join()
+        .unwrap();
+
+        // Requests are applied at the next poll
+        assert_eq!(mip(&platform), 0);
+        platform.poll_interrupt_mailbox();
+        assert_eq!(mip(&platform), 1 << MIP_MSIP);
+
+        platform.interrupt_handle().raise_external();
+        platform.poll_interrupt_mailbox();
+        assert_eq!(mip(&platform), 1 << MIP_MSIP | 1 << MIP_MEIP);
+    }
+}
@@ -6,6 +6,8 @@
 //! References to the privileged spec refer to version 20211203.
 //!
 
+use std::time::Instant;
+
 use thiserror::Error;
 
 use crate::utils::mask;
@@ -98,18 +100,67 @@ pub enum TrapCtrlError {
     PhysicalMemoryTooLarge,
 }
 
-#[derive(Debug, Default)]
+/// The host clock that mtime follows in wall-clock mode
+#[derive(Debug, Clone, Copy)]
+struct WallClock {
+    /// The host time when mtime had the value stored in
+    /// TimerInterrupt::mtime
+    origin: Instant,
+    /// mtime ticks per second
+    frequency: u64,
+}
+
+impl WallClock {
+    fn new(frequency: u64) -> Self {
+        Self {
+            origin: Instant::now(),
+            frequency,
+        }
+    }
+
+    /// The number of mtime ticks since origin
+    fn ticks(&self) -> u64 {
+        let nanos = self.origin.elapsed().as_nanos();
+        let ticks = nanos * u128::from(self.frequency) / 1_000_000_000;
+        u64::try_from(ticks).unwrap_or(u64::MAX)
+    }
+}
+
+#[derive(Debug, Default, Clone)]
 struct TimerInterrupt {
     /// Timer interrupt enable
     mtie: bool,
-    /// Real time
+    /// Real time. In wall-clock mode, this is the value of mtime at
+    /// the wall clock origin.
     mtime: u64,
     /// Timer compare register, used to control timer
     /// interrupt
     mtimecmp: u64,
+    /// If present, mtime follows the host clock instead of counting
+    /// clock cycles
+    wall_clock: Option<WallClock>,
 }
 
 impl TimerInterrupt {
+    /// The current value of mtime. In wall-clock mode, this samples
+    /// the host clock.
+    fn mtime(&self) -> u64 {
+        match &self.wall_clock {
+            Some(wall_clock) => self.mtime.wrapping_add(wall_clock.ticks()),
+            None => self.mtime,
+        }
+    }
+
+    /// Modify mtime. In wall-clock mode, mtime continues to follow the
+    /// host clock from the new value.
+    fn write_mtime(&mut self, write: impl FnOnce(&mut u64)) {
+        self.mtime = self.mtime();
+        write(&mut self.mtime);
+        if let Some(wall_clock) = &mut self.wall_clock {
+            wall_clock.origin = Instant::now();
+        }
+    }
+
     /// Return the MTIP bit. This function also evaluates
     /// the bit, which is equal to mtime >= mtimecmp (see
     /// section 3.1.2 privileged spec). Although 3.1.9
@@ -117,14 +168,14 @@ impl TimerInterrupt {
     /// MTIP, this is interpreted as meaning mtimecmp
     /// _can_ clear MTIP.
     fn mtip(&self) -> bool {
-        self.mtime >= self.mtimecmp
+        self.mtime() >= self.mtimecmp
     }
 }
 
 /// Trap control
 ///
 /// This implementation uses
-#[derive(Debug, Default)]
+#[derive(Debug, Default, Clone)]
 pub struct TrapCtrl {
     /// Global interrupt enable bit in mstatus (MIE)
     mstatus_mie: bool,
@@ -169,8 +220,35 @@ impl TrapCtrl {
         self.timer_interrupt.mtimecmp
     }
 
+    /// Advance mtime by one clock cycle (does nothing in wall-clock
+    /// mode)
     pub fn increment_mtime(&mut self) {
-        self.timer_interrupt.mtime += 1;
+        if self.timer_interrupt.wall_clock.is_none() {
+            self.timer_interrupt.mtime += 1;
+        }
+    }
+
+    /// Make mtime follow the host clock, counting frequency ticks per
+    /// second, or (if frequency is None) count clock cycles. mtime
+    /// continues from its current value.
+    ///
+    /// In wall-clock mode, the host clock is only read when mtime is
+    /// read or the timer interrupt is evaluated, which happens before
+    /// each instruction only while the timer interrupt is enabled.
+    pub fn set_mtime_frequency(&mut self, frequency: Option<u64>) {
+        let timer_interrupt = &mut self.timer_interrupt;
+        timer_interrupt.mtime = timer_interrupt.mtime();
+        timer_interrupt.wall_clock = frequency
+            .filter(|frequency| *frequency > 0)
+            .map(WallClock::new);
+    }
+
+    /// The mtime frequency in wall-clock mode (None if mtime counts
+    /// clock cycles)
+    pub fn mtime_frequency(&self) -> Option<u64> {
+        self.timer_interrupt
+            .wall_clock
+            .map(|wall_clock| wall_clock.frequency)
     }
 
     pub fn raise_external_interrupt(&mut self) {
@@ -256,23 +334,25 @@ impl TrapCtrl {
     }
 
     pub fn csr_write_mcycle(&mut self) -> u32 {
-        low_word(&self.timer_interrupt.mtime)
+        low_word(&self.timer_interrupt.mtime())
     }
 
     pub fn mmap_mtime(&self) -> u32 {
-        low_word(&self.timer_interrupt.mtime)
+        low_word(&self.timer_interrupt.mtime())
     }
 
     pub fn mmap_write_mtime(&mut self, value: u32) {
-        write_low_word(&mut self.timer_interrupt.mtime, value)
+        self.timer_interrupt
+            .write_mtime(|mtime| write_low_word(mtime, value))
     }
 
     pub fn mmap_mtimeh(&self) -> u32 {
-        high_word(&self.timer_interrupt.mtime)
+        high_word(&self.timer_interrupt.mtime())
     }
 
     pub fn mmap_write_mtimeh(&mut self, value: u32) {
-        write_high_word(&mut self.timer_interrupt.mtime, value)
+        self.timer_interrupt
+            .write_mtime(|mtime| write_high_word(mtime, value))
     }
 
     pub fn mmap_mtimecmp(&self) -> u32 {
@@ -489,7 +569,7 @@ impl TrapCtrl {
 /// This struct contains the core architectural state
 /// of privileged mode, including the state of the
 /// performance counters, interrupts, real time, etc.
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub struct Machine {
     /// Number of clock cycles since reset.
     mcycle: u64,
@@ -519,7 +599,7 @@ impl Machine {
     }
 
     pub fn mtime(&self) -> u64 {
-        self.trap_ctrl.timer_interrupt.mtime
+        self.trap_ctrl.timer_interrupt.mtime()
     }
 
     pub fn increment_mcycle(&mut self) {
@@ -561,8 +641,86 @@ impl Machine {
     pub fn csr_minstreth(&self) -> u32 {
         high_word(&self.minstret)
     }
+
+    /// Save the complete state of the machine as a fixed number of
+    /// words (used to write checkpoints to a file). The single-bit
+    /// fields are packed into the last word.
+    pub fn state(&self) -> [u64; MACHINE_STATE_LEN] {
+        let trap_ctrl = &self.trap_ctrl;
+        let flags = [
+            trap_ctrl.mstatus_mie,
+            trap_ctrl.mstatus_mpie,
+            trap_ctrl.timer_interrupt.mtie,
+            trap_ctrl.meip,
+            trap_ctrl.meie,
+            trap_ctrl.msip,
+            trap_ctrl.msie,
+        ]
+        .iter()
+        .enumerate()
+        .fold(0, |flags, (n, bit)| flags | u64::from(*bit) << n);
+        [
+            self.mcycle,
+            self.minstret,
+            self.mscratch.into(),
+            trap_ctrl.mcause.into(),
+            trap_ctrl.trap_vector_base.into(),
+            trap_ctrl.mepc.into(),
+            trap_ctrl.mepc_mask.into(),
+            trap_ctrl.timer_interrupt.mtime(),
+            trap_ctrl.timer_interrupt.mtimecmp,
+            flags,
+        ]
+    }
+
+    /// Make a machine from a state saved using state(). Returns None
+    /// if a 32-bit field does not fit in 32 bits.
+    pub fn from_state(state: &[u64; MACHINE_STATE_LEN]) -> Option<Self> {
+        let word = |n: usize| u32::try_from(state[n]).ok();
+        let flag = |n: usize| state[9] >> n & 1 != 0;
+        Some(Self {
+            mcycle: state[0],
+            minstret: state[1],
+            mscratch: word(2)?,
+            trap_ctrl: TrapCtrl {
+                mstatus_mie: flag(0),
+                mstatus_mpie: flag(1),
+                mcause: word(3)?,
+                trap_vector_base: word(4)?,
+                mepc: word(5)?,
+                mepc_mask: word(6)?,
+                timer_interrupt: TimerInterrupt {
+                    mtie: flag(2),
+                    mtime: state[7],
+                    mtimecmp: state[8],
+                    wall_clock: None,
+                },
+                meip: flag(3),
+                meie: flag(4),
+                msip: flag(5),
+                msie: flag(6),
+            },
+        })
+    }
 }
 
+/// The number of words in the saved state of a Machine
+pub const MACHINE_STATE_LEN: usize = 10;
+
+/// The name of each word in the saved state of a Machine
+pub const MACHINE_STATE_NAMES: [&str; MACHINE_STATE_LEN] = [
+    "mcycle",
+    "minstret",
+    "mscratch",
+    "mcause",
+    "trap vector base",
+    "mepc",
+    "mepc mask",
+    "mtime",
+    "mtimecmp",
+    "interrupt flags",
+];
+
 fn low_word(value: &u64) -> u32 {
     (0xffff_ffff & value).try_into().unwrap()
 }
@@ -593,4 +751,47 @@ mod tests {
         trap_ctrl.csr_write_mstatus(0xffff_ffff);
         assert_eq!(trap_ctrl.csr_mstatus(), 0x0000_1888);
     }
+
+    #[test]
+    fn check_machine_state_round_trip() {
+        let mut machine = Machine::default();
+        machine.increment_mcycle();
+        machine.mscratch = 0x1234;
+        machine.trap_ctrl.csr_write_mstatus(0xffff_ffff);
+        machine.trap_ctrl.csr_write_mie(0xffff_ffff);
+        machine.trap_ctrl.raise_external_interrupt();
+        machine.trap_ctrl.set_mtimecmp(100);
+
+        let state = machine.state();
+        let restored = Machine::from_state(&state).unwrap();
+        assert_eq!(restored.state(), state);
+        assert_eq!(restored.csr_mcycle(), 1);
+        assert_eq!(restored.trap_ctrl.csr_mie(), machine.trap_ctrl.csr_mie());
+        assert_eq!(restored.trap_ctrl.csr_mip(), machine.trap_ctrl.csr_mip());
+    }
+
+    #[test]
+    fn check_wall_clock_mtime() {
+        let mut trap_ctrl = TrapCtrl::default();
+        trap_ctrl.increment_mtime();
+        trap_ctrl.set_mtime_frequency(Some(1_000_000_000));
+        trap_ctrl.increment_mtime();
+        let start = trap_ctrl.mmap_mtime();
+        assert!(start >= 1);
+        std::thread::sleep(std::time::Duration::from_millis(2));
+        assert!(trap_ctrl.mmap_mtime() >= start + 2_000_000);
+
+        // Writes rebase the wall clock
+        trap_ctrl.mmap_write_mtimeh(0);
+        trap_ctrl.mmap_write_mtime(0);
+        assert!(trap_ctrl.mmap_mtime() < 1_000_000_000);
+        trap_ctrl.set_mtimecmp(u64::MAX);
+        assert_eq!(trap_ctrl.csr_mip() >> MIP_MTIP & 1, 0);
+
+        // Back to counting clock cycles from the current value
+        trap_ctrl.set_mtime_frequency(None);
+        let mtime = trap_ctrl.mmap_mtime();
+        trap_ctrl.increment_mtime();
+        assert_eq!(trap_ctrl.mmap_mtime(), mtime + 1);
+    }
 }
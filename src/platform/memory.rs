@@ -29,6 +29,14 @@ pub enum Xlen {
     Xlen64,
 }
 
+/// Size in bytes of the pages that memory is stored in
+pub const PAGE_SIZE: usize = 4096;
+
+type Page = [u8; PAGE_SIZE];
+
+/// The contents of a page that has not been written
+static ZERO_PAGE: Page = [0; PAGE_SIZE];
+
 /// RISC-V Hart Memory
 ///
 /// The basic memory model is described in section
@@ -48,10 +56,24 @@ pub enum Xlen {
 /// access to vacant, and the functions will be added
 /// to create new address regions.
 ///
-#[derive(Debug, Default)]
+/// Memory is stored sparsely, in pages of PAGE_SIZE
+/// bytes that are allocated when a nonzero byte is
+/// first written to them. Bulk transfers (see
+/// for_each_chunk and copy) work on whole slices of a
+/// page at a time.
+///
+/// Memory can also record which pages are written (see
+/// track_dirty_pages), so that two memories can be
+/// compared without comparing every page.
+///
+#[derive(Debug, Default, Clone)]
 pub struct Memory {
     xlen: Xlen,
-    data: HashMap<u64, u8>,
+    /// The pages that have been written, by address / PAGE_SIZE
+    pages: HashMap<u64, Box<Page>>,
+    /// The numbers of the pages written since the list was last
+    /// taken, if dirty page tracking is enabled
+    dirty: Option<Vec<u64>>,
 }
 
 #[derive(Error, PartialEq, Eq, Debug)]
@@ -73,27 +95,37 @@ fn wrap_address(addr: u64, xlen: Xlen) -> u64 {
     }
 }
 
-fn read_byte(byte_map: &HashMap<u64, u8>, addr: u64, xlen: Xlen) -> u64 {
-    let addr = wrap_address(addr, xlen);
-    u64::from(*byte_map.get(&addr).unwrap_or(&0))
+fn address_invalid(addr: u64, xlen: Xlen) -> bool {
+    xlen == Xlen::Xlen32 && addr > 0xffff_ffff
 }
 
-fn read_word(
-    byte_map: &HashMap<u64, u8>,
-    addr: u64,
-    num_bytes: u64,
-    xlen: Xlen,
-) -> u64 {
-    let mut value = 0;
-    for n in 0..num_bytes {
-        let byte_n = read_byte(byte_map, addr.wrapping_add(n), xlen);
-        value |= byte_n << (8 * n);
-    }
-    value
+/// The page number of addr, and the offset of addr in the page
+fn page_of(addr: u64) -> (u64, usize) {
+    let page_size = PAGE_SIZE as u64;
+    (addr / page_size, (addr % page_size) as usize)
 }
 
-fn address_invalid(addr: u64, xlen: Xlen) -> bool {
-    xlen == Xlen::Xlen32 && addr > 0xffff_ffff
+/// Split the len bytes starting at addr (wrapping at the top of the
+/// address space) into pieces that do not cross a page boundary.
+/// Yields the page number, the offset in the page, the offset from
+/// addr and the length of each piece.
+fn chunks(
+    addr: u64,
+    len: usize,
+    xlen: Xlen,
+) -> impl Iterator<Item = (u64, usize, usize, usize)> {
+    let mut offset = 0;
+    std::iter::from_fn(move || {
+        if offset == len {
+            return None;
+        }
+        let chunk_addr = wrap_address(addr.wrapping_add(offset as u64), xlen);
+        let (page, page_offset) = page_of(chunk_addr);
+        let chunk_len = (len - offset).min(PAGE_SIZE - page_offset);
+        let chunk = (page, page_offset, offset, chunk_len);
+        offset += chunk_len;
+        Some(chunk)
+    })
 }
 
 impl Memory {
@@ -104,32 +136,43 @@ impl Memory {
         }
     }
 
-    fn write_byte(&mut self, addr: u64, value: u8, xlen: Xlen) {
-        let addr = wrap_address(addr, xlen);
-        if value == 0 {
-            self.data.remove(&addr);
-        } else {
-            self.data.insert(addr, value);
+    /// The page with this page number, allocating it if it has not been
+    /// written yet. The page is recorded as dirty.
+    fn page_mut(&mut self, page: u64) -> &mut Page {
+        self.mark_dirty(page);
+        self.pages
+            .entry(page)
+            .or_insert_with(|| Box::new([0; PAGE_SIZE]))
+    }
+
+    fn mark_dirty(&mut self, page: u64) {
+        if let Some(dirty) = &mut self.dirty {
+            // Consecutive writes are usually to the same page
+            if dirty.last() != Some(&page) {
+                dirty.push(page);
+            }
         }
     }
 
-    fn write_word(
-        &mut self,
-        addr: u64,
-        num_bytes: u64,
-        value: u64,
-        xlen: Xlen,
-    ) {
-        for n in 0..num_bytes {
-            let byte_n = 0xff & (value >> (8 * n));
-            self.write_byte(
-                addr.wrapping_add(n),
-                byte_n.try_into().unwrap(),
-                xlen,
-            );
+    /// Start recording the pages that are written
+    pub fn track_dirty_pages(&mut self) {
+        self.dirty.get_or_insert_with(Vec::new);
+    }
+
+    /// Move the numbers of the pages written since the last call (or
+    /// since tracking started) into pages. A page may be listed more
+    /// than once.
+    pub fn take_dirty_pages(&mut self, pages: &mut Vec<u64>) {
+        if let Some(dirty) = &mut self.dirty {
+            pages.append(dirty);
         }
     }
 
+    /// The contents of the page with this page number
+    pub fn page(&self, page: u64) -> &[u8; PAGE_SIZE] {
+        self.pages.get(&page).map_or(&ZERO_PAGE, |page| page)
+    }
+
     pub fn write(
         &mut self,
         addr: u64,
@@ -139,8 +182,8 @@ impl Memory {
         if address_invalid(addr, self.xlen) {
             Err(WriteError::InvalidAddress)
         } else {
-            let write_width = word_size.width().try_into().unwrap();
-            self.write_word(addr, write_width, value, self.xlen);
+            let write_width = usize::from(word_size.width());
+            self.write_bytes(addr, &value.to_le_bytes()[..write_width]);
             Ok(())
         }
     }
@@ -153,11 +196,171 @@ impl Memory {
         if address_invalid(addr, self.xlen) {
             Err(ReadError::InvalidAddress)
         } else {
-            let read_width = word_size.width().try_into().unwrap();
-            let result = read_word(&self.data, addr, read_width, self.xlen);
-            Ok(result)
+            let read_width = usize::from(word_size.width());
+            let mut bytes = [0; 8];
+            self.read_into(addr, &mut bytes[..read_width]);
+            Ok(u64::from_le_bytes(bytes))
         }
     }
+
+    /// Copy len bytes from src to dst. Overlapping ranges are copied
+    /// as if through a temporary buffer (like memmove), by copying
+    /// from the end of the range when dst is inside the source range.
+    /// The bytes are copied a page slice at a time.
+    pub fn copy(&mut self, src: u64, dst: u64, len: u64) {
+        let len = usize::try_from(len).unwrap();
+        let distance = wrap_address(dst.wrapping_sub(src), self.xlen);
+        let backwards = distance < len as u64;
+        let mut done = 0;
+        while done < len {
+            // The length of the next piece, which must not cross a page
+            // boundary in either range
+            let (src_piece, dst_piece) = if backwards {
+                let end = (len - done - 1) as u64;
+                let (_, src_offset) = page_of(src.wrapping_add(end));
+                let (_, dst_offset) = page_of(dst.wrapping_add(end));
+                (src_offset + 1, dst_offset + 1)
+            } else {
+                let (_, src_offset) = page_of(src.wrapping_add(done as u64));
+                let (_, dst_offset) = page_of(dst.wrapping_add(done as u64));
+                (PAGE_SIZE - src_offset, PAGE_SIZE - dst_offset)
+            };
+            let piece = (len - done).min(src_piece).min(dst_piece);
+            let offset = if backwards { len - done - piece } else { done };
+            let offset = offset as u64;
+            self.copy_in_pages(
+                wrap_address(src.wrapping_add(offset), self.xlen),
+                wrap_address(dst.wrapping_add(offset), self.xlen),
+                piece,
+            );
+            done += piece;
+        }
+    }
+
+    /// Copy len bytes from src to dst, where neither range crosses a
+    /// page boundary
+    fn copy_in_pages(&mut self, src: u64, dst: u64, len: usize) {
+        let (src_page, src_offset) = page_of(src);
+        let (dst_page, dst_offset) = page_of(dst);
+        let src_range = src_offset..src_offset + len;
+        if src_page == dst_page {
+            // A page that has not been written is all zeros already
+            if let Some(page) = self.pages.get_mut(&src_page) {
+                page.copy_within(src_range, dst_offset);
+                self.mark_dirty(src_page);
+            }
+            return;
+        }
+
+        // Take the destination page out of the map, so that the source
+        // page can be borrowed while it is written
+        let mut page = match self.pages.remove(&dst_page) {
+            Some(page) => page,
+            None if !self.pages.contains_key(&src_page) => return,
+            None => Box::new([0; PAGE_SIZE]),
+        };
+        let dst = &mut page[dst_offset..dst_offset + len];
+        match self.pages.get(&src_page) {
+            Some(src) => dst.copy_from_slice(&src[src_range]),
+            None => dst.fill(0),
+        }
+        self.pages.insert(dst_page, page);
+        self.mark_dirty(dst_page);
+    }
+
+    /// Read len bytes starting at addr
+    pub fn read_bytes(&self, addr: u64, len: u64) -> Vec<u8> {
+        let mut bytes = vec![0; usize::try_from(len).unwrap()];
+        self.read_into(addr, &mut bytes);
+        bytes
+    }
+
+    /// Fill buf with the bytes starting at addr
+    pub fn read_into(&self, addr: u64, buf: &mut [u8]) {
+        for (page, page_offset, offset, len) in
+            chunks(addr, buf.len(), self.xlen)
+        {
+            let page = self.pages.get(&page).map_or(&ZERO_PAGE, |page| page);
+            buf[offset..offset + len]
+                .copy_from_slice(&page[page_offset..page_offset + len]);
+        }
+    }
+
+    /// Write bytes starting at addr
+    pub fn write_bytes(&mut self, addr: u64, bytes: &[u8]) {
+        for (page, page_offset, offset, len) in
+            chunks(addr, bytes.len(), self.xlen)
+        {
+            let bytes = &bytes[offset..offset + len];
+            let range = page_offset..page_offset + len;
+            if let Some(page_bytes) = self.pages.get_mut(&page) {
+                page_bytes[range].copy_from_slice(bytes);
+                self.mark_dirty(page);
+            } else if bytes.iter().any(|byte| *byte != 0) {
+                // Writing zeros to an unwritten page changes nothing
+                self.page_mut(page)[range].copy_from_slice(bytes);
+            }
+        }
+    }
+
+    /// Call f with each piece of the len bytes starting at addr, in
+    /// order, where no piece crosses a page boundary. f is also passed
+    /// the offset of the piece from addr. Stops at the first error
+    /// returned by f.
+    pub fn for_each_chunk<E>(
+        &self,
+        addr: u64,
+        len: usize,
+        mut f: impl FnMut(usize, &[u8]) -> Result<(), E>,
+    ) -> Result<(), E> {
+        for (page, page_offset, offset, len) in chunks(addr, len, self.xlen) {
+            let page = self.pages.get(&page).map_or(&ZERO_PAGE, |page| page);
+            f(offset, &page[page_offset..page_offset + len])?;
+        }
+        Ok(())
+    }
+
+    /// Like for_each_chunk, but f can modify the bytes
+    pub fn for_each_chunk_mut<E>(
+        &mut self,
+        addr: u64,
+        len: usize,
+        mut f: impl FnMut(usize, &mut [u8]) -> Result<(), E>,
+    ) -> Result<(), E> {
+        for (page, page_offset, offset, len) in chunks(addr, len, self.xlen) {
+            let page = self.page_mut(page);
+            f(offset, &mut page[page_offset..page_offset + len])?;
+        }
+        Ok(())
+    }
+
+    /// Iterate over the bytes of memory that are not zero, in no
+    /// particular order
+    pub fn nonzero_bytes(&self) -> impl Iterator<Item = (u64, u8)> + '_ {
+        self.pages.iter().flat_map(|(page, bytes)| {
+            let base = page * PAGE_SIZE as u64;
+            (base..)
+                .zip(bytes.iter().copied())
+                .filter(|(_, byte)| *byte != 0)
+        })
+    }
+
+    /// Set every byte to zero, except the bytes whose address
+    /// satisfies keep
+    pub fn retain<F: FnMut(u64) -> bool>(&mut self, mut keep: F) {
+        if let Some(dirty) = &mut self.dirty {
+            dirty.extend(self.pages.keys());
+        }
+        self.pages.retain(|page, bytes| {
+            let base = page * PAGE_SIZE as u64;
+            for (addr, byte) in (base..).zip(bytes.iter_mut()) {
+                if !keep(addr) {
+                    *byte = 0;
+                }
+            }
+            bytes.iter().any(|byte| *byte != 0)
+        })
+    }
 }
 
 #[cfg(test)]
@@ -258,6 +461,78 @@ mod tests {
         assert_eq!(mem.read(2, Wordsize::Byte).unwrap(), 4);
     }
 
+    /// Accesses that cross a page boundary, and writes of zeros to
+    /// pages that have not been written
+    #[test]
+    fn check_page_boundaries() {
+        let mut mem = Memory::default();
+        let addr = PAGE_SIZE as u64 - 2;
+        mem.write(addr, 0x0403_0201, Wordsize::Word).unwrap();
+        assert_eq!(mem.read(addr, Wordsize::Word).unwrap(), 0x0403_0201);
+        assert_eq!(mem.read_bytes(addr + 1, 2), [2, 3]);
+        assert_eq!(mem.pages.len(), 2);
+
+        let bytes: Vec<u8> = (0..3 * PAGE_SIZE).map(|n| n as u8).collect();
+        mem.write_bytes(0x10f00, &bytes);
+        assert_eq!(mem.read_bytes(0x10f00, bytes.len() as u64), bytes);
+        mem.write_bytes(0x40000, &[0; 100]);
+        assert_eq!(mem.pages.len(), 6);
+
+        mem.retain(|addr| addr < 0x10000);
+        assert_eq!(mem.pages.len(), 2);
+        let mut nonzero: Vec<(u64, u8)> = mem.nonzero_bytes().collect();
+        nonzero.sort();
+        assert_eq!(
+            nonzero,
+            [(addr, 1), (addr + 1, 2), (addr + 2, 3), (addr + 3, 4)]
+        );
+    }
+
+    /// Copies between overlapping and separate ranges, which are not
+    /// aligned to pages, compared with copy_within on a Vec
+    #[test]
+    fn check_copy() {
+        let mut mem = Memory::default();
+        let mut expected: Vec<u8> =
+            (0..0x8000).map(|n| (n % 251) as u8).collect();
+        expected[0x5000..0x6000].fill(0);
+        mem.write_bytes(0, &expected);
+
+        let copies = [
+            (0x0f00, 0x0f64, 3 * PAGE_SIZE), // overlapping, dst above src
+            (0x1000, 0x0f9c, 3 * PAGE_SIZE), // overlapping, dst below src
+            (0x0123, 0x6789, 0x1234),        // separate ranges
+            (0x5000, 0x0800, 0x1000),        // from a page of zeros
+            (0x0a00, 0x0a00, 0x100),         // onto itself
+        ];
+        for (src, dst, len) in copies {
+            mem.copy(src as u64, dst as u64, len as u64);
+            expected.copy_within(src..src + len, dst);
+            assert_eq!(mem.read_bytes(0, 0x8000), expected);
+        }
+    }
+
+    #[test]
+    fn check_dirty_pages() {
+        let mut mem = Memory::default();
+        mem.write(0x1000, 1, Wordsize::Byte).unwrap();
+        mem.track_dirty_pages();
+        mem.write(0x2ffe, 0x0102, Wordsize::Word).unwrap();
+        mem.write(0x5000, 0, Wordsize::Word).unwrap();
+        mem.copy(0x2000, 0x7ff0, 0x20);
+        let mut pages = Vec::new();
+        mem.take_dirty_pages(&mut pages);
+        // Writing zeros to pages 3 and 5, which are unwritten, leaves
+        // them unchanged
+        assert_eq!(pages, [2, 7, 8]);
+        assert_eq!(mem.page(2)[0xffe..], [2, 1]);
+        assert_eq!(mem.page(5), &ZERO_PAGE);
+
+        pages.clear();
+        mem.take_dirty_pages(&mut pages);
+        assert!(pages.is_empty());
+    }
+
     #[test]
     fn check_invalid_address_on_write() {
         let mut mem = Memory::default();
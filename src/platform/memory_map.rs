@@ -0,0 +1,294 @@
+//! Configurable memory map
+//!
+//! The layout described in the pma module is the default memory map.
+//! The sizes of the EEPROM and RAM, and the base addresses of the I/O
+//! region and RAM, can be changed (for example, to model a part with
+//! 64 MiB of external RAM) using a MemoryMap, either built in code or
+//! read from a text file like this:
+//!
+//! ```text
+//! # A part with 64 MiB of external RAM
+//! eeprom_size = 1M
+//! io_base = 0x4000_0000
+//! ram_base = 0x8000_0000
+//! ram_size = 64M
+//! ```
+//!
+//! Numbers are decimal, or hexadecimal with a 0x prefix, and may
+//! contain underscores. A K, M or G suffix multiplies by 1024, 1024^2
+//! or 1024^3. Keys that are not given keep their default values.
+//!
+//! The EEPROM always starts at address 0 (the reset and trap vectors
+//! are there), and the I/O region is always 0x80 bytes, with the
+//! registers at the same offsets from io_base as in the default map.
+//! The access permissions of each region are fixed by its type
+//! (EEPROM is read/execute, I/O and RAM are read/write): the block
+//! cache relies on only the EEPROM being executable, so that stores
+//! never change cached instructions.
+//!
+//! Memory is stored sparsely, so the size of the RAM costs nothing
+//! until the program writes to it.
+
+use std::str::FromStr;
+
+use thiserror::Error;
+
+/// Size of the I/O region in bytes
+pub const IO_SIZE: u32 = 0x80;
+
+/// The base address of the I/O region in the default memory map
+pub const DEFAULT_IO_BASE: u32 = 0x1000_0000;
+
+/// The base address of RAM in the default memory map
+pub const DEFAULT_RAM_BASE: u32 = 0x2000_0000;
+
+/// The sizes and locations of the platform's memory regions
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct MemoryMap {
+    /// Size of the EEPROM (which starts at address 0) in bytes
+    pub eeprom_size: u32,
+    /// Base address of the I/O region
+    pub io_base: u32,
+    /// Base address of RAM
+    pub ram_base: u32,
+    /// Size of RAM in bytes
+    pub ram_size: u32,
+}
+
+#[derive(Debug, Error)]
+pub enum MemoryMapError {
+    #[error("line {0}: expected key = value")]
+    Syntax(usize),
+    #[error("line {0}: unknown key {1}")]
+    UnknownKey(usize, String),
+    #[error("line {0}: invalid number {1}")]
+    InvalidNumber(usize, String),
+    #[error("the I/O region base address must be four byte aligned")]
+    IoMisaligned,
+    #[error("the {0} region extends past the end of the address space")]
+    OutOfRange(&'static str),
+    #[error("the {0} and {1} regions overlap")]
+    Overlap(&'static str, &'static str),
+}
+
+impl Default for MemoryMap {
+    /// Defaults to 4 MiB EEPROM device size and 4 MiB RAM device size
+    fn default() -> Self {
+        Self {
+            eeprom_size: 4 * 1024 * 1024,
+            io_base: DEFAULT_IO_BASE,
+            ram_base: DEFAULT_RAM_BASE,
+            ram_size: 4 * 1024 * 1024,
+        }
+    }
+}
+
+impl MemoryMap {
+    /// The start and end (first byte above) of each region, with its
+    /// name
+    fn regions(&self) -> [(&'static str, u64, u64); 3] {
+        let region = |base: u32, size: u32| {
+            (u64::from(base), u64::from(base) + u64::from(size))
+        };
+        let (eeprom_start, eeprom_end) = region(0, self.eeprom_size);
+        let (io_start, io_end) = region(self.io_base, IO_SIZE);
+        let (ram_start, ram_end) = region(self.ram_base, self.ram_size);
+        [
+            ("EEPROM", eeprom_start, eeprom_end),
+            ("I/O", io_start, io_end),
+            ("RAM", ram_start, ram_end),
+        ]
+    }
+
+    /// Check that the regions fit in the 32-bit address space and do
+    /// not overlap
+    pub fn validate(&self) -> Result<(), MemoryMapError> {
+        if self.io_base % 4 != 0 {
+            return Err(MemoryMapError::IoMisaligned);
+        }
+        let regions = self.regions();
+        for (name, _, end) in regions {
+            if end > 1 << 32 {
+                return Err(MemoryMapError::OutOfRange(name));
+            }
+        }
+        for (n, (name, start, end)) in regions.iter().enumerate() {
+            for (other, other_start, other_end) in &regions[n + 1..] {
+                if start < other_end && other_start < end {
+                    return Err(MemoryMapError::Overlap(name, other));
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+impl FromStr for MemoryMap {
+    type Err = MemoryMapError;
+
+    /// Read a memory map in the text format described in the module
+    /// documentation. The result is not validated.
+    fn from_str(text: &str) -> Result<Self, Self::Err> {
+        let mut map = Self::default();
+        for (n, line) in text.lines().enumerate() {
+            let line_number = n + 1;
+            let line = line.split('#').next().unwrap_or_default().trim();
+            if line.is_empty() {
+                continue;
+            }
+            let Some((key, value)) = line.split_once('=') else {
+                return Err(MemoryMapError::Syntax(line_number));
+            };
+            let (key, value) = (key.trim(), value.trim());
+            let field = match key {
+                "eeprom_size" => &mut map.eeprom_size,
+                "io_base" => &mut map.io_base,
+                "ram_base" => &mut map.ram_base,
+                "ram_size" => &mut map.ram_size,
+                _ => {
+                    let key = key.to_string();
+                    return Err(MemoryMapError::UnknownKey(line_number, key));
+                }
+            };
+            *field = parse_size(value).map_err(|_| {
+                MemoryMapError::InvalidNumber(line_number, value.to_string())
+            })?;
+        }
+        Ok(map)
+    }
+}
+
+/// Parse an address or size: a decimal or 0x-prefixed hexadecimal
+/// number, optionally containing underscores, with an optional K, M
+/// or G suffix
+pub fn parse_size(value: &str) -> Result<u32, String> {
+    let invalid = || format!("invalid size or address {value}");
+    let digits = value.replace('_', "");
+    let (digits, scale) = match digits.as_bytes().last() {
+        Some(b'K' | b'k') => (&digits[..digits.len() - 1], 1 << 10),
+        Some(b'M' | b'm') => (&digits[..digits.len() - 1], 1 << 20),
+        Some(b'G' | b'g') => (&digits[..digits.len() - 1], 1 << 30),
+        _ => (&digits[..], 1),
+    };
+    let number = match digits.strip_prefix("0x") {
+        Some(hex) => u32::from_str_radix(hex, 16),
+        None => digits.parse(),
+    }
+    .map_err(|_| invalid())?;
+    number.checked_mul(scale).ok_or_else(invalid)
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::platform::eei::Eei;
+    use crate::platform::memory::Wordsize;
+    use crate::platform::pma::UARTTX_ADDR;
+    use crate::platform::Platform;
+
+    #[test]
+    fn check_parse_memory_map() {
+        let text = "# comment\neeprom_size = 1M\n\
+                    ram_base = 0x8000_0000 # external RAM\nram_size = 64M\n";
+        let map: MemoryMap = text.parse().unwrap();
+        assert_eq!(
+            map,
+            MemoryMap {
+                eeprom_size: 0x10_0000,
+                io_base: DEFAULT_IO_BASE,
+                ram_base: 0x8000_0000,
+                ram_size: 0x400_0000,
+            }
+        );
+        map.validate().unwrap();
+
+        assert!(matches!(
+            "ram_size 4".parse::<MemoryMap>(),
+            Err(MemoryMapError::Syntax(1))
+        ));
+        assert!(matches!(
+            "\nrom_size = 4".parse::<MemoryMap>(),
+            Err(MemoryMapError::UnknownKey(2, _))
+        ));
+        assert!(matches!(
+            "ram_size = 8G".parse::<MemoryMap>(),
+            Err(MemoryMapError::InvalidNumber(1, _))
+        ));
+    }
+
+    #[test]
+    fn check_validate_memory_map() {
+        let overlapping = MemoryMap {
+            ram_base: 0x10_0000,
+            ..MemoryMap::default()
+        };
+        assert!(matches!(
+            overlapping.validate(),
+            Err(MemoryMapError::Overlap("EEPROM", "RAM"))
+        ));
+        let too_big = MemoryMap {
+            ram_base: 0xf000_0004,
+            ram_size: 0x1000_0000,
+            ..MemoryMap::default()
+        };
+        assert!(matches!(
+            too_big.validate(),
+            Err(MemoryMapError::OutOfRange("RAM"))
+        ));
+
+        // A region can end exactly at the top of the address space
+        let at_top = MemoryMap {
+            ram_base: 0xf000_0000,
+            ram_size: 0x1000_0000,
+            ..MemoryMap::default()
+        };
+        at_top.validate().unwrap();
+        let mut platform = Platform::with_memory_map(at_top).unwrap();
+        platform.store(0xffff_fffc, 0x1234, Wordsize::Word).unwrap();
+        assert_eq!(platform.load(0xffff_fffc, Wordsize::Word).unwrap(), 0x1234);
+        assert!(platform.load(0xffff_fffd, Wordsize::Word).is_err());
+    }
+
+    /// The last word of each region is accessible, and an access
+    /// that extends past the end of a region faults
+    #[test]
+    fn check_region_ends() {
+        let mut platform = Platform::new();
+        let ram_top = DEFAULT_RAM_BASE + 4 * 1024 * 1024;
+        platform.store(ram_top - 4, 0x1234, Wordsize::Word).unwrap();
+        assert_eq!(platform.load(ram_top - 4, Wordsize::Word).unwrap(), 0x1234);
+        platform.store(ram_top - 1, 0x56, Wordsize::Byte).unwrap();
+        assert!(platform.store(ram_top - 2, 0, Wordsize::Word).is_err());
+        assert!(platform.load(ram_top, Wordsize::Byte).is_err());
+
+        let eeprom_top = 4 * 1024 * 1024;
+        assert!(platform.load(eeprom_top - 4, Wordsize::Word).is_ok());
+        assert!(platform.load(eeprom_top - 2, Wordsize::Word).is_err());
+        assert!(platform.fetch_instruction(eeprom_top - 4).is_ok());
+
+        let blksize = DEFAULT_IO_BASE + IO_SIZE - 4;
+        assert!(platform.load(blksize, Wordsize::Word).is_ok());
+    }
+
+    #[test]
+    fn check_relocated_regions() {
+        let map = MemoryMap {
+            io_base: 0x4000_0000,
+            ram_base: 0x8000_0000,
+            ram_size: 256 * 1024 * 1024,
+            ..MemoryMap::default()
+        };
+        let mut platform = Platform::with_memory_map(map).unwrap();
+        let top = 0x8000_0000 + 255 * 1024 * 1024;
+        platform.store(top, 0x1234, Wordsize::Word).unwrap();
+        assert_eq!(platform.load(top, Wordsize::Word).unwrap(), 0x1234);
+        assert!(platform.load(DEFAULT_RAM_BASE, Wordsize::Word).is_err());
+
+        // The registers are at the same offsets from io_base
+        let uarttx = 0x4000_0000 + UARTTX_ADDR - DEFAULT_IO_BASE;
+        platform.store(uarttx, 'x'.into(), Wordsize::Word).unwrap();
+        assert_eq!(platform.flush_uartout(), "x");
+        assert!(platform.store(UARTTX_ADDR, 0, Wordsize::Word).is_err());
+    }
+}
@@ -9,10 +9,11 @@
 //!
 //! ## Memory Map
 //!
-//! The memory map for the 32-bit physical address space of the
-//! processor is as follows. Address ranges are listed in the format
-//! A-B, where address A is the first byte of the region and address B
-//! is the first byte above the region.
+//! The default memory map for the 32-bit physical address space of
+//! the processor is as follows (see the memory_map module for changing
+//! the sizes and locations of the regions). Address ranges are listed
+//! in the format A-B, where address A is the first byte of the region
+//! and address B is the first byte above the region.
 //!
 //! When errors are returned by the PMA checker, they are checked in
 //! this order:
@@ -79,6 +80,14 @@
 //! | 0x0001_0010 | 4 | softintctrl (32-bit software interrupt control register) |
 //! | 0x0001_0014 | 4 | extintctrl (32-bit external interrupt control register) |
 //! | 0x0001_0018 | 4 | uarttx (write causes low byte sent to UART; read as 0) |
+//! | 0x0001_001c | 4 | uartrx (read removes a byte from the UART receive FIFO) |
+//! | 0x0001_0020 | 4 | uartstat (UART receive status and interrupt enable) |
+//! | 0x0001_0024 | 20 | DMA controller registers |
+//! | 0x0001_0038 | 24 | Block device registers |
+//!
+//! See the interrupts module for the interrupt control registers, the
+//! uart module for the UART receive registers, the dma module for the
+//! DMA controller, and the block_device module for the block device.
 //!
 //! The region is read/write (but no instruction fetch); reads/writes
 //! must be 4-byte width and be 4-byte aligned.
@@ -111,6 +120,7 @@
 //!
 
 use super::machine::Exception;
+use super::memory_map::{MemoryMap, MemoryMapError, DEFAULT_IO_BASE, IO_SIZE};
 
 pub const RESET_VECTOR: u32 = 0x0000_0000;
 pub const NMI_VECTOR: u32 = 0x0000_0004;
@@ -126,6 +136,19 @@ pub const MTIMECMPH_ADDR: u32 = 0x1000_000c;
 pub const SOFTINTCTRL_ADDR: u32 = 0x1000_0010;
 pub const EXTINTCTRL_ADDR: u32 = 0x1000_0014;
 pub const UARTTX_ADDR: u32 = 0x1000_0018;
+pub const UARTRX_ADDR: u32 = 0x1000_001c;
+pub const UARTSTAT_ADDR: u32 = 0x1000_0020;
+pub const DMASRC_ADDR: u32 = 0x1000_0024;
+pub const DMADST_ADDR: u32 = 0x1000_0028;
+pub const DMALEN_ADDR: u32 = 0x1000_002c;
+pub const DMACTRL_ADDR: u32 = 0x1000_0030;
+pub const DMASTAT_ADDR: u32 = 0x1000_0034;
+pub const BLKSECTOR_ADDR: u32 = 0x1000_0038;
+pub const BLKCOUNT_ADDR: u32 = 0x1000_003c;
+pub const BLKBUF_ADDR: u32 = 0x1000_0040;
+pub const BLKCMD_ADDR: u32 = 0x1000_0044;
+pub const BLKSTAT_ADDR: u32 = 0x1000_0048;
+pub const BLKSIZE_ADDR: u32 = 0x1000_004c;
 
 /// Models the PMA checker (section 3.6 privileged spec)
 ///
@@ -138,28 +161,46 @@ pub const UARTTX_ADDR: u32 = 0x1000_0018;
 /// registers, which can affect other architectural state.
 ///
 /// TODO conside moving the docs above to this struct.
-#[derive(Debug)]
+#[derive(Debug, Default)]
 pub struct PmaChecker {
-    eeprom_size: u32,
-    ram_size: u32,
-}
-
-impl Default for PmaChecker {
-    /// Defaults to 4 MiB EEPROM device size and 4 MiB RAM device size
-    fn default() -> Self {
-        Self::new(4 * 1024 * 1024, 4 * 1024 * 1024)
-    }
+    memory_map: MemoryMap,
 }
 
 impl PmaChecker {
-    /// Pass the ROM device and RAM device size in bytes.
+    /// Pass the ROM device and RAM device size in bytes (the other
+    /// regions are as in the default memory map).
     pub fn new(eeprom_size: u32, ram_size: u32) -> Self {
         Self {
-            eeprom_size,
-            ram_size,
+            memory_map: MemoryMap {
+                eeprom_size,
+                ram_size,
+                ..MemoryMap::default()
+            },
         }
     }
 
+    /// Use a memory map other than the default. Returns an error if
+    /// the regions do not fit in the address space or overlap.
+    pub fn with_memory_map(
+        memory_map: MemoryMap,
+    ) -> Result<Self, MemoryMapError> {
+        memory_map.validate()?;
+        Ok(Self { memory_map })
+    }
+
+    pub fn memory_map(&self) -> &MemoryMap {
+        &self.memory_map
+    }
+
+    /// If addr is in the I/O region, return the address of the same
+    /// register in the default memory map (where the register address
+    /// constants above are defined)
+    #[inline]
+    pub fn io_register(&self, addr: u32) -> Option<u32> {
+        let offset = addr.wrapping_sub(self.memory_map.io_base);
+        (offset < IO_SIZE).then(|| DEFAULT_IO_BASE + offset)
+    }
+
     /// You can only fetch instructions from the EEPROM region, and
     /// they must be four-byte aligned
     pub fn check_instruction_fetch(&self, addr: u32) -> Result<(), Exception> {
@@ -240,17 +281,18 @@ impl PmaChecker {
 
     /// True if address (and width) is fully in EEPROM region
     pub fn in_eeprom(&self, addr: u32, width: u32) -> bool {
-        address_in_region(addr, width, 0x0000_0000, self.eeprom_size)
+        address_in_region(addr, width, 0x0000_0000, self.memory_map.eeprom_size)
     }
 
     /// True if address (and width) is fully in I/O region
     fn in_io(&self, addr: u32, width: u32) -> bool {
-        address_in_region(addr, width, 0x1000_0000, 0x1000_0080)
+        address_in_region(addr, width, self.memory_map.io_base, IO_SIZE)
     }
 
     /// True if address (and width) is fully in main memory
-    fn in_main_memory(&self, addr: u32, width: u32) -> bool {
-        address_in_region(addr, width, 0x2000_0000, 0x2000_0000 + self.ram_size)
+    pub fn in_main_memory(&self, addr: u32, width: u32) -> bool {
+        let map = &self.memory_map;
+        address_in_region(addr, width, map.ram_base, map.ram_size)
     }
 }
 
@@ -259,10 +301,12 @@ fn main_memory_valid_width(width: u32) -> bool {
     width == 1 || width == 2 || width == 4
 }
 
-/// Checks whether the area targeted by the address
-/// and width fits in the region start-end
-fn address_in_region(addr: u32, width: u32, start: u32, end: u32) -> bool {
-    addr >= start && addr + width < end
+/// Checks whether the area targeted by the address and width fits in
+/// the region of size bytes starting at start. (The arithmetic is
+/// 64-bit so that a region can end at the top of the address space.)
+fn address_in_region(addr: u32, width: u32, start: u32, size: u32) -> bool {
+    let top = u64::from(addr) + u64::from(width);
+    addr >= start && top <= u64::from(start) + u64::from(size)
 }
 
 /// Test if an address is aligned (add multiple of width)
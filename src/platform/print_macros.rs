@@ -1,13 +1,88 @@
+//! Instruction printers
+//!
+//! Each instruction has a printer, which writes its disassembly into
+//! a caller-provided fmt::Write (so printing many instructions, for
+//! example into a buffered file, does not allocate a string for each
+//! one). Branch and jump targets are printed as absolute addresses,
+//! using the address of the instruction in the PrintContext, followed
+//! by the symbol containing the target if symbols are available.
+//!
+//! The macros below define the printers shared by instructions of the
+//! same format.
+
+use std::fmt;
+
+use crate::elf_utils::SymbolIndex;
+
+/// Where an instruction is being printed
+#[derive(Debug, Clone, Copy, Default)]
+pub struct PrintContext<'a> {
+    /// The address of the instruction
+    pub pc: u32,
+    /// Symbols used to name branch and jump targets
+    pub symbols: Option<&'a SymbolIndex>,
+}
+
+/// Writes the disassembly of an instruction
+pub type Printer = fn(
+    out: &mut dyn fmt::Write,
+    instr: u32,
+    context: &PrintContext,
+) -> fmt::Result;
+
+/// Write the target of a branch or jump (pc + offset) as an absolute
+/// address, followed by the symbol containing it (if any), for
+/// example 0x214 <main+0x14>
+pub fn write_target(
+    out: &mut dyn fmt::Write,
+    context: &PrintContext,
+    offset: u32,
+) -> fmt::Result {
+    let target = context.pc.wrapping_add(offset);
+    write!(out, "0x{target:x}")?;
+    let symbol = context.symbols.and_then(|symbols| symbols.lookup(target));
+    match symbol {
+        Some(symbol) if symbol.start == target => {
+            write!(out, " <{}>", symbol.name)
+        }
+        Some(symbol) => {
+            write!(out, " <{}+0x{:x}>", symbol.name, target - symbol.start)
+        }
+        None => Ok(()),
+    }
+}
+
+/// An instruction to be disassembled when it is displayed (for
+/// example, using write! or println!)
+#[derive(Clone, Copy)]
+pub struct Disassembly<'a> {
+    pub printer: Printer,
+    pub instr: u32,
+    pub context: PrintContext<'a>,
+}
+
+impl fmt::Display for Disassembly<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        (self.printer)(f, self.instr, &self.context)
+    }
+}
+
 #[macro_export]
 macro_rules! define_branch_printer {
     ($instr_name:expr) => {
-        fn printer(instr: u32) -> String {
+        fn printer(
+            out: &mut dyn std::fmt::Write,
+            instr: u32,
+            context: &$crate::platform::print_macros::PrintContext,
+        ) -> std::fmt::Result {
             let SBtype {
                 rs1: src1,
                 rs2: src2,
                 imm: offset,
             } = decode_btype(instr);
-            format!("{} x{src1}, x{src2}, 0x{offset:x}", $instr_name)
+            let offset = $crate::utils::sign_extend(offset, 12);
+            write!(out, "{} x{src1}, x{src2}, ", $instr_name)?;
+            $crate::platform::print_macros::write_target(out, context, offset)
         }
     };
 }
@@ -16,13 +91,17 @@ pub use define_branch_printer;
 #[macro_export]
 macro_rules! define_load_printer {
     ($instr_name:expr) => {
-        fn printer(instr: u32) -> String {
+        fn printer(
+            out: &mut dyn std::fmt::Write,
+            instr: u32,
+            _context: &$crate::platform::print_macros::PrintContext,
+        ) -> std::fmt::Result {
             let Itype {
                 rs1: base,
                 imm: offset,
                 rd: dest,
             } = decode_itype(instr);
-            format!("{} x{dest}, 0x{offset:x}(x{base})", $instr_name)
+            write!(out, "{} x{dest}, 0x{offset:x}(x{base})", $instr_name)
         }
     };
 }
@@ -31,13 +110,17 @@ pub use define_load_printer;
 #[macro_export]
 macro_rules! define_store_printer {
     ($instr_name:expr) => {
-        fn printer(instr: u32) -> String {
+        fn printer(
+            out: &mut dyn std::fmt::Write,
+            instr: u32,
+            _context: &$crate::platform::print_macros::PrintContext,
+        ) -> std::fmt::Result {
             let SBtype {
                 rs1: base,
                 rs2: src,
                 imm: offset,
             } = decode_stype(instr);
-            format!("{} x{src}, 0x{offset:x}(x{base})", $instr_name)
+            write!(out, "{} x{src}, 0x{offset:x}(x{base})", $instr_name)
         }
     };
 }
@@ -46,13 +129,17 @@ pub use define_store_printer;
 #[macro_export]
 macro_rules! define_reg_imm_printer {
     ($instr_name:expr) => {
-        fn printer(instr: u32) -> String {
+        fn printer(
+            out: &mut dyn std::fmt::Write,
+            instr: u32,
+            _context: &$crate::platform::print_macros::PrintContext,
+        ) -> std::fmt::Result {
             let Itype {
                 rs1: src,
                 imm: i_immediate,
                 rd: dest,
             } = decode_itype(instr);
-            format!("{} x{dest}, x{src}, 0x{i_immediate:x}", $instr_name)
+            write!(out, "{} x{dest}, x{src}, 0x{i_immediate:x}", $instr_name)
         }
     };
 }
@@ -61,29 +148,36 @@ pub use define_reg_imm_printer;
 #[macro_export]
 macro_rules! define_reg_reg_printer {
     ($instr_name:expr) => {
-        pub fn printer(instr: u32) -> String {
+        pub fn printer(
+            out: &mut dyn std::fmt::Write,
+            instr: u32,
+            _context: &$crate::platform::print_macros::PrintContext,
+        ) -> std::fmt::Result {
             let Rtype {
                 rs1: src1,
                 rs2: src2,
                 rd: dest,
             } = decode_rtype(instr);
-            format!("{} x{dest}, x{src1}, x{src2}", $instr_name)
+            write!(out, "{} x{dest}, x{src1}, x{src2}", $instr_name)
         }
     };
 }
 pub use define_reg_reg_printer;
 
-pub fn get_csr_name(addr: u16) -> String {
+pub fn get_csr_name(addr: u16) -> &'static str {
     match addr {
         _ => "unknown-csr",
     }
-    .to_string()
 }
 
 #[macro_export]
 macro_rules! define_csr_reg_printer {
     ($instr_name:expr) => {
-        fn printer(instr: u32) -> String {
+        fn printer(
+            out: &mut dyn std::fmt::Write,
+            instr: u32,
+            _context: &$crate::platform::print_macros::PrintContext,
+        ) -> std::fmt::Result {
             use crate::platform::print_macros::get_csr_name;
             let Itype {
                 rs1: source,
@@ -91,7 +185,7 @@ macro_rules! define_csr_reg_printer {
                 rd: dest,
             } = decode_itype(instr);
             let csr_name = get_csr_name(csr);
-            format!("{} x{dest}, {csr_name}, x{source}", $instr_name)
+            write!(out, "{} x{dest}, {csr_name}, x{source}", $instr_name)
         }
     };
 }
@@ -100,7 +194,11 @@ pub use define_csr_reg_printer;
 #[macro_export]
 macro_rules! define_csr_imm_printer {
     ($instr_name:expr) => {
-        pub fn printer(instr: u32) -> String {
+        pub fn printer(
+            out: &mut dyn std::fmt::Write,
+            instr: u32,
+            _context: &$crate::platform::print_macros::PrintContext,
+        ) -> std::fmt::Result {
             use crate::platform::print_macros::get_csr_name;
             let Itype {
                 rs1: uimm,
@@ -108,7 +206,7 @@ macro_rules! define_csr_imm_printer {
                 rd: dest,
             } = decode_itype(instr);
             let csr_name = get_csr_name(csr);
-            format!("{} x{dest}, {csr_name}, 0x{uimm:x}", $instr_name)
+            write!(out, "{} x{dest}, {csr_name}, 0x{uimm:x}", $instr_name)
         }
     };
 }
@@ -5,10 +5,16 @@ use crate::{
         decode_btype, decode_itype, decode_jtype, decode_rtype, decode_stype,
         decode_utype, Itype, Rtype, SBtype, UJtype,
     },
-    platform::{machine::Exception, memory::Wordsize},
+    platform::{
+        machine::Exception,
+        memory::Wordsize,
+        print_macros::{write_target, PrintContext},
+    },
     utils::{interpret_i32_as_unsigned, interpret_u32_as_signed, sign_extend},
 };
 
+use std::fmt;
+
 use super::{eei::Eei, Instr};
 
 fn check_instruction_address_aligned(pc: u32) -> Result<(), Exception> {
@@ -59,12 +65,16 @@ pub fn lui<E: Eei>() -> Instr<E> {
         Ok(())
     }
 
-    fn printer(instr: u32) -> String {
+    fn printer(
+        out: &mut dyn fmt::Write,
+        instr: u32,
+        _context: &PrintContext,
+    ) -> fmt::Result {
         let UJtype {
             rd: dest,
             imm: u_immediate,
         } = decode_utype(instr);
-        format!("lui x{dest}, 0x{u_immediate:x}")
+        write!(out, "lui x{dest}, 0x{u_immediate:x}")
     }
 
     Instr { executer, printer }
@@ -89,12 +99,16 @@ pub fn auipc<E: Eei>() -> Instr<E> {
         Ok(())
     }
 
-    fn printer(instr: u32) -> String {
+    fn printer(
+        out: &mut dyn fmt::Write,
+        instr: u32,
+        _context: &PrintContext,
+    ) -> fmt::Result {
         let UJtype {
             rd: dest,
             imm: u_immediate,
         } = decode_utype(instr);
-        format!("auipc x{dest}, 0x{u_immediate:x}")
+        write!(out, "auipc x{dest}, 0x{u_immediate:x}")
     }
 
     Instr { executer, printer }
@@ -123,12 +137,17 @@ pub fn jal<E: Eei>() -> Instr<E> {
         Ok(())
     }
 
-    fn printer(instr: u32) -> String {
+    fn printer(
+        out: &mut dyn fmt::Write,
+        instr: u32,
+        context: &PrintContext,
+    ) -> fmt::Result {
         let UJtype {
             rd: dest,
             imm: offset,
         } = decode_jtype(instr);
-        format!("jal x{dest}, 0x{offset:x}")
+        write!(out, "jal x{dest}, ")?;
+        write_target(out, context, sign_extend(offset, 20))
     }
 
     Instr { executer, printer }
@@ -162,13 +181,17 @@ pub fn jalr<E: Eei>() -> Instr<E> {
         Ok(())
     }
 
-    fn printer(instr: u32) -> String {
+    fn printer(
+        out: &mut dyn fmt::Write,
+        instr: u32,
+        _context: &PrintContext,
+    ) -> fmt::Result {
         let Itype {
             rs1: base,
             imm: offset,
             rd: dest,
         } = decode_itype(instr);
-        format!("jalr x{dest}, 0x{offset:x}(x{base})")
+        write!(out, "jalr x{dest}, 0x{offset:x}(x{base})")
     }
 
     Instr { executer, printer }
@@ -191,7 +214,7 @@ fn do_branch<E: Eei>(
     offset: u16,
 ) -> Result<(), Exception> {
     if branch_taken {
-        let pc_relative_address = sign_extend(offset, 11);
+        let pc_relative_address = sign_extend(offset, 12);
         jump_relative_to_pc(eei, pc_relative_address)?;
     } else {
         eei.increment_pc();
@@ -94,9 +94,13 @@ pub fn div<E: Eei>() -> Instr<E> {
         let value = {
             let src1 = interpret_u32_as_signed(src1);
             let src2 = interpret_u32_as_signed(src2);
-            // Put wrapping_div for consistency, but not sure what
-            // wrapping div means for ints (same comment for rem)
-            src1.wrapping_div(src2) as u32
+            // Division by zero gives -1, and wrapping_div gives the
+            // result required for overflow (i32::MIN / -1 = i32::MIN)
+            if src2 == 0 {
+                u32::MAX
+            } else {
+                src1.wrapping_div(src2) as u32
+            }
         };
         eei.set_x(dest, value);
         eei.increment_pc();
@@ -109,7 +113,8 @@ pub fn div<E: Eei>() -> Instr<E> {
 pub fn divu<E: Eei>() -> Instr<E> {
     fn executer<E: Eei>(eei: &mut E, instr: u32) -> Result<(), Exception> {
         let (src1, src2, dest) = reg_reg_values(eei, instr);
-        let value = src1.wrapping_div(src2);
+        // Division by zero gives 2^32 - 1
+        let value = src1.checked_div(src2).unwrap_or(u32::MAX);
         eei.set_x(dest, value);
         eei.increment_pc();
         Ok(())
@@ -124,7 +129,13 @@ pub fn rem<E: Eei>() -> Instr<E> {
         let value = {
             let src1 = interpret_u32_as_signed(src1);
             let src2 = interpret_u32_as_signed(src2);
-            src1.wrapping_rem(src2) as u32
+            // The remainder of division by zero is the dividend, and
+            // of overflow (i32::MIN % -1) is zero
+            if src2 == 0 {
+                src1 as u32
+            } else {
+                src1.wrapping_rem(src2) as u32
+            }
         };
         eei.set_x(dest, value);
         eei.increment_pc();
@@ -137,7 +148,8 @@ pub fn rem<E: Eei>() -> Instr<E> {
 pub fn remu<E: Eei>() -> Instr<E> {
     fn executer<E: Eei>(eei: &mut E, instr: u32) -> Result<(), Exception> {
         let (src1, src2, dest) = reg_reg_values(eei, instr);
-        let value = src1.wrapping_rem(src2);
+        // The remainder of division by zero is the dividend
+        let value = src1.checked_rem(src2).unwrap_or(src1);
         eei.set_x(dest, value);
         eei.increment_pc();
         Ok(())
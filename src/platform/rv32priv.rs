@@ -1,4 +1,7 @@
+use std::fmt;
+
 use crate::platform::machine::Exception;
+use crate::platform::print_macros::PrintContext;
 
 use super::{eei::Eei, Instr};
 
@@ -8,8 +11,12 @@ pub fn mret<E: Eei>() -> Instr<E> {
         Ok(())
     }
 
-    fn printer(_instr: u32) -> String {
-        "mret".to_string()
+    fn printer(
+        out: &mut dyn fmt::Write,
+        _instr: u32,
+        _context: &PrintContext,
+    ) -> fmt::Result {
+        out.write_str("mret")
     }
 
     Instr { executer, printer }
@@ -20,20 +27,28 @@ pub fn ecall<E: Eei>() -> Instr<E> {
         Err(Exception::MmodeEcall)
     }
 
-    fn printer(_instr: u32) -> String {
-        "ecall".to_string()
+    fn printer(
+        out: &mut dyn fmt::Write,
+        _instr: u32,
+        _context: &PrintContext,
+    ) -> fmt::Result {
+        out.write_str("ecall")
     }
 
     Instr { executer, printer }
 }
 
 pub fn ebreak<E: Eei>() -> Instr<E> {
-    fn executer<E: Eei>(_eei: &mut E, _instr: u32) -> Result<(), Exception> {
-        Err(Exception::Breakpoint)
+    fn executer<E: Eei>(eei: &mut E, _instr: u32) -> Result<(), Exception> {
+        eei.ebreak()
     }
 
-    fn printer(_instr: u32) -> String {
-        "ebreak".to_string()
+    fn printer(
+        out: &mut dyn fmt::Write,
+        _instr: u32,
+        _context: &PrintContext,
+    ) -> fmt::Result {
+        out.write_str("ebreak")
     }
 
     Instr { executer, printer }
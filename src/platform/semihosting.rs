@@ -0,0 +1,551 @@
+//! RISC-V semihosting
+//!
+//! Semihosting lets a program use the file system of the host running
+//! the emulator, which is much faster than building large inputs into
+//! the EEPROM image or streaming them through the UART. It follows the
+//! RISC-V semihosting convention (which uses the Arm semihosting
+//! operations): a call is the uncompressed sequence
+//!
+//! ```text
+//! slli x0, x0, 0x1f
+//! ebreak
+//! srai x0, x0, 7
+//! ```
+//!
+//! with the operation number in a0 and a parameter (usually the
+//! address of a block of 32-bit parameters) in a1. The result is
+//! returned in a0, and execution continues after the ebreak. An ebreak
+//! that is not part of this sequence, or any ebreak when semihosting
+//! is disabled, raises the breakpoint exception as usual.
+//!
+//! The supported operations are SYS_OPEN, SYS_CLOSE, SYS_WRITEC,
+//! SYS_WRITE0, SYS_WRITE, SYS_READ, SYS_SEEK, SYS_FLEN, SYS_CLOCK,
+//! SYS_EXIT and SYS_EXIT_EXTENDED. Other operations return -1.
+//!
+//! Files are opened relative to a host directory, and paths that are
+//! absolute or contain .. are refused, so a program cannot access
+//! anything outside that directory. The special file :tt opens the
+//! console: writes go to the UART output (like writes to the UARTTX
+//! register), and reads return end of file.
+//!
+//! SYS_CLOCK is derived from mtime, counting at a nominal 1 MHz, so
+//! that runs stay deterministic. Open files are not part of the
+//! platform state saved in a checkpoint.
+
+use std::fs::{File, OpenOptions};
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::path::{Component, Path, PathBuf};
+
+use super::eei::Eei;
+use super::hooks::Hooks;
+use super::machine::Exception;
+use super::memory::Wordsize;
+use super::Platform;
+
+/// slli x0, x0, 0x1f
+const SEMIHOSTING_ENTRY: u32 = 0x01f0_1013;
+/// srai x0, x0, 7
+const SEMIHOSTING_EXIT: u32 = 0x4070_5013;
+
+pub const SYS_OPEN: u32 = 0x01;
+pub const SYS_CLOSE: u32 = 0x02;
+pub const SYS_WRITEC: u32 = 0x03;
+pub const SYS_WRITE0: u32 = 0x04;
+pub const SYS_WRITE: u32 = 0x05;
+pub const SYS_READ: u32 = 0x06;
+pub const SYS_SEEK: u32 = 0x0a;
+pub const SYS_FLEN: u32 = 0x0c;
+pub const SYS_CLOCK: u32 = 0x10;
+pub const SYS_EXIT: u32 = 0x18;
+pub const SYS_EXIT_EXTENDED: u32 = 0x20;
+
+/// The SYS_EXIT reason for a normal exit
+pub const ADP_STOPPED_APPLICATION_EXIT: u32 = 0x20026;
+
+/// mtime ticks per centisecond (for SYS_CLOCK)
+const MTIME_TICKS_PER_CENTISECOND: u64 = 10_000;
+
+/// The error result of an operation (-1)
+const FAILED: u32 = u32::MAX;
+
+/// A file opened by the program
+#[derive(Debug)]
+enum Handle {
+    /// The console (:tt)
+    Console,
+    File(File),
+}
+
+/// Semihosting state: the host directory and the open files
+#[derive(Debug)]
+pub struct Semihosting {
+    root: PathBuf,
+    /// Indexed by file handle. Closed handles are None
+    handles: Vec<Option<Handle>>,
+}
+
+impl Semihosting {
+    /// Allow the program to open files in root
+    pub fn new(root: PathBuf) -> Self {
+        Self {
+            root,
+            handles: Vec::new(),
+        }
+    }
+
+    /// The host path for a path given by the program, or None if it
+    /// could refer to something outside the root directory
+    fn host_path(&self, name: &str) -> Option<PathBuf> {
+        let path = Path::new(name);
+        let inside_root = path
+            .components()
+            .all(|component| matches!(component, Component::Normal(_)));
+        (inside_root && !name.is_empty()).then(|| self.root.join(path))
+    }
+
+    fn open(&mut self, name: &str, mode: u32) -> u32 {
+        let handle = if name == ":tt" {
+            Handle::Console
+        } else {
+            let Some(path) = self.host_path(name) else {
+                return FAILED;
+            };
+            // Modes are the fopen modes r, rb, r+, r+b, w, wb, w+, w+b,
+            // a, ab, a+, a+b in order
+            let mut options = OpenOptions::new();
+            match mode / 4 {
+                0 => options.read(true).write(mode & 2 != 0),
+                1 => options
+                    .write(true)
+                    .read(mode & 2 != 0)
+                    .create(true)
+                    .truncate(true),
+                2 => options.append(true).read(mode & 2 != 0).create(true),
+                _ => return FAILED,
+            };
+            match options.open(path) {
+                Ok(file) => Handle::File(file),
+                Err(_) => return FAILED,
+            }
+        };
+
+        let fd = match self.handles.iter().position(Option::is_none) {
+            Some(fd) => {
+                self.handles[fd] = Some(handle);
+                fd
+            }
+            None => {
+                self.handles.push(Some(handle));
+                self.handles.len() - 1
+            }
+        };
+        u32::try_from(fd).unwrap()
+    }
+
+    fn handle(&mut self, fd: u32) -> Option<&mut Handle> {
+        self.handles.get_mut(usize::try_from(fd).ok()?)?.as_mut()
+    }
+
+    fn close(&mut self, fd: u32) -> u32 {
+        match usize::try_from(fd)
+            .ok()
+            .and_then(|fd| self.handles.get_mut(fd))
+        {
+            Some(handle @ Some(_)) => {
+                *handle = None;
+                0
+            }
+            _ => FAILED,
+        }
+    }
+}
+
+impl<H: Hooks> Platform<H> {
+    /// Enable semihosting, with files opened relative to root, or
+    /// disable it (the default) if root is None
+    pub fn set_semihosting(&mut self, root: Option<PathBuf>) {
+        self.semihosting = root.map(Semihosting::new);
+    }
+
+    /// If the program has exited using SYS_EXIT, return the exit
+    /// status (and clear it, so that it is only returned once)
+    pub fn take_exit_status(&mut self) -> Option<u32> {
+        self.exit_status.take()
+    }
+
+    /// Handle an ebreak instruction at the current pc: perform a
+    /// semihosting call if semihosting is enabled and the ebreak is
+    /// part of the semihosting sequence, otherwise raise a breakpoint
+    /// exception
+    pub(super) fn semihosting_ebreak(&mut self) -> Result<(), Exception> {
+        let pc = self.pc;
+        let is_call = self.semihosting.is_some()
+            && pc >= 4
+            && self.fetch_instruction(pc - 4).ok() == Some(SEMIHOSTING_ENTRY)
+            && self.fetch_instruction(pc + 4).ok() == Some(SEMIHOSTING_EXIT);
+        if !is_call {
+            return Err(Exception::Breakpoint);
+        }
+
+        let result = self.semihosting_call(self.x(10), self.x(11))?;
+        self.set_x(10, result);
+        self.increment_pc();
+        Ok(())
+    }
+
+    /// Read the nth word of a parameter block
+    fn param(&self, block: u32, n: u32) -> Result<u32, Exception> {
+        self.load(block.wrapping_add(4 * n), Wordsize::Word)
+    }
+
+    /// Read len bytes from guest memory
+    fn read_bytes(&self, addr: u32, len: u32) -> Result<Vec<u8>, Exception> {
+        (0..len)
+            .map(|n| {
+                let byte = self.load(addr.wrapping_add(n), Wordsize::Byte)?;
+                Ok(u8::try_from(byte).unwrap())
+            })
+            .collect()
+    }
+
+    /// Read a zero-terminated string from guest memory
+    fn read_string(&self, mut addr: u32) -> Result<String, Exception> {
+        let mut bytes = Vec::new();
+        loop {
+            let byte = self.load(addr, Wordsize::Byte)?;
+            if byte == 0 {
+                break;
+            }
+            bytes.push(u8::try_from(byte).unwrap());
+            addr = addr.wrapping_add(1);
+        }
+        Ok(String::from_utf8_lossy(&bytes).into_owned())
+    }
+
+    fn write_bytes(
+        &mut self,
+        addr: u32,
+        bytes: &[u8],
+    ) -> Result<(), Exception> {
+        for (n, byte) in (0..).zip(bytes) {
+            self.store(addr.wrapping_add(n), (*byte).into(), Wordsize::Byte)?;
+        }
+        Ok(())
+    }
+
+    /// Perform a semihosting operation, returning the value for a0
+    fn semihosting_call(
+        &mut self,
+        operation: u32,
+        param: u32,
+    ) -> Result<u32, Exception> {
+        let result = match operation {
+            SYS_OPEN => {
+                let name_len = self.param(param, 2)?;
+                let name = self.read_bytes(self.param(param, 0)?, name_len)?;
+                let name = String::from_utf8_lossy(&name).into_owned();
+                let mode = self.param(param, 1)?;
+                self.semihosting().open(&name, mode)
+            }
+            SYS_CLOSE => {
+                let fd = self.param(param, 0)?;
+                self.semihosting().close(fd)
+            }
+            SYS_WRITEC => {
+                let ch = self.load(param, Wordsize::Byte)?;
+                self.push_uartout(&[u8::try_from(ch).unwrap()]);
+                0
+            }
+            SYS_WRITE0 => {
+                let string = self.read_string(param)?;
+                self.push_uartout(string.as_bytes());
+                0
+            }
+            SYS_WRITE => {
+                let fd = self.param(param, 0)?;
+                let len = self.param(param, 2)?;
+                let bytes = self.read_bytes(self.param(param, 1)?, len)?;
+                match self.semihosting().handle(fd) {
+                    Some(Handle::Console) => {
+                        self.push_uartout(&bytes);
+                        0
+                    }
+                    Some(Handle::File(file)) => match file.write(&bytes) {
+                        Ok(written) => len - u32::try_from(written).unwrap(),
+                        Err(_) => len,
+                    },
+                    None => FAILED,
+                }
+            }
+            SYS_READ => {
+                let fd = self.param(param, 0)?;
+                let addr = self.param(param, 1)?;
+                let len = self.param(param, 2)?;
+                // Check the buffer is in RAM before allocating len
+                // bytes for it, so that the program cannot make the
+                // host allocate more memory than the RAM size
+                if len != 0 && !self.pma_checker.in_main_memory(addr, len) {
+                    return Err(Exception::StoreAccessFault);
+                }
+                let mut bytes = vec![0; usize::try_from(len).unwrap()];
+                let read = match self.semihosting().handle(fd) {
+                    Some(Handle::Console) => Some(0),
+                    Some(Handle::File(file)) => read_up_to(file, &mut bytes),
+                    None => None,
+                };
+                match read {
+                    Some(read) => {
+                        self.write_bytes(addr, &bytes[..read])?;
+                        len - u32::try_from(read).unwrap()
+                    }
+                    None => FAILED,
+                }
+            }
+            SYS_SEEK => {
+                let fd = self.param(param, 0)?;
+                let pos = self.param(param, 1)?;
+                match self.semihosting().handle(fd) {
+                    Some(Handle::File(file)) => {
+                        match file.seek(SeekFrom::Start(pos.into())) {
+                            Ok(_) => 0,
+                            Err(_) => FAILED,
+                        }
+                    }
+                    _ => FAILED,
+                }
+            }
+            SYS_FLEN => {
+                let fd = self.param(param, 0)?;
+                match self.semihosting().handle(fd) {
+                    Some(Handle::File(file)) => file
+                        .metadata()
+                        .ok()
+                        .and_then(|metadata| metadata.len().try_into().ok())
+                        .unwrap_or(FAILED),
+                    _ => FAILED,
+                }
+            }
+            SYS_CLOCK => {
+                let mtime = self.machine_interface.machine.mtime();
+                let centiseconds = mtime / MTIME_TICKS_PER_CENTISECOND;
+                u32::try_from(centiseconds).unwrap_or(FAILED)
+            }
+            SYS_EXIT => {
+                // On 32-bit targets, the parameter is the reason
+                let status = u32::from(param != ADP_STOPPED_APPLICATION_EXIT);
+                self.exit_status = Some(status);
+                0
+            }
+            SYS_EXIT_EXTENDED => {
+                let reason = self.param(param, 0)?;
+                let status = if reason == ADP_STOPPED_APPLICATION_EXIT {
+                    self.param(param, 1)?
+                } else {
+                    1
+                };
+                self.exit_status = Some(status);
+                0
+            }
+            _ => FAILED,
+        };
+        Ok(result)
+    }
+
+    fn semihosting(&mut self) -> &mut Semihosting {
+        self.semihosting
+            .as_mut()
+            .expect("semihosting calls are only made when it is enabled")
+    }
+}
+
+/// Read from a file until buf is full or the end of the file is
+/// reached, returning the number of bytes read (None on an error)
+fn read_up_to(file: &mut File, buf: &mut [u8]) -> Option<usize> {
+    let mut total = 0;
+    while total < buf.len() {
+        match file.read(&mut buf[total..]) {
+            Ok(0) => break,
+            Ok(n) => total += n,
+            Err(_) => return None,
+        }
+    }
+    Some(total)
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::elf_utils::ElfLoadable;
+    use crate::platform::breakpoints::StopReason;
+
+    const EBREAK: u32 = 0x0010_0073;
+    const NOP: u32 = 0x0000_0013;
+    const CALL_ADDR: u32 = 0x88;
+    const PARAM_ADDR: u32 = 0x2000_0000;
+    const NAME_ADDR: u32 = 0x2000_0100;
+    const BUF_ADDR: u32 = 0x2000_0200;
+
+    fn write_word(platform: &mut Platform, addr: u32, word: u32) {
+        for (n, byte) in (0..).zip(word.to_le_bytes()) {
+            platform.write_byte(addr + n, byte).unwrap();
+        }
+    }
+
+    /// A platform with an ebreak at CALL_ADDR + 4, which is a
+    /// semihosting call if sequence is true (otherwise it is between
+    /// two nops)
+    fn make_platform(sequence: bool) -> Platform {
+        let mut platform = Platform::new();
+        platform.set_exceptions_are_errors(true);
+        let (entry, exit) = if sequence {
+            (SEMIHOSTING_ENTRY, SEMIHOSTING_EXIT)
+        } else {
+            (NOP, NOP)
+        };
+        write_word(&mut platform, CALL_ADDR, entry);
+        write_word(&mut platform, CALL_ADDR + 4, EBREAK);
+        write_word(&mut platform, CALL_ADDR + 8, exit);
+        platform
+    }
+
+    /// Write params to the parameter block, and make a semihosting
+    /// call with it
+    fn call(
+        platform: &mut Platform,
+        operation: u32,
+        params: &[u32],
+    ) -> Result<(StopReason, u32), Exception> {
+        for (n, param) in (0..).zip(params) {
+            platform.store(PARAM_ADDR + 4 * n, *param, Wordsize::Word)?;
+        }
+        platform.set_pc(CALL_ADDR);
+        platform.set_x(10, operation);
+        platform.set_x(11, PARAM_ADDR);
+        let stop_reason = platform.run(3)?;
+        Ok((stop_reason, platform.x(10)))
+    }
+
+    fn open(platform: &mut Platform, name: &str, mode: u32) -> u32 {
+        platform.write_bytes(NAME_ADDR, name.as_bytes()).unwrap();
+        let len = u32::try_from(name.len()).unwrap();
+        call(platform, SYS_OPEN, &[NAME_ADDR, mode, len]).unwrap().1
+    }
+
+    fn temp_root(name: &str) -> PathBuf {
+        let mut root = std::env::temp_dir();
+        root.push(format!("riscvemu-{name}-{}", std::process::id()));
+        std::fs::create_dir_all(&root).unwrap();
+        root
+    }
+
+    #[test]
+    fn check_file_round_trip() {
+        let root = temp_root("semihosting");
+        let mut platform = make_platform(true);
+        platform.set_semihosting(Some(root.clone()));
+
+        let fd = open(&mut platform, "out.txt", 4);
+        assert_ne!(fd, FAILED);
+        platform.write_bytes(BUF_ADDR, b"hello").unwrap();
+        let (_, unwritten) =
+            call(&mut platform, SYS_WRITE, &[fd, BUF_ADDR, 5]).unwrap();
+        assert_eq!(unwritten, 0);
+        assert_eq!(platform.pc(), CALL_ADDR + 12);
+        assert_eq!(call(&mut platform, SYS_CLOSE, &[fd]).unwrap().1, 0);
+        assert_eq!(call(&mut platform, SYS_CLOSE, &[fd]).unwrap().1, FAILED);
+        let contents = std::fs::read(root.join("out.txt")).unwrap();
+        assert_eq!(contents, b"hello");
+
+        let fd = open(&mut platform, "out.txt", 0);
+        assert_eq!(call(&mut platform, SYS_FLEN, &[fd]).unwrap().1, 5);
+        let (_, unread) =
+            call(&mut platform, SYS_READ, &[fd, BUF_ADDR, 8]).unwrap();
+        assert_eq!(unread, 3);
+        assert_eq!(platform.read_bytes(BUF_ADDR, 5).unwrap(), b"hello");
+        assert_eq!(call(&mut platform, SYS_SEEK, &[fd, 1]).unwrap().1, 0);
+        call(&mut platform, SYS_READ, &[fd, BUF_ADDR, 2]).unwrap();
+        assert_eq!(platform.read_bytes(BUF_ADDR, 2).unwrap(), b"el");
+
+        std::fs::remove_dir_all(&root).unwrap();
+    }
+
+    /// A read into a buffer that is not in RAM faults before anything
+    /// is read from the file
+    #[test]
+    fn check_read_outside_ram_faults() {
+        let root = temp_root("semihosting-read");
+        std::fs::write(root.join("in.txt"), b"hello").unwrap();
+        let mut platform = make_platform(true);
+        platform.set_semihosting(Some(root.clone()));
+
+        let fd = open(&mut platform, "in.txt", 0);
+        let result = call(&mut platform, SYS_READ, &[fd, BUF_ADDR, u32::MAX]);
+        assert!(matches!(result, Err(Exception::StoreAccessFault)));
+        let result = call(&mut platform, SYS_READ, &[fd, 0x100, 5]);
+        assert!(matches!(result, Err(Exception::StoreAccessFault)));
+        let (_, unread) =
+            call(&mut platform, SYS_READ, &[fd, BUF_ADDR, 5]).unwrap();
+        assert_eq!(unread, 0);
+        assert_eq!(platform.read_bytes(BUF_ADDR, 5).unwrap(), b"hello");
+
+        std::fs::remove_dir_all(&root).unwrap();
+    }
+
+    #[test]
+    fn check_paths_outside_root_are_refused() {
+        let root = temp_root("semihosting-sandbox");
+        let mut platform = make_platform(true);
+        platform.set_semihosting(Some(root.join("inner")));
+
+        assert_eq!(open(&mut platform, "../escape.txt", 4), FAILED);
+        assert_eq!(open(&mut platform, "/tmp/escape.txt", 4), FAILED);
+        assert!(!root.join("escape.txt").exists());
+
+        let console = open(&mut platform, ":tt", 4);
+        platform.write_bytes(BUF_ADDR, b"hi\n").unwrap();
+        call(&mut platform, SYS_WRITE, &[console, BUF_ADDR, 3]).unwrap();
+        assert_eq!(platform.flush_uartout(), "hi\n");
+
+        std::fs::remove_dir_all(&root).unwrap();
+    }
+
+    #[test]
+    fn check_exit() {
+        let mut platform = make_platform(true);
+        platform.set_semihosting(Some(std::env::temp_dir()));
+
+        platform.set_pc(CALL_ADDR);
+        platform.set_x(10, SYS_EXIT);
+        platform.set_x(11, ADP_STOPPED_APPLICATION_EXIT);
+        assert_eq!(platform.run(100).unwrap(), StopReason::Exit(0));
+
+        // run_to_cycle stops at the exit, short of the requested cycle
+        platform.set_pc(CALL_ADDR);
+        platform.set_x(10, SYS_EXIT);
+        platform.set_x(11, ADP_STOPPED_APPLICATION_EXIT);
+        let cycle = platform.mcycle() + 100;
+        let stop_reason = platform.run_to_cycle(cycle).unwrap();
+        assert_eq!(stop_reason, StopReason::Exit(0));
+        assert!(platform.mcycle() < cycle);
+
+        let params = [ADP_STOPPED_APPLICATION_EXIT, 3];
+        let (stop_reason, _) =
+            call(&mut platform, SYS_EXIT_EXTENDED, &params).unwrap();
+        assert_eq!(stop_reason, StopReason::Exit(3));
+    }
+
+    /// Without semihosting, or outside the semihosting sequence, an
+    /// ebreak is a breakpoint exception
+    #[test]
+    fn check_plain_ebreak() {
+        let mut platform = make_platform(true);
+        let result = call(&mut platform, SYS_EXIT, &[]);
+        assert!(matches!(result, Err(Exception::Breakpoint)));
+
+        let mut platform = make_platform(false);
+        platform.set_semihosting(Some(std::env::temp_dir()));
+        let result = call(&mut platform, SYS_EXIT, &[]);
+        assert!(matches!(result, Err(Exception::Breakpoint)));
+    }
+}
@@ -0,0 +1,310 @@
+//! UART receiver
+//!
+//! The receive side of the debug UART is a FIFO of bytes sent by the
+//! host, read by the program through two memory-mapped registers:
+//!
+//! | Address | Description |
+//! |---------|-------------|
+//! | 0x1000_001c | uartrx (read removes and returns the oldest byte in the FIFO, or 0 if it is empty; writes are ignored) |
+//! | 0x1000_0020 | uartstat (UART status and control, see below) |
+//!
+//! The fields of uartstat are:
+//!
+//! | Bits | Description |
+//! |------|-------------|
+//! | 0 | RX data available (read-only) |
+//! | 1 | RX overrun: a byte arrived while the FIFO was full, and was dropped (read-only, cleared by reading uartstat) |
+//! | 2 | RX interrupt enable (read/write) |
+//! | 16-31 | Number of bytes in the FIFO (read-only) |
+//!
+//! While the RX interrupt is enabled and the FIFO is not empty, the
+//! UART raises the machine external interrupt (mip.MEIP). The
+//! interrupt is level-triggered, so the handler should read uartrx
+//! until uartstat shows the FIFO is empty.
+//!
+//! The host sends input in bulk (see Platform::send_uart_input), and
+//! it is held in a host-side buffer until it arrives in the FIFO. By
+//! default, a byte arrives as soon as there is room in the FIFO, so no
+//! input is lost however slowly the program reads it. Alternatively,
+//! bytes can arrive at a fixed rate (one every so many cycles), like a
+//! real serial line without flow control, in which case bytes that
+//! arrive while the FIFO is full are dropped and the overrun bit is
+//! set.
+//!
+//! A checkpoint saves the FIFO, the input not yet delivered to it,
+//! and the status bits (see UartRxState). The FIFO depth and pacing
+//! interval are settings, and are not saved.
+
+use std::collections::VecDeque;
+
+/// The default number of bytes the FIFO can hold
+pub const DEFAULT_RX_DEPTH: usize = 16;
+
+/// uartstat: RX data available
+pub const UARTSTAT_RX_AVAILABLE: u32 = 1 << 0;
+/// uartstat: RX overrun
+pub const UARTSTAT_RX_OVERRUN: u32 = 1 << 1;
+/// uartstat: RX interrupt enable
+pub const UARTSTAT_RX_INTERRUPT_ENABLE: u32 = 1 << 2;
+/// uartstat: shift of the FIFO count field
+pub const UARTSTAT_RX_COUNT_SHIFT: u32 = 16;
+
+#[derive(Debug)]
+pub struct UartRx {
+    fifo: VecDeque<u8>,
+    depth: usize,
+    /// Bytes sent by the host that have not yet arrived in the FIFO
+    pending: VecDeque<u8>,
+    /// If present, one pending byte arrives every interval cycles,
+    /// whether or not there is room in the FIFO. Otherwise, bytes
+    /// arrive as soon as there is room
+    interval: Option<u64>,
+    /// The cycle when the next pending byte arrives (u64::MAX if
+    /// there is no paced arrival scheduled)
+    next_arrival: u64,
+    overrun: bool,
+    interrupt_enable: bool,
+    /// Set when the interrupt level may have changed since the last
+    /// tick
+    changed: bool,
+}
+
+/// The receiver state saved in a checkpoint
+#[derive(Debug, Clone, Default, PartialEq, Eq, Hash)]
+pub struct UartRxState {
+    pub fifo: Vec<u8>,
+    pub pending: Vec<u8>,
+    pub next_arrival: u64,
+    pub overrun: bool,
+    pub interrupt_enable: bool,
+}
+
+impl Default for UartRx {
+    fn default() -> Self {
+        Self {
+            fifo: VecDeque::new(),
+            depth: DEFAULT_RX_DEPTH,
+            pending: VecDeque::new(),
+            interval: None,
+            next_arrival: u64::MAX,
+            overrun: false,
+            interrupt_enable: false,
+            changed: false,
+        }
+    }
+}
+
+impl UartRx {
+    /// Set the number of bytes the FIFO can hold (at least one).
+    /// Bytes already in the FIFO beyond the new depth are kept.
+    pub fn set_depth(&mut self, depth: usize) {
+        self.depth = depth.max(1);
+        self.fill();
+    }
+
+    /// Deliver one byte every interval cycles (starting interval
+    /// cycles after mcycle), or as soon as there is room in the FIFO
+    /// if interval is None
+    pub fn set_interval(&mut self, interval: Option<u64>, mcycle: u64) {
+        self.interval = interval.map(|interval| interval.max(1));
+        self.schedule(mcycle);
+        self.fill();
+    }
+
+    /// Add bytes sent by the host to the end of the input
+    pub fn send(&mut self, bytes: &[u8], mcycle: u64) {
+        self.pending.extend(bytes);
+        if self.next_arrival == u64::MAX {
+            self.schedule(mcycle);
+        }
+        self.fill();
+    }
+
+    /// The number of bytes sent by the host that the program has not
+    /// read yet (in the FIFO or still waiting to arrive)
+    pub fn unread(&self) -> usize {
+        self.fifo.len() + self.pending.len()
+    }
+
+    /// Read the uartrx register
+    pub fn read_data(&mut self) -> u32 {
+        let byte = self.fifo.pop_front().unwrap_or(0);
+        self.fill();
+        self.changed = true;
+        byte.into()
+    }
+
+    /// Read the uartstat register (which clears the overrun bit)
+    pub fn read_status(&mut self) -> u32 {
+        let mut status = u32::try_from(self.fifo.len())
+            .unwrap_or(u32::MAX)
+            .min(0xffff)
+            << UARTSTAT_RX_COUNT_SHIFT;
+        if !self.fifo.is_empty() {
+            status |= UARTSTAT_RX_AVAILABLE;
+        }
+        if self.overrun {
+            status |= UARTSTAT_RX_OVERRUN;
+        }
+        if self.interrupt_enable {
+            status |= UARTSTAT_RX_INTERRUPT_ENABLE;
+        }
+        self.overrun = false;
+        status
+    }
+
+    /// Write the uartstat register
+    pub fn write_status(&mut self, value: u32) {
+        self.interrupt_enable = value & UARTSTAT_RX_INTERRUPT_ENABLE != 0;
+        self.changed = true;
+    }
+
+    /// True if the receiver is raising the external interrupt
+    pub fn interrupt_level(&self) -> bool {
+        self.interrupt_enable && !self.fifo.is_empty()
+    }
+
+    /// Advance the receiver to mcycle, delivering any paced bytes that
+    /// have arrived. Returns true if the interrupt level may have
+    /// changed since the last tick.
+    ///
+    /// This is called every cycle, so the common case (nothing to do)
+    /// is a single comparison.
+    #[inline]
+    pub fn tick(&mut self, mcycle: u64) -> bool {
+        if !self.changed && mcycle < self.next_arrival {
+            return false;
+        }
+        if let Some(interval) = self.interval {
+            while mcycle >= self.next_arrival {
+                let Some(byte) = self.pending.pop_front() else {
+                    self.next_arrival = u64::MAX;
+                    break;
+                };
+                if self.fifo.len() < self.depth {
+                    self.fifo.push_back(byte);
+                } else {
+                    self.overrun = true;
+                }
+                self.next_arrival = self.next_arrival.saturating_add(interval);
+            }
+            if self.pending.is_empty() {
+                self.next_arrival = u64::MAX;
+            }
+        }
+        self.changed = false;
+        true
+    }
+
+    /// Schedule the next paced arrival (if any) interval cycles after
+    /// mcycle
+    fn schedule(&mut self, mcycle: u64) {
+        self.next_arrival = match self.interval {
+            Some(interval) if !self.pending.is_empty() => {
+                mcycle.saturating_add(interval)
+            }
+            _ => u64::MAX,
+        };
+        self.changed = true;
+    }
+
+    /// Save the receiver state (for a checkpoint)
+    pub fn state(&self) -> UartRxState {
+        UartRxState {
+            fifo: self.fifo.iter().copied().collect(),
+            pending: self.pending.iter().copied().collect(),
+            next_arrival: self.next_arrival,
+            overrun: self.overrun,
+            interrupt_enable: self.interrupt_enable,
+        }
+    }
+
+    /// Restore a state saved using state(), keeping the current depth
+    /// and interval. If the saved state has no paced arrival scheduled
+    /// (or pacing is off), the next arrival is scheduled from mcycle.
+    pub fn restore(&mut self, state: &UartRxState, mcycle: u64) {
+        self.fifo = state.fifo.iter().copied().collect();
+        self.pending = state.pending.iter().copied().collect();
+        self.overrun = state.overrun;
+        self.interrupt_enable = state.interrupt_enable;
+        self.next_arrival = state.next_arrival;
+        if self.interval.is_none() || self.next_arrival == u64::MAX {
+            self.schedule(mcycle);
+        }
+        self.fill();
+        self.changed = true;
+    }
+
+    /// Without pacing, move pending bytes into the FIFO while there is
+    /// room
+    fn fill(&mut self) {
+        if self.interval.is_none() {
+            while self.fifo.len() < self.depth {
+                let Some(byte) = self.pending.pop_front() else {
+                    break;
+                };
+                self.fifo.push_back(byte);
+                self.changed = true;
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+
+    #[test]
+    fn check_unpaced_input_fills_fifo() {
+        let mut uart_rx = UartRx::default();
+        uart_rx.set_depth(4);
+        uart_rx.send(b"abcdef", 0);
+        assert_eq!(uart_rx.read_status() >> UARTSTAT_RX_COUNT_SHIFT, 4);
+        assert_eq!(uart_rx.unread(), 6);
+
+        let read: Vec<u32> = (0..7).map(|_| uart_rx.read_data()).collect();
+        assert_eq!(
+            read,
+            [b'a', b'b', b'c', b'd', b'e', b'f', 0].map(u32::from)
+        );
+        assert_eq!(uart_rx.read_status(), 0);
+    }
+
+    #[test]
+    fn check_paced_input_overruns() {
+        let mut uart_rx = UartRx::default();
+        uart_rx.set_depth(2);
+        uart_rx.set_interval(Some(10), 0);
+        uart_rx.send(b"abc", 0);
+        assert!(uart_rx.tick(9));
+        assert_eq!(uart_rx.read_status(), 0);
+        assert!(!uart_rx.tick(9));
+
+        // All three bytes have arrived by cycle 30, and the third was
+        // dropped
+        uart_rx.tick(30);
+        let status = uart_rx.read_status();
+        assert_eq!(status >> UARTSTAT_RX_COUNT_SHIFT, 2);
+        assert_ne!(status & UARTSTAT_RX_OVERRUN, 0);
+        assert_eq!(uart_rx.read_status() & UARTSTAT_RX_OVERRUN, 0);
+        assert_eq!(uart_rx.read_data(), b'a'.into());
+        assert_eq!(uart_rx.read_data(), b'b'.into());
+        assert_eq!(uart_rx.unread(), 0);
+    }
+
+    #[test]
+    fn check_interrupt_level() {
+        let mut uart_rx = UartRx::default();
+        uart_rx.write_status(UARTSTAT_RX_INTERRUPT_ENABLE);
+        assert!(uart_rx.tick(0));
+        assert!(!uart_rx.interrupt_level());
+        uart_rx.send(b"x", 0);
+        assert!(uart_rx.tick(1));
+        assert!(uart_rx.interrupt_level());
+        assert!(!uart_rx.tick(2));
+        uart_rx.read_data();
+        assert!(uart_rx.tick(3));
+        assert!(!uart_rx.interrupt_level());
+    }
+}
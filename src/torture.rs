@@ -0,0 +1,523 @@
+//! Random instruction-stream torture programs
+//!
+//! This module generates random, but always valid, RV32IM programs
+//! using the instruction builders in the encode module. The programs
+//! are intended for differential testing of the execution engines
+//! (for example, using bisect::run_lockstep) and as tunable
+//! throughput benchmarks. Real firmware rarely exercises corner cases
+//! like division by zero or signed division overflow, so operands for
+//! these are generated deliberately.
+//!
+//! The program never raises an exception. Its layout is:
+//!
+//! * the reset vector jumps to START_ADDR. Every other word in the
+//!   vector table jumps to a halt loop at HALT_ADDR (so an unexpected
+//!   trap stops the program)
+//! * initialisation: x1 is set to the base of RAM, x2 to x1, x3 to
+//!   the iteration count, and x4-x31 to random values (biased towards
+//!   values like 0, -1 and i32::MIN)
+//! * the body: a random sequence of ALU, multiply/divide, load/store
+//!   and branch instructions, chosen according to the instruction mix
+//! * loop control: x3 is decremented, and the body is repeated until
+//!   it reaches zero, after which the program jumps to the halt loop
+//!
+//! The body never writes x1, x2 or x3, except that x2 is used to form
+//! addresses for loads and stores beyond the 12-bit offset range of
+//! x1. Loads and stores stay within the first footprint bytes of RAM,
+//! and may be misaligned (which is allowed in RAM). Branches only jump
+//! forwards, to the start of a later group of instructions in the body
+//! (never into the middle of an address calculation).
+
+use std::collections::BTreeMap;
+
+use crate::encode::*;
+use crate::trace_file::Section;
+use crate::utils::interpret_i32_as_unsigned;
+
+/// The first instruction after the vector table
+pub const START_ADDR: u32 = 0x0000_0088;
+
+/// Address of the halt loop (a jump to itself)
+pub const HALT_ADDR: u32 = 0x0000_0084;
+
+/// Base address of RAM
+const RAM_BASE: u32 = 0x2000_0000;
+
+/// Registers with a fixed use in the program
+const REG_RAM_BASE: u32 = 1;
+const REG_ADDR: u32 = 2;
+const REG_COUNTER: u32 = 3;
+const FIRST_FREE_REG: u32 = 4;
+
+/// The maximum number of groups of instructions skipped by a branch
+const MAX_BRANCH_SKIP: u64 = 8;
+
+/// Relative weights of each kind of instruction in the body. A zero
+/// weight means that kind of instruction is not generated.
+#[derive(Debug, Clone)]
+pub struct InstrMix {
+    /// Integer register-register and register-immediate instructions,
+    /// lui and auipc
+    pub alu: u32,
+    /// Multiply, divide and remainder instructions
+    pub mul_div: u32,
+    /// Loads and stores
+    pub load_store: u32,
+    /// Conditional branches and jal (forwards only)
+    pub branch: u32,
+}
+
+impl Default for InstrMix {
+    fn default() -> Self {
+        Self {
+            alu: 50,
+            mul_div: 15,
+            load_store: 20,
+            branch: 15,
+        }
+    }
+}
+
+/// Parameters of a torture program
+#[derive(Debug, Clone)]
+pub struct TortureOptions {
+    /// Seed for the random number generator. The same options always
+    /// give the same program.
+    pub seed: u64,
+    /// Number of groups of instructions in the body. Most groups are
+    /// a single instruction; address calculations and division
+    /// overflow cases use a few.
+    pub length: usize,
+    /// Number of times the body is executed
+    pub iterations: u32,
+    pub mix: InstrMix,
+    /// Number of bytes at the start of RAM used by loads and stores
+    /// (at least 4)
+    pub footprint: u32,
+}
+
+impl Default for TortureOptions {
+    fn default() -> Self {
+        Self {
+            seed: 1,
+            length: 1000,
+            iterations: 10,
+            mix: InstrMix::default(),
+            footprint: 4096,
+        }
+    }
+}
+
+/// A small xorshift random number generator (xorshift64*)
+#[derive(Debug)]
+struct Rng(u64);
+
+impl Rng {
+    fn new(seed: u64) -> Self {
+        // The state must not be zero
+        Self(seed ^ 0x9e37_79b9_7f4a_7c15)
+    }
+
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545_f491_4f6c_dd1d)
+    }
+
+    /// A random number in 0..n
+    fn below(&mut self, n: u64) -> u64 {
+        self.next() % n
+    }
+
+    /// True with probability 1/n
+    fn one_in(&mut self, n: u64) -> bool {
+        self.below(n) == 0
+    }
+
+    fn choose<T: Copy>(&mut self, items: &[T]) -> T {
+        items[self.below(items.len() as u64) as usize]
+    }
+
+    /// A 32-bit value, often one of the corner cases
+    fn value(&mut self) -> u32 {
+        if self.one_in(4) {
+            self.choose(&[0, 1, 0xffff_ffff, 0x8000_0000, 0x7fff_ffff])
+        } else {
+            self.next() as u32
+        }
+    }
+
+    /// A 12-bit signed immediate, often one of the corner cases
+    fn imm12(&mut self) -> i32 {
+        if self.one_in(4) {
+            self.choose(&[0, 1, -1, 2047, -2048])
+        } else {
+            self.below(4096) as i32 - 2048
+        }
+    }
+
+    /// A register the body may write (x0 occasionally)
+    fn rd(&mut self) -> u32 {
+        if self.one_in(16) {
+            0
+        } else {
+            FIRST_FREE_REG + self.below(u64::from(32 - FIRST_FREE_REG)) as u32
+        }
+    }
+
+    /// Any register
+    fn rs(&mut self) -> u32 {
+        self.below(32) as u32
+    }
+}
+
+/// A group of instructions generated together. A branch is stored as
+/// the number of groups it skips, and encoded once the layout of the
+/// body is known.
+#[derive(Debug)]
+enum Group {
+    Instrs(Vec<u32>),
+    Branch { instr: u32, skip: u64 },
+}
+
+fn lui(rd: u32, upper: u32) -> u32 {
+    ujtype(upper, rd, OP_LUI)
+}
+
+fn addi(rd: u32, rs1: u32, imm: i32) -> u32 {
+    itype(
+        interpret_i32_as_unsigned(imm) & 0xfff,
+        rs1,
+        FUNCT3_ADDI,
+        rd,
+        OP_IMM,
+    )
+}
+
+fn jal(rd: u32, offset: i32) -> u32 {
+    ujtype(jtype_imm_field(offset), rd, OP_JAL)
+}
+
+/// Split value into (upper, lower), where lower is a 12-bit signed
+/// immediate and (upper << 12) + lower == value
+fn split_imm(value: u32) -> (u32, i32) {
+    let upper = value.wrapping_add(0x800) >> 12;
+    let lower = value.wrapping_sub(upper << 12) as i32;
+    (upper, lower)
+}
+
+/// Instructions to load a 32-bit value into rd
+fn load_imm(rd: u32, value: u32) -> Vec<u32> {
+    let (upper, lower) = split_imm(value);
+    vec![lui(rd, upper), addi(rd, rd, lower)]
+}
+
+fn alu_group(rng: &mut Rng) -> Group {
+    let rd = rng.rd();
+    let instr = match rng.below(5) {
+        0 | 1 => {
+            let (funct7, funct3) = rng.choose(&[
+                (FUNCT7_ADD, FUNCT3_ADD),
+                (FUNCT7_SUB, FUNCT3_SUB),
+                (FUNCT7_SLL, FUNCT3_SLL),
+                (FUNCT7_SLT, FUNCT3_SLT),
+                (FUNCT7_SLTU, FUNCT3_SLTU),
+                (FUNCT7_XOR, FUNCT3_XOR),
+                (FUNCT7_SRL, FUNCT3_SRL),
+                (FUNCT7_SRA, FUNCT3_SRA),
+                (FUNCT7_OR, FUNCT3_OR),
+                (FUNCT7_AND, FUNCT3_AND),
+            ]);
+            rstype(funct7, rng.rs(), rng.rs(), funct3, rd, OP)
+        }
+        2 => {
+            let funct3 = rng.choose(&[
+                FUNCT3_ADDI,
+                FUNCT3_SLTI,
+                FUNCT3_SLTIU,
+                FUNCT3_XORI,
+                FUNCT3_ORI,
+                FUNCT3_ANDI,
+            ]);
+            let imm = interpret_i32_as_unsigned(rng.imm12()) & 0xfff;
+            itype(imm, rng.rs(), funct3, rd, OP_IMM)
+        }
+        3 => {
+            let (upper, funct3) = rng.choose(&[
+                (FUNCT7_SLLI, FUNCT3_SLLI),
+                (FUNCT7_SRLI, FUNCT3_SRLI),
+                (FUNCT7_SRAI, FUNCT3_SRAI),
+            ]);
+            let imm = shifts_imm_field(rng.below(32) as u32, upper);
+            itype(imm, rng.rs(), funct3, rd, OP_IMM)
+        }
+        _ => {
+            let opcode = rng.choose(&[OP_LUI, OP_AUIPC]);
+            ujtype(rng.value() >> 12, rd, opcode)
+        }
+    };
+    Group::Instrs(vec![instr])
+}
+
+fn mul_div_group(rng: &mut Rng) -> Group {
+    let funct3 = rng.choose(&[
+        FUNCT3_MUL,
+        FUNCT3_MULH,
+        FUNCT3_MULHSU,
+        FUNCT3_MULHU,
+        FUNCT3_DIV,
+        FUNCT3_DIVU,
+        FUNCT3_REM,
+        FUNCT3_REMU,
+    ]);
+    let rd = rng.rd();
+    if rng.one_in(8) {
+        // Signed overflow: i32::MIN / -1
+        let rs1 = FIRST_FREE_REG + rng.below(14) as u32;
+        let rs2 = rs1 + 14;
+        let mut instrs = load_imm(rs1, 0x8000_0000);
+        instrs.extend(load_imm(rs2, 0xffff_ffff));
+        instrs.push(rstype(FUNCT7_MULDIV, rs2, rs1, funct3, rd, OP));
+        Group::Instrs(instrs)
+    } else {
+        // Divide by zero when rs2 is x0
+        let rs2 = if rng.one_in(4) { 0 } else { rng.rs() };
+        let instr = rstype(FUNCT7_MULDIV, rs2, rng.rs(), funct3, rd, OP);
+        Group::Instrs(vec![instr])
+    }
+}
+
+fn load_store_group(rng: &mut Rng, footprint: u32) -> Group {
+    let (funct3, width, is_load) = rng.choose(&[
+        (FUNCT3_B, 1, true),
+        (FUNCT3_H, 2, true),
+        (FUNCT3_W, 4, true),
+        (FUNCT3_BU, 1, true),
+        (FUNCT3_HU, 2, true),
+        (FUNCT3_B, 1, false),
+        (FUNCT3_H, 2, false),
+        (FUNCT3_W, 4, false),
+    ]);
+    let mut offset = rng.below(u64::from(footprint - width + 1)) as u32;
+    if !rng.one_in(8) {
+        // Mostly aligned, but sometimes misaligned
+        offset -= offset % width;
+    }
+
+    // Offsets that do not fit in the immediate use x2 as the base
+    let mut instrs = Vec::new();
+    let (base, imm) = if offset < 2048 {
+        (REG_RAM_BASE, offset as i32)
+    } else {
+        let (upper, lower) = split_imm(offset);
+        instrs.push(lui(REG_ADDR, upper));
+        instrs.push(rstype(
+            FUNCT7_ADD,
+            REG_RAM_BASE,
+            REG_ADDR,
+            FUNCT3_ADD,
+            REG_ADDR,
+            OP,
+        ));
+        (REG_ADDR, lower)
+    };
+    let imm = interpret_i32_as_unsigned(imm) & 0xfff;
+    instrs.push(if is_load {
+        itype(imm, base, funct3, rng.rd(), OP_LOAD)
+    } else {
+        rstype(imm >> 5, rng.rs(), base, funct3, imm & 0x1f, OP_STORE)
+    });
+    Group::Instrs(instrs)
+}
+
+fn branch_group(rng: &mut Rng) -> Group {
+    let skip = 1 + rng.below(MAX_BRANCH_SKIP);
+    let instr = if rng.one_in(8) {
+        jal(rng.rd(), 0)
+    } else {
+        let funct3 = rng.choose(&[
+            FUNCT3_BEQ,
+            FUNCT3_BNE,
+            FUNCT3_BLT,
+            FUNCT3_BGE,
+            FUNCT3_BLTU,
+            FUNCT3_BGEU,
+        ]);
+        rstype(0, rng.rs(), rng.rs(), funct3, 0, OP_BRANCH)
+    };
+    Group::Branch { instr, skip }
+}
+
+/// Set the offset of a branch or jal instruction with a zero offset
+fn set_offset(instr: u32, offset: i32) -> u32 {
+    if instr & 0x7f == OP_JAL {
+        instr | ujtype(jtype_imm_field(offset), 0, 0)
+    } else {
+        let (a, b) = btype_imm_fields(offset);
+        instr | rstype(a, 0, 0, 0, b, 0)
+    }
+}
+
+/// Generate the instructions of the body
+fn body(rng: &mut Rng, options: &TortureOptions) -> Vec<Group> {
+    let mix = &options.mix;
+    let weights = [mix.alu, mix.mul_div, mix.load_store, mix.branch];
+    let total: u64 = weights.iter().map(|w| u64::from(*w)).sum();
+    let footprint = options.footprint.max(4);
+    (0..options.length)
+        .map(|_| {
+            if total == 0 {
+                return alu_group(rng);
+            }
+            let mut choice = rng.below(total);
+            let mut kind = 0;
+            while choice >= u64::from(weights[kind]) {
+                choice -= u64::from(weights[kind]);
+                kind += 1;
+            }
+            match kind {
+                0 => alu_group(rng),
+                1 => mul_div_group(rng),
+                2 => load_store_group(rng, footprint),
+                _ => branch_group(rng),
+            }
+        })
+        .collect()
+}
+
+/// Generate a torture program, returned as an .eeprom section that
+/// can be loaded into a platform or written to a trace file
+pub fn generate(options: &TortureOptions) -> Section {
+    let mut rng = Rng::new(options.seed);
+
+    // Vector table and halt loop
+    let mut words = BTreeMap::new();
+    words.insert(0, jal(0, START_ADDR as i32));
+    for addr in (4..HALT_ADDR).step_by(4) {
+        words.insert(addr, jal(0, (HALT_ADDR - addr) as i32));
+    }
+    words.insert(HALT_ADDR, jal(0, 0));
+
+    // Initialisation
+    let mut instrs = load_imm(REG_RAM_BASE, RAM_BASE);
+    instrs.push(addi(REG_ADDR, REG_RAM_BASE, 0));
+    instrs.extend(load_imm(REG_COUNTER, options.iterations.max(1)));
+    for reg in FIRST_FREE_REG..32 {
+        instrs.extend(load_imm(reg, rng.value()));
+    }
+
+    // Body. First find the address of each group, so that branches
+    // can be encoded
+    let groups = body(&mut rng, options);
+    let body_start = START_ADDR + 4 * instrs.len() as u32;
+    let mut group_addrs = vec![body_start];
+    for group in groups.iter() {
+        let len = match group {
+            Group::Instrs(group_instrs) => group_instrs.len(),
+            Group::Branch { .. } => 1,
+        };
+        group_addrs.push(group_addrs.last().unwrap() + 4 * len as u32);
+    }
+    for (n, group) in groups.into_iter().enumerate() {
+        match group {
+            Group::Instrs(group_instrs) => instrs.extend(group_instrs),
+            Group::Branch { instr, skip } => {
+                // Jump to a later group, or the loop control
+                let target = (n + 1 + skip as usize).min(group_addrs.len() - 1);
+                let offset = group_addrs[target] - group_addrs[n];
+                instrs.push(set_offset(instr, offset as i32));
+            }
+        }
+    }
+
+    // Loop control: decrement the counter and repeat the body
+    // (using jalr, so that the body can be any length), then halt
+    let loop_control = START_ADDR + 4 * instrs.len() as u32;
+    instrs.push(addi(REG_COUNTER, REG_COUNTER, -1));
+    let (a, b) = btype_imm_fields(4 * 4);
+    instrs.push(rstype(a, 0, REG_COUNTER, FUNCT3_BEQ, b, OP_BRANCH));
+    instrs.extend(load_imm(REG_ADDR, body_start));
+    instrs.push(itype(0, REG_ADDR, FUNCT3_JALR, 0, OP_JALR));
+    let halt_offset = HALT_ADDR as i32 - (loop_control as i32 + 4 * 5);
+    instrs.push(jal(0, halt_offset));
+
+    for (n, instr) in instrs.into_iter().enumerate() {
+        words.insert(START_ADDR + 4 * n as u32, instr);
+    }
+    Section::Eeprom {
+        section_data: words,
+        symbols: Vec::new(),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::bisect::run_lockstep;
+    use crate::platform::eei::Eei;
+    use crate::platform::Platform;
+    use crate::trace_file::TraceLoadable;
+
+    fn load(options: &TortureOptions) -> Platform {
+        let mut platform = Platform::new();
+        platform.push(&generate(options));
+        platform
+    }
+
+    /// Every seed runs to the halt loop without raising an exception
+    #[test]
+    fn check_torture_halts_without_exceptions() {
+        for seed in 0..20 {
+            let options = TortureOptions {
+                seed,
+                length: 300,
+                iterations: 3,
+                footprint: 8192,
+                ..TortureOptions::default()
+            };
+            let mut platform = load(&options);
+            platform.set_exceptions_are_errors(true);
+            while platform.pc() != HALT_ADDR {
+                platform.run(1000).unwrap();
+            }
+            assert!(platform.mcycle() > 3 * 10);
+        }
+    }
+
+    #[test]
+    fn check_torture_is_deterministic() {
+        let options = TortureOptions::default();
+        let Section::Eeprom {
+            section_data: a, ..
+        } = generate(&options)
+        else {
+            unreachable!()
+        };
+        let Section::Eeprom {
+            section_data: b, ..
+        } = generate(&options)
+        else {
+            unreachable!()
+        };
+        assert_eq!(a, b);
+    }
+
+    /// The block engine agrees with single stepping on torture
+    /// programs
+    #[test]
+    fn check_torture_lockstep() {
+        for seed in 0..5 {
+            let options = TortureOptions {
+                seed,
+                length: 500,
+                iterations: 2,
+                ..TortureOptions::default()
+            };
+            let mut fast = load(&options);
+            let mut reference = load(&options);
+            assert!(run_lockstep(&mut fast, &mut reference, 5000).is_none());
+        }
+    }
+}
@@ -1,16 +1,28 @@
-use crate::decode::Decoder;
 use crate::elf_utils::{load_elf, ElfError, ElfLoadable, FullSymbol};
-use crate::platform::arch::{
-    make_rv32i, make_rv32m, make_rv32priv, make_rv32zicsr,
-};
-use crate::platform::{Instr, Platform};
+use crate::platform::breakpoints::BreakpointError;
+use crate::platform::checkpoint::CheckpointError;
+use crate::platform::machine::Exception;
+use crate::platform::Platform;
 use crate::utils::mask;
-use itertools::{Itertools, PeekingNext};
 use std::collections::BTreeMap;
 use std::fs::File;
-use std::io::{self, prelude::*, BufReader, LineWriter};
+use std::io::{self, prelude::*, BufWriter};
 use thiserror::Error;
 
+pub use self::binary::{
+    is_binary_trace_file, BinaryTraceReader, BinaryTraceWriter,
+};
+pub use self::parallel::{check_trace_file_parallel, ParallelCheckOptions};
+pub use self::reader::{check_trace, check_trace_file, TraceReader};
+pub use self::record::{RecordOptions, Recorder};
+use self::writer::write_section;
+
+pub mod binary;
+pub mod parallel;
+pub mod reader;
+pub mod record;
+mod writer;
+
 #[derive(Debug, Error)]
 pub enum TraceFileError {
     #[error("missing section heading at start of file")]
@@ -19,12 +31,34 @@ pub enum TraceFileError {
     MissingEepromSection,
     #[error("section {0} is not recognised/implemented")]
     UnrecognisedSection(String),
-    #[error("error parsing entry {0} in .trace section")]
-    ParseTraceSectionFailed(String),
     #[error("error processing ELF file: {0}")]
     ElfError(ElfError),
     #[error("Trace file I/O error: {0}")]
     IoError(String),
+    #[error("line {line}: expected an address and instruction in hexadecimal")]
+    InvalidEepromEntry { line: usize },
+    #[error("line {line}: could not parse trace property '{text}'")]
+    InvalidProperty { line: usize, text: String },
+    #[error("line {line}: could not parse section heading '{text}'")]
+    InvalidSectionHeading { line: usize, text: String },
+    #[error("line {line}: invalid UTF-8")]
+    InvalidUtf8 { line: usize },
+    #[error("trace check failed: {0}")]
+    CheckFailed(TraceCheckFailed),
+    #[error("invalid binary trace file: {0}")]
+    InvalidBinaryTrace(String),
+    #[error("{0}")]
+    BreakpointError(BreakpointError),
+    #[error("{0}")]
+    CheckpointError(CheckpointError),
+}
+
+/// The two trace file formats (see the binary module for the binary
+/// format)
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum TraceFormat {
+    Text,
+    Binary,
 }
 
 impl From<ElfError> for TraceFileError {
@@ -33,85 +67,27 @@ impl From<ElfError> for TraceFileError {
     }
 }
 
-impl From<io::Error> for TraceFileError {
-    fn from(e: io::Error) -> Self {
-        Self::IoError(e.to_string())
+impl From<BreakpointError> for TraceFileError {
+    fn from(e: BreakpointError) -> Self {
+        Self::BreakpointError(e)
     }
 }
 
-/// If the line ends in a comment, remove it. If the
-/// result contains any non-whitespace characters,
-/// return it as Some. Otherwise, return None. (Covers
-/// empty lines and comment-only lines).
-fn get_non_comment(line: String) -> Option<String> {
-    let without_comment = &line[0..line.find("#").unwrap_or(line.len())];
-    if without_comment.trim().is_empty() {
-        None
-    } else {
-        Some(without_comment.to_string())
+impl From<CheckpointError> for TraceFileError {
+    fn from(e: CheckpointError) -> Self {
+        Self::CheckpointError(e)
     }
 }
 
-/// Return true if the line begins with a dot (.)
-fn is_section_header(line: &String) -> bool {
-    line.chars().nth(0).unwrap() == '.'
-}
-
-fn get_addr_instr_tuple(non_comment_line: String) -> (u32, u32) {
-    let terms: Vec<u32> = non_comment_line
-        .split_whitespace()
-        .into_iter()
-        .map(|term| u32::from_str_radix(term, 16))
-        .map(|res| res.expect("term should be hex"))
-        .collect();
-    if terms.len() != 2 {
-        panic!("Line length should be 2")
+impl From<TraceCheckFailed> for TraceFileError {
+    fn from(e: TraceCheckFailed) -> Self {
+        Self::CheckFailed(e)
     }
-    let addr = terms[0];
-    let instr = terms[1];
-    (addr, instr)
-}
-
-fn parse_dec_or_hex(value: &str) -> Result<u32, TraceFileError> {
-    if value.len() > 2 && &value[0..2] == "0x" {
-	// Value is hexadecimal
-	u32::from_str_radix(&value[2..], 16)
-    } else {
-	value.parse()
-    }.map_err(|_| TraceFileError::ParseTraceSectionFailed(value.to_string()))
 }
 
-fn get_trace_key_value_tuple(
-    non_comment_line: String,
-) -> Result<Property, TraceFileError> {
-    let (key, value) = non_comment_line.split_once(char::is_whitespace).ok_or(
-        TraceFileError::ParseTraceSectionFailed(non_comment_line.to_string()),
-    )?;
-    let value = value.trim();
-    if key == "pc" {
-        let pc = parse_dec_or_hex(value)?;
-        Ok(Property::Pc(pc))
-    } else if key.starts_with("x") {
-        // Remove first character and interpret number as register
-        // index
-        let mut chars = key.chars();
-        chars.next();
-        let reg_index_string: String = chars.collect();
-        let index: u8 = reg_index_string.parse().map_err(|_| {
-            TraceFileError::ParseTraceSectionFailed(value.to_string())
-        })?;
-        let value = parse_dec_or_hex(value)?;
-        Ok(Property::Reg { index, value })
-    } else if key == "uart" {
-        // Remove first and last quotes/speech marks characters
-        // Note: no check is performed.
-        let value = value.replace("\\n", "\n");
-        let mut chars = value.chars();
-        chars.next();
-        chars.next_back();
-        Ok(Property::Uart(chars.collect()))
-    } else {
-        Err(TraceFileError::ParseTraceSectionFailed(value.to_string()))
+impl From<io::Error> for TraceFileError {
+    fn from(e: io::Error) -> Self {
+        Self::IoError(e.to_string())
     }
 }
 
@@ -127,6 +103,16 @@ pub enum TraceCheckFailed {
         expected: Property,
         found: Property,
     },
+    #[error("Exception {exception:?} at cycle {cycle}")]
+    Exception { cycle: u64, exception: Exception },
+    #[error(
+        "Program exited with status {status} at cycle {cycle}, before cycle {required}"
+    )]
+    ProgramExited {
+        cycle: u64,
+        status: u32,
+        required: u64,
+    },
 }
 
 /// Check where a property is satisfied at a particular clock cycle
@@ -142,7 +128,7 @@ pub trait TraceCheck {
     ) -> Result<(), TraceCheckFailed>;
 }
 
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub enum Property {
     /// Value of the program counter
     Pc(u32),
@@ -164,7 +150,7 @@ pub enum Property {
 /// of mcycle at the previous falling edge.
 ///
 /// The properties to be tested are stored in the properties item.
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub struct TracePoint {
     pub cycle: u64,
     pub properties: Vec<Property>,
@@ -219,141 +205,144 @@ impl ElfLoadable for Section {
     }
 }
 
-fn get_symbol_at_address(
-    addr: u32,
-    symbols: &Vec<FullSymbol>,
-) -> Option<&FullSymbol> {
-    symbols.iter().find(|&symbol| symbol.value == addr)
-}
-
-fn write_section(file: &mut LineWriter<File>, section: Section) {
-    let mut decoder = Decoder::<Instr<Platform>>::new(mask(7));
-    make_rv32i(&mut decoder).expect("adding instructions should work");
-    make_rv32m(&mut decoder).expect("adding instructions should work");
-    make_rv32zicsr(&mut decoder).expect("adding instructions should work");
-    make_rv32priv(&mut decoder).expect("adding instructions should work");
-
-    match section {
-        Section::Eeprom {
-            section_data,
-            symbols,
-        } => {
-            file.write_all(b".eeprom\n").expect("should work");
-            for (addr, instr) in section_data.into_iter() {
-                // Check for a function label at this address
-                if let Some(symbol) = get_symbol_at_address(addr, &symbols) {
-                    let name = symbol.name.clone().unwrap();
-                    file.write_all(format!("\n# {name}\n").as_bytes())
-                        .expect("should write");
-                }
-
-                let asm = if let Ok(Instr { printer, .. }) =
-                    decoder.get_exec(instr)
-                {
-                    printer(instr)
-                } else {
-                    "unknown/not instruction".to_string()
-                };
-                file.write_all(
-                    format!("{addr:0>8x}  {instr:0>8x}  # {asm}\n").as_bytes(),
-                )
-                .expect("should write")
-            }
-        }
-        _ => unimplemented!("Not yet implemented writing that section"),
-    }
-}
-
-fn read_section<I>(lines: &mut I) -> Result<Section, TraceFileError>
-where
-    I: Iterator<Item = String> + PeekingNext,
-{
-    if let Some(first_line) = lines.next() {
-        if first_line == ".eeprom" {
-            let section_data = lines
-                .peeking_take_while(|line| !is_section_header(line))
-                .map(get_addr_instr_tuple)
-                .collect();
-            Ok(Section::Eeprom {
-                section_data,
-                symbols: Vec::new(),
-            })
-        } else if first_line.starts_with(".trace") {
-            let cycle: u64 = first_line
-                .strip_prefix(".trace.")
-                .expect("prefix is present")
-                .parse()
-                .map_err(|_| {
-                    TraceFileError::ParseTraceSectionFailed(first_line)
-                })?;
-            let properties_result: Result<Vec<_>, _> = lines
-                .peeking_take_while(|line| !is_section_header(line))
-                .map(get_trace_key_value_tuple)
-                .collect();
-            let properties = properties_result?;
-            let trace_point = TracePoint { cycle, properties };
-            Ok(Section::Trace(trace_point))
-        } else {
-            Err(TraceFileError::UnrecognisedSection(first_line))
-        }
-    } else {
-        Err(TraceFileError::MissingSectionHeading)
-    }
-}
-
 pub trait TraceLoadable {
     fn push(&mut self, section: &Section);
 }
 
 /// Load a trace file from file. Returns the set of trace points (the
-/// sections that are not the .eeprom section)
+/// sections that are not the .eeprom section), sorted by cycle.
+///
+/// This holds every trace point in memory; for large files whose trace
+/// points are already in cycle order, use check_trace_file instead.
 pub fn load_trace<L: TraceLoadable>(
     loadable: &mut L,
     trace_file_path: String,
 ) -> Result<Vec<TracePoint>, TraceFileError> {
-    let file = File::open(trace_file_path)?;
-    let reader = BufReader::new(file);
+    if is_binary_trace_file(&trace_file_path)? {
+        let mut reader = BinaryTraceReader::open(&trace_file_path)?;
+        loadable.push(&reader.eeprom()?);
+        return (0..reader.len()).map(|n| reader.trace_point(n)).collect();
+    }
 
     let mut trace_points = Vec::new();
-
-    let mut iter = reader
-        .lines()
-        .flatten() // note this drops line errors
-        .map(get_non_comment)
-        .flatten()
-        .peekable();
-    while iter.peek().is_some() {
-        match read_section(&mut iter) {
-            Ok(section) => match section {
-                Section::Eeprom { .. } => loadable.push(&section),
-                Section::Trace(trace_point) => trace_points.push(trace_point),
-            },
-            Err(e) => match e {
-                TraceFileError::UnrecognisedSection(name) => {
-                    println!("Warning: unrecognised section {name}")
-                }
-                _ => panic!("Error {e} occurred"),
-            },
+    for section in TraceReader::open(trace_file_path)? {
+        match section {
+            Ok(section @ Section::Eeprom { .. }) => loadable.push(&section),
+            Ok(Section::Trace(trace_point)) => trace_points.push(trace_point),
+            Err(TraceFileError::UnrecognisedSection(name)) => {
+                println!("Warning: unrecognised section {name}")
+            }
+            Err(e) => return Err(e),
         }
     }
 
-    let in_cycle_order = trace_points
-        .into_iter()
-        .sorted_by_key(|trace_point| trace_point.cycle)
-        .collect();
+    trace_points.sort_by_key(|trace_point| trace_point.cycle);
+    Ok(trace_points)
+}
 
-    Ok(in_cycle_order)
+/// Write sections to a trace file in the given format
+fn write_trace_file<I>(
+    sections: I,
+    trace_path_out: String,
+    format: TraceFormat,
+) -> Result<(), TraceFileError>
+where
+    I: IntoIterator<Item = Result<Section, TraceFileError>>,
+{
+    match format {
+        TraceFormat::Text => {
+            let mut file = BufWriter::new(File::create(trace_path_out)?);
+            for section in sections {
+                write_section(&mut file, &section?)?;
+            }
+            file.flush()?;
+        }
+        TraceFormat::Binary => {
+            let mut writer = BinaryTraceWriter::create(trace_path_out)?;
+            for section in sections {
+                writer.write_section(&section?)?;
+            }
+            writer.finish()?;
+        }
+    }
+    Ok(())
 }
 
 pub fn elf_to_trace_file(
     elf_path_in: String,
     trace_path_out: String,
+    format: TraceFormat,
 ) -> Result<(), TraceFileError> {
     let mut section = Section::new_eeprom();
     load_elf(&mut section, &elf_path_in)?;
+    write_program_trace_file(section, trace_path_out, format, None)
+}
 
-    let file = File::create(trace_path_out)?;
-    let mut file = LineWriter::new(file);
-    write_section(&mut file, section);
-    Ok(())
+/// Run the program in an ELF file and record a golden trace file
+/// containing the program and the trace points chosen by options
+pub fn record_trace_file(
+    elf_path_in: String,
+    trace_path_out: String,
+    format: TraceFormat,
+    options: &RecordOptions,
+) -> Result<(), TraceFileError> {
+    let mut section = Section::new_eeprom();
+    load_elf(&mut section, &elf_path_in)?;
+    write_program_trace_file(section, trace_path_out, format, Some(options))
+}
+
+/// Write a trace file containing a program (an .eeprom section). If
+/// options is given, the program is also run and the trace points
+/// chosen by options are recorded after it.
+pub fn write_program_trace_file(
+    program: Section,
+    trace_path_out: String,
+    format: TraceFormat,
+    options: Option<&RecordOptions>,
+) -> Result<(), TraceFileError> {
+    let Section::Eeprom { symbols, .. } = &program else {
+        return Err(TraceFileError::MissingEepromSection);
+    };
+    let Some(options) = options else {
+        return write_trace_file([Ok(program)], trace_path_out, format);
+    };
+
+    let mut platform = Platform::new();
+    platform.push(&program);
+    let recorder = Recorder::new(&mut platform, options, symbols)?;
+    let sections = std::iter::once(Ok(program))
+        .chain(recorder.map(|trace_point| Ok(Section::Trace(trace_point))));
+    write_trace_file(sections, trace_path_out, format)
+}
+
+/// Convert a trace file to the given format. The format of the input
+/// file is detected from its contents. Sections are converted one at
+/// a time, so the input file is never held in memory. Unrecognised
+/// sections in a text input are dropped with a warning.
+pub fn convert_trace_file(
+    trace_path_in: String,
+    trace_path_out: String,
+    format: TraceFormat,
+) -> Result<(), TraceFileError> {
+    if is_binary_trace_file(&trace_path_in)? {
+        let mut reader = BinaryTraceReader::open(&trace_path_in)?;
+        let eeprom = reader.eeprom();
+        let trace_points = (0..reader.len())
+            .map(move |n| reader.trace_point(n).map(Section::Trace));
+        write_trace_file(
+            std::iter::once(eeprom).chain(trace_points),
+            trace_path_out,
+            format,
+        )
+    } else {
+        let sections = TraceReader::open(trace_path_in)?.filter(|section| {
+            if let Err(TraceFileError::UnrecognisedSection(name)) = section {
+                println!("Warning: dropping unrecognised section {name}");
+                false
+            } else {
+                true
+            }
+        });
+        write_trace_file(sections, trace_path_out, format)
+    }
 }
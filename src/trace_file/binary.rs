@@ -0,0 +1,467 @@
+//! Binary trace file format
+//!
+//! A compact counterpart to the text trace format, with an index from
+//! cycle to file offset so that trace points can be located without
+//! scanning the file. All integers are little-endian. The layout is:
+//!
+//! * header: the bytes of MAGIC, a u32 version, a u32 (reserved,
+//!   zero), then four u64 values: the number of EEPROM entries, the
+//!   offset of the EEPROM entries, the number of trace points, and the
+//!   offset of the index
+//! * EEPROM entries: (addr: u32, word: u32) pairs in address order
+//! * trace points: a u32 property count followed by the properties. A
+//!   property is a u8 tag followed by its value: pc (TAG_PC, u32
+//!   value), register (TAG_REG, u8 index, u32 value) or uart
+//!   (TAG_UART, u32 length, followed by that many bytes of UTF-8)
+//! * index: (cycle: u64, offset: u64) pairs, sorted by cycle
+//!
+//! The index comes last so that a trace can be written in one pass,
+//! with the header filled in when the writer is finished.
+
+use std::collections::BTreeMap;
+use std::fs::File;
+use std::io::{BufReader, BufWriter, Read, Seek, SeekFrom, Write};
+use std::path::Path;
+
+use super::{Property, Section, TraceFileError, TracePoint};
+
+pub const MAGIC: &[u8; 8] = b"RVTRACE\0";
+pub const VERSION: u32 = 1;
+
+const TAG_PC: u8 = 0;
+const TAG_REG: u8 = 1;
+const TAG_UART: u8 = 2;
+
+fn invalid(reason: &str) -> TraceFileError {
+    TraceFileError::InvalidBinaryTrace(reason.to_string())
+}
+
+/// Returns true if the file at path begins with the binary trace
+/// magic bytes
+pub fn is_binary_trace_file<P: AsRef<Path>>(
+    path: P,
+) -> Result<bool, TraceFileError> {
+    let mut magic = [0; MAGIC.len()];
+    let mut file = File::open(path)?;
+    match file.read_exact(&mut magic) {
+        Ok(()) => Ok(&magic == MAGIC),
+        Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => Ok(false),
+        Err(e) => Err(e.into()),
+    }
+}
+
+/// Writes a binary trace file. The .eeprom section and trace points
+/// can be written in any order; call finish() to write the index.
+#[derive(Debug)]
+pub struct BinaryTraceWriter<W: Write + Seek> {
+    writer: W,
+    /// Current offset in the file (kept here to avoid flushing a
+    /// buffered writer to query the position)
+    offset: u64,
+    eeprom_len: u64,
+    eeprom_offset: u64,
+    /// (cycle, offset) for each trace point written
+    index: Vec<(u64, u64)>,
+}
+
+impl BinaryTraceWriter<BufWriter<File>> {
+    pub fn create<P: AsRef<Path>>(path: P) -> Result<Self, TraceFileError> {
+        Self::new(BufWriter::new(File::create(path)?))
+    }
+}
+
+impl<W: Write + Seek> BinaryTraceWriter<W> {
+    /// Start a new trace, writing a placeholder header
+    pub fn new(writer: W) -> Result<Self, TraceFileError> {
+        let mut trace_writer = Self {
+            writer,
+            offset: 0,
+            eeprom_len: 0,
+            eeprom_offset: 0,
+            index: Vec::new(),
+        };
+        trace_writer.write_header(0)?;
+        Ok(trace_writer)
+    }
+
+    fn write_bytes(&mut self, bytes: &[u8]) -> Result<(), TraceFileError> {
+        self.writer.write_all(bytes)?;
+        self.offset += u64::try_from(bytes.len()).unwrap();
+        Ok(())
+    }
+
+    fn write_header(
+        &mut self,
+        index_offset: u64,
+    ) -> Result<(), TraceFileError> {
+        self.write_bytes(MAGIC)?;
+        self.write_bytes(&VERSION.to_le_bytes())?;
+        self.write_bytes(&0u32.to_le_bytes())?;
+        self.write_bytes(&self.eeprom_len.to_le_bytes())?;
+        self.write_bytes(&self.eeprom_offset.to_le_bytes())?;
+        let index_len = u64::try_from(self.index.len()).unwrap();
+        self.write_bytes(&index_len.to_le_bytes())?;
+        self.write_bytes(&index_offset.to_le_bytes())
+    }
+
+    pub fn write_section(
+        &mut self,
+        section: &Section,
+    ) -> Result<(), TraceFileError> {
+        match section {
+            Section::Eeprom { section_data, .. } => {
+                self.write_eeprom(section_data)
+            }
+            Section::Trace(trace_point) => self.write_trace_point(trace_point),
+        }
+    }
+
+    fn write_eeprom(
+        &mut self,
+        section_data: &BTreeMap<u32, u32>,
+    ) -> Result<(), TraceFileError> {
+        self.eeprom_len = u64::try_from(section_data.len()).unwrap();
+        self.eeprom_offset = self.offset;
+        for (addr, word) in section_data.iter() {
+            self.write_bytes(&addr.to_le_bytes())?;
+            self.write_bytes(&word.to_le_bytes())?;
+        }
+        Ok(())
+    }
+
+    fn write_trace_point(
+        &mut self,
+        trace_point: &TracePoint,
+    ) -> Result<(), TraceFileError> {
+        self.index.push((trace_point.cycle, self.offset));
+        let count = u32::try_from(trace_point.properties.len()).unwrap();
+        self.write_bytes(&count.to_le_bytes())?;
+        for property in trace_point.properties.iter() {
+            match property {
+                Property::Pc(pc) => {
+                    self.write_bytes(&[TAG_PC])?;
+                    self.write_bytes(&pc.to_le_bytes())?;
+                }
+                Property::Reg { index, value } => {
+                    self.write_bytes(&[TAG_REG, *index])?;
+                    self.write_bytes(&value.to_le_bytes())?;
+                }
+                Property::Uart(string) => {
+                    let len = u32::try_from(string.len()).unwrap();
+                    self.write_bytes(&[TAG_UART])?;
+                    self.write_bytes(&len.to_le_bytes())?;
+                    self.write_bytes(string.as_bytes())?;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Write the index and the final header, and return the writer
+    pub fn finish(mut self) -> Result<W, TraceFileError> {
+        // Stable sort keeps trace points for the same cycle in the
+        // order they were written
+        self.index.sort_by_key(|(cycle, _)| *cycle);
+        let index_offset = self.offset;
+        for n in 0..self.index.len() {
+            let (cycle, offset) = self.index[n];
+            self.write_bytes(&cycle.to_le_bytes())?;
+            self.write_bytes(&offset.to_le_bytes())?;
+        }
+
+        self.writer.seek(SeekFrom::Start(0))?;
+        self.write_header(index_offset)?;
+        self.writer.flush()?;
+        Ok(self.writer)
+    }
+}
+
+/// Reads a binary trace file, giving random access to trace points
+/// by their position in cycle order
+#[derive(Debug)]
+pub struct BinaryTraceReader<R: Read + Seek> {
+    reader: R,
+    /// Current offset in the file, used to avoid unnecessary seeks
+    /// (which discard the contents of a buffered reader)
+    offset: u64,
+    /// Length of the file, used to check lengths read from it
+    len: u64,
+    eeprom_len: u64,
+    eeprom_offset: u64,
+    /// (cycle, offset) for each trace point, sorted by cycle
+    index: Vec<(u64, u64)>,
+}
+
+impl BinaryTraceReader<BufReader<File>> {
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<Self, TraceFileError> {
+        Self::new(BufReader::new(File::open(path)?))
+    }
+}
+
+impl<R: Read + Seek> BinaryTraceReader<R> {
+    /// Read the header and index of a binary trace
+    pub fn new(mut reader: R) -> Result<Self, TraceFileError> {
+        let len = reader.seek(SeekFrom::End(0))?;
+        reader.seek(SeekFrom::Start(0))?;
+        let mut trace_reader = Self {
+            reader,
+            offset: 0,
+            len,
+            eeprom_len: 0,
+            eeprom_offset: 0,
+            index: Vec::new(),
+        };
+
+        let mut magic = [0; MAGIC.len()];
+        trace_reader.read_bytes(&mut magic)?;
+        if &magic != MAGIC {
+            return Err(invalid("missing magic bytes"));
+        }
+        if trace_reader.read_u32()? != VERSION {
+            return Err(invalid("unsupported version"));
+        }
+        trace_reader.read_u32()?;
+        trace_reader.eeprom_len = trace_reader.read_u64()?;
+        trace_reader.eeprom_offset = trace_reader.read_u64()?;
+        let index_len = trace_reader.read_u64()?;
+        let index_offset = trace_reader.read_u64()?;
+
+        trace_reader.seek(index_offset)?;
+        for _ in 0..index_len {
+            let cycle = trace_reader.read_u64()?;
+            let offset = trace_reader.read_u64()?;
+            trace_reader.index.push((cycle, offset));
+        }
+        Ok(trace_reader)
+    }
+
+    fn seek(&mut self, offset: u64) -> Result<(), TraceFileError> {
+        if offset != self.offset {
+            self.reader.seek(SeekFrom::Start(offset))?;
+            self.offset = offset;
+        }
+        Ok(())
+    }
+
+    fn read_bytes(&mut self, buf: &mut [u8]) -> Result<(), TraceFileError> {
+        self.reader.read_exact(buf).map_err(|e| {
+            if e.kind() == std::io::ErrorKind::UnexpectedEof {
+                invalid("unexpected end of file")
+            } else {
+                e.into()
+            }
+        })?;
+        self.offset += u64::try_from(buf.len()).unwrap();
+        Ok(())
+    }
+
+    fn read_u8(&mut self) -> Result<u8, TraceFileError> {
+        let mut buf = [0; 1];
+        self.read_bytes(&mut buf)?;
+        Ok(buf[0])
+    }
+
+    fn read_u32(&mut self) -> Result<u32, TraceFileError> {
+        let mut buf = [0; 4];
+        self.read_bytes(&mut buf)?;
+        Ok(u32::from_le_bytes(buf))
+    }
+
+    fn read_u64(&mut self) -> Result<u64, TraceFileError> {
+        let mut buf = [0; 8];
+        self.read_bytes(&mut buf)?;
+        Ok(u64::from_le_bytes(buf))
+    }
+
+    /// Read the .eeprom section
+    pub fn eeprom(&mut self) -> Result<Section, TraceFileError> {
+        self.seek(self.eeprom_offset)?;
+        let mut section_data = BTreeMap::new();
+        for _ in 0..self.eeprom_len {
+            let addr = self.read_u32()?;
+            let word = self.read_u32()?;
+            section_data.insert(addr, word);
+        }
+        Ok(Section::Eeprom {
+            section_data,
+            symbols: Vec::new(),
+        })
+    }
+
+    /// Number of trace points in the file
+    pub fn len(&self) -> usize {
+        self.index.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.index.is_empty()
+    }
+
+    /// The cycle of the nth trace point (in cycle order)
+    pub fn cycle(&self, n: usize) -> u64 {
+        self.index[n].0
+    }
+
+    /// The position (in cycle order) of the first trace point at or
+    /// after cycle, or len() if there is none
+    pub fn position(&self, cycle: u64) -> usize {
+        self.index.partition_point(|(c, _)| *c < cycle)
+    }
+
+    /// Read the nth trace point (in cycle order)
+    pub fn trace_point(
+        &mut self,
+        n: usize,
+    ) -> Result<TracePoint, TraceFileError> {
+        let (cycle, offset) = self.index[n];
+        self.seek(offset)?;
+        let count = self.read_u32()?;
+        let mut properties = Vec::new();
+        for _ in 0..count {
+            let property = match self.read_u8()? {
+                TAG_PC => Property::Pc(self.read_u32()?),
+                TAG_REG => {
+                    let index = self.read_u8()?;
+                    if index >= 32 {
+                        return Err(invalid("register index is not < 32"));
+                    }
+                    let value = self.read_u32()?;
+                    Property::Reg { index, value }
+                }
+                TAG_UART => {
+                    let len = self.read_u32()?;
+                    if u64::from(len) > self.len.saturating_sub(self.offset) {
+                        return Err(invalid("unexpected end of file"));
+                    }
+                    let mut bytes = vec![0; len.try_into().unwrap()];
+                    self.read_bytes(&mut bytes)?;
+                    let string = String::from_utf8(bytes)
+                        .map_err(|_| invalid("uart string is not UTF-8"))?;
+                    Property::Uart(string)
+                }
+                _ => return Err(invalid("unknown property tag")),
+            };
+            properties.push(property);
+        }
+        Ok(TracePoint { cycle, properties })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use std::io::Cursor;
+
+    use super::*;
+
+    #[test]
+    fn check_binary_round_trip() {
+        let mut writer = BinaryTraceWriter::new(Cursor::new(Vec::new()))
+            .expect("writing to a vector should work");
+        writer
+            .write_section(&Section::Trace(TracePoint {
+                cycle: 20,
+                properties: vec![Property::Uart("hi\n".to_string())],
+            }))
+            .unwrap();
+        let eeprom = BTreeMap::from([(0, 0x0010_0093), (4, 0x0000_006f)]);
+        writer
+            .write_section(&Section::Eeprom {
+                section_data: eeprom.clone(),
+                symbols: Vec::new(),
+            })
+            .unwrap();
+        writer
+            .write_section(&Section::Trace(TracePoint {
+                cycle: 5,
+                properties: vec![
+                    Property::Pc(4),
+                    Property::Reg {
+                        index: 1,
+                        value: 0xffff_ffff,
+                    },
+                ],
+            }))
+            .unwrap();
+        let bytes = writer.finish().unwrap().into_inner();
+
+        let mut reader = BinaryTraceReader::new(Cursor::new(bytes)).unwrap();
+        match reader.eeprom().unwrap() {
+            Section::Eeprom { section_data, .. } => {
+                assert_eq!(section_data, eeprom)
+            }
+            _ => panic!("expected .eeprom section"),
+        }
+
+        // Trace points are indexed in cycle order
+        assert_eq!(reader.len(), 2);
+        assert_eq!(reader.position(6), 1);
+        assert_eq!(reader.position(21), 2);
+        let trace_point = reader.trace_point(1).unwrap();
+        assert_eq!(trace_point.cycle, 20);
+        assert!(matches!(
+            &trace_point.properties[..],
+            [Property::Uart(s)] if s == "hi\n"
+        ));
+        let trace_point = reader.trace_point(0).unwrap();
+        assert_eq!(trace_point.cycle, 5);
+        assert!(matches!(
+            trace_point.properties[..],
+            [
+                Property::Pc(4),
+                Property::Reg {
+                    index: 1,
+                    value: 0xffff_ffff
+                }
+            ]
+        ));
+    }
+
+    /// Write a trace containing one trace point
+    fn single_trace_point(properties: Vec<Property>) -> Vec<u8> {
+        let mut writer = BinaryTraceWriter::new(Cursor::new(Vec::new()))
+            .expect("writing to a vector should work");
+        writer
+            .write_section(&Section::Trace(TracePoint {
+                cycle: 0,
+                properties,
+            }))
+            .unwrap();
+        writer.finish().unwrap().into_inner()
+    }
+
+    #[test]
+    fn check_malformed_properties_are_errors() {
+        let bytes = single_trace_point(vec![Property::Reg {
+            index: 32,
+            value: 0,
+        }]);
+        let mut reader = BinaryTraceReader::new(Cursor::new(bytes)).unwrap();
+        assert!(matches!(
+            reader.trace_point(0),
+            Err(TraceFileError::InvalidBinaryTrace(_))
+        ));
+
+        // Overwrite the length of the uart string (after the header,
+        // the property count and the tag) with one past the end of
+        // the file
+        let mut bytes = single_trace_point(vec![Property::Uart("hi".into())]);
+        let len_offset = MAGIC.len() + 4 + 4 + 4 * 8 + 4 + 1;
+        let len = u32::MAX.to_le_bytes();
+        bytes[len_offset..len_offset + 4].copy_from_slice(&len);
+        let mut reader = BinaryTraceReader::new(Cursor::new(bytes)).unwrap();
+        assert!(matches!(
+            reader.trace_point(0),
+            Err(TraceFileError::InvalidBinaryTrace(_))
+        ));
+    }
+
+    #[test]
+    fn check_truncated_binary_is_error() {
+        let bytes = MAGIC.to_vec();
+        assert!(matches!(
+            BinaryTraceReader::new(Cursor::new(bytes)),
+            Err(TraceFileError::InvalidBinaryTrace(_))
+        ));
+    }
+}
@@ -0,0 +1,332 @@
+//! Checkpoint-parallel trace checking
+//!
+//! Checking a long trace one trace point at a time uses a single
+//! core. Instead, the trace points can be split into segments, each
+//! starting from a checkpoint of the platform state (see the
+//! platform checkpoint module), and the segments checked in parallel
+//! on separate threads.
+//!
+//! The checkpoints come from one of two places:
+//!
+//! * a first pass that runs the program once (at full speed, without
+//!   checking any properties) and takes a checkpoint at the first
+//!   trace point of each segment
+//! * a checkpoint file saved by an earlier run. For example, saving
+//!   checkpoints using a trusted version of the emulator allows a
+//!   modified emulator to be checked against a long trace without
+//!   any serial pass at all
+//!
+//! A segment starts at the first trace point at or after each
+//! checkpoint, and ends before the next checkpoint. Trace points
+//! before the first checkpoint are checked from reset. Checking gives
+//! the same result as the serial check_trace_file: if any trace point
+//! fails, the error for the earliest failing trace point is returned.
+
+use std::collections::BTreeMap;
+use std::ops::Range;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::thread;
+
+use crate::platform::breakpoints::StopReason;
+use crate::platform::checkpoint::{
+    read_checkpoint_file, write_checkpoint_file, Checkpoint,
+};
+use crate::platform::Platform;
+
+use super::{
+    load_trace, Property, Section, TraceCheck, TraceCheckFailed,
+    TraceFileError, TraceLoadable, TracePoint,
+};
+
+/// How to split up and check a trace in parallel
+#[derive(Debug, Clone, Default)]
+pub struct ParallelCheckOptions {
+    /// Number of threads used to check segments (0 means use the
+    /// available parallelism)
+    pub threads: usize,
+    /// Minimum number of cycles between checkpoints. If None, the
+    /// trace is split into a few segments per thread.
+    pub interval: Option<u64>,
+    /// Read checkpoints from this file instead of taking them
+    pub checkpoints_in: Option<PathBuf>,
+    /// Write the checkpoints used to this file
+    pub checkpoints_out: Option<PathBuf>,
+}
+
+/// Keeps a copy of the .eeprom section of a trace, to load into the
+/// platform of each thread
+#[derive(Debug, Default)]
+struct Program(BTreeMap<u32, u32>);
+
+impl TraceLoadable for Program {
+    fn push(&mut self, section: &Section) {
+        if let Section::Eeprom { section_data, .. } = section {
+            self.0.extend(section_data)
+        }
+    }
+}
+
+/// Run a platform (with the program already loaded and at reset)
+/// through the trace points, taking a checkpoint at the first trace
+/// point, and then at the first trace point at least interval cycles
+/// after the previous checkpoint. Properties are not checked, but the
+/// UART output is flushed wherever a trace point would flush it, so
+/// that the checkpoints hold the same pending UART output as a serial
+/// check would.
+pub fn take_checkpoints(
+    platform: &mut Platform,
+    trace_points: &[TracePoint],
+    interval: u64,
+) -> Vec<Checkpoint> {
+    let last_cycle = match trace_points.last() {
+        Some(trace_point) => trace_point.cycle,
+        None => return Vec::new(),
+    };
+
+    let mut checkpoints: Vec<Checkpoint> = Vec::new();
+    for trace_point in trace_points {
+        let next_checkpoint_cycle = match checkpoints.last() {
+            Some(checkpoint) => checkpoint.cycle().saturating_add(interval),
+            None => 0,
+        };
+        if next_checkpoint_cycle > last_cycle {
+            // No later trace point can start a segment
+            break;
+        }
+
+        match platform.run_to_cycle(trace_point.cycle) {
+            // The remaining trace points cannot be reached (checking
+            // them reports the error)
+            Ok(StopReason::Exit(_)) | Err(_) => break,
+            Ok(_) => {}
+        }
+        if trace_point.cycle >= next_checkpoint_cycle {
+            checkpoints.push(platform.checkpoint());
+        }
+        if trace_point
+            .properties
+            .iter()
+            .any(|property| matches!(property, Property::Uart(_)))
+        {
+            platform.flush_uartout();
+        }
+    }
+    checkpoints
+}
+
+/// Split the trace points (sorted by cycle) into segments, each
+/// starting from the most recent checkpoint (or from reset, if None)
+fn segments<'a>(
+    trace_points: &[TracePoint],
+    checkpoints: &'a [Checkpoint],
+) -> Vec<(Option<&'a Checkpoint>, Range<usize>)> {
+    let position = |cycle: u64| {
+        trace_points.partition_point(|trace_point| trace_point.cycle < cycle)
+    };
+    let mut segments = Vec::new();
+    let mut start = 0;
+    let mut checkpoint = None;
+    for next in checkpoints {
+        let end = position(next.cycle());
+        if end > start {
+            segments.push((checkpoint, start..end));
+        }
+        start = end;
+        checkpoint = Some(next);
+    }
+    if trace_points.len() > start {
+        segments.push((checkpoint, start..trace_points.len()));
+    }
+    segments
+}
+
+/// Check trace points (sorted by cycle) in parallel, with each segment
+/// starting from a checkpoint (sorted by cycle). The program is loaded
+/// into a new platform on each thread.
+pub fn check_trace_points_parallel(
+    program: &Section,
+    trace_points: &[TracePoint],
+    checkpoints: &[Checkpoint],
+    threads: usize,
+) -> Result<(), TraceFileError> {
+    let segments = segments(trace_points, checkpoints);
+    let reset = {
+        let mut platform = Platform::new();
+        platform.push(program);
+        platform.checkpoint()
+    };
+
+    // Segments are handed out in order. Once a segment fails, later
+    // segments are skipped (the earliest failure is the one reported)
+    let next_segment = AtomicUsize::new(0);
+    let first_failed_segment = AtomicUsize::new(usize::MAX);
+    let failures = Mutex::new(Vec::new());
+
+    let check_segments = || {
+        let mut platform = Platform::new();
+        platform.push(program);
+        loop {
+            let n = next_segment.fetch_add(1, Ordering::Relaxed);
+            if n >= segments.len()
+                || n > first_failed_segment.load(Ordering::Relaxed)
+            {
+                break;
+            }
+
+            let (checkpoint, range) = &segments[n];
+            platform.restore(checkpoint.unwrap_or(&reset));
+            for trace_point in trace_points[range.clone()].iter() {
+                if let Err(e) = platform.check_trace_point(trace_point.clone())
+                {
+                    first_failed_segment.fetch_min(n, Ordering::Relaxed);
+                    failures.lock().unwrap().push((n, e));
+                    break;
+                }
+            }
+        }
+    };
+
+    let threads = threads.clamp(1, segments.len().max(1));
+    thread::scope(|scope| {
+        for _ in 0..threads {
+            scope.spawn(check_segments);
+        }
+    });
+
+    let failures: Vec<(usize, TraceCheckFailed)> =
+        failures.into_inner().unwrap();
+    match failures.into_iter().min_by_key(|(n, _)| *n) {
+        Some((_, e)) => Err(e.into()),
+        None => Ok(()),
+    }
+}
+
+/// Check a trace file (text or binary) in parallel. All the trace
+/// points are loaded into memory.
+pub fn check_trace_file_parallel(
+    trace_file_path: String,
+    options: &ParallelCheckOptions,
+) -> Result<(), TraceFileError> {
+    let mut program = Program::default();
+    let trace_points = load_trace(&mut program, trace_file_path)?;
+    if program.0.is_empty() {
+        return Err(TraceFileError::MissingEepromSection);
+    }
+    let program = Section::Eeprom {
+        section_data: program.0,
+        symbols: Vec::new(),
+    };
+
+    let threads = match options.threads {
+        0 => thread::available_parallelism().map_or(1, |n| n.get()),
+        threads => threads,
+    };
+
+    let checkpoints = match &options.checkpoints_in {
+        Some(path) => read_checkpoint_file(path)?,
+        None => {
+            let last_cycle = trace_points.last().map_or(0, |t| t.cycle);
+            let segment_count = u64::try_from(4 * threads).unwrap();
+            let interval = options
+                .interval
+                .unwrap_or(last_cycle / segment_count)
+                .max(1);
+            let mut platform = Platform::new();
+            platform.push(&program);
+            take_checkpoints(&mut platform, &trace_points, interval)
+        }
+    };
+    if let Some(path) = &options.checkpoints_out {
+        write_checkpoint_file(path, &checkpoints)?;
+    }
+
+    check_trace_points_parallel(&program, &trace_points, &checkpoints, threads)
+}
+
+#[cfg(test)]
+mod tests {
+
+    use std::path::PathBuf;
+
+    use super::*;
+    use crate::trace_file::{RecordOptions, Recorder};
+
+    /// Record a golden trace of the hello world program, with a trace
+    /// point every 100 cycles and after every UART write
+    fn record_hello() -> (Section, Vec<TracePoint>) {
+        let mut d = PathBuf::from(env!("CARGO_MANIFEST_DIR"));
+        d.push("test_traces/hello.trace");
+        let path = d.into_os_string().into_string().unwrap();
+
+        let mut program = Program::default();
+        load_trace(&mut program, path).unwrap();
+        let program = Section::Eeprom {
+            section_data: program.0,
+            symbols: Vec::new(),
+        };
+        let mut platform = Platform::new();
+        platform.push(&program);
+        let options = RecordOptions {
+            cycles: 3000,
+            interval: Some(100),
+            on_uart: true,
+            ..RecordOptions::default()
+        };
+        let trace_points = Recorder::new(&mut platform, &options, &[])
+            .unwrap()
+            .collect();
+        (program, trace_points)
+    }
+
+    #[test]
+    fn check_hello_parallel() {
+        let (program, trace_points) = record_hello();
+        for interval in [1, 250, 1000, u64::MAX] {
+            let mut platform = Platform::new();
+            platform.push(&program);
+            let checkpoints =
+                take_checkpoints(&mut platform, &trace_points, interval);
+            for threads in [1, 4] {
+                check_trace_points_parallel(
+                    &program,
+                    &trace_points,
+                    &checkpoints,
+                    threads,
+                )
+                .unwrap();
+            }
+        }
+    }
+
+    /// A wrong property in a late segment is still found, and is
+    /// reported in preference to a failure in a later segment
+    #[test]
+    fn check_parallel_reports_earliest_failure() {
+        let (program, mut trace_points) = record_hello();
+        let mut platform = Platform::new();
+        platform.push(&program);
+        let checkpoints = take_checkpoints(&mut platform, &trace_points, 1);
+        assert_eq!(checkpoints.len(), trace_points.len());
+
+        let n = trace_points.len();
+        for index in [n - 2, n - 1] {
+            trace_points[index]
+                .properties
+                .push(Property::Pc(0xffff_ffff));
+        }
+        let result = check_trace_points_parallel(
+            &program,
+            &trace_points,
+            &checkpoints,
+            4,
+        );
+        match result {
+            Err(TraceFileError::CheckFailed(
+                TraceCheckFailed::FailedCheck { cycle, .. },
+            )) => assert_eq!(cycle, trace_points[n - 2].cycle),
+            _ => panic!("expected a failed check, got {result:?}"),
+        }
+    }
+}
@@ -0,0 +1,456 @@
+//! Streaming trace file reader
+//!
+//! Trace files can be very large, so this reader parses them one
+//! section at a time, without holding the whole file in memory. Every
+//! line is read into the same buffer, and parsed in place (comments
+//! and whitespace are stripped by slicing, not copying). The only
+//! allocations are for the parsed sections themselves.
+//!
+//! Sections are returned in the order they appear in the file. Use
+//! check_trace to check the trace points against a platform as they
+//! are read (this requires the trace points after the .eeprom section
+//! to be in cycle order, which is how the tools write them), or
+//! load_trace (in the parent module) to collect and sort them all.
+
+use std::collections::BTreeMap;
+use std::fs::File;
+use std::io::{BufRead, BufReader};
+use std::ops::Range;
+use std::path::Path;
+
+use super::{
+    is_binary_trace_file, BinaryTraceReader, Property, Section, TraceCheck,
+    TraceFileError, TraceLoadable, TracePoint,
+};
+
+/// A parsed section heading
+#[derive(Debug)]
+enum Heading {
+    Eeprom,
+    Trace(u64),
+    Unrecognised(String),
+}
+
+/// Reads sections from a trace file in order. Also usable as an
+/// iterator over the sections.
+#[derive(Debug)]
+pub struct TraceReader<R> {
+    reader: R,
+    /// Buffer holding the current line (reused for every line)
+    line: Vec<u8>,
+    /// Number of the line in the buffer (starting from 1)
+    line_number: usize,
+    /// The heading which ended the previous section
+    next_heading: Option<Heading>,
+}
+
+impl TraceReader<BufReader<File>> {
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<Self, TraceFileError> {
+        let file = File::open(path)?;
+        Ok(Self::new(BufReader::new(file)))
+    }
+}
+
+impl<R: BufRead> TraceReader<R> {
+    pub fn new(reader: R) -> Self {
+        Self {
+            reader,
+            line: Vec::new(),
+            line_number: 0,
+            next_heading: None,
+        }
+    }
+
+    /// Read the next section from the file, or return None at the
+    /// end of the file. If the section is not recognised, its
+    /// contents are skipped and UnrecognisedSection is returned, after
+    /// which reading can continue.
+    pub fn next_section(&mut self) -> Result<Option<Section>, TraceFileError> {
+        let heading = match self.next_heading.take() {
+            Some(heading) => heading,
+            None => match self.next_line()? {
+                Some(line) if line.starts_with('.') => self.parse_heading()?,
+                Some(_) => return Err(TraceFileError::MissingSectionHeading),
+                None => return Ok(None),
+            },
+        };
+
+        match heading {
+            Heading::Eeprom => {
+                let mut section_data = BTreeMap::new();
+                while let Some((line_number, line)) = self.section_line()? {
+                    let (addr, instr) = parse_eeprom_entry(line).ok_or(
+                        TraceFileError::InvalidEepromEntry {
+                            line: line_number,
+                        },
+                    )?;
+                    section_data.insert(addr, instr);
+                }
+                Ok(Some(Section::Eeprom {
+                    section_data,
+                    symbols: Vec::new(),
+                }))
+            }
+            Heading::Trace(cycle) => {
+                let mut properties = Vec::new();
+                while let Some((line_number, line)) = self.section_line()? {
+                    let property = parse_property(line).ok_or_else(|| {
+                        TraceFileError::InvalidProperty {
+                            line: line_number,
+                            text: line.to_string(),
+                        }
+                    })?;
+                    properties.push(property);
+                }
+                Ok(Some(Section::Trace(TracePoint { cycle, properties })))
+            }
+            Heading::Unrecognised(name) => {
+                while self.section_line()?.is_some() {}
+                Err(TraceFileError::UnrecognisedSection(name))
+            }
+        }
+    }
+
+    /// Read the next non-empty line in the current section, and
+    /// return it along with its line number. Returns None at the end
+    /// of the file, or if the next line is a section heading (which is
+    /// kept for the next call to next_section).
+    fn section_line(
+        &mut self,
+    ) -> Result<Option<(usize, &str)>, TraceFileError> {
+        match self.next_line_range()? {
+            Some(range) if self.line[range.start] == b'.' => {
+                self.next_heading = Some(self.parse_heading()?);
+                Ok(None)
+            }
+            Some(range) => Ok(Some((self.line_number, self.line_str(range)?))),
+            None => Ok(None),
+        }
+    }
+
+    /// Read the next line that is not empty or a comment, and return
+    /// it without the comment or surrounding whitespace. Returns None
+    /// at the end of the file.
+    fn next_line(&mut self) -> Result<Option<&str>, TraceFileError> {
+        match self.next_line_range()? {
+            Some(range) => Ok(Some(self.line_str(range)?)),
+            None => Ok(None),
+        }
+    }
+
+    /// As next_line, but return the range of the line buffer holding
+    /// the line, so that the buffer is not borrowed
+    fn next_line_range(
+        &mut self,
+    ) -> Result<Option<Range<usize>>, TraceFileError> {
+        loop {
+            self.line.clear();
+            if self.reader.read_until(b'\n', &mut self.line)? == 0 {
+                return Ok(None);
+            }
+            self.line_number += 1;
+
+            let end = comment_start(&self.line);
+            let start = self.line[..end]
+                .iter()
+                .position(|b| !b.is_ascii_whitespace());
+            if let Some(start) = start {
+                let end = self.line[..end]
+                    .iter()
+                    .rposition(|b| !b.is_ascii_whitespace())
+                    .expect("line contains a non-whitespace byte")
+                    + 1;
+                return Ok(Some(start..end));
+            }
+        }
+    }
+
+    fn line_str(&self, range: Range<usize>) -> Result<&str, TraceFileError> {
+        std::str::from_utf8(&self.line[range]).map_err(|_| {
+            TraceFileError::InvalidUtf8 {
+                line: self.line_number,
+            }
+        })
+    }
+
+    /// Parse the heading on the current line (which begins with a dot)
+    fn parse_heading(&self) -> Result<Heading, TraceFileError> {
+        let line = self.line_str(0..self.line.len())?;
+        let text = line[..comment_start(line.as_bytes())].trim();
+        if text == ".eeprom" {
+            Ok(Heading::Eeprom)
+        } else if let Some(cycle) = text.strip_prefix(".trace.") {
+            cycle.parse().map(Heading::Trace).map_err(|_| {
+                TraceFileError::InvalidSectionHeading {
+                    line: self.line_number,
+                    text: text.to_string(),
+                }
+            })
+        } else {
+            Ok(Heading::Unrecognised(text.to_string()))
+        }
+    }
+}
+
+impl<R: BufRead> Iterator for TraceReader<R> {
+    type Item = Result<Section, TraceFileError>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        self.next_section().transpose()
+    }
+}
+
+/// Return the position of the # that starts the comment in a line,
+/// ignoring any # inside a quoted string, or the length of the line if
+/// there is no comment
+fn comment_start(line: &[u8]) -> usize {
+    let mut in_string = false;
+    let mut escaped = false;
+    for (n, b) in line.iter().enumerate() {
+        match b {
+            _ if escaped => escaped = false,
+            b'\\' if in_string => escaped = true,
+            b'"' => in_string = !in_string,
+            b'#' if !in_string => return n,
+            _ => (),
+        }
+    }
+    line.len()
+}
+
+/// Replace the escape sequences in a quoted string (the reverse of
+/// escape_string in the writer module). Returns None for an unknown
+/// escape sequence.
+fn unescape_string(string: &str) -> Option<String> {
+    let mut unescaped = String::with_capacity(string.len());
+    let mut chars = string.chars();
+    while let Some(ch) = chars.next() {
+        if ch == '\\' {
+            unescaped.push(match chars.next()? {
+                'n' => '\n',
+                't' => '\t',
+                'r' => '\r',
+                '"' => '"',
+                '\\' => '\\',
+                _ => return None,
+            });
+        } else {
+            unescaped.push(ch);
+        }
+    }
+    Some(unescaped)
+}
+
+/// Parse a line of the form "ADDR INSTR", both in hexadecimal
+fn parse_eeprom_entry(line: &str) -> Option<(u32, u32)> {
+    let mut terms = line.split_whitespace();
+    let addr = u32::from_str_radix(terms.next()?, 16).ok()?;
+    let instr = u32::from_str_radix(terms.next()?, 16).ok()?;
+    if terms.next().is_some() {
+        None
+    } else {
+        Some((addr, instr))
+    }
+}
+
+/// Parse a decimal value, or a hexadecimal value with 0x prefix
+fn parse_dec_or_hex(value: &str) -> Option<u32> {
+    match value.strip_prefix("0x") {
+        Some(hex) => u32::from_str_radix(hex, 16).ok(),
+        None => value.parse().ok(),
+    }
+}
+
+/// Parse a line of the form "KEY VALUE" in a .trace section
+fn parse_property(line: &str) -> Option<Property> {
+    let (key, value) = line.split_once(char::is_whitespace)?;
+    let value = value.trim();
+    if key == "pc" {
+        Some(Property::Pc(parse_dec_or_hex(value)?))
+    } else if let Some(index) = key.strip_prefix('x') {
+        let index = index.parse().ok().filter(|index| *index < 32)?;
+        let value = parse_dec_or_hex(value)?;
+        Some(Property::Reg { index, value })
+    } else if key == "uart" {
+        let value = value.strip_prefix('"')?.strip_suffix('"')?;
+        Some(Property::Uart(unescape_string(value)?))
+    } else {
+        None
+    }
+}
+
+/// Load the program and check the trace points in a trace file as
+/// they are read, so that checking starts without reading the whole
+/// file.
+///
+/// Trace points that appear before the .eeprom section are held until
+/// the program is loaded. After that, trace points must appear in
+/// cycle order; a trace point for an earlier cycle than the one
+/// already reached fails with CannotAdvanceToCycle.
+pub fn check_trace<P, R>(
+    platform: &mut P,
+    reader: TraceReader<R>,
+) -> Result<(), TraceFileError>
+where
+    P: TraceCheck + TraceLoadable,
+    R: BufRead,
+{
+    let mut eeprom_loaded = false;
+    let mut early_trace_points = Vec::new();
+    for section in reader {
+        match section {
+            Ok(section @ Section::Eeprom { .. }) => {
+                platform.push(&section);
+                eeprom_loaded = true;
+                early_trace_points.sort_by_key(|t: &TracePoint| t.cycle);
+                for trace_point in early_trace_points.drain(..) {
+                    platform.check_trace_point(trace_point)?;
+                }
+            }
+            Ok(Section::Trace(trace_point)) => {
+                if eeprom_loaded {
+                    platform.check_trace_point(trace_point)?;
+                } else {
+                    early_trace_points.push(trace_point);
+                }
+            }
+            Err(TraceFileError::UnrecognisedSection(name)) => {
+                println!("Warning: unrecognised section {name}")
+            }
+            Err(e) => return Err(e),
+        }
+    }
+
+    if eeprom_loaded {
+        Ok(())
+    } else {
+        Err(TraceFileError::MissingEepromSection)
+    }
+}
+
+/// Open a trace file and check it using check_trace. Binary trace
+/// files are also accepted; their trace points are read in cycle
+/// order using the index.
+pub fn check_trace_file<P, Q>(
+    platform: &mut P,
+    trace_file_path: Q,
+) -> Result<(), TraceFileError>
+where
+    P: TraceCheck + TraceLoadable,
+    Q: AsRef<Path>,
+{
+    if is_binary_trace_file(&trace_file_path)? {
+        let mut reader = BinaryTraceReader::open(trace_file_path)?;
+        platform.push(&reader.eeprom()?);
+        for n in 0..reader.len() {
+            platform.check_trace_point(reader.trace_point(n)?)?;
+        }
+        Ok(())
+    } else {
+        check_trace(platform, TraceReader::open(trace_file_path)?)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use std::io::Cursor;
+    use std::path::PathBuf;
+
+    use super::*;
+    use crate::platform::Platform;
+    use crate::trace_file::TraceCheckFailed;
+
+    fn read_all(text: &str) -> Result<Vec<Section>, TraceFileError> {
+        TraceReader::new(Cursor::new(text)).collect()
+    }
+
+    #[test]
+    fn check_read_sections() {
+        let text = "# comment\n\
+		    .eeprom # program\n\
+		    00000000 00100093 # addi x1, x0, 1\n\
+		    \n\
+		    .trace.1\n\
+		    pc 0x4\n\
+		    x1  1\n\
+		    uart \"hi\\n\\\"#\\\"\" # comment\n";
+        let sections = read_all(text).unwrap();
+        assert_eq!(sections.len(), 2);
+        match &sections[0] {
+            Section::Eeprom { section_data, .. } => {
+                assert_eq!(section_data.get(&0), Some(&0x0010_0093))
+            }
+            _ => panic!("expected .eeprom section"),
+        }
+        match &sections[1] {
+            Section::Trace(trace_point) => {
+                assert_eq!(trace_point.cycle, 1);
+                assert_eq!(trace_point.properties.len(), 3);
+                assert!(matches!(
+                    &trace_point.properties[2],
+                    Property::Uart(s) if s == "hi\n\"#\""
+                ));
+            }
+            _ => panic!("expected .trace section"),
+        }
+    }
+
+    #[test]
+    fn check_malformed_lines_are_errors() {
+        let result = read_all(".eeprom\n00000000 nothex\n");
+        assert!(matches!(
+            result,
+            Err(TraceFileError::InvalidEepromEntry { line: 2 })
+        ));
+
+        let result = read_all(".eeprom\n.trace.3\nx40 1\n");
+        assert!(matches!(
+            result,
+            Err(TraceFileError::InvalidProperty { line: 3, .. })
+        ));
+
+        let result = read_all(".trace.x\n");
+        assert!(matches!(
+            result,
+            Err(TraceFileError::InvalidSectionHeading { line: 1, .. })
+        ));
+
+        let result = read_all("pc 0\n");
+        assert!(matches!(result, Err(TraceFileError::MissingSectionHeading)));
+    }
+
+    #[test]
+    fn check_unrecognised_section_is_skipped() {
+        let mut reader =
+            TraceReader::new(Cursor::new(".other\n1 2\n.trace.0\npc 0\n"));
+        assert!(matches!(
+            reader.next(),
+            Some(Err(TraceFileError::UnrecognisedSection(_)))
+        ));
+        assert!(matches!(reader.next(), Some(Ok(Section::Trace(_)))));
+        assert!(reader.next().is_none());
+    }
+
+    #[test]
+    fn check_streaming_hello_trace() {
+        let mut d = PathBuf::from(env!("CARGO_MANIFEST_DIR"));
+        d.push("test_traces/hello.trace");
+        let mut platform = Platform::new();
+        check_trace_file(&mut platform, d).unwrap();
+    }
+
+    #[test]
+    fn check_out_of_order_trace_fails() {
+        let text = ".eeprom\n.trace.5\n.trace.2\n";
+        let mut platform = Platform::new();
+        let result =
+            check_trace(&mut platform, TraceReader::new(text.as_bytes()));
+        assert!(matches!(
+            result,
+            Err(TraceFileError::CheckFailed(
+                TraceCheckFailed::CannotAdvanceToCycle { .. }
+            ))
+        ));
+    }
+}
@@ -0,0 +1,190 @@
+//! Golden trace recording
+//!
+//! Instead of writing trace points by hand, run a program on the
+//! platform and record its state (pc, registers and UART output) at
+//! chosen points. The recorder stops the platform using breakpoints
+//! and watchpoints, so that the program runs at full speed between
+//! trace points:
+//!
+//! * every interval cycles
+//! * after every write to the UART (a watchpoint on the UART register)
+//! * on entry to a trap (breakpoints on the trap vectors)
+//! * at any other breakpoint (for example, a symbol)
+//!
+//! A final trace point is always recorded at the last cycle. Each
+//! trace point includes the UART output since the previous trace
+//! point, if there is any.
+
+use crate::elf_utils::FullSymbol;
+use crate::platform::breakpoints::{BreakpointSpec, WatchKind, Watchpoint};
+use crate::platform::eei::Eei;
+use crate::platform::pma::{
+    EXCEPTION_VECTOR, MACHINE_EXTERNAL_INT_VECTOR, MACHINE_SOFTWARE_INT_VECTOR,
+    MACHINE_TIMER_INT_VECTOR, NMI_VECTOR, UARTTX_ADDR,
+};
+use crate::platform::Platform;
+
+use super::{Property, TraceFileError, TracePoint};
+
+/// Which trace points to record
+#[derive(Debug, Clone, Default)]
+pub struct RecordOptions {
+    /// Stop recording at this cycle
+    pub cycles: u64,
+    /// Record a trace point every interval cycles
+    pub interval: Option<u64>,
+    /// Record a trace point after every UART write
+    pub on_uart: bool,
+    /// Record a trace point on entry to a trap handler
+    pub on_trap: bool,
+    /// Record a trace point at each of these breakpoints
+    pub breakpoints: Vec<BreakpointSpec>,
+}
+
+/// Runs a platform, yielding a trace point each time one of the
+/// recording events occurs
+#[derive(Debug)]
+pub struct Recorder<'a> {
+    platform: &'a mut Platform,
+    end_cycle: u64,
+    interval: Option<u64>,
+    next_interval_cycle: u64,
+}
+
+impl<'a> Recorder<'a> {
+    /// Prepare to record from a platform with a program already
+    /// loaded. Symbol breakpoints are resolved using symbols. This
+    /// adds to the platform's breakpoints and watchpoints.
+    pub fn new(
+        platform: &'a mut Platform,
+        options: &RecordOptions,
+        symbols: &[FullSymbol],
+    ) -> Result<Self, TraceFileError> {
+        let breakpoints = platform.breakpoints_mut();
+        for spec in options.breakpoints.iter() {
+            breakpoints.insert_spec(spec, symbols)?;
+        }
+        if options.on_trap {
+            for vector in [
+                NMI_VECTOR,
+                EXCEPTION_VECTOR,
+                MACHINE_SOFTWARE_INT_VECTOR,
+                MACHINE_TIMER_INT_VECTOR,
+                MACHINE_EXTERNAL_INT_VECTOR,
+            ] {
+                breakpoints.insert_pc(vector);
+            }
+        }
+        if options.on_uart {
+            breakpoints.insert_watchpoint(Watchpoint {
+                addr: UARTTX_ADDR,
+                len: 1,
+                kind: WatchKind::Write,
+            });
+        }
+
+        platform.set_exceptions_are_errors(false);
+        let interval = options.interval.filter(|interval| *interval != 0);
+        let next_interval_cycle = match interval {
+            Some(interval) => platform.mcycle() + interval,
+            None => u64::MAX,
+        };
+        Ok(Self {
+            platform,
+            end_cycle: options.cycles,
+            interval,
+            next_interval_cycle,
+        })
+    }
+
+    /// Capture the current state of the platform
+    fn trace_point(&mut self) -> TracePoint {
+        let mut properties = vec![Property::Pc(self.platform.pc())];
+        for index in 0..32 {
+            let value = self.platform.x(index);
+            properties.push(Property::Reg { index, value });
+        }
+        let uart = self.platform.flush_uartout();
+        if !uart.is_empty() {
+            properties.push(Property::Uart(uart));
+        }
+        TracePoint {
+            cycle: self.platform.mcycle(),
+            properties,
+        }
+    }
+}
+
+impl Iterator for Recorder<'_> {
+    type Item = TracePoint;
+
+    fn next(&mut self) -> Option<TracePoint> {
+        let current = self.platform.mcycle();
+        if current >= self.end_cycle {
+            return None;
+        }
+
+        // Run to the next interval (or the end), unless an event
+        // stops the platform first. Exceptions trap to the exception
+        // vector here (so they can be recorded using on_trap).
+        let target = self.next_interval_cycle.min(self.end_cycle);
+        self.platform
+            .run(target - current)
+            .expect("exceptions are not errors while recording");
+
+        if self.platform.mcycle() == self.next_interval_cycle {
+            self.next_interval_cycle += self.interval.unwrap();
+        }
+        Some(self.trace_point())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+
+    use std::path::PathBuf;
+
+    use super::*;
+    use crate::trace_file::{load_trace, TraceCheck};
+
+    /// Record the hello world program, and check the recorded trace
+    /// on a fresh platform
+    #[test]
+    fn check_record_hello() {
+        let mut d = PathBuf::from(env!("CARGO_MANIFEST_DIR"));
+        d.push("test_traces/hello.trace");
+        let path = d.into_os_string().into_string().unwrap();
+
+        let mut platform = Platform::new();
+        load_trace(&mut platform, path.clone()).unwrap();
+        let options = RecordOptions {
+            cycles: 3000,
+            interval: Some(1000),
+            on_uart: true,
+            ..RecordOptions::default()
+        };
+        let trace_points: Vec<_> = Recorder::new(&mut platform, &options, &[])
+            .unwrap()
+            .collect();
+
+        // One trace point per character, plus one per interval
+        // (the last interval is the final trace point)
+        assert_eq!(trace_points.len(), "Hello world\n".len() + 3);
+        assert_eq!(trace_points.last().unwrap().cycle, 3000);
+        let uart: String = trace_points
+            .iter()
+            .flat_map(|trace_point| trace_point.properties.iter())
+            .filter_map(|property| match property {
+                Property::Uart(string) => Some(string.as_str()),
+                _ => None,
+            })
+            .collect();
+        assert_eq!(uart, "Hello world\n");
+
+        let mut platform = Platform::new();
+        load_trace(&mut platform, path).unwrap();
+        for trace_point in trace_points {
+            platform.check_trace_point(trace_point).unwrap();
+        }
+    }
+}
@@ -0,0 +1,257 @@
+//! Text trace file writer
+//!
+//! Writing the .eeprom section means disassembling every word of the
+//! program. To keep this fast for large images:
+//!
+//! * one decoder is built the first time it is needed, and shared by
+//!   every section (and every file) written afterwards
+//! * function labels are looked up in an index sorted by address,
+//!   which is walked alongside the (also sorted) words, rather than
+//!   searching all the symbols for every word
+//! * lines, including the disassembly, are formatted straight into
+//!   the buffered output, with no intermediate string per line
+//! * large images are split into chunks, which are disassembled on
+//!   separate threads and then written in order, so the output is the
+//!   same as for a single thread
+
+use std::collections::BTreeMap;
+use std::io::{self, Write};
+use std::sync::OnceLock;
+use std::thread;
+
+use crate::decode::Decoder;
+use crate::elf_utils::{FullSymbol, SymbolIndex};
+use crate::platform::arch::{
+    make_rv32i, make_rv32m, make_rv32priv, make_rv32zicsr,
+};
+use crate::platform::print_macros::{Disassembly, PrintContext};
+use crate::platform::{Instr, Platform};
+use crate::utils::mask;
+
+use super::{Property, Section, TraceFileError, TracePoint};
+
+/// Images with at least this many words are disassembled in parallel
+const PARALLEL_DISASSEMBLY_WORDS: usize = 0x10000;
+
+/// The decoder used to disassemble .eeprom sections
+fn disassembler() -> &'static Decoder<Instr<Platform>> {
+    static DECODER: OnceLock<Decoder<Instr<Platform>>> = OnceLock::new();
+    DECODER.get_or_init(|| {
+        let mut decoder = Decoder::new(mask(7));
+        make_rv32i(&mut decoder).expect("adding instructions should work");
+        make_rv32m(&mut decoder).expect("adding instructions should work");
+        make_rv32zicsr(&mut decoder).expect("adding instructions should work");
+        make_rv32priv(&mut decoder).expect("adding instructions should work");
+        decoder
+    })
+}
+
+/// The function labels to write in an .eeprom section, sorted by
+/// address. Only the first named symbol at each address is used.
+fn symbol_labels(symbols: &[FullSymbol]) -> Vec<(u32, &str)> {
+    let mut labels: Vec<(u32, &str)> = symbols
+        .iter()
+        .filter_map(|symbol| Some((symbol.value, symbol.name.as_deref()?)))
+        .collect();
+    labels.sort_by_key(|(addr, _)| *addr);
+    labels.dedup_by_key(|(addr, _)| *addr);
+    labels
+}
+
+/// Write the lines of an .eeprom section for words (sorted by
+/// address), preceded by any function labels at their addresses.
+/// Branch and jump targets are named using symbols.
+fn write_words<'a, W, I>(
+    file: &mut W,
+    words: I,
+    labels: &[(u32, &str)],
+    symbols: &SymbolIndex,
+) -> io::Result<()>
+where
+    W: Write,
+    I: IntoIterator<Item = (&'a u32, &'a u32)>,
+{
+    let decoder = disassembler();
+    let mut words = words.into_iter().peekable();
+    let Some((first_addr, _)) = words.peek() else {
+        return Ok(());
+    };
+    let mut next_label = labels.partition_point(|(addr, _)| addr < first_addr);
+
+    for (addr, instr) in words {
+        // Skip labels at addresses with no word
+        while labels
+            .get(next_label)
+            .is_some_and(|(label_addr, _)| label_addr < addr)
+        {
+            next_label += 1;
+        }
+        if let Some((label_addr, name)) = labels.get(next_label) {
+            if label_addr == addr {
+                write!(file, "\n# {name}\n")?;
+                next_label += 1;
+            }
+        }
+
+        write!(file, "{addr:0>8x}  {instr:0>8x}  # ")?;
+        match decoder.get_exec(*instr) {
+            Ok(Instr { printer, .. }) => {
+                let disassembly = Disassembly {
+                    printer: *printer,
+                    instr: *instr,
+                    context: PrintContext {
+                        pc: *addr,
+                        symbols: Some(symbols),
+                    },
+                };
+                writeln!(file, "{disassembly}")?
+            }
+            Err(_) => writeln!(file, "unknown/not instruction")?,
+        }
+    }
+    Ok(())
+}
+
+/// Write the lines of an .eeprom section, splitting the words into
+/// chunks that are disassembled on separate threads
+fn write_words_parallel<W: Write>(
+    file: &mut W,
+    section_data: &BTreeMap<u32, u32>,
+    labels: &[(u32, &str)],
+    symbols: &SymbolIndex,
+    threads: usize,
+) -> io::Result<()> {
+    let words: Vec<(&u32, &u32)> = section_data.iter().collect();
+    let chunk_len = words.len().div_ceil(threads.max(1)).max(1);
+    let chunks: Vec<io::Result<Vec<u8>>> = thread::scope(|scope| {
+        let handles: Vec<_> = words
+            .chunks(chunk_len)
+            .map(|chunk| {
+                scope.spawn(move || {
+                    let mut buffer = Vec::new();
+                    write_words(
+                        &mut buffer,
+                        chunk.iter().copied(),
+                        labels,
+                        symbols,
+                    )?;
+                    Ok(buffer)
+                })
+            })
+            .collect();
+        handles
+            .into_iter()
+            .map(|handle| handle.join().expect("disassembly should not panic"))
+            .collect()
+    });
+    for chunk in chunks {
+        file.write_all(&chunk?)?;
+    }
+    Ok(())
+}
+
+/// Escape a string for writing in quotes in a trace file. Newlines,
+/// tabs, carriage returns, quotes and backslashes are escaped.
+fn escape_string(string: &str) -> String {
+    let mut escaped = String::with_capacity(string.len());
+    for ch in string.chars() {
+        match ch {
+            '\n' => escaped.push_str("\\n"),
+            '\t' => escaped.push_str("\\t"),
+            '\r' => escaped.push_str("\\r"),
+            '"' => escaped.push_str("\\\""),
+            '\\' => escaped.push_str("\\\\"),
+            _ => escaped.push(ch),
+        }
+    }
+    escaped
+}
+
+/// Write a section in the text format
+pub(super) fn write_section<W: Write>(
+    file: &mut W,
+    section: &Section,
+) -> Result<(), TraceFileError> {
+    match section {
+        Section::Eeprom {
+            section_data,
+            symbols,
+        } => {
+            file.write_all(b".eeprom\n")?;
+            let labels = symbol_labels(symbols);
+            let symbols = SymbolIndex::new(symbols);
+            if section_data.len() >= PARALLEL_DISASSEMBLY_WORDS {
+                let threads =
+                    thread::available_parallelism().map_or(1, |n| n.get());
+                write_words_parallel(
+                    file,
+                    section_data,
+                    &labels,
+                    &symbols,
+                    threads,
+                )?;
+            } else {
+                write_words(file, section_data, &labels, &symbols)?;
+            }
+        }
+        Section::Trace(TracePoint { cycle, properties }) => {
+            write!(file, "\n.trace.{cycle}\n")?;
+            for property in properties.iter() {
+                match property {
+                    Property::Pc(pc) => writeln!(file, "pc 0x{pc:x}")?,
+                    Property::Reg { index, value } => {
+                        writeln!(file, "x{index} 0x{value:x}")?
+                    }
+                    Property::Uart(string) => {
+                        writeln!(file, "uart \"{}\"", escape_string(string))?
+                    }
+                }
+            }
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+
+    use super::*;
+    use crate::torture::{generate, TortureOptions};
+
+    /// Splitting the disassembly across threads gives the same output
+    /// as a single thread, including labels at chunk boundaries
+    #[test]
+    fn check_parallel_disassembly_matches_serial() {
+        let Section::Eeprom { section_data, .. } =
+            generate(&TortureOptions::default())
+        else {
+            unreachable!()
+        };
+        let addrs: Vec<u32> = section_data.keys().copied().collect();
+        let labels: Vec<(u32, &str)> = addrs
+            .iter()
+            .step_by(97)
+            .map(|addr| (*addr, "label"))
+            .collect();
+
+        let mut serial = Vec::new();
+        let symbols = SymbolIndex::default();
+        write_words(&mut serial, &section_data, &labels, &symbols).unwrap();
+        for threads in [1, 3, 8] {
+            let mut parallel = Vec::new();
+            write_words_parallel(
+                &mut parallel,
+                &section_data,
+                &labels,
+                &symbols,
+                threads,
+            )
+            .unwrap();
+            assert_eq!(parallel, serial);
+        }
+
+        let text = String::from_utf8(serial).unwrap();
+        assert_eq!(text.matches("\n# label\n").count(), labels.len());
+        assert!(text.starts_with("\n# label\n00000000  0880006f  # jal"));
+    }
+}
@@ -0,0 +1,154 @@
+//! Check that the emulator does not allocate once a program is running
+//!
+//! The run loop should not touch the heap in steady state (once the
+//! program's blocks are in the block cache, its memory has been
+//! written, and the UART output buffer has grown to size), because
+//! allocations cost throughput and, when many emulators share a host,
+//! tail latency. This test runs a program that exercises loads,
+//! stores, CSR accesses, UART output and timer interrupts under a
+//! global allocator that counts allocations, and fails if any happen
+//! after a warm-up period.
+//!
+//! This is an integration test, rather than a unit test in the
+//! library, because a global allocator needs unsafe code, which the
+//! library forbids.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+
+use riscvemu::elf_utils::ElfLoadable;
+use riscvemu::platform::breakpoints::StopReason;
+use riscvemu::platform::Platform;
+
+/// Wraps the system allocator, counting the allocations made by each
+/// thread (so that the test harness's own threads are not counted)
+struct CountingAllocator;
+
+thread_local! {
+    static ALLOCATIONS: Cell<u64> = const { Cell::new(0) };
+}
+
+fn count_allocation() {
+    // Ignore allocations made while the thread is being destroyed
+    let _ = ALLOCATIONS.try_with(|count| count.set(count.get() + 1));
+}
+
+fn allocations() -> u64 {
+    ALLOCATIONS.with(Cell::get)
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        count_allocation();
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        count_allocation();
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(
+        &self,
+        ptr: *mut u8,
+        layout: Layout,
+        new_size: usize,
+    ) -> *mut u8 {
+        count_allocation();
+        System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+/// A loop that stores and loads a counter, reads mcycle, and writes
+/// to the UART every 64 iterations, with a timer interrupt every 100
+/// cycles
+const PROGRAM: [(u32, u32); 23] = [
+    (0x00, 0x0400006f), // jal x0, start
+    // Timer interrupt handler: set mtimecmp to mtime + 100
+    (0x24, 0x00042283), // lw x5, 0(x8)
+    (0x28, 0x06428293), // addi x5, x5, 100
+    (0x2c, 0x00542423), // sw x5, 8(x8)
+    (0x30, 0x30200073), // mret
+    // start:
+    (0x40, 0x10000437), // lui x8, 0x10000 (memory-mapped registers)
+    (0x44, 0x200004b7), // lui x9, 0x20000 (RAM)
+    (0x48, 0x06400293), // addi x5, x0, 100
+    (0x4c, 0x00542423), // sw x5, 8(x8) (mtimecmp)
+    (0x50, 0x08000293), // addi x5, x0, 0x80
+    (0x54, 0x3042a073), // csrrs x0, mie, x5 (MTIE)
+    (0x58, 0x30046073), // csrrsi x0, mstatus, 8 (MIE)
+    // loop:
+    (0x5c, 0x00150513), // addi x10, x10, 1
+    (0x60, 0x00a4a023), // sw x10, 0(x9)
+    (0x64, 0x0004a583), // lw x11, 0(x9)
+    (0x68, 0x03f57613), // andi x12, x10, 0x3f
+    (0x6c, 0x00061663), // bne x12, x0, skip
+    (0x70, 0x07800693), // addi x13, x0, 'x'
+    (0x74, 0x00d42c23), // sw x13, 0x18(x8) (uarttx)
+    // skip:
+    (0x78, 0xb0002773), // csrrs x14, mcycle, x0
+    (0x7c, 0xfe1ff06f), // jal x0, loop
+    // Unused vectors
+    (0x04, 0x0000006f), // jal x0, 0 (NMI: loop forever)
+    (0x08, 0x0000006f), // jal x0, 0 (exception: loop forever)
+];
+
+fn load_program() -> Platform {
+    let mut platform = Platform::new();
+    for (addr, instr) in PROGRAM {
+        for (offset, byte) in (0..).zip(instr.to_le_bytes()) {
+            platform.write_byte(addr + offset, byte).unwrap();
+        }
+    }
+    platform
+}
+
+/// Run with step, reading the UART output after every step. Returns
+/// the number of UART bytes read.
+fn run_steps(platform: &mut Platform, steps: u64) -> usize {
+    let mut buf = [0; 16];
+    let mut uart_bytes = 0;
+    for _ in 0..steps {
+        platform.step().unwrap();
+        uart_bytes += platform.read_uartout(&mut buf);
+    }
+    uart_bytes
+}
+
+/// Run with run (using the block cache), reading the UART output
+/// after every call. Returns the number of UART bytes read.
+fn run_blocks(platform: &mut Platform, steps: u64) -> usize {
+    let mut buf = [0; 16];
+    let mut uart_bytes = 0;
+    for _ in 0..steps / 1000 {
+        let stop_reason = platform.run(1000).unwrap();
+        assert!(matches!(stop_reason, StopReason::StepsCompleted));
+        while platform.uart_output_unread() != 0 {
+            uart_bytes += platform.read_uartout(&mut buf);
+        }
+    }
+    uart_bytes
+}
+
+#[test]
+fn check_steady_state_does_not_allocate() {
+    let mut platform = load_program();
+    run_steps(&mut platform, 100_000);
+    run_blocks(&mut platform, 100_000);
+
+    let before = allocations();
+    let uart_bytes = run_steps(&mut platform, 100_000)
+        + run_blocks(&mut platform, 1_000_000);
+    let allocated = allocations() - before;
+
+    // Check the program really wrote to the UART
+    assert!(uart_bytes > 1000, "only {uart_bytes} bytes of output");
+    assert_eq!(allocated, 0, "{allocated} allocations after warm-up");
+}
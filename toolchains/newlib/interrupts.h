@@ -1,7 +1,7 @@
 #include <stdint.h>
 
-#define MTIME_BASE 0x10000
-#define MTIMECMP_BASE 0x10008
+#define MTIME_BASE 0x10000000
+#define MTIMECMP_BASE 0x10000008
 
 void global_enable_interrupts();
 void enable_machine_timer_interrupt();
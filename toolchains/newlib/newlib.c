@@ -10,10 +10,31 @@
  *
  * These implementations are based on the versions described here
  * https://interrupt.memfault.com/blog/boostrapping-libc-with-newlib
+ *
+ * If SEMIHOSTING is defined (make SEMIHOSTING=1), files opened with
+ * open() or fopen() are files on the host, accessed using semihosting
+ * calls (run the program with emulate --semihosting DIR), and exit()
+ * ends the emulation with the exit status. The standard streams
+ * (file descriptors 0, 1 and 2) still use the UART in either case.
+ *
+ * times(), clock() and gettimeofday() are implemented from mtime,
+ * which is taken to count at MTIME_FREQUENCY ticks per second. By
+ * default the emulator advances mtime once per clock cycle, so times
+ * are relative to a MTIME_FREQUENCY clock; run with emulate
+ * --mtime-frequency MTIME_FREQUENCY to measure host time instead.
+ * Build with make MTIME_FREQUENCY=<Hz> to change it.
  */
 
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/times.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /// This is the beginning of the heap (which begins directly after the
 /// .bss section, hence the use of the _end symbol).
@@ -33,6 +54,169 @@ void *_sbrk(int incr) {
     return prev_heap;
 }
 
+#ifdef SEMIHOSTING
+
+#define SYS_OPEN 0x01
+#define SYS_CLOSE 0x02
+#define SYS_WRITE 0x05
+#define SYS_READ 0x06
+#define SYS_SEEK 0x0a
+#define SYS_FLEN 0x0c
+#define SYS_EXIT_EXTENDED 0x20
+
+#define ADP_STOPPED_APPLICATION_EXIT 0x20026
+
+/// Maximum number of files open at once (including the standard
+/// streams)
+#define MAX_FILES 16
+
+/// The first file descriptor used for host files
+#define FIRST_HOST_FD 3
+
+/// Semihosting handle (plus one, so that zero means the descriptor
+/// is not open) and current position of each open host file, indexed
+/// by file descriptor
+static struct {
+    int handle;
+    int pos;
+} host_files[MAX_FILES];
+
+/// Make a semihosting call. The three instructions must be
+/// uncompressed, and must not be separated.
+static int semihosting_call(int operation, void *param) {
+    register int a0 asm("a0") = operation;
+    register void *a1 asm("a1") = param;
+    __asm__ volatile(".option push\n"
+		     ".option norvc\n"
+		     "slli x0, x0, 0x1f\n"
+		     "ebreak\n"
+		     "srai x0, x0, 7\n"
+		     ".option pop\n"
+		     : "+r"(a0)
+		     : "r"(a1)
+		     : "memory");
+    return a0;
+}
+
+/// Return the stored handle (semihosting handle plus one) for file,
+/// or zero or less if file is not an open host file
+static int host_handle(int file) {
+    if (file < FIRST_HOST_FD || file >= MAX_FILES) {
+	return -1;
+    }
+    return host_files[file].handle;
+}
+
+int _open(const char *name, int flags, __attribute__((unused)) int mode) {
+    // Semihosting modes are the fopen modes r, r+, w, w+, a and a+
+    // (the binary modes, which are the same, are odd numbers)
+    int sh_mode;
+    int access = flags & O_ACCMODE;
+    if (flags & O_APPEND) {
+	sh_mode = (access == O_RDWR) ? 10 : 8;
+    } else if (flags & O_TRUNC) {
+	sh_mode = (access == O_RDWR) ? 6 : 4;
+    } else {
+	sh_mode = (access == O_RDONLY) ? 0 : 2;
+    }
+
+    int file;
+    for (file = FIRST_HOST_FD; file < MAX_FILES; file++) {
+	if (host_files[file].handle <= 0) {
+	    break;
+	}
+    }
+    if (file == MAX_FILES) {
+	errno = EMFILE;
+	return -1;
+    }
+
+    int param[3] = { (int)name, sh_mode | 1, (int)strlen(name) };
+    int handle = semihosting_call(SYS_OPEN, param);
+    if (handle == -1) {
+	errno = ENOENT;
+	return -1;
+    }
+    host_files[file].handle = handle + 1;
+    host_files[file].pos = 0;
+    return file;
+}
+
+int _close(int file) {
+    int handle = host_handle(file);
+    if (handle <= 0) {
+	errno = EBADF;
+	return -1;
+    }
+    int param[1] = { handle - 1 };
+    host_files[file].handle = 0;
+    return semihosting_call(SYS_CLOSE, param);
+}
+
+int _fstat(int file, struct stat *st) {
+    st->st_mode = host_handle(file) > 0 ? S_IFREG : S_IFCHR;
+    return 0;
+}
+
+int _isatty(int file) {
+    return host_handle(file) <= 0;
+}
+
+int _lseek(int file, int offset, int whence) {
+    int handle = host_handle(file);
+    if (handle <= 0) {
+	return 0;
+    }
+
+    int param[2] = { handle - 1, 0 };
+    int pos;
+    if (whence == SEEK_SET) {
+	pos = offset;
+    } else if (whence == SEEK_CUR) {
+	pos = host_files[file].pos + offset;
+    } else {
+	pos = semihosting_call(SYS_FLEN, param) + offset;
+    }
+    if (pos < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    param[1] = pos;
+    if (semihosting_call(SYS_SEEK, param) != 0) {
+	errno = EIO;
+	return -1;
+    }
+    host_files[file].pos = pos;
+    return pos;
+}
+
+int _read(int file, char *buf, int nbytes) {
+    int handle = host_handle(file);
+    if (handle <= 0) {
+	// The standard input is always at the end of file
+	return 0;
+    }
+
+    int param[3] = { handle - 1, (int)buf, nbytes };
+    int not_read = semihosting_call(SYS_READ, param);
+    if (not_read < 0) {
+	errno = EIO;
+	return -1;
+    }
+    host_files[file].pos += nbytes - not_read;
+    return nbytes - not_read;
+}
+
+void _exit(int status) {
+    int param[2] = { ADP_STOPPED_APPLICATION_EXIT, status };
+    semihosting_call(SYS_EXIT_EXTENDED, param);
+    while (1) {
+    }
+}
+
+#else
+
 int _close(__attribute__((unused)) int fd) {
     return -1;
 }
@@ -58,6 +242,8 @@ void _exit(int status) {
 }
 */
 
+#endif
+
 void _kill(__attribute__((unused)) int pid, __attribute__((unused)) int sig) {
     return;
 }
@@ -66,6 +252,40 @@ int _getpid(void) {
     return -1;
 }
 
+#ifndef MTIME_FREQUENCY
+#define MTIME_FREQUENCY 1000000
+#endif
+
+/// Read the 64-bit mtime register, re-reading if the high word
+/// changes between the two reads
+static uint64_t read_mtime(void) {
+    volatile uint32_t *mtime = (uint32_t*)0x10000000;
+    uint32_t hi, lo;
+    do {
+	hi = mtime[1];
+	lo = mtime[0];
+    } while (hi != mtime[1]);
+    return ((uint64_t)hi << 32) | lo;
+}
+
+clock_t _times(struct tms *buf) {
+    uint64_t mtime = read_mtime();
+    clock_t ticks = (clock_t)(mtime / MTIME_FREQUENCY * CLOCKS_PER_SEC
+	+ mtime % MTIME_FREQUENCY * CLOCKS_PER_SEC / MTIME_FREQUENCY);
+    buf->tms_utime = ticks;
+    buf->tms_stime = 0;
+    buf->tms_cutime = 0;
+    buf->tms_cstime = 0;
+    return ticks;
+}
+
+int _gettimeofday(struct timeval *tv, __attribute__((unused)) void *tz) {
+    uint64_t mtime = read_mtime();
+    tv->tv_sec = mtime / MTIME_FREQUENCY;
+    tv->tv_usec = mtime % MTIME_FREQUENCY * 1000000 / MTIME_FREQUENCY;
+    return 0;
+}
+
 static void outbyte(char c) {
     static volatile int *dev = (int*)0x10000018;
     *dev = (int)c;
@@ -73,6 +293,20 @@ static void outbyte(char c) {
 
 int _write(__attribute__((unused)) int file, char *buf, int nbytes) {
 
+#ifdef SEMIHOSTING
+    int handle = host_handle(file);
+    if (handle > 0) {
+	int param[3] = { handle - 1, (int)buf, nbytes };
+	int not_written = semihosting_call(SYS_WRITE, param);
+	if (not_written < 0) {
+	    errno = EIO;
+	    return -1;
+	}
+	host_files[file].pos += nbytes - not_written;
+	return nbytes - not_written;
+    }
+#endif
+
     /* Output character at at time */
     for (int i = 0; i < nbytes; i++) {
 	outbyte(buf[i]);
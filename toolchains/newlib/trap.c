@@ -75,7 +75,8 @@ void _software_isr() {
     while (1)
 	;  
 }
-void _timer_isr() {
+// Weak, so that a program can replace it with its own handler
+__attribute__((weak)) void _timer_isr() {
     printf("tick\n");
     set_timeout(2000000);
     asm("mret");